@@ -229,6 +229,59 @@ static int avfsd_read(const char *path, char *buf, size_t size, off_t offset,
     return res;
 }
 
+#if FUSE_VERSION >= 29
+/* Files that are backed by a real file (local files, archive members
+   stored without compression) are passed to FUSE as a file
+   descriptor, so the data is not copied through avfs */
+static int avfsd_read_buf(const char *path, struct fuse_bufvec **bufp,
+                          size_t size, off_t offset,
+                          struct fuse_file_info *fi)
+{
+    int fd;
+    int res;
+    off_t start;
+    off_t len;
+    struct fuse_bufvec *src;
+
+    pthread_mutex_lock( &avfsd_mutexlock );
+    fd = virt_getfd(fi->fh, &start, &len);
+    pthread_mutex_unlock( &avfsd_mutexlock );
+
+    src = malloc(sizeof(struct fuse_bufvec));
+    if (src == NULL)
+        return -ENOMEM;
+
+    if (fd != -1) {
+        if (offset >= len)
+            size = 0;
+        else if (size > len - offset)
+            size = len - offset;
+
+        *src = FUSE_BUFVEC_INIT(size);
+        src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        src->buf[0].fd = fd;
+        src->buf[0].pos = start + offset;
+    } else {
+        *src = FUSE_BUFVEC_INIT(size);
+        src->buf[0].mem = malloc(size);
+        if (src->buf[0].mem == NULL) {
+            free(src);
+            return -ENOMEM;
+        }
+        res = avfsd_read(path, src->buf[0].mem, size, offset, fi);
+        if (res < 0) {
+            free(src->buf[0].mem);
+            free(src);
+            return res;
+        }
+        src->buf[0].size = res;
+    }
+
+    *bufp = src;
+    return 0;
+}
+#endif
+
 static int avfsd_write(const char *path, const char *buf, size_t size,
                        off_t offset, struct fuse_file_info *fi)
 {
@@ -303,6 +356,9 @@ static struct fuse_operations avfsd_oper = {
     utime:	avfsd_utime,
     open:	avfsd_open,
     read:	avfsd_read,
+#if FUSE_VERSION >= 29
+    read_buf:	avfsd_read_buf,
+#endif
     write:	avfsd_write,
     release:	avfsd_release,
     access:	avfsd_access,
@@ -12,8 +12,11 @@
 struct archive;
 struct archnode;
 struct archfile;
+struct readahead;
 
-#define ARF_NOBASE (1 << 0)
+#define ARF_NOBASE      (1 << 0)
+#define ARF_PROGRESSIVE (1 << 1)  /* Parse in the background, see
+                                     av_arch_parse_unlock() */
 
 struct archparams {
     void *data;
@@ -23,11 +26,14 @@ struct archparams {
     int (*close) (struct archfile *fil);
     avssize_t (*read)  (vfile *vf, char *buf, avsize_t nbyte);
     void (*release) (struct archive *arch, struct archnode *nod);
+    int (*expand) (void *data, struct archive *arch, struct entry *dir);
 };
 
 #define ANOF_DIRTY    (1 << 0)
 #define ANOF_CREATED  (1 << 1)
 #define ANOF_AUTODIR  (1 << 2)
+#define ANOF_LAZY     (1 << 3)  /* Entries not yet created by expand() */
+#define ANOF_STORED   (1 << 4)  /* Contents are at offset in the base file */
 
 struct archnode {
     struct avstat st;
@@ -39,6 +45,10 @@ struct archnode {
     
     int numopen;
 
+    /* Taken instead of the archive lock while reading the member, it
+       protects the state shared by the opens of the member (data) */
+    avmutex lock;
+
     void *data;
 };
 
@@ -49,6 +59,7 @@ struct archfile {
     struct entry *ent;     /* Only for readdir */
     struct entry *curr;
     int currn;
+    struct readahead *ra;  /* Only for av_arch_read() */
     void *data;
 };
 
@@ -60,11 +71,15 @@ avssize_t av_arch_read(vfile *vf, char *buf, avsize_t nbyte);
 struct archnode *av_arch_new_node(struct archive *arch, struct entry *ent,
                                   int isdir);
 void av_arch_del_node(struct entry *ent);
+struct archnode *av_arch_default_dir(struct archive *arch, struct entry *ent);
 struct entry *av_arch_resolve(struct archive *arch, const char *path,
                               int create, int flags);
 int av_arch_isroot(struct archive *arch, struct entry *ent);
 struct entry *av_arch_create(struct archive *arch, const char *path,
                              int flags);
+void av_arch_set_lazy(struct archive *arch, void *data);
+void av_arch_parse_unlock(struct archive *arch);
+int av_arch_parse_lock(struct archive *arch);
 
 static inline struct archfile *arch_vfile_file(vfile *vf)
 {
@@ -0,0 +1,12 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "avfs.h"
+
+/* Same result as zlib's crc32(), but uses the carry-less multiply or
+   CRC instructions of the processor where available */
+avuint av_crc32(avuint crc, const void *buf, avsize_t len);
@@ -97,11 +97,23 @@ struct avmount {
     int flags;
 };
 
+/* Reads of the files of one filesystem, shown in /#avfsstat/layers */
+struct avreadstat {
+    avoff_t reads;
+    avoff_t bytes;
+    avoff_t seeks;
+    avoff_t hints;
+    avoff_t nsec;
+    avoff_t selfnsec;
+};
+
 struct avfs {
     /* private */
     struct vmodule *module;
     avmutex lock;
     avino_t inoctr;
+    avmutex statlock;
+    struct avreadstat rstat;
 
     /* read-only: */
     char *name;
@@ -137,6 +149,9 @@ struct avfs {
     int       (*setattr) (vfile *vf, struct avstat *buf, int attrmask);
     int       (*truncate)(vfile *vf, avoff_t length);
     avoff_t   (*lseek)   (vfile *vf, avoff_t offset, int whence);
+    int       (*getfd)   (vfile *vf, avoff_t *offsetp, avoff_t *sizep);
+    int       (*linkfile)(vfile *vf, const char *path);
+    void      (*seekhint)(vfile *vf, avoff_t offset);
 };
 
 struct ext_info {
@@ -0,0 +1,37 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "avfs.h"
+
+/* Default distance of the periodic checkpoints in output bytes */
+#define CKPT_DISTANCE 1048576
+
+/* A saved decoder state, from which decompression can be resumed */
+struct ckpt {
+    avoff_t offset;          /* The number of output bytes */
+    avoff_t indexoffset;     /* Offset in the indexfile */
+    avsize_t indexsize;      /* Size of state record */
+    struct ckpt *next;
+};
+
+/* The checkpoints of one compressed stream.  The states are stored
+   compressed in a temporary file.  Not locked, the decoder must
+   serialize the calls */
+struct ckptfile {
+    const char *name;        /* Prefix of the error messages */
+    char *indexfile;
+    avoff_t filesize;
+    avoff_t nextindex;       /* Where the next periodic one is due */
+    struct ckpt *ckpts;      /* In ascending order of offset */
+};
+
+void av_ckptfile_init(struct ckptfile *cf, const char *name);
+void av_ckptfile_free(struct ckptfile *cf);
+int av_ckptfile_save(struct ckptfile *cf, const char *state, int statelen,
+                     avoff_t offset);
+int av_ckptfile_load(struct ckptfile *cf, struct ckpt *ck, char **statep);
+struct ckpt *av_ckptfile_find(struct ckptfile *cf, avoff_t offset);
@@ -0,0 +1,22 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    based on zfile.h
+*/
+
+
+#include "avfs.h"
+
+struct d64file;
+struct d64cache;
+
+avssize_t av_d64file_pread(struct d64file *fil, struct d64cache *zc,
+                           char *buf, avsize_t nbyte, avoff_t offset);
+int av_d64file_size(struct d64file *fil, struct d64cache *zc,
+                    avoff_t *sizep);
+
+struct d64file *av_d64file_new(vfile *vf, avuint crc, int calccrc);
+struct d64cache *av_d64cache_new();
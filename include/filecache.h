@@ -11,3 +11,8 @@
 void *av_filecache_get(const char *key);
 void av_filecache_set(const char *key, void *obj);
 int av_filecache_getkey(ventry *ve, char **resp);
+int av_filecache_hasopt(ventry *ve, int opt);
+int av_filecache_checkopts(ventry *ve, const char *known);
+int av_filecache_recheck(ventry *ve, const char *key);
+void *av_filecache_get_checked(ventry *ve, const char *key);
+void av_filecache_checked(const char *key);
@@ -11,3 +11,7 @@
 int av_init_filt(struct vmodule *module, int version, const char *name,
                  const char *prog[], const char *revprog[],
                  struct ext_info *exts, struct avfs **resp);
+
+/* Use the named in-process codecs instead of running prog/revprog */
+void av_filt_set_codecs(struct avfs *avfs, const char *codec,
+                        const char *revcodec);
@@ -0,0 +1,13 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "avfs.h"
+
+/* The handler releases saved state not used since 'expire' and
+   returns the number of bytes still held.  With 'expire' 0 nothing is
+   released, this is used to query the memory usage. */
+void av_add_idlehandler(const char *name, avoff_t (*func)(avtime_t expire));
@@ -25,9 +25,16 @@ void av_delete_tmpdir();
 void av_init_avfsstat();
 void av_init_logstat();
 void av_init_cache();
+void av_init_idle();
 void av_check_malloc();
 void av_init_filecache();
+void av_init_readstat();
+void av_init_readahead();
+void av_init_zread();
 void av_do_exit();
+void av_archive_stop_parses();
 
 void av_avfsstat_register(const char *path, struct statefile *func);
+void av_avfsstat_register_int(const char *path, avoff_t *valp, avmutex *lock,
+                              avoff_t min, avoff_t max, void (*changed)(void));
 int av_get_symlink_rewrite();
@@ -0,0 +1,23 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    based on xzfile.h
+*/
+
+
+#include "avfs.h"
+
+struct lz4file;
+struct lz4cache;
+
+avssize_t av_lz4file_pread(struct lz4file *fil, struct lz4cache *zc,
+                           char *buf, avsize_t nbyte, avoff_t offset);
+
+struct lz4file *av_lz4file_new(vfile *vf);
+int av_lz4file_size(struct lz4file *fil, struct lz4cache *zc,
+                    avoff_t *sizep);
+struct lz4cache *av_lz4cache_new();
+void av_init_lz4stat();
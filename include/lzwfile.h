@@ -0,0 +1,23 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    based on zfile.h
+*/
+
+
+#include "avfs.h"
+
+struct lzwfile;
+struct lzwcache;
+
+avssize_t av_lzwfile_pread(struct lzwfile *fil, struct lzwcache *zc,
+                           char *buf, avsize_t nbyte, avoff_t offset);
+int av_lzwfile_size(struct lzwfile *fil, struct lzwcache *zc,
+                    avoff_t *sizep);
+
+int av_lzwfile_check(vfile *vf);
+struct lzwfile *av_lzwfile_new(vfile *vf);
+struct lzwcache *av_lzwcache_new();
@@ -16,6 +16,9 @@ avssize_t  av_pwrite(vfile *vf, const char *buf, avsize_t nbyte,
                        avoff_t offset);
 avoff_t    av_lseek(vfile *vf, avoff_t offset, int whence);
 int        av_ftruncate(vfile *vf, avoff_t length);
+int        av_getfd(vfile *vf, avoff_t *offsetp, avoff_t *sizep);
+int        av_linkfile(vfile *vf, const char *path);
+void       av_seekhint(vfile *vf, avoff_t offset);
 int        av_getattr(ventry *ve, struct avstat *buf, int attrmask, int flags);
 int        av_fgetattr(vfile *vf, struct avstat *buf, int attrmask);
 int        av_fsetattr(vfile *vf, struct avstat *buf, int attrmask);
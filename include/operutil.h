@@ -18,6 +18,9 @@ int av_file_truncate(vfile *vf, avoff_t length);
 int av_file_getattr(vfile *vf, struct avstat *buf, int attrmask);
 int av_file_setattr(vfile *vf, struct avstat *buf, int attrmask);
 avoff_t av_file_lseek(vfile *vf, avoff_t offset, int whence);
+int av_file_getfd(vfile *vf, avoff_t *offsetp, avoff_t *sizep);
+int av_file_linkfile(vfile *vf, const char *path);
+void av_file_seekhint(vfile *vf, avoff_t offset);
 int av_open(ventry *ve, int flags, avmode_t mode, vfile **resp);
 int av_close(vfile *vf);
 
@@ -31,3 +34,4 @@ int av_fd_readdir(int fd, struct avdirent *buf, avoff_t *posp);
 int av_fd_getattr(int fd, struct avstat *buf, int attrmask);
 int av_fd_setattr(int fd, struct avstat *buf, int attrmask);
 int av_fd_truncate(int fd, avoff_t length);
+int av_fd_getfd(int fd, avoff_t *offsetp, avoff_t *sizep);
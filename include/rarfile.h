@@ -0,0 +1,19 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    based on xzfile.h
+*/
+
+
+#include "avfs.h"
+
+struct rarstream;
+
+avssize_t av_rarstream_pread(struct rarstream *fil, char *buf, avsize_t nbyte,
+                             avoff_t offset);
+
+int av_rarstream_new(vfile *vf, int index, avoff_t size,
+                     struct rarstream **resp);
@@ -0,0 +1,18 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "avfs.h"
+
+struct readahead;
+
+/* Read from 'vf' like av_pread(), but serve reads following each other
+   from a buffer filled ahead of them.  '*rap' holds the state, it is
+   allocated on the first call.  There is no data at or after 'end'.
+   The calls for one state must be serialized by the caller */
+avssize_t av_readahead_pread(struct readahead **rap, vfile *vf, char *buf,
+                             avsize_t nbyte, avoff_t offset, avoff_t end);
+void av_readahead_free(struct readahead *ra);
@@ -11,6 +11,7 @@
 struct realfile {
     char *name;
     int is_tmp;
+    struct avstat st;
 };
 
 int av_get_realfile(ventry *ve, struct realfile **resp);
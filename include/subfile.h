@@ -0,0 +1,14 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "avfs.h"
+
+/* Open a read-only file, which consists of 'size' bytes of 'base'
+   starting at 'offset'.  Optionally a header of 'hdrlen' bytes (copied
+   from 'hdr') is put in front of it.  Close with av_close() */
+int av_subfile_new(vfile *base, avoff_t offset, avoff_t size,
+                   const char *hdr, avsize_t hdrlen, vfile **resp);
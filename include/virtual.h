@@ -46,6 +46,7 @@ int            virt_close     (int fh);
 ssize_t        virt_read      (int fh, void *buf, size_t nbyte);
 ssize_t        virt_write     (int fh, const void *buf, size_t nbyte);
 off_t          virt_lseek     (int fh, off_t offset, int whence);
+int            virt_getfd     (int fh, off_t *offsetp, off_t *sizep);
 
 DIR           *virt_opendir   (const char *path);
 int            virt_closedir  (DIR *dirp);
@@ -20,3 +20,4 @@ avssize_t av_xzfile_pread(struct xzfile *fil, struct xzcache *zc, char *buf,
 struct xzfile *av_xzfile_new(vfile *vf);
 int av_xzfile_size(struct xzfile *fil, struct xzcache *zc, avoff_t *sizep);
 struct xzcache *av_xzcache_new();
+void av_init_xzstat();
@@ -19,3 +19,4 @@ int av_zfile_size(struct zfile *fil, struct zcache *zc, avoff_t *sizep);
 struct zfile *av_zfile_new(vfile *vf, avoff_t dataoff, avuint crc, int calccrc);
 struct zcache *av_zcache_new();
 avoff_t av_zcache_size(struct zcache *zc);
+void av_zcache_hint(struct zcache *zc, avoff_t offset);
@@ -15,6 +15,7 @@ extern int av_init_module_bz2(struct vmodule *module);
 
 int av_init_module_bz2(struct vmodule *module)
 {
+    int res;
     struct avfs *avfs;
     const char *ubz2_args[3];
     const char *bz2_args[2];
@@ -27,6 +28,10 @@ int av_init_module_bz2(struct vmodule *module)
     bz2_args[1] = NULL;
 
     /* FIXME: compression level argument */
-    return av_init_filt(module, AV_VER, "bz2", bz2_args, ubz2_args,
-                        NULL, &avfs);
+    res = av_init_filt(module, AV_VER, "bz2", bz2_args, ubz2_args,
+                       NULL, &avfs);
+    if(res == 0)
+        av_filt_set_codecs(avfs, "bzip2", "bunzip2");
+
+    return res;
 }
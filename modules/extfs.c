@@ -22,34 +22,287 @@
 #include "cache.h"
 #include "exit.h"
 #include "tmpfile.h"
+#include "oper.h"
+#include "internal.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 struct extfsdata {
     int needbase;
+    int multi;
     char *progpath;
 };
 
+/* A request for one member, waiting for a copyoutmulti run */
+struct extfsreq {
+    struct extfsreq *next;
+    const char *fullpath;
+    const char *tofile;
+    int res;
+    int done;
+};
+
+/* Shared by all the nodes of one listing */
+struct extfsarch {
+    char *cachedir;
+    avmutex lock;
+    pthread_cond_t cond;
+    int running;
+    struct extfsreq *pending;
+};
+
 struct extfsnode {
     char *fullpath;
     avmutex lock;
+    struct extfsarch *earch;
 };
 
 struct extfscacheentry {
     char *tmpfile;
+    int persistent;
 };
 
 struct extfsfile {
     struct extfscacheentry *cent;
     int fd;
+    char *key;
 };
 
+static AV_LOCK_DECL(extfsstat_lock);
+static AV_LOCK_DECL(extfs_tmplock);
+static unsigned int extfs_tmpctr;
+static char *extfs_cache_dir = NULL;
+static int extfs_exit_added = 0;
+static int extfs_exiting = 0;
+
+static void extfs_exit()
+{
+    AV_LOCK(extfsstat_lock);
+    extfs_exiting = 1;
+    AV_UNLOCK(extfsstat_lock);
+}
+
+/* Added at init, so it is run after the cache is destroyed, and
+   leaves everything as it was before the init */
+static void extfs_destroy()
+{
+    AV_LOCK(extfsstat_lock);
+    av_free(extfs_cache_dir);
+    extfs_cache_dir = NULL;
+    extfs_exit_added = 0;
+    extfs_exiting = 0;
+    AV_UNLOCK(extfsstat_lock);
+}
+
 static void extfscacheentry_delete(struct extfscacheentry *cent)
 {
+    int exiting;
+
     if( cent->tmpfile != NULL ) {
-        av_del_tmpfile(cent->tmpfile);
+        if(!cent->persistent)
+            av_del_tmpfile(cent->tmpfile);
+        else {
+            /* Dropped from the cache: the file goes too, except at
+               exit, when it is kept for the next process */
+            AV_LOCK(extfsstat_lock);
+            exiting = extfs_exiting;
+            AV_UNLOCK(extfsstat_lock);
+            if(!exiting)
+                unlink(cent->tmpfile);
+            av_free(cent->tmpfile);
+        }
+    }
+}
+
+static void extfsarch_delete(struct extfsarch *earch)
+{
+    av_free(earch->cachedir);
+    AV_FREELOCK(earch->lock);
+    pthread_cond_destroy(&earch->cond);
+}
+
+static unsigned long long extfs_hash(const char *s, avsize_t len)
+{
+    unsigned long long h = 14695981039346656037ULL;
+
+    for(; len != 0; s++, len--) {
+        h ^= (unsigned char) *s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static char *extfs_cache_path(const char *dir, const char *name)
+{
+    char buf[32];
+
+    sprintf(buf, "/%016llx", extfs_hash(name, strlen(name)));
+    return av_stradd(NULL, dir, buf, NULL);
+}
+
+/* A file to write before renaming it to 'path'.  Its name is unique
+   among the processes and threads sharing the cache directory */
+static char *extfs_tmp_path(const char *path)
+{
+    unsigned int ctr;
+    char buf[64];
+
+    AV_LOCK(extfs_tmplock);
+    ctr = extfs_tmpctr++;
+    AV_UNLOCK(extfs_tmplock);
+
+    sprintf(buf, ".%i.%u.tmp", (int) getpid(), ctr);
+    return av_stradd(NULL, path, buf, NULL);
+}
+
+static void extfs_clear_cachedir(const char *dir)
+{
+    DIR *dirp;
+    struct dirent *de;
+
+    dirp = opendir(dir);
+    if(dirp == NULL)
+        return;
+
+    while((de = readdir(dirp)) != NULL) {
+        char *path;
+
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        path = av_stradd(NULL, dir, "/", de->d_name, NULL);
+        unlink(path);
+        av_free(path);
+    }
+    closedir(dirp);
+}
+
+static int extfs_write_file(const char *path, const char *data)
+{
+    int res;
+    int fd;
+    char *tmppath;
+    avsize_t len = strlen(data);
+
+    tmppath = extfs_tmp_path(path);
+    fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd == -1) {
+        av_free(tmppath);
+        return -errno;
+    }
+    res = write(fd, data, len);
+    if(res == (int) len)
+        res = 0;
+    else
+        res = -EIO;
+    close(fd);
+
+    if(res == 0 && rename(tmppath, path) == -1)
+        res = -errno;
+    if(res < 0)
+        unlink(tmppath);
+    av_free(tmppath);
+
+    return res;
+}
+
+static int extfs_check_key(const char *path, const char *key)
+{
+    int fd;
+    int res;
+    avsize_t len = strlen(key);
+    char *buf;
+
+    fd = open(path, O_RDONLY);
+    if(fd == -1)
+        return 0;
+
+    buf = av_malloc(len + 1);
+    res = read(fd, buf, len + 1);
+    close(fd);
+    if(res == (int) len && memcmp(buf, key, len) == 0)
+        res = 1;
+    else
+        res = 0;
+    av_free(buf);
+
+    return res;
+}
+
+/* The persistent cache of an archive is a directory named after the
+   handler and the path of the base.  The "key" file in it holds these
+   and the size and modification time of the base; if they don't
+   match, everything in the directory is stale. */
+static char *extfs_get_cachedir(ventry *ve, struct extfsdata *info)
+{
+    int res;
+    char *topdir;
+    char *dir;
+    char *path;
+    char *key;
+    char *keyfile;
+    char buf[128];
+    struct avstat st;
+    int addexit;
+
+    AV_LOCK(extfsstat_lock);
+    topdir = av_strdup(extfs_cache_dir);
+    addexit = topdir != NULL && !extfs_exit_added;
+    if(addexit)
+        extfs_exit_added = 1;
+    AV_UNLOCK(extfsstat_lock);
+    if(topdir == NULL)
+        return NULL;
+
+    /* Exit handlers run in reverse order, so this one has to be added
+       after the one of the cache, which is set up later than the
+       modules.  Not under extfsstat_lock, which the handler takes */
+    if(addexit)
+        av_add_exithandler(extfs_exit);
+
+    res = av_getattr(ve->mnt->base, &st, AVA_SIZE | AVA_MTIME, 0);
+    if(res == 0)
+        res = av_generate_path(ve->mnt->base, &path);
+    if(res < 0) {
+        av_free(topdir);
+        return NULL;
+    }
+
+    key = av_stradd(NULL, info->progpath, "\n", path, NULL);
+    av_free(path);
+    mkdir(topdir, 0700);
+    dir = extfs_cache_path(topdir, key);
+    av_free(topdir);
+
+    sprintf(buf, "\n%lli %li %li\n", st.size, (long) st.mtime.sec,
+            (long) st.mtime.nsec);
+    key = av_stradd(key, buf, NULL);
+
+    if(mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        av_log(AVLOG_WARNING, "EXTFS: Could not create %s: %s", dir,
+               strerror(errno));
+        av_free(dir);
+        av_free(key);
+        return NULL;
+    }
+
+    keyfile = av_stradd(NULL, dir, "/key", NULL);
+    if(!extfs_check_key(keyfile, key)) {
+        extfs_clear_cachedir(dir);
+        res = extfs_write_file(keyfile, key);
+        if(res < 0) {
+            av_free(dir);
+            dir = NULL;
+        }
     }
+    av_free(keyfile);
+    av_free(key);
+
+    return dir;
 }
 
 static void fill_extfs_link(struct archive *arch, struct entry *ent,
@@ -78,10 +331,12 @@ static void extfsnode_delete(struct extfsnode *enod)
 {
     av_free(enod->fullpath);
     AV_FREELOCK(enod->lock);
+    av_unref_obj(enod->earch);
 }
 
 static void fill_extfs_node(struct archive *arch, struct entry *ent, 
-                            struct avstat *stbuf, char *path, char *linkname)
+                            struct avstat *stbuf, char *path, char *linkname,
+                            struct extfsarch *earch)
 {
     struct archnode *nod;
     struct extfsnode *enod;
@@ -100,6 +355,8 @@ static void fill_extfs_node(struct archive *arch, struct entry *ent,
     AV_NEW_OBJ(enod, extfsnode_delete);
 
     AV_INITLOCK(enod->lock);
+    enod->earch = earch;
+    av_ref_obj(earch);
 
     nod->data = enod;
 
@@ -113,7 +370,8 @@ static void fill_extfs_node(struct archive *arch, struct entry *ent,
 
 
 static void insert_extfs_entry(struct archive *arch, struct avstat *stbuf,
-			      char *path, char *linkname)
+			      char *path, char *linkname,
+                              struct extfsarch *earch)
 {
     struct entry *ent;
 
@@ -129,13 +387,13 @@ static void insert_extfs_entry(struct archive *arch, struct avstat *stbuf,
     if(linkname != NULL && !AV_ISLNK(stbuf->mode)) 
         fill_extfs_link(arch, ent, linkname);
     else
-        fill_extfs_node(arch, ent, stbuf, path, linkname);
+        fill_extfs_node(arch, ent, stbuf, path, linkname, earch);
 
     av_unref_obj(ent);
 }
 
 static void parse_extfs_line(struct lscache *lc, char *line,
-                             struct archive *arch)
+                             struct archive *arch, struct extfsarch *earch)
 {
     int res;
     char *filename;
@@ -146,13 +404,14 @@ static void parse_extfs_line(struct lscache *lc, char *line,
     if(res != 1)
         return;
     
-    insert_extfs_entry(arch, &stbuf, filename, linkname);
+    insert_extfs_entry(arch, &stbuf, filename, linkname, earch);
     av_free(filename);
     av_free(linkname);
 }
 
 static int read_extfs_list(struct program *pr, struct lscache *lc,
-                           struct archive *arch)
+                           struct archive *arch, struct extfsarch *earch,
+                           int outfd)
 {
     int res;
 
@@ -164,41 +423,124 @@ static int read_extfs_list(struct program *pr, struct lscache *lc,
             return res;
         if(line == NULL)
             return 0;
-        parse_extfs_line(lc, line, arch);
+        if(outfd != -1 && write(outfd, line, strlen(line)) == -1)
+            return -errno;
+        parse_extfs_line(lc, line, arch, earch);
         av_free(line);
     }
 }
 
-static int extfs_list(void *data, ventry *ve, struct archive *arch)
+static int read_cached_list(struct lscache *lc, struct archive *arch,
+                            struct extfsarch *earch, const char *listfile)
+{
+    int res;
+    int fd;
+    struct filebuf *fb;
+
+    fd = open(listfile, O_RDONLY);
+    if(fd == -1)
+        return 0;
+
+    fb = av_filebuf_new(fd, 0);
+    while(1) {
+        char *line;
+
+        res = av_filebuf_getline(fb, &line, -1);
+        if(res < 0 || line == NULL)
+            break;
+        parse_extfs_line(lc, line, arch, earch);
+        av_free(line);
+    }
+    av_unref_obj(fb);
+    if(res < 0)
+        return res;
+
+    return 1;
+}
+
+static int run_extfs_list(struct extfsdata *info, struct realfile *rf,
+                          struct lscache *lc, struct archive *arch,
+                          struct extfsarch *earch, const char *listfile)
 {
     int res;
     const char *prog[4];
-    struct realfile *rf;
     struct program *pr;
+    char *tmpfile = NULL;
+    int outfd = -1;
+
+    prog[0] = info->progpath;
+    prog[1] = "list";
+    prog[2] = rf == NULL ? NULL : rf->name;
+    prog[3] = NULL;
+
+    res = av_start_program(prog, &pr);
+    if(res < 0)
+        return res;
+
+    if(listfile != NULL) {
+        tmpfile = extfs_tmp_path(listfile);
+        outfd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    }
+
+    res = read_extfs_list(pr, lc, arch, earch, outfd);
+    av_unref_obj(pr);
+
+    if(outfd != -1) {
+        if(close(outfd) == -1 && res == 0)
+            res = -errno;
+        /* The listing itself is fine even if it could not be saved */
+        if(res < 0 || rename(tmpfile, listfile) == -1)
+            unlink(tmpfile);
+    }
+    av_free(tmpfile);
+
+    return res;
+}
+
+static int extfs_list(void *data, ventry *ve, struct archive *arch)
+{
+    int res;
+    struct realfile *rf;
+    struct lscache *lc;
+    struct extfsarch *earch;
+    char *listfile = NULL;
     struct extfsdata *info = (struct extfsdata *) data;    
 
+    AV_NEW_OBJ(earch, extfsarch_delete);
+    AV_INITLOCK(earch->lock);
+    pthread_cond_init(&earch->cond, NULL);
+    earch->running = 0;
+    earch->pending = NULL;
+    earch->cachedir = NULL;
+
+    lc = av_new_lscache();
     if(info->needbase) {
+        earch->cachedir = extfs_get_cachedir(ve, info);
+        if(earch->cachedir != NULL) {
+            listfile = av_stradd(NULL, earch->cachedir, "/list", NULL);
+            res = read_cached_list(lc, arch, earch, listfile);
+            if(res != 0) {
+                if(res > 0)
+                    res = 0;
+                goto out;
+            }
+        }
+
         res = av_get_realfile(ve->mnt->base, &rf);
         if(res < 0)
-            return res;
+            goto out;
     }
     else
         rf = NULL;
-    
-    prog[0] = info->progpath;
-    prog[1] = "list";
-    prog[2] = rf == NULL ? NULL : rf->name;
-    prog[3] = NULL;
 
-    res = av_start_program(prog, &pr);
-    if(res == 0) {
-        struct lscache *lc = av_new_lscache();
-        res = read_extfs_list(pr, lc, arch);
-        av_unref_obj(lc);
-        av_unref_obj(pr);
-    }
+    res = run_extfs_list(info, rf, lc, arch, earch, listfile);
     av_unref_obj(rf);
 
+  out:
+    av_free(listfile);
+    av_unref_obj(lc);
+    av_unref_obj(earch);
+
     return res;
 }
 
@@ -209,6 +551,10 @@ static int get_key_for_node(ventry *ve, struct archfile *fil, char **resp)
     int res;
 
     if(enod == NULL) {
+        /* no extfsnode means someone tries to access the extfs
+	   archive as a file (e.g. open( "test.lha#" ) )
+	   Although open on a directory is not forbidden we cannot
+	   create an appropriate tmpfile so we return EISDIR */
         return -EISDIR;
     }
 
@@ -221,40 +567,136 @@ static int get_key_for_node(ventry *ve, struct archfile *fil, char **resp)
     return 0;
 }
 
-static int get_extfs_file(ventry *ve, struct archfile *fil,
+static int extfs_copyout(struct extfsdata *info, const char *archname,
+                         const char *fullpath, const char *tofile)
+{
+    const char *prog[6];
+
+    prog[0] = info->progpath;
+    prog[1] = "copyout";
+    prog[2] = archname;
+    prog[3] = fullpath;
+    prog[4] = tofile;
+    prog[5] = NULL;
+  
+    return av_run_program(prog);
+}
+
+/* Extract all the requests with one copyoutmulti, and fall back to
+   copyout for those which are not there after it */
+static void extfs_copyout_reqs(struct extfsdata *info, const char *archname,
+                               struct extfsreq *reqs)
+{
+    int res;
+    int n;
+    const char **prog;
+    struct extfsreq *req;
+    struct stat st;
+
+    if(reqs->next == NULL) {
+        reqs->res = extfs_copyout(info, archname, reqs->fullpath,
+                                  reqs->tofile);
+        return;
+    }
+
+    for(n = 0, req = reqs; req != NULL; req = req->next)
+        n++;
+
+    prog = av_malloc((n * 2 + 4) * sizeof(*prog));
+    prog[0] = info->progpath;
+    prog[1] = "copyoutmulti";
+    prog[2] = archname;
+    for(n = 3, req = reqs; req != NULL; req = req->next) {
+        prog[n++] = req->fullpath;
+        prog[n++] = req->tofile;
+    }
+    prog[n] = NULL;
+
+    res = av_run_program(prog);
+    av_free(prog);
+    if(res < 0)
+        av_log(AVLOG_WARNING, "EXTFS: %s copyoutmulti failed: %s",
+               info->progpath, strerror(-res));
+
+    for(req = reqs; req != NULL; req = req->next) {
+        if(res == 0 && stat(req->tofile, &st) == 0)
+            req->res = 0;
+        else
+            req->res = extfs_copyout(info, archname, req->fullpath,
+                                     req->tofile);
+    }
+}
+
+/* Members asked for while a copyout is running are queued, and the
+   first of them to get the lock after it extracts all of them with
+   one run of the program */
+static int extfs_copyout_queued(struct extfsdata *info, const char *archname,
+                                struct extfsarch *earch, const char *fullpath,
+                                const char *tofile)
+{
+    struct extfsreq req;
+    struct extfsreq **rp;
+    struct extfsreq *reqs;
+    struct extfsreq *next;
+
+    req.next = NULL;
+    req.fullpath = fullpath;
+    req.tofile = tofile;
+    req.res = 0;
+    req.done = 0;
+
+    AV_LOCK(earch->lock);
+    for(rp = &earch->pending; *rp != NULL; rp = &(*rp)->next);
+    *rp = &req;
+
+    while(!req.done) {
+        if(earch->running) {
+            pthread_cond_wait(&earch->cond, &earch->lock);
+            continue;
+        }
+        reqs = earch->pending;
+        earch->pending = NULL;
+        earch->running = 1;
+        AV_UNLOCK(earch->lock);
+
+        extfs_copyout_reqs(info, archname, reqs);
+
+        AV_LOCK(earch->lock);
+        for(; reqs != NULL; reqs = next) {
+            next = reqs->next;
+            reqs->done = 1;
+        }
+        earch->running = 0;
+        pthread_cond_broadcast(&earch->cond);
+    }
+    AV_UNLOCK(earch->lock);
+
+    return req.res;
+}
+
+static int get_extfs_file(struct avmount *mnt, struct extfsnode *enod,
                           const char *tmpfile)
 {
     int res;
-    struct archparams *ap = (struct archparams *) ve->mnt->avfs->data;
+    struct archparams *ap = (struct archparams *) mnt->avfs->data;
     struct extfsdata *info = (struct extfsdata *) ap->data;
-    struct extfsnode *enod = (struct extfsnode *) fil->nod->data;
-    const char *prog[6];
     struct realfile *rf;
+    const char *archname;
 
-    if(enod == NULL) {
-        /* no extfsnode means someone tries to access the extfs
-	   archive as a file (e.g. open( "test.lha#" ) )
-	   Although open on a directory is not forbidden we cannot
-	   create an appropriate tmpfile so we return EISDIR */
-        return -EISDIR;
-    }
-  
     if(info->needbase) {
-        res = av_get_realfile(ve->mnt->base, &rf);
+        res = av_get_realfile(mnt->base, &rf);
         if(res < 0)
             return res;
     }
     else 
         rf = NULL;
   
-    prog[0] = info->progpath;
-    prog[1] = "copyout";
-    prog[2] = rf == NULL ? "/" : rf->name;
-    prog[3] = enod->fullpath;
-    prog[4] = tmpfile;
-    prog[5] = NULL;
-  
-    res = av_run_program(prog);
+    archname = rf == NULL ? "/" : rf->name;
+    if(info->multi)
+        res = extfs_copyout_queued(info, archname, enod->earch,
+                                   enod->fullpath, tmpfile);
+    else
+        res = extfs_copyout(info, archname, enod->fullpath, tmpfile);
     av_unref_obj(rf);
 
     return res;
@@ -296,74 +738,91 @@ static struct ext_info *create_exts(char *line)
     return exts;
 }
 
-static avssize_t extfs_read(vfile *vf, char *buf, avsize_t nbyte)
+/* Get the member into a file, which is in the persistent cache of
+   the archive if there is one and the member may already be there */
+static int new_extfs_cacheentry(struct avmount *mnt, struct extfsnode *enod,
+                                struct extfscacheentry **resp)
 {
-    avssize_t res;
-    struct archfile *fil = arch_vfile_file(vf);
-    struct extfsfile *efil = (struct extfsfile *) fil->data;
-
-    if(lseek(efil->fd, vf->ptr, SEEK_SET) == -1)
-        return -errno;
+    int res;
+    struct extfscacheentry *cent;
+    char *tmpfile;
+    int persistent;
+
+    if(enod->earch->cachedir != NULL) {
+        char *path = extfs_cache_path(enod->earch->cachedir, enod->fullpath);
+
+        if(access(path, F_OK) != 0) {
+            tmpfile = extfs_tmp_path(path);
+            res = get_extfs_file(mnt, enod, tmpfile);
+            if(res == 0 && rename(tmpfile, path) == -1)
+                res = -errno;
+            if(res < 0)
+                unlink(tmpfile);
+            av_free(tmpfile);
+            if(res < 0) {
+                av_free(path);
+                return res;
+            }
+        }
+        tmpfile = path;
+        persistent = 1;
+    }
+    else {
+	/* no persistent cache so create a temporary file */
+        res = av_get_tmpfile(&tmpfile);
+        if(res < 0)
+            return res;
 
-    res = read(efil->fd, buf, nbyte);
-    if(res == -1)
-        return -errno;
+	res = get_extfs_file(mnt, enod, tmpfile);
+	if(res < 0) {
+	    av_del_tmpfile(tmpfile);
+	    return res;
+	}
+        persistent = 0;
+    }
 
-    vf->ptr += res;
+    /* create an object to store tmpfile */
+    AV_NEW_OBJ(cent, extfscacheentry_delete);
+    cent->tmpfile = tmpfile;
+    cent->persistent = persistent;
 
-    return res;
+    *resp = cent;
+    return 0;
 }
 
-static int extfs_open(ventry *ve, struct archfile *fil)
+/* The member is only extracted at the first read, which is not done
+   with the archive locked, so that members of the same archive can be
+   extracted together.  So open succeeds even if the extraction is
+   going to fail, and the error is returned by the read */
+static int extfs_get_file(vfile *vf, struct archfile *fil,
+                          struct extfsfile *efil)
 {
     int res;
-    struct extfsfile *efil;
     struct extfsnode *enod = (struct extfsnode *) fil->nod->data;
-    int fd;
-    char *key;
     struct extfscacheentry *cent;
-    
-    /* get key for extfscache */
-    res = get_key_for_node(ve, fil, &key);
-    if(res < 0)
-        return res;
+    int fd;
 
     AV_LOCK(enod->lock);
-    cent = av_cache2_get(key);
+    cent = av_cache2_get(efil->key);
     if (cent == NULL) {
-        char *tmpfile;
         avoff_t tmpsize;
 
-	/* no entry in cache so create a temporary file... */
-        res = av_get_tmpfile(&tmpfile);
-        if(res < 0) {
-	    av_free(key);
-	    AV_UNLOCK(enod->lock);
-            return res;
-	}
-	res = get_extfs_file(ve, fil, tmpfile);
+	res = new_extfs_cacheentry(vf->mnt, enod, &cent);
 	if(res < 0) {
-	    av_free(key);
-	    av_del_tmpfile(tmpfile);
 	    AV_UNLOCK(enod->lock);
 	    return res;
 	}
 
-	/* ...create an object to store tmpfile */
-	AV_NEW_OBJ(cent, extfscacheentry_delete);
-	cent->tmpfile = tmpfile;
-
 	/* put it in the extfscache */
-	av_cache2_set(cent,key);
+	av_cache2_set(cent, efil->key);
 	AV_UNLOCK(enod->lock);
 
-        tmpsize = av_tmpfile_blksize(tmpfile);
+        tmpsize = av_tmpfile_blksize(cent->tmpfile);
         if(tmpsize > 0)
-            av_cache2_setsize(key, tmpsize);
+            av_cache2_setsize(efil->key, tmpsize);
     } else {
 	AV_UNLOCK(enod->lock);
     }
-    av_free(key);
 
     fd = open(cent->tmpfile, O_RDONLY);
     if(fd == -1) {
@@ -374,10 +833,52 @@ static int extfs_open(ventry *ve, struct archfile *fil)
         return res;
     }
 
-    AV_NEW(efil);
     efil->cent = cent;
     efil->fd = fd;
 
+    return 0;
+}
+
+static avssize_t extfs_read(vfile *vf, char *buf, avsize_t nbyte)
+{
+    avssize_t res;
+    struct archfile *fil = arch_vfile_file(vf);
+    struct extfsfile *efil = (struct extfsfile *) fil->data;
+
+    if(efil->fd == -1) {
+        res = extfs_get_file(vf, fil, efil);
+        if(res < 0)
+            return res;
+    }
+
+    if(lseek(efil->fd, vf->ptr, SEEK_SET) == -1)
+        return -errno;
+
+    res = read(efil->fd, buf, nbyte);
+    if(res == -1)
+        return -errno;
+
+    vf->ptr += res;
+
+    return res;
+}
+
+static int extfs_open(ventry *ve, struct archfile *fil)
+{
+    int res;
+    struct extfsfile *efil;
+    char *key;
+    
+    /* get key for extfscache */
+    res = get_key_for_node(ve, fil, &key);
+    if(res < 0)
+        return res;
+
+    AV_NEW(efil);
+    efil->cent = NULL;
+    efil->fd = -1;
+    efil->key = key;
+
     fil->data = efil;
     
     return 0;
@@ -387,14 +888,15 @@ static int extfs_close(struct archfile *fil)
 {
     struct extfsfile *efil = (struct extfsfile *) fil->data;
 
-    close(efil->fd);
+    if(efil->fd != -1)
+        close(efil->fd);
 
     av_unref_obj(efil->cent);
+    av_free(efil->key);
     av_free(efil);
     
     return 0;
 }
-
 static void extfsdata_delete(struct extfsdata *info)
 {
     av_free(info->progpath);
@@ -409,12 +911,21 @@ static int create_extfs_handler(struct vmodule *module, const char *extfs_dir,
     struct extfsdata *info;
     struct ext_info *extlist;
     int needbase;
+    int multi;
     int end;
 
     /* Creates extension list, and strips name of the extensions */
     extlist = create_exts(name);
     end = strlen(name) - 1;
 
+    /* A '+' means the program can also do copyoutmulti */
+    if(end > 0 && name[end] == '+') {
+        multi = 1;
+        name[end--] = '\0';
+    }
+    else
+        multi = 0;
+
     if(name[end] == ':') {
         needbase = 0;
         name[end] = '\0';
@@ -442,6 +953,7 @@ static int create_extfs_handler(struct vmodule *module, const char *extfs_dir,
   
     info->progpath = av_stradd(NULL, extfs_dir, "/", name, NULL);
     info->needbase = needbase;
+    info->multi = multi;
     
     av_add_avfs(avfs);
 
@@ -499,9 +1011,70 @@ static int extfs_init(struct vmodule *module)
     return 0;
 }
 
+static int extfsstat_get(struct entry *ent, const char *param, char **retp)
+{
+    char *s;
+
+    AV_LOCK(extfsstat_lock);
+    if(extfs_cache_dir != NULL)
+        s = av_stradd(NULL, extfs_cache_dir, "\n", NULL);
+    else
+        s = av_strdup("");
+    AV_UNLOCK(extfsstat_lock);
+
+    *retp = s;
+
+    return 0;
+}
+
+static int extfsstat_set(struct entry *ent, const char *param, const char *val)
+{
+    char *s;
+    unsigned int len;
+
+    s = av_strdup(val);
+    len = strlen(s);
+    if(len > 0 && s[len-1] == '\n')
+        s[len-1] = '\0';
+
+    if(s[0] == '\0') {
+        av_free(s);
+        s = NULL;
+    }
+    else if(s[0] != '/') {
+        av_free(s);
+        return -EINVAL;
+    }
+
+    AV_LOCK(extfsstat_lock);
+    av_free(extfs_cache_dir);
+    extfs_cache_dir = s;
+    AV_UNLOCK(extfsstat_lock);
+
+    return 0;
+}
+
 extern int av_init_module_extfs(struct vmodule *module);
 
 int av_init_module_extfs(struct vmodule *module)
 {
-    return extfs_init(module);
+    int res;
+    const char *cachedir;
+    struct statefile statf;
+
+    res = extfs_init(module);
+    if(res < 0)
+        return res;
+
+    cachedir = getenv("AVFS_EXTFS_CACHE");
+    if(cachedir != NULL && cachedir[0] == '/')
+        extfs_cache_dir = av_strdup(cachedir);
+    av_add_exithandler(extfs_destroy);
+
+    statf.data = NULL;
+    statf.get = extfsstat_get;
+    statf.set = extfsstat_set;
+    av_avfsstat_register("extfs/cache_dir", &statf);
+
+    return 0;
 }
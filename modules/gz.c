@@ -15,6 +15,7 @@ extern int av_init_module_gz(struct vmodule *module);
 
 int av_init_module_gz(struct vmodule *module)
 {
+    int res;
     struct avfs *avfs;
     const char *ugz_args[3];
     const char *gz_args[2];
@@ -27,5 +28,9 @@ int av_init_module_gz(struct vmodule *module)
     gz_args[1] = NULL;
 
     /* FIXME: compression level argument */
-    return av_init_filt(module, AV_VER, "gz", gz_args, ugz_args, NULL, &avfs);
+    res = av_init_filt(module, AV_VER, "gz", gz_args, ugz_args, NULL, &avfs);
+    if(res == 0)
+        av_filt_set_codecs(avfs, "gzip", "gunzip");
+
+    return res;
 }
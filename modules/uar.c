@@ -49,6 +49,7 @@ static void fill_arentry(struct archive *arch, struct entry *ent,
     
     nod->offset = arv->offset;
     nod->realsize = arv->size;
+    nod->flags |= ANOF_STORED;
 
     nod->st.mode       = arv->mode;
     nod->st.uid        = arv->uid;
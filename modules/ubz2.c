@@ -69,6 +69,8 @@ static struct bznode *bz_do_get_node(ventry *ve, const char *key,
             av_unref_obj(nod);
             nod = NULL;
         }
+        else
+            av_filecache_checked(key);
     }
     
     if(nod == NULL) {
@@ -88,13 +90,22 @@ static int bz_getnode(ventry *ve, vfile *base, struct bznode **resp)
     struct bznode *nod;
     char *key;
 
-    res = av_fgetattr(base, &stbuf, attrmask);
+    res = av_filecache_getkey(ve, &key);
     if(res < 0)
         return res;
 
-    res = av_filecache_getkey(ve, &key);
-    if(res < 0)
+    nod = (struct bznode *) av_filecache_get_checked(ve, key);
+    if(nod != NULL) {
+        av_free(key);
+        *resp = nod;
+        return 0;
+    }
+
+    res = av_fgetattr(base, &stbuf, attrmask);
+    if(res < 0) {
+        av_free(key);
         return res;
+    }
 
     nod = bz_do_get_node(ve, key, &stbuf);
 
@@ -111,7 +122,7 @@ static int bz_lookup(ventry *ve, const char *name, void **newp)
     if(path == NULL) {
         if(name[0] != '\0')
             return -ENOENT;
-	if(ve->mnt->opts[0] != '\0')
+	if(av_filecache_checkopts(ve, "") < 0)
             return -ENOENT;
         path = av_strdup(name);
     }
@@ -15,6 +15,7 @@ extern int av_init_module_ubzip2(struct vmodule *module);
 
 int av_init_module_ubzip2(struct vmodule *module)
 {
+    int res;
     struct avfs *avfs;
     const char *ubz2_args[3];
     const char *bz2_args[2];
@@ -26,6 +27,10 @@ int av_init_module_ubzip2(struct vmodule *module)
     bz2_args[0] = "bzip2";
     bz2_args[1] = NULL;
 
-    return av_init_filt(module, AV_VER, "ubzip2", ubz2_args, bz2_args,
-                        NULL, &avfs);
+    res = av_init_filt(module, AV_VER, "ubzip2", ubz2_args, bz2_args,
+                       NULL, &avfs);
+    if(res == 0)
+        av_filt_set_codecs(avfs, "bunzip2", "bzip2");
+
+    return res;
 }
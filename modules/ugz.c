@@ -242,6 +242,8 @@ static struct gznode *gz_findnode(ventry *ve, const char *key,
             av_unref_obj(nod);
             nod = NULL;
         }
+        else
+            av_filecache_checked(key);
     }
     
     if(nod == NULL) {
@@ -261,15 +263,20 @@ static int gz_getnode(ventry *ve, vfile *base, struct gznode **resp)
     struct gznode *nod;
     char *key;
 
-    res = av_fgetattr(base, &stbuf, attrmask);
-    if(res < 0)
-        return res;
-
     res = av_filecache_getkey(ve, &key);
     if(res < 0)
         return res;
-    
-    nod = gz_findnode(ve, key, &stbuf);
+
+    nod = (struct gznode *) av_filecache_get_checked(ve, key);
+    if(nod == NULL) {
+        res = av_fgetattr(base, &stbuf, attrmask);
+        if(res < 0) {
+            av_free(key);
+            return res;
+        }
+
+        nod = gz_findnode(ve, key, &stbuf);
+    }
 
     AV_LOCK(nod->lock);
     if(!nod->ready) {
@@ -325,7 +332,7 @@ static int gz_lookup(ventry *ve, const char *name, void **newp)
     if(path == NULL) {
         if(name[0] != '\0')
             return -ENOENT;
-	if(ve->mnt->opts[0] != '\0' && strcmp(ve->mnt->opts, "-s") != 0)
+	if(av_filecache_checkopts(ve, "s") < 0)
             return -ENOENT;
         path = av_strdup(name);
     }
@@ -376,10 +383,7 @@ static int gz_open(ventry *ve, int flags, avmode_t mode, void **resp)
 
     fil->base = base;
     fil->node = nod;
-    if(strcmp(ve->mnt->opts, "-s") == 0)
-        fil->validsize = 1;
-    else
-        fil->validsize = 0;
+    fil->validsize = av_filecache_hasopt(ve, 's');
     
     *resp = fil;
     return 0;
@@ -430,6 +434,19 @@ static avssize_t gz_read(vfile *vf, char *buf, avsize_t nbyte)
     return res;
 }
 
+static void gz_seekhint(vfile *vf, avoff_t offset)
+{
+    struct gzfile *fil = (struct gzfile *) vf->data;
+    struct zcache *zc;
+
+    AV_LOCK(fil->node->lock);
+    zc = gz_getcache(vf->mnt->base, fil->node);
+    AV_UNLOCK(fil->node->lock);
+
+    av_zcache_hint(zc, offset);
+    av_unref_obj(zc);
+}
+
 static int gz_getsize(vfile *vf, struct avstat *buf)
 {
     int res;
@@ -510,6 +527,7 @@ int av_init_module_ugz(struct vmodule *module)
     avfs->close    = gz_close; 
     avfs->read     = gz_read;
     avfs->getattr  = gz_getattr;
+    avfs->seekhint = gz_seekhint;
 
     av_add_avfs(avfs);
 
@@ -15,6 +15,7 @@ extern int av_init_module_ugzip(struct vmodule *module);
 
 int av_init_module_ugzip(struct vmodule *module)
 {
+    int res;
     struct avfs *avfs;
     const char *ugz_args[3];
     const char *gz_args[2];
@@ -26,6 +27,10 @@ int av_init_module_ugzip(struct vmodule *module)
     gz_args[0] = "gzip";
     gz_args[1] = NULL;
 
-    return av_init_filt(module, AV_VER, "ugzip", ugz_args, gz_args,
-                        NULL, &avfs);
+    res = av_init_filt(module, AV_VER, "ugzip", ugz_args, gz_args,
+                       NULL, &avfs);
+    if(res == 0)
+        av_filt_set_codecs(avfs, "gunzip", "gzip");
+
+    return res;
 }
@@ -0,0 +1,266 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    ULZ4 module (based on UXZ module)
+*/
+
+#include "version.h"
+
+#include "lz4file.h"
+#include "filecache.h"
+#include "oper.h"
+#include "version.h"
+
+struct lz4node {
+    struct avstat sig;
+    struct lz4cache *cache;
+    avino_t ino;
+};
+
+struct lz4handle {
+    struct lz4file *zfil;
+    vfile *base;
+    struct lz4node *node;
+};
+
+
+static void lz4node_destroy(struct lz4node *nod)
+{
+    av_unref_obj(nod->cache);
+}
+
+static struct lz4node *lz4_new_node(ventry *ve, struct avstat *stbuf)
+{
+    struct lz4node *nod;
+
+    AV_NEW_OBJ(nod, lz4node_destroy);
+    nod->sig = *stbuf;
+    nod->cache = av_lz4cache_new();
+    nod->ino = av_new_ino(ve->mnt->avfs);
+    
+    return nod;
+}
+
+static int lz4_same(struct lz4node *nod, struct avstat *stbuf)
+{
+    if(nod->sig.ino == stbuf->ino &&
+       nod->sig.dev == stbuf->dev &&
+       nod->sig.size == stbuf->size &&
+       AV_TIME_EQ(nod->sig.mtime, stbuf->mtime))
+        return 1;
+    else
+        return 0;
+}
+
+static struct lz4node *lz4_do_get_node(ventry *ve, const char *key,
+                                         struct avstat *stbuf)
+{
+    static AV_LOCK_DECL(lock);
+    struct lz4node *nod;
+
+    AV_LOCK(lock);
+    nod = (struct lz4node *) av_filecache_get(key);
+    if(nod != NULL) {
+        if(!lz4_same(nod, stbuf)) {
+            av_unref_obj(nod);
+            nod = NULL;
+        }
+        else
+            av_filecache_checked(key);
+    }
+    
+    if(nod == NULL) {
+        nod =  lz4_new_node(ve, stbuf);
+        av_filecache_set(key, nod);
+    }
+    AV_UNLOCK(lock);
+
+    return nod;
+}
+
+static int lz4_getnode(ventry *ve, vfile *base, struct lz4node **resp)
+{
+    int res;
+    struct avstat stbuf;
+    const int attrmask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME;
+    struct lz4node *nod;
+    char *key;
+
+    res = av_filecache_getkey(ve, &key);
+    if(res < 0)
+        return res;
+
+    nod = (struct lz4node *) av_filecache_get_checked(ve, key);
+    if(nod != NULL) {
+        av_free(key);
+        *resp = nod;
+        return 0;
+    }
+
+    res = av_fgetattr(base, &stbuf, attrmask);
+    if(res < 0) {
+        av_free(key);
+        return res;
+    }
+
+    nod = lz4_do_get_node(ve, key, &stbuf);
+
+    av_free(key);
+
+    *resp = nod;
+    return 0;
+}
+
+static int lz4_lookup(ventry *ve, const char *name, void **newp)
+{
+    char *path = (char *) ve->data;
+    
+    if(path == NULL) {
+        if(name[0] != '\0')
+            return -ENOENT;
+	if(av_filecache_checkopts(ve, "") < 0)
+            return -ENOENT;
+        path = av_strdup(name);
+    }
+    else if(name == NULL) {
+        av_free(path);
+        path = NULL;
+    }
+    else 
+        return -ENOENT;
+    
+    *newp = path;
+    return 0;
+}
+
+static int lz4_access(ventry *ve, int amode)
+{
+    return av_access(ve->mnt->base, amode);
+}
+
+static int lz4_open(ventry *ve, int flags, avmode_t mode, void **resp)
+{
+    int res;
+    vfile *base;
+    struct lz4node *nod;
+    struct lz4handle *fil;
+
+    if(flags & AVO_DIRECTORY)
+        return -ENOTDIR;
+
+    if(AV_ISWRITE(flags))
+        return -EROFS;
+
+    res = av_open(ve->mnt->base, AVO_RDONLY, 0, &base);
+    if(res < 0)
+        return res;
+
+    res = lz4_getnode(ve, base, &nod);
+    if(res < 0) {
+        av_close(base);
+        return res;
+    }
+
+    AV_NEW(fil);
+    if((flags & AVO_ACCMODE) != AVO_NOPERM)
+        fil->zfil = av_lz4file_new(base);
+    else
+        fil->zfil = NULL;
+
+    fil->base = base;
+    fil->node = nod;
+    
+    *resp = fil;
+    return 0;
+}
+
+static int lz4_close(vfile *vf)
+{
+    struct lz4handle *fil = (struct lz4handle *) vf->data;
+
+    av_unref_obj(fil->zfil);
+    av_unref_obj(fil->node);
+    av_close(fil->base);
+    av_free(fil);
+
+    return 0;
+}
+
+static avssize_t lz4_read(vfile *vf, char *buf, avsize_t nbyte)
+{
+    avssize_t res;
+    struct lz4handle *fil = (struct lz4handle *) vf->data;
+ 
+    res = av_lz4file_pread(fil->zfil, fil->node->cache, buf, nbyte, vf->ptr);
+    if(res > 0)
+        vf->ptr += res;
+
+    return res;
+}
+
+static int lz4_getattr(vfile *vf, struct avstat *buf, int attrmask)
+{
+    int res;
+    struct lz4handle *fil = (struct lz4handle *) vf->data;
+    struct lz4node *nod = fil->node;
+    avoff_t size;
+    const int basemask = AVA_MODE | AVA_UID | AVA_GID | AVA_MTIME | AVA_ATIME | AVA_CTIME;
+
+    res = av_fgetattr(fil->base, buf, basemask);
+    if(res < 0)
+        return res;
+
+    if((attrmask & (AVA_SIZE | AVA_BLKCNT)) != 0) {
+        res = av_lz4file_size(fil->zfil, fil->node->cache, &size);
+        if(res == 0 && size == -1) {
+            fil->zfil = av_lz4file_new(fil->base);
+            res = av_lz4file_size(fil->zfil, fil->node->cache, &size);
+        }
+        if(res < 0)
+            return res;
+
+        buf->size = size;
+        buf->blocks = AV_BLOCKS(buf->size);
+    }
+
+    buf->mode &= ~(07000);
+    buf->blksize = 4096;
+    buf->dev = vf->mnt->avfs->dev;
+    buf->ino = nod->ino;
+    buf->nlink = 1;
+    
+    return 0;
+}
+
+extern int av_init_module_ulz4(struct vmodule *module);
+
+int av_init_module_ulz4(struct vmodule *module)
+{
+    int res;
+    struct avfs *avfs;
+    struct ext_info ulz4_exts[3];
+
+    ulz4_exts[0].from = ".tar.lz4",  ulz4_exts[0].to = ".tar";
+    ulz4_exts[1].from = ".lz4",  ulz4_exts[1].to = NULL;
+    ulz4_exts[2].from = NULL;
+
+    res = av_new_avfs("ulz4", ulz4_exts, AV_VER, AVF_NOLOCK, module, &avfs);
+    if(res < 0)
+        return res;
+
+    avfs->lookup   = lz4_lookup;
+    avfs->access   = lz4_access;
+    avfs->open     = lz4_open;
+    avfs->close    = lz4_close; 
+    avfs->read     = lz4_read;
+    avfs->getattr  = lz4_getattr;
+
+    av_add_avfs(avfs);
+
+    av_init_lz4stat();
+
+    return 0;
+}
@@ -9,12 +9,22 @@
     Copyright (C) 1998 David Hanak (dhanak@inf.bme.hu)
 */
 
+#include "config.h"
 #include "archive.h"
+#ifdef HAVE_LIBARCHIVE
+#include "rarfile.h"
+#include "subfile.h"
+#endif
 #include "realfile.h"
 #include "prog.h"
 #include "oper.h"
+#include "cache.h"
+#include "internal.h"
 #include "version.h"
+#include "exit.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -106,18 +116,66 @@ typedef avbyte file_header[FILE_HEAD_SIZE];
 #define CRC_TABLESIZE 256
 static avuint CRC_table[CRC_TABLESIZE];
 
+/* Solid archives up to this unpacked size are unpacked into a
+   temporary file as a whole on the first open of a member, 0 disables
+   this */
+static AV_LOCK_DECL(urarstat_lock);
+static avoff_t urar_solid_cache = 100 * 1024 * 1024;
+
+#define RARUNPACK_BUFSIZE 65536
+#define RARUNPACK_ACCOUNT (4 * 1024 * 1024)
+
+/* Shared by the nodes of a solid archive */
+struct rarsolid {
+    avmutex lock;
+    int usable;               /* Members can be cut from 'rar p' output */
+    int num;
+    avoff_t *starts;          /* Offsets of the members in the tmpfile */
+    struct cacheobj *cobj;    /* The struct rarunpack */
+};
+
+/* All members of a solid archive, unpacked in the background */
+struct rarunpack {
+    char *tmpfile;
+    int fd;
+    int num;
+    avoff_t *starts;
+    avoff_t accounted;        /* Size last told to the cache */
+
+    /* Only used by the thread */
+    struct realfile *rf;
+    struct cacheobj *cobj;
+
+    avmutex lock;
+    pthread_cond_t cond;
+    avoff_t done;             /* Bytes written to the tmpfile */
+    int state;                /* 0 running, 1 finished, < 0 error */
+};
+
+/* The unpacking threads use the cache, so they are stopped and waited
+   for at exit, before it is destroyed */
+static AV_LOCK_DECL(rarunpack_lock);
+static pthread_cond_t rarunpack_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int rarunpack_running = 0;
+static int rarunpack_stop = 0;
+static int rarunpack_exit_added = 0;
+
 struct rarnode {
     avushort flags;
     avbyte hostos;
     avbyte packer_version;
     avbyte method;
+    int index;
     char *path;
+    struct rarsolid *solid;
 };
 
 struct rar_entinfo {
     char *name;
     char *linkname;
     avoff_t datastart;
+    int index;
+    struct rarsolid *solid;
     block_header bh;
     file_header fh;
 };
@@ -125,6 +183,11 @@ struct rar_entinfo {
 struct rarfile {
     char *tmpfile;
     int fd;
+    struct rarunpack *ru;
+#ifdef HAVE_LIBARCHIVE
+    struct rarstream *rs;
+    vfile *base;             /* Read by rs, ahead of it */
+#endif
 };
 
 static void initCRC(void)
@@ -207,7 +270,7 @@ static int read_marker_block(vfile *vf)
     return 0; /* Just to avoid warnings. Never reaches this line. */
 }
 
-static int read_archive_header(vfile *vf)
+static int read_archive_header(vfile *vf, avushort *flagsp)
 {
     int res;
     block_header main_head;
@@ -238,6 +301,7 @@ static int read_archive_header(vfile *vf)
     }
 
     av_lseek(vf, bh_size(main_head) - headlen - 6, AVSEEK_CUR);
+    *flagsp = bh_flags(main_head);
 
     return 0;
 }
@@ -283,6 +347,7 @@ static avmode_t dos2unix_attr(avuint da, avmode_t archmode)
 static void rarnode_delete(struct rarnode *info)
 {
     av_free(info->path);
+    av_unref_obj(info->solid);
 }
 
 static avmode_t rar_get_mode(struct rar_entinfo *ei, avmode_t origmode)
@@ -297,6 +362,47 @@ static avmode_t rar_get_mode(struct rar_entinfo *ei, avmode_t origmode)
     }
 }
 
+static void rarsolid_delete(struct rarsolid *solid)
+{
+    av_unref_obj(solid->cobj);
+    av_free(solid->starts);
+    AV_FREELOCK(solid->lock);
+}
+
+static struct rarsolid *rarsolid_new()
+{
+    struct rarsolid *solid;
+
+    AV_NEW_OBJ(solid, rarsolid_delete);
+    AV_INITLOCK(solid->lock);
+    solid->usable = 1;
+    solid->num = 0;
+    solid->starts = av_malloc(sizeof(avoff_t));
+    solid->starts[0] = 0;
+    solid->cobj = NULL;
+
+    return solid;
+}
+
+static void rarsolid_add(struct rarsolid *solid, struct rar_entinfo *ei)
+{
+    avoff_t size = fh_origsize(ei->fh);
+
+    if(AV_ISDIR(rar_get_mode(ei, 0)))
+        size = 0;
+
+    /* Can't tell what 'rar p' prints for these */
+    if(ei->linkname != NULL ||
+       (bh_flags(ei->bh) & (FF_WITH_PASSWORD | FF_CONT_FROM_PREV |
+                            FF_CONT_IN_NEXT)) != 0)
+        solid->usable = 0;
+
+    solid->starts = av_realloc(solid->starts,
+                               (solid->num + 2) * sizeof(avoff_t));
+    solid->starts[solid->num + 1] = solid->starts[solid->num] + size;
+    solid->num ++;
+}
+
 static void fill_rarentry(struct archive *arch, struct entry *ent,
                          struct rar_entinfo *ei)
 {
@@ -316,8 +422,10 @@ static void fill_rarentry(struct archive *arch, struct entry *ent,
     nod->st.blksize = 4096;
 
     nod->offset = ei->datastart;
-    if(fh_method(ei->fh) == M_STORE)
+    if(fh_method(ei->fh) == M_STORE) {
         nod->realsize = fh_origsize(ei->fh);
+        nod->flags |= ANOF_STORED;
+    }
     else
         nod->realsize = 0;
 
@@ -330,7 +438,10 @@ static void fill_rarentry(struct archive *arch, struct entry *ent,
     info->hostos = fh_hostos(ei->fh);
     info->packer_version = fh_version(ei->fh);
     info->method = fh_method(ei->fh);
+    info->index = ei->index;
     info->path = av_strdup(ei->name);
+    info->solid = ei->solid;
+    av_ref_obj(info->solid);
 }
 
 static void insert_rarentry(struct archive *arch, struct rar_entinfo *ei)
@@ -443,18 +554,12 @@ static int read_rarentry(vfile *vf, struct rar_entinfo *ei)
     return 0;
 }
 
-static int read_rarfile(vfile *vf, struct archive *arch)
+static int read_rarentries(vfile *vf, struct archive *arch,
+                           struct rarsolid *solid)
 {
     avoff_t headstart;
     int res;
-
-    res = read_marker_block(vf);
-    if(res < 0)
-        return res;
-
-    res = read_archive_header(vf);
-    if(res < 0)
-        return res;
+    int index = 0;
 
     headstart = vf->ptr;
     while(1) {
@@ -477,6 +582,10 @@ static int read_rarfile(vfile *vf, struct archive *arch)
                 return res;
             }
             ei.datastart = vf->ptr;
+            ei.index = index++;
+            ei.solid = solid;
+            if(solid != NULL)
+                rarsolid_add(solid, &ei);
 
             insert_rarentry(arch, &ei);
             av_free(ei.name);
@@ -489,6 +598,28 @@ static int read_rarfile(vfile *vf, struct archive *arch)
     return 0;
 }
 
+static int read_rarfile(vfile *vf, struct archive *arch)
+{
+    int res;
+    avushort mainflags;
+    struct rarsolid *solid = NULL;
+
+    res = read_marker_block(vf);
+    if(res < 0)
+        return res;
+
+    res = read_archive_header(vf, &mainflags);
+    if(res < 0)
+        return res;
+
+    if((mainflags & (FA_IS_SOLID | FA_IS_VOLUME)) == FA_IS_SOLID)
+        solid = rarsolid_new();
+    res = read_rarentries(vf, arch, solid);
+    av_unref_obj(solid);
+
+    return res;
+}
+
 static int parse_rarfile(void *data, ventry *ve, struct archive *arch)
 {
     int res;
@@ -506,7 +637,8 @@ static int parse_rarfile(void *data, ventry *ve, struct archive *arch)
 }
 
 /* FIXME: Because we use the 'rar' program to extract the contents of
-   each file individually , we get _VERY_ poor performance */
+   each file individually , we get _VERY_ poor performance.  This is
+   only used if the member can't be unpacked with libarchive. */
 
 static int get_rar_file(ventry *ve, struct archfile *fil, int fd)
 {
@@ -606,12 +738,388 @@ static int do_unrar(ventry *ve, struct archfile *fil)
     AV_NEW(rfil);
     rfil->tmpfile = tmpfile;
     rfil->fd = fd;
+    rfil->ru = NULL;
+#ifdef HAVE_LIBARCHIVE
+    rfil->rs = NULL;
+    rfil->base = NULL;
+#endif
 
     fil->data = rfil;
 
     return 0;
 }
 
+static void rarunpack_delete(struct rarunpack *ru)
+{
+    if(ru->fd != -1)
+        close(ru->fd);
+    av_del_tmpfile(ru->tmpfile);
+    av_free(ru->starts);
+    av_unref_obj(ru->rf);
+    pthread_cond_destroy(&ru->cond);
+    AV_FREELOCK(ru->lock);
+}
+
+static void rarunpack_exit()
+{
+    AV_LOCK(rarunpack_lock);
+    rarunpack_stop = 1;
+    while(rarunpack_running != 0)
+        pthread_cond_wait(&rarunpack_cond, &rarunpack_lock);
+    rarunpack_stop = 0;
+    rarunpack_exit_added = 0;
+    AV_UNLOCK(rarunpack_lock);
+}
+
+static int rarunpack_stopped()
+{
+    int stop;
+
+    AV_LOCK(rarunpack_lock);
+    stop = rarunpack_stop;
+    AV_UNLOCK(rarunpack_lock);
+
+    return stop;
+}
+
+/* Copy the output of the program to the tmpfile */
+static int rarunpack_copy(struct rarunpack *ru, int fd)
+{
+    avssize_t res;
+    avoff_t pos = 0;
+    avoff_t total = ru->starts[ru->num];
+    char buf[RARUNPACK_BUFSIZE];
+
+    while(1) {
+        /* The program is killed by the caller */
+        if(rarunpack_stopped())
+            return -EINTR;
+
+        res = read(fd, buf, RARUNPACK_BUFSIZE);
+        if(res == -1 && errno == EINTR)
+            continue;
+        if(res == -1)
+            return -errno;
+        if(res == 0)
+            break;
+
+        if(res > total - pos)
+            return -EIO;
+
+        if(pwrite(ru->fd, buf, res, pos) != res) {
+            av_log(AVLOG_ERROR, "URAR: Could not write %s: %s", ru->tmpfile,
+                   strerror(errno));
+            return -EIO;
+        }
+        pos += res;
+
+        AV_LOCK(ru->lock);
+        if(pos > ru->done) {
+            ru->done = pos;
+            pthread_cond_broadcast(&ru->cond);
+        }
+        AV_UNLOCK(ru->lock);
+
+        /* Don't check the free space for each buffer */
+        if(pos - ru->accounted >= RARUNPACK_ACCOUNT) {
+            av_cacheobj_setsize(ru->cobj, pos);
+            ru->accounted = pos;
+        }
+    }
+
+    return (pos == total) ? 0 : -EIO;
+}
+
+static int rarunpack_prog(struct rarunpack *ru, const char *progname)
+{
+    int res;
+    int wres;
+    int pipefd[2];
+    const char *prog[6];
+    struct proginfo pri;
+
+    /* Without a member name all members are printed in archive order */
+    prog[0] = progname;
+    prog[1] = "p";
+    prog[2] = "-c-";
+    prog[3] = "-ierr";
+    prog[4] = ru->rf->name;
+    prog[5] = NULL;
+
+    if(pipe(pipefd) == -1) {
+        res = -errno;
+        av_log(AVLOG_ERROR, "URAR: unable to create pipe: %s",
+               strerror(errno));
+        return res;
+    }
+    av_registerfd(pipefd[0]);
+    av_registerfd(pipefd[1]);
+
+    av_init_proginfo(&pri);
+    pri.prog = prog;
+    pri.ifd = open("/dev/null", O_RDONLY);
+    pri.ofd = pipefd[1];
+    pri.efd = pri.ifd;
+
+    res = av_start_prog(&pri);
+    close(pri.ifd);
+    close(pipefd[1]);
+
+    if(res == 0) {
+        res = rarunpack_copy(ru, pipefd[0]);
+        wres = av_wait_prog(&pri, res < 0, 0);
+        if(res == 0 && wres < 0)
+            res = wres;
+    }
+    close(pipefd[0]);
+
+    return res;
+}
+
+static void *rarunpack_run(void *data)
+{
+    int res;
+    avoff_t done;
+    struct rarunpack *ru = (struct rarunpack *) data;
+
+    res = rarunpack_prog(ru, "rar");
+
+    /* unrar would write the tmpfile again from the start, so it is
+       only tried if nothing has been written, and maybe read, yet.
+       Otherwise the unpacking fails, and what was written stays
+       readable */
+    AV_LOCK(ru->lock);
+    done = ru->done;
+    AV_UNLOCK(ru->lock);
+    if(res < 0 && res != -EINTR && done == 0)
+        res = rarunpack_prog(ru, "unrar");
+    if(res < 0)
+        av_log(AVLOG_WARNING, "URAR: unpacking solid archive failed: %i",
+               res);
+
+    av_cacheobj_setsize(ru->cobj, ru->done);
+
+    AV_LOCK(ru->lock);
+    ru->state = (res < 0) ? res : 1;
+    pthread_cond_broadcast(&ru->cond);
+    AV_UNLOCK(ru->lock);
+
+    av_unref_obj(ru->cobj);
+    av_unref_obj(ru);
+
+    AV_LOCK(rarunpack_lock);
+    rarunpack_running --;
+    pthread_cond_broadcast(&rarunpack_cond);
+    AV_UNLOCK(rarunpack_lock);
+
+    return NULL;
+}
+
+/* Takes over the reference to 'rf' */
+static int rarunpack_start(struct realfile *rf, struct rarsolid *solid,
+                           struct rarunpack **resp)
+{
+    int res;
+    int addexit;
+    struct rarunpack *ru;
+    pthread_t thread;
+
+    AV_NEW_OBJ(ru, rarunpack_delete);
+    AV_INITLOCK(ru->lock);
+    pthread_cond_init(&ru->cond, NULL);
+    ru->tmpfile = NULL;
+    ru->fd = -1;
+    ru->num = solid->num;
+    ru->starts = av_malloc((solid->num + 1) * sizeof(avoff_t));
+    memcpy(ru->starts, solid->starts, (solid->num + 1) * sizeof(avoff_t));
+    ru->accounted = 0;
+    ru->rf = rf;
+    ru->cobj = NULL;
+    ru->done = 0;
+    ru->state = 0;
+
+    res = av_get_tmpfile(&ru->tmpfile);
+    if(res < 0) {
+        av_unref_obj(ru);
+        return res;
+    }
+    ru->fd = open(ru->tmpfile, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(ru->fd == -1) {
+        res = -errno;
+        av_log(AVLOG_ERROR, "URAR: Could not open %s: %s", ru->tmpfile,
+               strerror(errno));
+        av_unref_obj(ru);
+        return res;
+    }
+
+    /* The reference to the cache object is the thread's, and it holds
+       one to 'ru' as well */
+    ru->cobj = av_cacheobj_new(ru, "(urar:solid)");
+    av_unref_obj(solid->cobj);
+    solid->cobj = ru->cobj;
+    av_ref_obj(solid->cobj);
+
+    av_ref_obj(ru);
+    AV_LOCK(rarunpack_lock);
+    if(pthread_create(&thread, NULL, rarunpack_run, ru) != 0) {
+        AV_UNLOCK(rarunpack_lock);
+        /* Remembered as failed, like an error in the thread */
+        av_log(AVLOG_ERROR, "URAR: Could not start thread");
+        av_unref_obj(ru->cobj);
+        ru->state = -EIO;
+        av_unref_obj(ru);
+        av_unref_obj(ru);
+        return -EIO;
+    }
+    rarunpack_running ++;
+    addexit = !rarunpack_exit_added;
+    rarunpack_exit_added = 1;
+    AV_UNLOCK(rarunpack_lock);
+    pthread_detach(thread);
+
+    /* Not under rarunpack_lock, which the handler takes with the exit
+       lock held.  Added after the cache's, so it is run before that */
+    if(addexit)
+        av_add_exithandler(rarunpack_exit);
+
+    *resp = ru;
+    return 0;
+}
+
+static int do_rarunpack(ventry *ve, struct archfile *fil)
+{
+    int res;
+    struct rarnode *info = (struct rarnode *) fil->nod->data;
+    struct rarsolid *solid = info->solid;
+    struct rarfile *rfil;
+    struct rarunpack *ru;
+    struct realfile *rf;
+    avoff_t limit;
+
+    AV_LOCK(urarstat_lock);
+    limit = urar_solid_cache;
+    AV_UNLOCK(urarstat_lock);
+
+    if(!solid->usable || limit == 0 || solid->starts[solid->num] > limit)
+        return -ENOSYS;
+
+    AV_LOCK(solid->lock);
+    ru = (struct rarunpack *) av_cacheobj_get(solid->cobj);
+    AV_UNLOCK(solid->lock);
+    if(ru == NULL) {
+        /* This may copy the whole archive, so not under the lock */
+        res = av_get_realfile(ve->mnt->base, &rf);
+        if(res < 0)
+            return res;
+
+        AV_LOCK(solid->lock);
+        ru = (struct rarunpack *) av_cacheobj_get(solid->cobj);
+        if(ru == NULL)
+            res = rarunpack_start(rf, solid, &ru);
+        else
+            av_unref_obj(rf);
+        AV_UNLOCK(solid->lock);
+        if(res < 0)
+            return res;
+    }
+
+    AV_LOCK(ru->lock);
+    res = ru->state;
+    AV_UNLOCK(ru->lock);
+    if(res < 0) {
+        av_unref_obj(ru);
+        return res;
+    }
+
+    AV_NEW(rfil);
+    rfil->tmpfile = NULL;
+    rfil->fd = -1;
+    rfil->ru = ru;
+#ifdef HAVE_LIBARCHIVE
+    rfil->rs = NULL;
+    rfil->base = NULL;
+#endif
+
+    fil->data = rfil;
+
+    return 0;
+}
+
+/* Only waits for the part of the tmpfile that is read */
+static avssize_t rarunpack_read(vfile *vf, struct rarunpack *ru, char *buf,
+                                avsize_t nbyte)
+{
+    avssize_t res;
+    struct archfile *fil = arch_vfile_file(vf);
+    struct rarnode *info = (struct rarnode *) fil->nod->data;
+    avoff_t start = ru->starts[info->index];
+    avoff_t size = ru->starts[info->index + 1] - start;
+
+    if(vf->ptr >= size)
+        return 0;
+    if(nbyte > size - vf->ptr)
+        nbyte = size - vf->ptr;
+
+    AV_LOCK(ru->lock);
+    while(ru->done < start + vf->ptr + nbyte && ru->state == 0)
+        pthread_cond_wait(&ru->cond, &ru->lock);
+    res = (ru->done < start + vf->ptr + nbyte) ? -EIO : 0;
+    AV_UNLOCK(ru->lock);
+    if(res < 0)
+        return res;
+
+    res = pread(ru->fd, buf, nbyte, start + vf->ptr);
+    if(res == -1)
+        return -errno;
+
+    vf->ptr += res;
+
+    return res;
+}
+
+#ifdef HAVE_LIBARCHIVE
+static int do_rarstream(ventry *ve, struct archfile *fil)
+{
+    int res;
+    struct rarnode *info = (struct rarnode *) fil->nod->data;
+    struct rarfile *rfil;
+    struct rarstream *rs;
+    struct avstat stbuf;
+    vfile *base;
+
+    if(fil->basefile == NULL)
+        return -ENOSYS;
+
+    /* libarchive reads the archive from the start in pieces, so read
+       the base ahead of it */
+    res = av_fgetattr(fil->basefile, &stbuf, AVA_SIZE);
+    if(res < 0)
+        return res;
+    res = av_subfile_new(fil->basefile, 0, stbuf.size, NULL, 0, &base);
+    if(res < 0)
+        return res;
+
+    res = av_rarstream_new(base, info->index, fil->nod->st.size, &rs);
+    if(res < 0) {
+        av_log(AVLOG_DEBUG, "URAR: unpacking %s with libarchive failed: %i",
+               info->path, res);
+        av_unref_obj(base);
+        return res;
+    }
+
+    AV_NEW(rfil);
+    rfil->tmpfile = NULL;
+    rfil->fd = -1;
+    rfil->rs = rs;
+    rfil->base = base;
+    rfil->ru = NULL;
+
+    fil->data = rfil;
+
+    return 0;
+}
+#endif
+
 
 static int rar_open(ventry *ve, struct archfile *fil)
 {
@@ -627,8 +1135,15 @@ static int rar_open(ventry *ve, struct archfile *fil)
         return -EACCES;
     }
 
-    if(info->method != M_STORE)
+    if(info->method != M_STORE) {
+        if(info->solid != NULL && do_rarunpack(ve, fil) == 0)
+            return 0;
+#ifdef HAVE_LIBARCHIVE
+        if(do_rarstream(ve, fil) == 0)
+            return 0;
+#endif
         return do_unrar(ve, fil);
+    }
     
     return 0;
 }
@@ -638,8 +1153,15 @@ static int rar_close(struct archfile *fil)
     struct rarfile *rfil = (struct rarfile *) fil->data;
 
     if(rfil != NULL) {
-        close(rfil->fd);
-        av_del_tmpfile(rfil->tmpfile);
+        av_unref_obj(rfil->ru);
+#ifdef HAVE_LIBARCHIVE
+        av_unref_obj(rfil->rs);
+        av_unref_obj(rfil->base);
+#endif
+        if(rfil->fd != -1) {
+            close(rfil->fd);
+            av_del_tmpfile(rfil->tmpfile);
+        }
         av_free(rfil);
     }
     
@@ -655,6 +1177,19 @@ static avssize_t rar_read(vfile *vf, char *buf, avsize_t nbyte)
     if(rfil == NULL)
         return av_arch_read(vf, buf, nbyte);
 
+    if(rfil->ru != NULL)
+        return rarunpack_read(vf, rfil->ru, buf, nbyte);
+
+#ifdef HAVE_LIBARCHIVE
+    if(rfil->rs != NULL) {
+        res = av_rarstream_pread(rfil->rs, buf, nbyte, vf->ptr);
+        if(res > 0)
+            vf->ptr += res;
+
+        return res;
+    }
+#endif
+
     if(lseek(rfil->fd, vf->ptr, SEEK_SET) == -1)
         return -errno;
 
@@ -694,5 +1229,8 @@ int av_init_module_urar(struct vmodule *module)
 
     av_add_avfs(avfs);
 
+    av_avfsstat_register_int("urar/solid_cache", &urar_solid_cache,
+                             &urarstat_lock, 0, AV_MAXOFF, NULL);
+
     return 0;
 }
@@ -16,10 +16,37 @@
 #include "oper.h"
 #include "ugid.h"
 #include "version.h"
+#include "internal.h"
 #include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #define COPYBUFSIZE 16384
 #define BIGBLOCKSIZE (20 * BLOCKSIZE)
+#define TARBUFSIZE (64 * BIGBLOCKSIZE)
+
+/* The index sidecar: "<archive>.avfsidx" next to the archive.  After
+   the magic come the size and the mtime of the archive, the number of
+   entries and the entries.  An entry is the data offset and the size
+   (8 bytes each), the length of the name and of the link name (4
+   bytes each), the header fields in TARIDX_FIELDS, then the name and
+   the link name.  Numbers are little endian */
+#define TARIDX_SUFFIX ".avfsidx"
+#define TARIDX_MAGIC "AVFSTARIDX1\n"
+#define TARIDX_MAGICLEN 12
+#define TARIDX_HDRSIZE (TARIDX_MAGICLEN + 3 * 8)
+#define TARIDX_ENTSIZE (2 * 8 + 2 * 4 + TARIDX_FIELDSIZE)
+
+/* mode .. typeflag, magic .. devminor and the realsize of sparse files */
+#define TARIDX_FIELDSIZE (57 + 88 + 12)
+static const struct { int off; int len; } taridx_fields[] = {
+    { 100, 57 }, { 257, 88 }, { 483, 12 }, { 0, 0 }
+};
+
+/* Tunable in #avfsstat: 0: no sidecar, 1: use it if it is there and
+   up to date, 2: also write it after scanning the archive */
+static AV_LOCK_DECL(utarstat_lock);
+static avoff_t utar_index = 0;
 
 /* Some constants from POSIX are given names.  */
 #define NAME_FIELD_SIZE   100
@@ -38,6 +65,26 @@ struct tar_entinfo {
     union block header;
 };
 
+/* Read-ahead buffer used while scanning the headers.  The amount read
+   at once starts at one record after a skip and grows while the blocks
+   are used one after the other, as with many small files */
+struct tarbuf {
+    vfile *vf;
+    avoff_t off;       /* Offset of buf in the file */
+    char *buf;
+    avsize_t len;      /* Bytes in buf */
+    avsize_t ptr;      /* Current position relative to buf */
+    avsize_t fill;     /* Size of the next read */
+};
+
+/* The entries found by a scan, in sidecar format */
+struct taridx {
+    char *buf;
+    avsize_t len;
+    avsize_t alloc;
+    avuquad num;
+};
+
 struct sp_array
 {
     avoff_t offset;
@@ -49,6 +96,7 @@ struct tarnode {
     struct sp_array *sparsearray;
     int sp_array_len;
     avoff_t headeroff;
+    avoff_t sparsedata;      /* Data offset after the extended headers */
     avuid_t uid;
     avgid_t gid;
     char uname[UNAME_FIELD_SIZE];
@@ -230,26 +278,93 @@ static void to_oct (long value, int digs, char *where)
 
 #endif
 
-static int find_next_block(vfile *vf, union block *blk)
+static void tarbuf_init(struct tarbuf *tb, vfile *vf)
+{
+    tb->vf = vf;
+    tb->off = 0;
+    tb->buf = av_malloc(TARBUFSIZE);
+    tb->len = 0;
+    tb->ptr = 0;
+    tb->fill = BIGBLOCKSIZE;
+}
+
+static void tarbuf_free(struct tarbuf *tb)
+{
+    av_free(tb->buf);
+}
+
+static avoff_t tarbuf_pos(struct tarbuf *tb)
+{
+    return tb->off + tb->ptr;
+}
+
+/* Skip the data of a member, without reading it if it is not already
+   in the buffer */
+static void tarbuf_skip(struct tarbuf *tb, avoff_t size)
+{
+    if(size <= (avoff_t) (tb->len - tb->ptr)) {
+        tb->ptr += size;
+        return;
+    }
+
+    tb->off += tb->ptr + size;
+    tb->len = 0;
+    tb->ptr = 0;
+    tb->fill = BIGBLOCKSIZE;
+
+    /* The next member is not right after the previous one in the
+       stream: if this is compressed, ask for a restart point there */
+    av_seekhint(tb->vf, tb->off);
+}
+
+static int tarbuf_fill(struct tarbuf *tb)
+{
+    avssize_t res;
+    avsize_t len = 0;
+
+    tb->off += tb->ptr;
+    tb->ptr = 0;
+    while(len < tb->fill) {
+        res = av_pread(tb->vf, tb->buf + len, tb->fill - len, tb->off + len);
+        if(res < 0)
+            return res;
+        if(res == 0)
+            break;
+        len += res;
+    }
+    tb->len = len;
+    if(tb->fill < TARBUFSIZE)
+        tb->fill *= 2;
+
+    return 0;
+}
+
+static int find_next_block(struct tarbuf *tb, union block *blk)
 {
     int res;
 
-    res = av_read(vf, blk->buffer, BLOCKSIZE);
-    if(res <= 0)
-        return res;
-    if(res < BLOCKSIZE) {
-        av_log(AVLOG_WARNING, "TAR: Broken archive");
-        return -EIO;
+    if(tb->ptr + BLOCKSIZE > tb->len) {
+        res = tarbuf_fill(tb);
+        if(res < 0)
+            return res;
+        if(tb->len == 0)
+            return 0;
+        if(tb->len < BLOCKSIZE) {
+            av_log(AVLOG_WARNING, "TAR: Broken archive");
+            return -EIO;
+        }
     }
+    memcpy(blk->buffer, tb->buf + tb->ptr, BLOCKSIZE);
+    tb->ptr += BLOCKSIZE;
 
     return 1;
 }
 
-static int get_next_block(vfile *vf, union block *blk)
+static int get_next_block(struct tarbuf *tb, union block *blk)
 {
     int res;
   
-    res = find_next_block(vf, blk);
+    res = find_next_block(tb, blk);
     if(res < 0)
         return res;
     if(res == 0) {
@@ -278,7 +393,7 @@ static enum archive_format get_header_format( union block *header )
 }
 
 /* return values: < 0: fatal, 0 eof, 1 bad header, 2 OK */
-static int read_entry(vfile *vf, struct tar_entinfo *tinf)
+static int read_entry(struct tarbuf *tb, struct tar_entinfo *tinf)
 {
     int i;
     long unsigned_sum;		/* the POSIX one :-) */
@@ -290,13 +405,12 @@ static int read_entry(vfile *vf, struct tar_entinfo *tinf)
     union block data_block;
     int size, written;
     int res;
-    avoff_t sres;
     char *next_long_name = NULL, *next_long_link = NULL;
     union block *header = &tinf->header;
 
     while (1)
     {
-        res = find_next_block(vf, header);
+        res = find_next_block(tb, header);
         if(res <= 0) break; /* HEADER_END_OF_FILE */
 
         recorded_sum
@@ -364,7 +478,7 @@ static int read_entry(vfile *vf, struct tar_entinfo *tinf)
 
                 for (size = tinf->size; size > 0; size -= written)
                     {
-                        res = get_next_block (vf, &data_block);
+                        res = get_next_block (tb, &data_block);
                         if (res < 0) break;
                         written = BLOCKSIZE;
                         if (written > size)
@@ -386,21 +500,18 @@ static int read_entry(vfile *vf, struct tar_entinfo *tinf)
 	}
         else
 	{
-            tinf->datastart = vf->ptr;
+            tinf->datastart = tarbuf_pos(tb);
 
             if (header->oldgnu_header.isextended) {
                 do {
-                    res = get_next_block (vf, &data_block);
+                    res = get_next_block (tb, &data_block);
                     if(res < 0) break;
                 }
                 while(data_block.sparse_header.isextended);
             }
             if(res < 0) break;
 
-            sres = av_lseek(vf, AV_DIV(tinf->size, BLOCKSIZE) * BLOCKSIZE, 
-                            AVSEEK_CUR);
-            if(sres < 0)
-                break;
+            tarbuf_skip(tb, AV_DIV(tinf->size, BLOCKSIZE) * BLOCKSIZE);
 
             if (header->header.typeflag == 'g')
                 continue;
@@ -627,6 +738,8 @@ static void fill_node(struct archive *arch, struct entry *ent,
 
     nod->offset = tinf->datastart;
     nod->realsize = tinf->size;
+    if(header->header.typeflag != GNUTYPE_SPARSE)
+        nod->flags |= ANOF_STORED;
 
     AV_NEW_OBJ(tn, tarnode_delete);
     nod->data = tn;
@@ -700,18 +813,247 @@ static void insert_tarentry(struct archive *arch, struct tar_entinfo *tinf,
     av_unref_obj(ent);
 }
 
+static void taridx_put(char *p, avuquad val, int len)
+{
+    int i;
+
+    for(i = 0; i < len; i++, val >>= 8)
+        p[i] = val & 0xff;
+}
+
+static avuquad taridx_get(const char *p, int len)
+{
+    int i;
+    avuquad val = 0;
+
+    for(i = len - 1; i >= 0; i--)
+        val = (val << 8) | (unsigned char) p[i];
+
+    return val;
+}
+
+static void taridx_add(struct taridx *ti, struct tar_entinfo *tinf)
+{
+    avsize_t namelen = strlen(tinf->name);
+    avsize_t linklen = strlen(tinf->linkname);
+    avsize_t size = TARIDX_ENTSIZE + namelen + linklen;
+    char *p;
+    int i;
+
+    if(ti->len + size > ti->alloc) {
+        ti->alloc = (ti->alloc + size) * 2;
+        ti->buf = av_realloc(ti->buf, ti->alloc);
+    }
+    p = ti->buf + ti->len;
+    taridx_put(p, tinf->datastart, 8);
+    taridx_put(p + 8, tinf->size, 8);
+    taridx_put(p + 16, namelen, 4);
+    taridx_put(p + 20, linklen, 4);
+    p += 24;
+    for(i = 0; taridx_fields[i].len != 0; i++) {
+        memcpy(p, tinf->header.buffer + taridx_fields[i].off,
+               taridx_fields[i].len);
+        p += taridx_fields[i].len;
+    }
+    memcpy(p, tinf->name, namelen);
+    memcpy(p + namelen, tinf->linkname, linklen);
+
+    ti->len += size;
+    ti->num ++;
+}
+
+/* Path of the sidecar: for a compressed tar ("foo.tgz#ugz") it is
+   next to the compressed file */
+static char *taridx_path(ventry *base)
+{
+    int res;
+    char *path;
+    char *s;
+
+    res = av_generate_path(base, &path);
+    if(res < 0)
+        return NULL;
+
+    s = strrchr(path, AVFS_SEP_CHAR);
+    if(s != NULL && strchr(s, '/') == NULL)
+        *s = '\0';
+
+    return av_stradd(path, TARIDX_SUFFIX, NULL);
+}
+
+static int taridx_open(const char *path, int flags, vfile **resp)
+{
+    int res;
+    ventry *ve;
+
+    res = av_get_ventry(path, 1, &ve);
+    if(res < 0)
+        return res;
+
+    res = av_open(ve, flags, 0644, resp);
+    av_free_ventry(ve);
+
+    return res;
+}
+
+static void taridx_sig(char *p, struct avstat *stbuf)
+{
+    memcpy(p, TARIDX_MAGIC, TARIDX_MAGICLEN);
+    taridx_put(p + TARIDX_MAGICLEN, stbuf->size, 8);
+    taridx_put(p + TARIDX_MAGICLEN + 8, stbuf->mtime.sec, 8);
+}
+
+/* Check the whole index before creating any entries, so that a broken
+   one can still fall back to scanning */
+static int taridx_check(const char *buf, avsize_t len, struct avstat *stbuf)
+{
+    char sig[TARIDX_HDRSIZE];
+    avuquad num;
+    avsize_t pos;
+
+    if(len < TARIDX_HDRSIZE)
+        return -1;
+
+    taridx_sig(sig, stbuf);
+    if(memcmp(buf, sig, TARIDX_HDRSIZE - 8) != 0)
+        return -1;
+
+    num = taridx_get(buf + TARIDX_HDRSIZE - 8, 8);
+    for(pos = TARIDX_HDRSIZE; num > 0; num--) {
+        if(len - pos < TARIDX_ENTSIZE)
+            return -1;
+        pos += TARIDX_ENTSIZE;
+        pos += taridx_get(buf + pos - TARIDX_ENTSIZE + 16, 4);
+        pos += taridx_get(buf + pos - TARIDX_ENTSIZE + 20, 4);
+        if(pos > len)
+            return -1;
+    }
+    if(pos != len)
+        return -1;
+
+    return 0;
+}
+
+static void taridx_insert(const char *buf, struct archive *arch,
+                          struct ugidcache *cache)
+{
+    struct tar_entinfo tinf;
+    enum archive_format format;
+    struct avstat tarstat;
+    avuquad num;
+    avsize_t namelen;
+    avsize_t linklen;
+    const char *p;
+    int i;
+
+    num = taridx_get(buf + TARIDX_HDRSIZE - 8, 8);
+    for(p = buf + TARIDX_HDRSIZE; num > 0; num--) {
+        tinf.datastart = taridx_get(p, 8);
+        tinf.size = taridx_get(p + 8, 8);
+        namelen = taridx_get(p + 16, 4);
+        linklen = taridx_get(p + 20, 4);
+        p += 24;
+        memset(&tinf.header, 0, sizeof(tinf.header));
+        for(i = 0; taridx_fields[i].len != 0; i++) {
+            memcpy(tinf.header.buffer + taridx_fields[i].off, p,
+                   taridx_fields[i].len);
+            p += taridx_fields[i].len;
+        }
+        tinf.name = av_strndup(p, namelen);
+        tinf.linkname = av_strndup(p + namelen, linklen);
+        p += namelen + linklen;
+
+        av_default_stat(&tarstat);
+        decode_header(&tinf.header, &tarstat, &format, cache);
+
+        insert_tarentry(arch, &tinf, &tarstat);
+        av_free(tinf.name);
+        av_free(tinf.linkname);
+    }
+}
+
+/* Returns 0 if the archive was filled from the sidecar */
+static int taridx_read(const char *path, struct avstat *stbuf,
+                       struct archive *arch, struct ugidcache *cache)
+{
+    int res;
+    vfile *vf;
+    struct avstat idxst;
+    char *buf;
+
+    res = taridx_open(path, AVO_RDONLY, &vf);
+    if(res < 0)
+        return res;
+
+    res = av_fgetattr(vf, &idxst, AVA_SIZE);
+    if(res == 0 && (idxst.size < TARIDX_HDRSIZE ||
+                    idxst.size > (avoff_t) (avsize_t) -1 / 2))
+        res = -EINVAL;
+    if(res < 0) {
+        av_close(vf);
+        return res;
+    }
+
+    buf = av_malloc(idxst.size);
+    res = av_read_all(vf, buf, idxst.size);
+    av_close(vf);
+    if(res >= 0) {
+        if(taridx_check(buf, idxst.size, stbuf) == 0) {
+            taridx_insert(buf, arch, cache);
+            res = 0;
+        }
+        else {
+            av_log(AVLOG_WARNING, "TAR: Stale or broken index %s", path);
+            res = -EINVAL;
+        }
+    }
+    av_free(buf);
+
+    return res;
+}
+
+/* A partly written index is found broken by taridx_check() */
+static void taridx_write(const char *path, struct avstat *stbuf,
+                         struct taridx *ti)
+{
+    int res;
+    int ok;
+    vfile *vf;
+    char hdr[TARIDX_HDRSIZE];
+
+    res = taridx_open(path, AVO_WRONLY | AVO_CREAT | AVO_TRUNC, &vf);
+    if(res < 0) {
+        av_log(AVLOG_WARNING, "TAR: Cannot create index %s: %s", path,
+               strerror(-res));
+        return;
+    }
+
+    taridx_sig(hdr, stbuf);
+    taridx_put(hdr + TARIDX_HDRSIZE - 8, ti->num, 8);
+    ok = (av_write(vf, hdr, TARIDX_HDRSIZE) == TARIDX_HDRSIZE);
+    if(ok && ti->len != 0)
+        ok = (av_write(vf, ti->buf, ti->len) == (avssize_t) ti->len);
+    if(av_close(vf) < 0 || !ok)
+        av_log(AVLOG_WARNING, "TAR: Error writing index %s", path);
+}
+
 static int read_tarfile(vfile *vf, struct archive *arch,
-                        struct ugidcache *cache)
+                        struct ugidcache *cache, struct taridx *ti)
 {
     struct tar_entinfo tinf;
     enum archive_format format;
     struct avstat tarstat;
+    struct tarbuf tb;
     int res;
 
+    tarbuf_init(&tb, vf);
     while(1) {
-        res = read_entry(vf, &tinf);
+        av_arch_parse_unlock(arch);
+        res = read_entry(&tb, &tinf);
+        if(av_arch_parse_lock(arch) < 0)
+            res = -EINTR;
         if(res < 0)
-            return res;
+            break;
         else if(res == 1) {
 #if 0  /* FIXME */
             arch->flags |= ARCHF_RDONLY; /* Broken archive */
@@ -726,6 +1068,9 @@ static int read_tarfile(vfile *vf, struct archive *arch,
         else if(res == 0)
             break;
 
+        if(ti != NULL)
+            taridx_add(ti, &tinf);
+
         av_default_stat(&tarstat);
         decode_header(&tinf.header, &tarstat, &format, cache);
 
@@ -733,6 +1078,10 @@ static int read_tarfile(vfile *vf, struct archive *arch,
         av_free(tinf.name);
         av_free(tinf.linkname);
     }
+    tarbuf_free(&tb);
+
+    if(res < 0)
+        return res;
 
     return 0;
 }
@@ -743,16 +1092,47 @@ static int parse_tarfile(void *data, ventry *ve, struct archive *arch)
     int res;
     vfile *vf;
     struct ugidcache *cache;
+    avoff_t useindex;
+    char *idxpath = NULL;
+    struct avstat stbuf;
+    struct taridx ti;
+
+    AV_LOCK(utarstat_lock);
+    useindex = utar_index;
+    AV_UNLOCK(utarstat_lock);
+
+    cache = av_new_ugidcache();
+    if(useindex != 0 &&
+       av_getattr(ve->mnt->base, &stbuf, AVA_SIZE | AVA_MTIME, 0) == 0)
+        idxpath = taridx_path(ve->mnt->base);
+
+    if(idxpath != NULL && taridx_read(idxpath, &stbuf, arch, cache) == 0) {
+        av_unref_obj(cache);
+        av_free(idxpath);
+        return 0;
+    }
 
     res = av_open(ve->mnt->base, AVO_RDONLY, 0, &vf);
-    if(res < 0)
+    if(res < 0) {
+        av_unref_obj(cache);
+        av_free(idxpath);
         return res;
+    }
 
-    cache = av_new_ugidcache();
-    res = read_tarfile(vf, arch, cache);
+    ti.buf = NULL;
+    ti.len = 0;
+    ti.alloc = 0;
+    ti.num = 0;
+    res = read_tarfile(vf, arch, cache,
+                       idxpath != NULL && useindex == 2 ? &ti : NULL);
     av_unref_obj(cache);
 
     av_close(vf);
+
+    if(res == 0 && idxpath != NULL && useindex == 2)
+        taridx_write(idxpath, &stbuf, &ti);
+    av_free(ti.buf);
+    av_free(idxpath);
     
     return res;  
 }
@@ -1183,17 +1563,34 @@ static avssize_t tar_write(ave *v, void *devinfo, const char *buf,
 
 #endif
 
+/* The sparse map is read under the node lock by read_sparse() */
 static void tar_release(struct archive *arch, struct archnode *nod)
 {
     struct tarnode *tn = (struct tarnode *) nod->data;
 
     if(tn != NULL) {
+	AV_LOCK(nod->lock);
 	av_free(tn->sparsearray);
 	tn->sparsearray = NULL;
+	AV_UNLOCK(nod->lock);
     }
 }
 
 
+/* The base file is shared by the readers of all members, so its file
+   position is not used here */
+static int get_block_at(vfile *vf, avoff_t *offp, union block *blk)
+{
+    int res;
+
+    res = av_pread_all(vf, blk->buffer, BLOCKSIZE, *offp);
+    if(res < 0)
+        return res;
+
+    *offp += BLOCKSIZE;
+    return 0;
+}
+
 static int read_sparsearray(struct archfile *fil)
 {
     int res;
@@ -1202,9 +1599,9 @@ static int read_sparsearray(struct archfile *fil)
     struct sp_array *sparses;
     struct tarnode *tn = (struct tarnode *) fil->nod->data;
     int size, len;
+    avoff_t off = tn->headeroff;
   
-    av_lseek(fil->basefile, tn->headeroff, AVSEEK_SET);
-    res = get_next_block(fil->basefile, &header);
+    res = get_block_at(fil->basefile, &off, &header);
     if(res < 0)
         return res;
 
@@ -1228,7 +1625,7 @@ static int read_sparsearray(struct archfile *fil)
            the sparsearray as before.  */
 
         while (1) {
-            res = get_next_block(fil->basefile, &header);
+            res = get_block_at(fil->basefile, &off, &header);
             if(res < 0) {
                 av_free(sparses);
                 return res;
@@ -1261,7 +1658,7 @@ static int read_sparsearray(struct archfile *fil)
   
     tn->sparsearray = sparses;
     tn->sp_array_len = len;
-    fil->nod->offset = fil->basefile->ptr; /* the correct offset */
+    tn->sparsedata = off; /* the correct offset */
 
     return 0;
 }
@@ -1294,7 +1691,7 @@ static avssize_t read_sparse(vfile *vf, char *buf, avsize_t nbyte)
             return res;
     }
     sparses = tn->sparsearray;
-    offset = fil->nod->offset;
+    offset = tn->sparsedata;
 
     // since nbyte is avsize_t, the min will not be larger than that datatype
     nact = (avsize_t)AV_MIN((avoff_t)nbyte, (avoff_t) (size - vf->ptr));
@@ -1365,8 +1762,12 @@ int av_init_module_utar(struct vmodule *module)
     ap->parse = parse_tarfile;
     ap->read = tar_read;
     ap->release = tar_release;
+    ap->flags |= ARF_PROGRESSIVE;
 
     av_add_avfs(avfs);
 
+    av_avfsstat_register_int("utar/index", &utar_index, &utarstat_lock,
+                             0, 2, NULL);
+
     return 0;
 }
@@ -15,6 +15,7 @@ extern int av_init_module_uxze(struct vmodule *module);
 
 int av_init_module_uxze(struct vmodule *module)
 {
+    int res;
     struct avfs *avfs;
     const char *uxze_args[3];
     const char *xze_args[2];
@@ -33,6 +34,10 @@ int av_init_module_uxze(struct vmodule *module)
     uxze_exts[3].from = ".lzma",   uxze_exts[3].to = NULL;
     uxze_exts[4].from = NULL;
 
-    return av_init_filt(module, AV_VER, "uxze", uxze_args, xze_args,
-                        uxze_exts, &avfs);
+    res = av_init_filt(module, AV_VER, "uxze", uxze_args, xze_args,
+                       uxze_exts, &avfs);
+    if(res == 0)
+        av_filt_set_codecs(avfs, "unxz", "xz");
+
+    return res;
 }
@@ -1,32 +1,322 @@
-/*  
+/*
     AVFS: A Virtual File System Library
-    Copyright (C) 1998  Miklos Szeredi <miklos@szeredi.hu>
 
     This program can be distributed under the terms of the GNU GPL.
     See the file COPYING.
 
-    UZ (uncompress) module 
-    using gzip
+    UZ (uncompress) module (based on UBZ2 module)
 */
 
-#include "filter.h"
 #include "version.h"
 
+#include "lzwfile.h"
+#include "filecache.h"
+#include "oper.h"
+#include "internal.h"
+#include "version.h"
+
+struct uznode {
+    struct avstat sig;
+    struct lzwcache *cache;
+    avino_t ino;
+};
+
+struct uzfile {
+    struct lzwfile *zfil;
+    vfile *base;
+    vfile *filt;             /* Opened through #uze, if not NULL */
+    struct uznode *node;
+};
+
+
+static void uznode_destroy(struct uznode *nod)
+{
+    av_unref_obj(nod->cache);
+}
+
+static struct uznode *uz_new_node(ventry *ve, struct avstat *stbuf)
+{
+    struct uznode *nod;
+
+    AV_NEW_OBJ(nod, uznode_destroy);
+    nod->sig = *stbuf;
+    nod->cache = av_lzwcache_new();
+    nod->ino = av_new_ino(ve->mnt->avfs);
+    
+    return nod;
+}
+
+static int uz_same(struct uznode *nod, struct avstat *stbuf)
+{
+    if(nod->sig.ino == stbuf->ino &&
+       nod->sig.dev == stbuf->dev &&
+       nod->sig.size == stbuf->size &&
+       AV_TIME_EQ(nod->sig.mtime, stbuf->mtime))
+        return 1;
+    else
+        return 0;
+}
+
+static struct uznode *uz_do_get_node(ventry *ve, const char *key,
+                                     struct avstat *stbuf)
+{
+    static AV_LOCK_DECL(lock);
+    struct uznode *nod;
+
+    AV_LOCK(lock);
+    nod = (struct uznode *) av_filecache_get(key);
+    if(nod != NULL) {
+        if(!uz_same(nod, stbuf)) {
+            av_unref_obj(nod);
+            nod = NULL;
+        }
+        else
+            av_filecache_checked(key);
+    }
+    
+    if(nod == NULL) {
+        nod =  uz_new_node(ve, stbuf);
+        av_filecache_set(key, nod);
+    }
+    AV_UNLOCK(lock);
+
+    return nod;
+}
+
+static int uz_getnode(ventry *ve, vfile *base, struct uznode **resp)
+{
+    int res;
+    struct avstat stbuf;
+    const int attrmask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME;
+    struct uznode *nod;
+    char *key;
+
+    res = av_filecache_getkey(ve, &key);
+    if(res < 0)
+        return res;
+
+    nod = (struct uznode *) av_filecache_get_checked(ve, key);
+    if(nod != NULL) {
+        av_free(key);
+        *resp = nod;
+        return 0;
+    }
+
+    res = av_fgetattr(base, &stbuf, attrmask);
+    if(res < 0) {
+        av_free(key);
+        return res;
+    }
+
+    nod = uz_do_get_node(ve, key, &stbuf);
+
+    av_free(key);
+
+    *resp = nod;
+    return 0;
+}
+
+static int uz_lookup(ventry *ve, const char *name, void **newp)
+{
+    char *path = (char *) ve->data;
+    
+    if(path == NULL) {
+        if(name[0] != '\0')
+            return -ENOENT;
+	if(av_filecache_checkopts(ve, "") < 0)
+            return -ENOENT;
+        path = av_strdup(name);
+    }
+    else if(name == NULL) {
+        av_free(path);
+        path = NULL;
+    }
+    else 
+        return -ENOENT;
+    
+    *newp = path;
+    return 0;
+}
+
+static int uz_access(ventry *ve, int amode)
+{
+    return av_access(ve->mnt->base, amode);
+}
+
+/* Files the builtin decoder rejects (e.g. gzip data named .Z) are
+   unpacked by the #uze filter instead */
+static int uz_open_filt(ventry *ve, int flags, vfile **resp)
+{
+    int res;
+    char *path;
+    ventry *fve;
+
+    res = av_generate_path(ve->mnt->base, &path);
+    if(res < 0)
+        return res;
+
+    path = av_stradd(path, AVFS_SEP_STR "uze", NULL);
+    av_log(AVLOG_DEBUG, "UZ: not in compress format, using %s", path);
+    res = av_get_ventry(path, 1, &fve);
+    av_free(path);
+    if(res < 0)
+        return res;
+
+    res = av_open(fve, flags, 0, resp);
+    av_free_ventry(fve);
+
+    return res;
+}
+
+static int uz_open(ventry *ve, int flags, avmode_t mode, void **resp)
+{
+    int res;
+    vfile *base;
+    vfile *filt;
+    struct uznode *nod;
+    struct uzfile *fil;
+
+    if(flags & AVO_DIRECTORY)
+        return -ENOTDIR;
+
+    if(AV_ISWRITE(flags))
+        return -EROFS;
+
+    res = av_open(ve->mnt->base, AVO_RDONLY, 0, &base);
+    if(res < 0)
+        return res;
+
+    filt = NULL;
+    res = av_lzwfile_check(base);
+    if(res == 0)
+        res = uz_open_filt(ve, flags, &filt);
+    if(res < 0) {
+        av_close(base);
+        return res;
+    }
+
+    res = uz_getnode(ve, base, &nod);
+    if(res < 0) {
+        if(filt != NULL)
+            av_close(filt);
+        av_close(base);
+        return res;
+    }
+
+    AV_NEW(fil);
+    if(filt == NULL && (flags & AVO_ACCMODE) != AVO_NOPERM)
+        fil->zfil = av_lzwfile_new(base);
+    else
+        fil->zfil = NULL;
+
+    fil->base = base;
+    fil->filt = filt;
+    fil->node = nod;
+    
+    *resp = fil;
+    return 0;
+}
+
+static int uz_close(vfile *vf)
+{
+    struct uzfile *fil = (struct uzfile *) vf->data;
+
+    av_unref_obj(fil->zfil);
+    av_unref_obj(fil->node);
+    if(fil->filt != NULL)
+        av_close(fil->filt);
+    av_close(fil->base);
+    av_free(fil);
+
+    return 0;
+}
+
+static avssize_t uz_read(vfile *vf, char *buf, avsize_t nbyte)
+{
+    avssize_t res;
+    struct uzfile *fil = (struct uzfile *) vf->data;
+ 
+    if(fil->filt != NULL)
+        res = av_pread(fil->filt, buf, nbyte, vf->ptr);
+    else
+        res = av_lzwfile_pread(fil->zfil, fil->node->cache, buf, nbyte,
+                               vf->ptr);
+    if(res > 0)
+        vf->ptr += res;
+
+    return res;
+}
+
+static int uz_getattr(vfile *vf, struct avstat *buf, int attrmask)
+{
+    int res;
+    struct uzfile *fil = (struct uzfile *) vf->data;
+    struct uznode *nod = fil->node;
+    avoff_t size;
+    const int basemask = AVA_MODE | AVA_UID | AVA_GID | AVA_MTIME | AVA_ATIME | AVA_CTIME;
+
+    res = av_fgetattr(fil->base, buf, basemask);
+    if(res < 0)
+        return res;
+
+    if((attrmask & (AVA_SIZE | AVA_BLKCNT)) != 0 && fil->filt != NULL) {
+        struct avstat fbuf;
+
+        res = av_fgetattr(fil->filt, &fbuf, AVA_SIZE);
+        if(res < 0)
+            return res;
+
+        buf->size = fbuf.size;
+        buf->blocks = AV_BLOCKS(buf->size);
+    }
+    else if((attrmask & (AVA_SIZE | AVA_BLKCNT)) != 0) {
+        res = av_lzwfile_size(fil->zfil, fil->node->cache, &size);
+        if(res == 0 && size == -1) {
+            fil->zfil = av_lzwfile_new(fil->base);
+            res = av_lzwfile_size(fil->zfil, fil->node->cache, &size);
+        }
+        if(res < 0)
+            return res;
+
+        buf->size = size;
+        buf->blocks = AV_BLOCKS(buf->size);
+    }
+
+    buf->mode &= ~(07000);
+    buf->blksize = 4096;
+    buf->dev = vf->mnt->avfs->dev;
+    buf->ino = nod->ino;
+    buf->nlink = 1;
+    
+    return 0;
+}
+
+extern int av_init_module_uz(struct vmodule *module);
+
 int av_init_module_uz(struct vmodule *module)
 {
+    int res;
     struct avfs *avfs;
     struct ext_info uz_exts[5];
-    const char *uz_args[3];
 
     uz_exts[0].from = ".Z",   uz_exts[0].to = NULL;
     uz_exts[1].from = ".tpz", uz_exts[1].to = ".tar";
     uz_exts[2].from = ".tz",  uz_exts[2].to = ".tar";
     uz_exts[3].from = ".taz", uz_exts[3].to = ".tar";
     uz_exts[4].from = NULL;
-  
-    uz_args[0] = "gzip";
-    uz_args[1] = "-d";
-    uz_args[2] = NULL;
 
-    return av_init_filt(module, AV_VER, "uz", uz_args, NULL, uz_exts, &avfs);
+    res = av_new_avfs("uz", uz_exts, AV_VER, AVF_NOLOCK, module, &avfs);
+    if(res < 0)
+        return res;
+
+    avfs->lookup   = uz_lookup;
+    avfs->access   = uz_access;
+    avfs->open     = uz_open;
+    avfs->close    = uz_close; 
+    avfs->read     = uz_read;
+    avfs->getattr  = uz_getattr;
+
+    av_add_avfs(avfs);
+
+    return 0;
 }
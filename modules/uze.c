@@ -0,0 +1,28 @@
+/*  
+    AVFS: A Virtual File System Library
+    Copyright (C) 1998  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    UZE (uncompress) module
+    using gzip, fallback for the builtin UZ module
+*/
+
+#include "filter.h"
+#include "version.h"
+
+extern int av_init_module_uze(struct vmodule *module);
+
+int av_init_module_uze(struct vmodule *module)
+{
+    struct avfs *avfs;
+    const char *uz_args[3];
+
+    uz_args[0] = "gzip";
+    uz_args[1] = "-d";
+    uz_args[2] = NULL;
+
+    /* No extensions: .Z files are handled by the builtin uz module */
+    return av_init_filt(module, AV_VER, "uze", uz_args, NULL, NULL, &avfs);
+}
@@ -8,9 +8,23 @@
     ZIP module
 */
 
+#include "config.h"
 #include "archive.h"
 #include "zipconst.h"
 #include "zfile.h"
+#include "d64file.h"
+#include "bzfile.h"
+#ifdef HAVE_LIBLZMA
+#include "xzfile.h"
+#endif
+#ifdef HAVE_LIBZSTD
+#include "zstdfile.h"
+#endif
+#include "subfile.h"
+#include "internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
 #include "cache.h"
 #include "oper.h"
 #include "version.h"
@@ -164,6 +178,40 @@ struct zipnode {
     avushort method;
     avoff_t headeroff;
     struct cacheobj *cache;
+    void *dcache;            /* Index of methods other than deflate */
+};
+
+/* A central directory entry, kept for the lazy mode */
+struct zipdirent {
+    avsize_t nameoff;        /* Offset in the name pool */
+    const char *name;        /* Normalized path, set after the parse */
+    avuint index;            /* Order in the central directory */
+    int entflags;
+    struct cdirentry cent;
+};
+
+/* The central directory of an archive parsed in the lazy mode, sorted
+   by path, so that the entries of a directory are a contiguous range */
+struct ziplist {
+    struct ecrec ecrec;
+    avsize_t num;
+    avsize_t alloc;
+    struct zipdirent *ents;
+    char *names;
+    avsize_t nameslen;
+    avsize_t namesalloc;
+};
+
+/* Archives with more entries than this are parsed lazily, 0 disables
+   the lazy mode */
+static AV_LOCK_DECL(uzipstat_lock);
+static avoff_t uzip_lazy_entries = 50000;
+
+/* An open compressed member */
+struct zipmember {
+    avushort method;
+    vfile *data;             /* Compressed data, not used for deflate */
+    void *dec;
 };
 
 static void conv_tolower(char *s)
@@ -282,6 +330,7 @@ static avmode_t zip_get_mode(struct cdirentry *cent, const char *path,
 static void zipnode_delete(struct zipnode *nod)
 {
     av_unref_obj(nod->cache);
+    av_unref_obj(nod->dcache);
 }
 
 static void fill_zipentry(struct archive *arch, const char *path, 
@@ -308,6 +357,7 @@ static void fill_zipentry(struct archive *arch, const char *path,
     nod->data = info;
 
     info->cache = NULL;
+    info->dcache = NULL;
     info->crc = cent->crc;
     info->method = 0;
 
@@ -319,10 +369,8 @@ static void fill_zipentry(struct archive *arch, const char *path,
 
 }
 
-static void insert_zipentry(struct archive *arch, char *path, 
-                            struct cdirentry *cent, struct ecrec *ecrec)
+static int zip_entflags(char *path, struct cdirentry *cent)
 {
-    struct entry *ent;
     int entflags = 0;
 
     /* FIXME: option for uzip, not to convert filenames to lowercase */
@@ -344,6 +392,15 @@ static void insert_zipentry(struct archive *arch, char *path,
 	entflags |= NSF_NOCASE;
     }
 
+    return entflags;
+}
+
+static void insert_zipentry(struct archive *arch, char *path, 
+                            struct cdirentry *cent, struct ecrec *ecrec)
+{
+    struct entry *ent;
+    int entflags = zip_entflags(path, cent);
+
     ent = av_arch_create(arch, path, entflags);
     if(ent == NULL)
         return;
@@ -352,43 +409,35 @@ static void insert_zipentry(struct archive *arch, char *path,
     av_unref_obj(ent);
 }
 
-static int parse_extra_header(vfile *vf, avoff_t pos,
-                              struct cdirentry *cent,
-                              struct ldirentry *lent)
+/* Pick up the zip64 sizes and offset from the extra field, which is
+   already in memory */
+static void parse_extra_header(const char *extra, int extra_len,
+                               struct cdirentry *cent,
+                               struct ldirentry *lent)
 {
-    char buf[4];
-    avoff_t end = pos + (cent ? cent->extra_len : lent->extra_len);
+    int pos = 0;
+    int end = extra_len;
 
     while (pos + 4 <= end) {
-        /* read header ID and size */
-        int res = av_pread_all(vf, buf, 4, pos);
-        avushort id;
-        int size;
+        /* header ID and size */
+        avushort id = DBYTE(extra+pos);
+        int size = DBYTE(extra+pos+2);
+        int next = pos + 4 + size;
 
-        if(res < 0) {
-            return res;
-        }
-
-        id = DBYTE(buf);
-        size = DBYTE(buf+2);
+        /* Broken, the block doesn't fit in the extra field */
+        if (next > end)
+            break;
 
         pos += 4;
 
-        if (id == 1 && pos + size <= end) {
+        if (id == 1) {
             if((cent && (avuint)(cent->file_size) == 0xffffffff) ||
                (lent && (avuint)(lent->file_size) == 0xffffffff)) {
                 if(size >= 8) {
-                    char buf8[8];
-                    int res = av_pread_all(vf, buf8, 8, pos);
-
-                    if(res < 0) {
-                        return res;
-                    }
-
                     if (cent) {
-                        cent->file_size = DQBYTE(buf8);
+                        cent->file_size = DQBYTE(extra+pos);
                     } else {
-                        lent->file_size = DQBYTE(buf8);
+                        lent->file_size = DQBYTE(extra+pos);
                     }
 
                     size -= 8;
@@ -399,24 +448,17 @@ static int parse_extra_header(vfile *vf, avoff_t pos,
                     } else {
                         lent->file_size = 0;
                     }
-                    pos += size;
+                    size = 0;
                 }
             }
 
             if((cent && (avuint)(cent->comp_size) == 0xffffffff) ||
                (lent && (avuint)(lent->comp_size) == 0xffffffff)) {
                 if(size >= 8) {
-                    char buf8[8];
-                    int res = av_pread_all(vf, buf8, 8, pos);
-
-                    if(res < 0) {
-                        return res;
-                    }
-
                     if (cent) {
-                        cent->comp_size = DQBYTE(buf8);
+                        cent->comp_size = DQBYTE(extra+pos);
                     } else{
-                        lent->comp_size = DQBYTE(buf8);
+                        lent->comp_size = DQBYTE(extra+pos);
                     }
 
                     size -= 8;
@@ -427,48 +469,273 @@ static int parse_extra_header(vfile *vf, avoff_t pos,
                     } else{
                         lent->comp_size = 0;
                     }
-                    pos += size;
+                    size = 0;
                 }
             }
 
             if(cent && (avuint)(cent->file_off) == 0xffffffff) {
                 if(size >= 8) {
-                    char buf8[8];
-                    int res = av_pread_all(vf, buf8, 8, pos);
-
-                    if(res < 0) {
-                        return res;
-                    }
-
-                    cent->file_off = DQBYTE(buf8);
+                    cent->file_off = DQBYTE(extra+pos);
 
                     size -= 8;
                     pos += 8;
-                } else {
-                    pos += size;
                 }
             }
-        } else {
-            pos += size;
         }
+        pos = next;
     }
+}
 
-    return 0;
+static void ziplist_delete(struct ziplist *zl)
+{
+    av_free(zl->ents);
+    av_free(zl->names);
 }
 
-static avoff_t read_entry(vfile *vf, struct archive *arch, avoff_t pos,
-                          struct ecrec *ecrec)
+static struct ziplist *ziplist_new(struct ecrec *ecrec, avuquad nentries)
+{
+    struct ziplist *zl;
+
+    AV_NEW_OBJ(zl, ziplist_delete);
+    zl->ecrec = *ecrec;
+    zl->num = 0;
+    zl->alloc = nentries < 1024 * 1024 ? nentries : 1024 * 1024;
+    if(zl->alloc == 0)
+        zl->alloc = 16;
+    zl->ents = av_malloc(zl->alloc * sizeof(struct zipdirent));
+    zl->nameslen = 0;
+    zl->namesalloc = zl->alloc * 32;
+    zl->names = av_malloc(zl->namesalloc);
+
+    return zl;
+}
+
+/* Resolve empty and "." components and ".." in place, the way
+   av_arch_resolve() would.  A trailing '/' is kept */
+static void zip_normalize_path(char *path)
 {
+    char *s = path;
+    char *d = path;
+    char *start;
+    avsize_t len;
+    int isdir;
+
+    len = strlen(path);
+    isdir = (len != 0 && path[len - 1] == '/');
+    while(1) {
+        for(; *s == '/'; s++);
+        if(!*s)
+            break;
+        start = s;
+        for(; *s && *s != '/'; s++);
+        len = s - start;
+        if(len == 1 && start[0] == '.')
+            continue;
+        if(len == 2 && start[0] == '.' && start[1] == '.') {
+            for(; d != path && d[-1] != '/'; d--);
+            if(d != path)
+                d--;
+            continue;
+        }
+        if(d != path)
+            *d++ = '/';
+        memmove(d, start, len);
+        d += len;
+    }
+    if(d != path && isdir)
+        *d++ = '/';
+    *d = '\0';
+}
+
+/* The name is copied to the pool and normalized there */
+static void ziplist_add(struct ziplist *zl, const char *name, avsize_t len,
+                        struct cdirentry *cent)
+{
+    char *path;
+    struct zipdirent *ze;
+
+    while(zl->nameslen + len + 1 > zl->namesalloc) {
+        zl->namesalloc *= 2;
+        zl->names = av_realloc(zl->names, zl->namesalloc);
+    }
+    path = zl->names + zl->nameslen;
+    memcpy(path, name, len);
+    path[len] = '\0';
+
+    if(zl->num == zl->alloc) {
+        zl->alloc *= 2;
+        zl->ents = av_realloc(zl->ents, zl->alloc * sizeof(struct zipdirent));
+    }
+    ze = &zl->ents[zl->num];
+    ze->entflags = zip_entflags(path, cent);
+
+    zip_normalize_path(path);
+    if(!path[0]) {
+        av_log(AVLOG_WARNING, "Empty filename");
+        return;
+    }
+
+    ze->nameoff = zl->nameslen;
+    ze->name = NULL;
+    ze->index = zl->num;
+    ze->cent = *cent;
+    zl->nameslen += strlen(path) + 1;
+    zl->num++;
+}
+
+static int ziplist_cmp(const void *a, const void *b)
+{
+    const struct zipdirent *za = (const struct zipdirent *) a;
+    const struct zipdirent *zb = (const struct zipdirent *) b;
+    int res = strcmp(za->name, zb->name);
+
+    /* Duplicates keep their order, the first one is used */
+    if(res == 0)
+        res = za->index < zb->index ? -1 : 1;
+
+    return res;
+}
+
+static void ziplist_sort(struct ziplist *zl)
+{
+    avsize_t i;
+    int sorted = 1;
+
+    for(i = 0; i < zl->num; i++) {
+        zl->ents[i].name = zl->names + zl->ents[i].nameoff;
+        if(i != 0 && sorted &&
+           strcmp(zl->ents[i - 1].name, zl->ents[i].name) > 0)
+            sorted = 0;
+    }
+
+    /* Archivers often write the entries in order already */
+    if(!sorted)
+        qsort(zl->ents, zl->num, sizeof(struct zipdirent), ziplist_cmp);
+}
+
+/* The first entry, whose path doesn't sort before 'prefix', or with
+   'after' set the first one not starting with 'prefix' */
+static avsize_t ziplist_bound(struct ziplist *zl, const char *prefix,
+                              avsize_t plen, int after)
+{
+    avsize_t lo = 0;
+    avsize_t hi = zl->num;
+    avsize_t mid;
     int res;
-    char buf[CDIRENT_SIZE];
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        res = strncmp(zl->ents[mid].name, prefix, plen);
+        if(res < 0 || (after && res == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Create an entry from the list, or an implicit directory if 'ze' is
+   NULL.  Like insert_zipentry() an implicit directory gets the flags
+   of the entry below it.  Directories with entries below them are
+   left to be expanded */
+static void zip_lazy_insert(struct archive *arch, struct ziplist *zl,
+                            const char *path, struct zipdirent *ze,
+                            int entflags, int lazy)
+{
+    struct entry *ent;
+    struct archnode *nod;
+
+    ent = av_arch_resolve(arch, path, 0, entflags);
+    if(ent == NULL)
+        return;
+
+    nod = (struct archnode *) av_namespace_get(ent);
+    if(nod == NULL) {
+        av_namespace_setflags(ent, entflags, 0);
+        if(ze != NULL) {
+            fill_zipentry(arch, ze->name, ent, &ze->cent, &zl->ecrec);
+            nod = (struct archnode *) av_namespace_get(ent);
+        }
+        else
+            nod = av_arch_default_dir(arch, ent);
+    }
+    if(lazy && AV_ISDIR(nod->st.mode))
+        nod->flags |= ANOF_LAZY;
+
+    av_unref_obj(ent);
+}
+
+/* Create the entries directly in 'dir'.  Subdirectories are skipped
+   over with a binary search, so this costs about the number of
+   entries in the directory, not in the whole subtree */
+static int zip_expand(void *data, struct archive *arch, struct entry *dir)
+{
+    struct ziplist *zl = (struct ziplist *) data;
+    char *prefix;
+    char *subpath;
+    const char *name;
+    const char *s;
+    avsize_t plen;
+    avsize_t sublen;
+    avsize_t i;
+    avsize_t end;
+    avsize_t next;
+
+    prefix = av_namespace_getpath(dir);
+    if(prefix[0])
+        prefix = av_stradd(prefix, "/", NULL);
+    /* The path of the root is "", of the others "/dir" */
+    plen = prefix[0] ? strlen(prefix) - 1 : 0;
+
+    i = ziplist_bound(zl, prefix + 1, plen, 0);
+    end = ziplist_bound(zl, prefix + 1, plen, 1);
+    if(plen == 0) {
+        i = 0;
+        end = zl->num;
+    }
+
+    for(; i < end; i = next) {
+        struct zipdirent *ze = &zl->ents[i];
+
+        next = i + 1;
+        name = ze->name + plen;
+        s = strchr(name, '/');
+        if(s == NULL) {
+            zip_lazy_insert(arch, zl, ze->name, ze, ze->entflags, 0);
+            continue;
+        }
+
+        /* A subdirectory, maybe with an entry of its own ("name/"),
+           which sorts first */
+        sublen = s + 1 - ze->name;
+        subpath = av_strndup(ze->name, sublen);
+        next = ziplist_bound(zl, subpath, sublen, 1);
+        if(s[1] == '\0')
+            zip_lazy_insert(arch, zl, subpath, ze, ze->entflags,
+                            next > i + 1);
+        else
+            zip_lazy_insert(arch, zl, subpath, NULL, ze->entflags, 1);
+        av_free(subpath);
+    }
+    av_free(prefix);
+
+    return 0;
+}
+
+/* Parse one entry of the central directory, which has been read into
+   memory as a whole.  In the lazy mode ('zl' not NULL) it is only
+   recorded.  Returns the offset of the next entry */
+static avoff_t read_entry(const char *cdir, avsize_t cdir_len,
+                          avsize_t pos, struct archive *arch,
+                          struct ecrec *ecrec, struct ziplist *zl)
+{
+    const char *buf = cdir + pos;
     struct cdirentry ent;
     char *filename;
 
-    res = av_pread_all(vf, buf, CDIRENT_SIZE, pos);
-    if(res < 0)
-        return res;
-  
-    if(buf[0] != 'P' || buf[1] != 'K' || buf[2] != 1 || buf[3] != 2) {
+    if(pos + CDIRENT_SIZE > cdir_len ||
+       buf[0] != 'P' || buf[1] != 'K' || buf[2] != 1 || buf[3] != 2) {
         av_log(AVLOG_ERROR, "UZIP: Broken archive");
         return -EIO;
     }
@@ -489,32 +756,87 @@ static avoff_t read_entry(vfile *vf, struct archive *arch, avoff_t pos,
     ent.attr         = QBYTE(buf+CDIRENT_ATTR);
     ent.file_off     = QBYTE(buf+CDIRENT_FILE_OFF);
 
-    filename = av_malloc(ent.fname_len + 1);
-    res = av_pread_all(vf, filename, ent.fname_len, pos + CDIRENT_SIZE);
-    if(res < 0) {
-        av_free(filename);
-        return res;
-    }
-    filename[ent.fname_len] = '\0';
-
     if(pos + CDIRENT_SIZE + ent.fname_len + ent.extra_len +
-       ent.comment_len > ecrec->file_size) {
-        av_free(filename);
+       ent.comment_len > cdir_len) {
+        av_log(AVLOG_ERROR, "UZIP: Broken archive");
         return -EIO;
     }
 
-    if(parse_extra_header(vf, pos + CDIRENT_SIZE + ent.fname_len, &ent, NULL) < 0 ) {
+    parse_extra_header(buf + CDIRENT_SIZE + ent.fname_len, ent.extra_len,
+                       &ent, NULL);
+
+    if(zl != NULL)
+        ziplist_add(zl, buf + CDIRENT_SIZE, ent.fname_len, &ent);
+    else {
+        filename = av_strndup(buf + CDIRENT_SIZE, ent.fname_len);
+        insert_zipentry(arch, filename, &ent, ecrec);
         av_free(filename);
-        return -EIO;
     }
 
-    insert_zipentry(arch, filename, &ent, ecrec);
-    av_free(filename);
-
     return pos + CDIRENT_SIZE + ent.fname_len + ent.extra_len +
         ent.comment_len;
 }
 
+/* Read the central directory with a single read, instead of several
+   small reads per entry, which is slow if the base is compressed or
+   remote */
+static int read_cdir(vfile *vf, struct archive *arch, struct ecrec *ecrec,
+                     avoff_t cdir_pos, avoff_t cdir_end, avuquad nentries)
+{
+    int res;
+    char *cdir;
+    avsize_t cdir_len;
+    avoff_t pos;
+    avuquad nument;
+    avoff_t lazy_entries;
+    struct ziplist *zl = NULL;
+
+    if(cdir_end - cdir_pos > 0x7fffffff) {
+        av_log(AVLOG_ERROR, "UZIP: Central directory too large");
+        return -EIO;
+    }
+    cdir_len = cdir_end - cdir_pos;
+
+    cdir = av_malloc(cdir_len);
+    res = av_pread_all(vf, cdir, cdir_len, cdir_pos);
+    if(res < 0) {
+        av_free(cdir);
+        return res;
+    }
+
+    AV_LOCK(uzipstat_lock);
+    lazy_entries = uzip_lazy_entries;
+    AV_UNLOCK(uzipstat_lock);
+    if(lazy_entries != 0 && nentries > (avuquad) lazy_entries)
+        zl = ziplist_new(ecrec, nentries);
+
+    pos = 0;
+    for(nument = 0; nument < nentries; nument++) {
+        if(pos >= cdir_len) {
+            av_log(AVLOG_ERROR, "UZIP: Broken archive");
+            res = -EIO;
+            break;
+        }
+        pos = read_entry(cdir, cdir_len, pos, arch, ecrec, zl);
+        if(pos < 0) {
+            res = pos;
+            break;
+        }
+    }
+    av_free(cdir);
+
+    if(zl != NULL) {
+        if(res >= 0) {
+            ziplist_sort(zl);
+            av_arch_set_lazy(arch, zl);
+        }
+        else
+            av_unref_obj(zl);
+    }
+
+    return res < 0 ? res : 0;
+}
+
 static avoff_t find_z64_ecd(vfile *vf, struct z64_end_of_central_dir_loc *ecdl, struct z64_end_of_central_dir *z64_ecd, avoff_t pos)
 {
     char buf[Z64_ECD_SIZE];
@@ -607,7 +929,6 @@ static int read_zip64file(vfile *vf, struct archive *arch, struct ecrec *ecrec,
     avoff_t cdir_end;
     avoff_t ecdir_pos;
     avoff_t cdir_pos;
-    int nument;
 
     ecdir_pos = ecdl->ecdir_off;
 
@@ -640,17 +961,7 @@ static int read_zip64file(vfile *vf, struct archive *arch, struct ecrec *ecrec,
   
     cdir_pos = z64_ecd.cdir_off + extra_bytes;
 
-    for(nument = 0; nument < z64_ecd.total_entries; nument++) {
-        if(cdir_pos >= pos) {
-            av_log(AVLOG_ERROR, "UZIP: Broken archive");
-            return -EIO;
-        }
-        cdir_pos = read_entry(vf, arch, cdir_pos, ecrec);
-        if(cdir_pos < 0) 
-            return cdir_pos;
-    }
-  
-    return 0;
+    return read_cdir(vf, arch, ecrec, cdir_pos, pos, z64_ecd.total_entries);
 }
 
 static int read_zipfile(vfile *vf, struct archive *arch)
@@ -661,7 +972,6 @@ static int read_zipfile(vfile *vf, struct archive *arch)
     avoff_t extra_bytes;
     avoff_t cdir_end;
     avoff_t cdir_pos;
-    int nument;
 
     ecrec_pos = find_ecrec(vf, SEARCHLEN, &ecrec);
     if(ecrec_pos < 0)
@@ -691,19 +1001,9 @@ static int read_zipfile(vfile *vf, struct archive *arch)
     }
   
     cdir_pos = ecrec.cdir_off + extra_bytes;
-  
-    for(nument = 0; nument < ecrec.total_entries; nument++) {
-	if(cdir_pos >= ecrec_pos) {
-            av_log(AVLOG_ERROR, "UZIP: Broken archive");
-            return -EIO;
-	}
 
-	cdir_pos = read_entry(vf, arch, cdir_pos, &ecrec);
-	if(cdir_pos < 0) 
-            return cdir_pos;
-    }
-  
-    return 0;
+    return read_cdir(vf, arch, &ecrec, cdir_pos, ecrec_pos,
+                     ecrec.total_entries);
 }
 
 static int parse_zipfile(void *data, ventry *ve, struct archive *arch)
@@ -723,9 +1023,125 @@ static int parse_zipfile(void *data, ventry *ve, struct archive *arch)
 
 static int zip_close(struct archfile *fil)
 {
-    struct zfile *zfil = fil->data;
+    struct zipmember *zm = (struct zipmember *) fil->data;
+
+    if(zm != NULL) {
+        av_unref_obj(zm->dec);
+        av_unref_obj(zm->data);
+        av_free(zm);
+    }
+    return 0;
+}
+
+static int zip_method_supported(int method)
+{
+    switch(method) {
+    case METHOD_STORE:
+    case METHOD_DEFLATE:
+    case METHOD_ENHDEFLATE:
+    case METHOD_BZIP2:
+#ifdef HAVE_LIBLZMA
+    case METHOD_LZMA:
+    case METHOD_XZ:
+#endif
+#ifdef HAVE_LIBZSTD
+    case METHOD_ZSTD:
+#endif
+        return 1;
+    }
 
-    av_unref_obj(zfil);
+    return 0;
+}
+
+/* The decompressors read a whole file, so the compressed data is made
+   into a file of its own, which also reads the base ahead of them.
+   LZMA members get the header of the .lzma format instead of the zip
+   specific one */
+static int zip_open_data(struct archfile *fil, struct ldirentry *ent,
+                         vfile **resp)
+{
+    int res;
+    int i;
+    char buf[9];
+    char hdr[13];
+    avsize_t hdrlen = 0;
+    avoff_t offset = fil->nod->offset;
+    avoff_t size = ent->comp_size;
+
+    if(ent->method == METHOD_LZMA) {
+        /* version, size of properties, properties */
+        if(size < 9)
+            goto broken;
+        res = av_pread_all(fil->basefile, buf, 9, offset);
+        if(res < 0)
+            return res;
+        if(DBYTE(buf+2) != 5)
+            goto broken;
+
+        memcpy(hdr, buf+4, 5);
+        for(i = 0; i < 8; i++) {
+            /* Unknown size if there's an end marker */
+            if((ent->flag & 0x02) != 0)
+                hdr[5+i] = (char) 0xff;
+            else
+                hdr[5+i] = (ent->file_size >> (i * 8)) & 0xff;
+        }
+        hdrlen = 13;
+        offset += 9;
+        size -= 9;
+    }
+
+    return av_subfile_new(fil->basefile, offset, size, hdr, hdrlen, resp);
+
+  broken:
+    av_log(AVLOG_ERROR, "UZIP: Broken LZMA header");
+    return -EIO;
+}
+
+static int zip_open_member(struct archfile *fil, struct ldirentry *ent)
+{
+    int res;
+    struct zipmember *zm;
+
+    AV_NEW(zm);
+    zm->method = ent->method;
+    zm->data = NULL;
+    zm->dec = NULL;
+
+    res = zip_open_data(fil, ent, &zm->data);
+    if(res < 0) {
+        av_free(zm);
+        return res;
+    }
+
+    switch(ent->method) {
+    case METHOD_DEFLATE:
+        zm->dec = av_zfile_new(zm->data, 0, ent->crc, 1);
+        break;
+
+    case METHOD_ENHDEFLATE:
+        zm->dec = av_d64file_new(zm->data, ent->crc, 1);
+        break;
+
+    case METHOD_BZIP2:
+        zm->dec = av_bzfile_new(zm->data);
+        break;
+
+#ifdef HAVE_LIBLZMA
+    case METHOD_LZMA:
+    case METHOD_XZ:
+        zm->dec = av_xzfile_new(zm->data);
+        break;
+#endif
+
+#ifdef HAVE_LIBZSTD
+    case METHOD_ZSTD:
+        zm->dec = av_zstdfile_new(zm->data);
+        break;
+#endif
+    }
+
+    fil->data = zm;
     return 0;
 }
 
@@ -768,7 +1184,7 @@ static int zip_open(ventry *ve, struct archfile *fil)
     ent.fname_len    = DBYTE(buf+LDIRENT_FNAME_LEN);
     ent.extra_len    = DBYTE(buf+LDIRENT_EXTRA_LEN);
 
-    if(ent.method != METHOD_STORE && ent.method != METHOD_DEFLATE) {
+    if(!zip_method_supported(ent.method)) {
         av_log(AVLOG_ERROR, "UZIP: Cannot handle compression method %i",
                ent.method);
         return -ENOENT;
@@ -784,18 +1200,29 @@ static int zip_open(ventry *ve, struct archfile *fil)
 
     info->method = ent.method;
     headersize = LDIRENT_SIZE + ent.fname_len + ent.extra_len;
-    fil->nod->offset = offset + headersize;
 
-    if(parse_extra_header(fil->basefile, offset + LDIRENT_SIZE + ent.fname_len, NULL, &ent) < 0 ) {
-        return -EIO;
+    /* The data offset is only known from the local header.  Opens of
+       the member may be reading it, under the node lock */
+    AV_LOCK(fil->nod->lock);
+    fil->nod->offset = offset + headersize;
+    if(ent.method == METHOD_STORE)
+        fil->nod->flags |= ANOF_STORED;
+    AV_UNLOCK(fil->nod->lock);
+
+    if(ent.extra_len != 0) {
+        char *extra = av_malloc(ent.extra_len);
+
+        res = av_pread_all(fil->basefile, extra, ent.extra_len,
+                           offset + LDIRENT_SIZE + ent.fname_len);
+        if(res == 0)
+            parse_extra_header(extra, ent.extra_len, NULL, &ent);
+        av_free(extra);
+        if(res < 0)
+            return res;
     }
 
-    if(ent.method == METHOD_DEFLATE) {
-        struct zfile *zfil;
-
-        zfil = av_zfile_new(fil->basefile, fil->nod->offset, ent.crc, 1);
-        fil->data = zfil;
-    }
+    if(ent.method != METHOD_STORE)
+        return zip_open_member(fil, &ent);
 
     return 0;
 }
@@ -805,7 +1232,8 @@ static avssize_t zip_deflate_read(vfile *vf, char *buf, avsize_t nbyte)
 {
     avssize_t res;
     struct archfile *fil = arch_vfile_file(vf);
-    struct zfile *zfil = (struct zfile *) fil->data;
+    struct zipmember *zm = (struct zipmember *) fil->data;
+    struct zfile *zfil = (struct zfile *) zm->dec;
     struct zipnode *info = (struct zipnode *) fil->nod->data;
     struct zcache *zc;
 
@@ -838,16 +1266,98 @@ static avssize_t zip_deflate_read(vfile *vf, char *buf, avsize_t nbyte)
     return res;
 }
 
+static void *zip_member_cache_new(int method)
+{
+    switch(method) {
+    case METHOD_ENHDEFLATE:
+        return av_d64cache_new();
+
+    case METHOD_BZIP2:
+        return av_bzcache_new();
+
+#ifdef HAVE_LIBLZMA
+    case METHOD_LZMA:
+    case METHOD_XZ:
+        return av_xzcache_new();
+#endif
+
+#ifdef HAVE_LIBZSTD
+    case METHOD_ZSTD:
+        return av_zstdcache_new();
+#endif
+    }
+
+    return NULL;
+}
+
+static avssize_t zip_member_pread(struct zipmember *zm, void *dc, char *buf,
+                                  avsize_t nbyte, avoff_t offset)
+{
+    switch(zm->method) {
+    case METHOD_ENHDEFLATE:
+        return av_d64file_pread((struct d64file *) zm->dec,
+                                (struct d64cache *) dc, buf, nbyte, offset);
+
+    case METHOD_BZIP2:
+        return av_bzfile_pread((struct bzfile *) zm->dec,
+                               (struct bzcache *) dc, buf, nbyte, offset);
+
+#ifdef HAVE_LIBLZMA
+    case METHOD_LZMA:
+    case METHOD_XZ:
+        return av_xzfile_pread((struct xzfile *) zm->dec,
+                               (struct xzcache *) dc, buf, nbyte, offset);
+#endif
+
+#ifdef HAVE_LIBZSTD
+    case METHOD_ZSTD:
+        return av_zstdfile_pread((struct zstdfile *) zm->dec,
+                                 (struct zstdcache *) dc, buf, nbyte, offset);
+#endif
+    }
+
+    return -EIO;
+}
+
+/* The index is shared by all opens of the member and dropped after an
+   error, like the one of deflate */
+static avssize_t zip_member_read(vfile *vf, char *buf, avsize_t nbyte)
+{
+    avssize_t res;
+    struct archfile *fil = arch_vfile_file(vf);
+    struct zipmember *zm = (struct zipmember *) fil->data;
+    struct zipnode *info = (struct zipnode *) fil->nod->data;
+    void *dc;
+
+    if(info->dcache == NULL)
+        info->dcache = zip_member_cache_new(zm->method);
+    dc = info->dcache;
+    av_ref_obj(dc);
+
+    res = zip_member_pread(zm, dc, buf, nbyte, vf->ptr);
+    if(res >= 0)
+        vf->ptr += res;
+    else if(info->dcache == dc) {
+        av_unref_obj(info->dcache);
+        info->dcache = NULL;
+    }
+    av_unref_obj(dc);
+
+    return res;
+}
+
 static avssize_t zip_read(vfile *vf, char *buf, avsize_t nbyte)
 {
     avssize_t res;
     struct archfile *fil = arch_vfile_file(vf);
-    struct zfile *zfil = (struct zfile *) fil->data;
+    struct zipmember *zm = (struct zipmember *) fil->data;
 
-    if(zfil != NULL)
+    if(zm == NULL)
+        res = av_arch_read(vf, buf, nbyte);
+    else if(zm->method == METHOD_DEFLATE)
         res = zip_deflate_read(vf, buf, nbyte);
     else
-        res = av_arch_read(vf, buf, nbyte);
+        res = zip_member_read(vf, buf, nbyte);
 
     return res;
 }
@@ -876,9 +1386,13 @@ int av_init_module_uzip(struct vmodule *module)
     ap->open = zip_open;
     ap->close = zip_close;
     ap->read = zip_read;
+    ap->expand = zip_expand;
 
     av_add_avfs(avfs);
 
+    av_avfsstat_register_int("uzip/lazy_entries", &uzip_lazy_entries,
+                             &uzipstat_lock, 0, AV_MAXOFF, NULL);
+
     return 0;
 }
 
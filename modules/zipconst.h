@@ -36,3 +36,7 @@
 #define METHOD_DEFLATE     8
 #define METHOD_ENHDEFLATE  9
 #define METHOD_DCLIMPLODE  10
+#define METHOD_BZIP2       12
+#define METHOD_LZMA        14
+#define METHOD_ZSTD        93
+#define METHOD_XZ          95
@@ -8,16 +8,20 @@
 
 #include "archive.h"
 
-#define ARCHF_READY  (1 << 0)
+#define ARCHF_READY    (1 << 0)
+#define ARCHF_PARSING  (1 << 1)  /* Parse still running in the background */
 
 struct archive {
     int flags;
     avmutex lock;
+    pthread_cond_t cond;     /* Entries added or parse ended */
+    int parseres;
     struct namespace *ns;
     struct avstat st;
     unsigned int numread;
     vfile *basefile;
     struct avfs *avfs;
+    void *lazydata;
 };
 
 struct archent {
@@ -25,4 +29,4 @@ struct archent {
     struct entry *ent;
 };
 
-struct archnode *av_arch_default_dir(struct archive *arch, struct entry *ent);
+int av_arch_parse_stopped();
@@ -11,6 +11,7 @@
 #include "filecache.h"
 #include "internal.h"
 #include "oper.h"
+#include "readahead.h"
 
 static struct archent *arch_ventry_entry(ventry *ve)
 {
@@ -47,8 +48,10 @@ static void arch_delete(struct archive *arch)
         av_unref_obj(root);
         av_unref_obj(arch->ns);
     }
+    av_unref_obj(arch->lazydata);
 
     AV_FREELOCK(arch->lock);
+    pthread_cond_destroy(&arch->cond);
 }
 
 static int arch_same(struct archive *arch, struct avstat *stbuf)
@@ -62,17 +65,133 @@ static int arch_same(struct archive *arch, struct avstat *stbuf)
         return 0;
 }
 
+static int parse_archive(ventry *ve, struct archive *arch)
+{
+    int res;
+    struct archparams *ap = (struct archparams *) ve->mnt->avfs->data;
+    struct avstat stbuf;
+
+    res = ap->parse(ap->data, ve, arch);
+    if(res < 0)
+        return res;
+
+    if(!(ap->flags & ARF_NOBASE)) {
+        /* The size is only requested _after_ the parse, so bzip2 &
+           al. won't suffer. */
+        res = av_getattr(ve->mnt->base, &stbuf, AVA_SIZE, 0);
+        if(res < 0)
+            return res;
+    }
+
+    arch->st.size = stbuf.size;
+
+    return 0;
+}
+
+struct parsethread {
+    ventry *ve;
+    struct archive *arch;
+};
+
+/* The parses running in the background hold references to their
+   archive and base.  Before the library exits they are told to stop
+   at the next entry, and waited for */
+static AV_LOCK_DECL(parselock);
+static pthread_cond_t parsecond = PTHREAD_COND_INITIALIZER;
+static unsigned int parse_running = 0;
+static int parse_stop = 0;
+
+int av_arch_parse_stopped()
+{
+    int stop;
+
+    AV_LOCK(parselock);
+    stop = parse_stop;
+    AV_UNLOCK(parselock);
+
+    return stop;
+}
+
+void av_archive_stop_parses()
+{
+    AV_LOCK(parselock);
+    parse_stop = 1;
+    while(parse_running != 0)
+        pthread_cond_wait(&parsecond, &parselock);
+    parse_stop = 0;
+    AV_UNLOCK(parselock);
+}
+
+static void *parse_thread(void *data)
+{
+    struct parsethread *pt = (struct parsethread *) data;
+    struct archive *arch = pt->arch;
+
+    AV_LOCK(arch->lock);
+    arch->parseres = parse_archive(pt->ve, arch);
+    arch->flags &= ~ARCHF_PARSING;
+    pthread_cond_broadcast(&arch->cond);
+    AV_UNLOCK(arch->lock);
+
+    av_free_ventry(pt->ve);
+    av_unref_obj(arch);
+    av_free(pt);
+
+    AV_LOCK(parselock);
+    parse_running --;
+    pthread_cond_broadcast(&parsecond);
+    AV_UNLOCK(parselock);
+
+    return NULL;
+}
+
+/* Lookups can go on while the parse is running, and only wait for it
+   if they don't find what they are looking for */
+static int start_parse_thread(ventry *ve, struct archive *arch)
+{
+    int res;
+    struct parsethread *pt;
+    pthread_t thread;
+
+    AV_NEW(pt);
+    res = av_copy_ventry(ve, &pt->ve);
+    if(res < 0) {
+        av_free(pt);
+        return res;
+    }
+    pt->arch = arch;
+    av_ref_obj(arch);
+
+    arch->flags |= ARCHF_PARSING;
+    AV_LOCK(parselock);
+    if(pthread_create(&thread, NULL, parse_thread, pt) != 0) {
+        AV_UNLOCK(parselock);
+        arch->flags &= ~ARCHF_PARSING;
+        av_free_ventry(pt->ve);
+        av_unref_obj(arch);
+        av_free(pt);
+        return -EAGAIN;
+    }
+    parse_running ++;
+    AV_UNLOCK(parselock);
+    pthread_detach(thread);
+
+    return 0;
+}
+
 static int new_archive(ventry *ve, struct archive *arch)
 {
     int res;
     struct archparams *ap = (struct archparams *) ve->mnt->avfs->data;
     struct entry *root;
-    struct avstat stbuf;
 
     arch->avfs = ve->mnt->avfs;
 
     if(!(ap->flags & ARF_NOBASE)) {
-        res = av_getattr(ve->mnt->base, &arch->st, AVA_ALL & ~AVA_SIZE, 0);
+        /* Neither the size nor the block count, which would need the
+           whole of a compressed base to be read */
+        res = av_getattr(ve->mnt->base, &arch->st,
+                         AVA_ALL & ~(AVA_SIZE | AVA_BLKCNT), 0);
         if(res < 0)
             return res;
     }
@@ -82,34 +201,35 @@ static int new_archive(ventry *ve, struct archive *arch)
     av_arch_default_dir(arch, root);
     av_unref_obj(root);
 
-    res = ap->parse(ap->data, ve, arch);
-    if(res < 0)
-        return res;
-
-    if(!(ap->flags & ARF_NOBASE)) {
-        /* The size is only requested _after_ the parse, so bzip2 &
-           al. won't suffer. */
-        res = av_getattr(ve->mnt->base, &stbuf, AVA_SIZE, 0);
+    if(!(ap->flags & ARF_PROGRESSIVE) || start_parse_thread(ve, arch) < 0) {
+        res = parse_archive(ve, arch);
         if(res < 0)
             return res;
     }
 
-    arch->st.size = stbuf.size;
-
     arch->flags |= ARCHF_READY;
 
     return 0;
 }
 
-static int check_archive(ventry *ve, struct archive *arch, int *neednew)
+static int check_archive(ventry *ve, const char *key, struct archive *arch,
+                         int *neednew)
 {
     int res;
     struct archparams *ap = (struct archparams *) ve->mnt->avfs->data;
     struct avstat stbuf;
     int attrmask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME;
     
+    /* The size is not known yet, and a failed parse is done again */
+    if((arch->flags & ARCHF_PARSING) != 0)
+        return 0;
+    if(arch->parseres < 0)
+        return arch->parseres;
+
     if((ap->flags & ARF_NOBASE) != 0)
         return 0;
+    if(!av_filecache_recheck(ve, key))
+        return 0;
 
     res = av_getattr(ve->mnt->base, &stbuf, attrmask, 0);
     if(res < 0)
@@ -117,6 +237,8 @@ static int check_archive(ventry *ve, struct archive *arch, int *neednew)
 
     if(!arch_same(arch, &stbuf))
         *neednew = 1;
+    else
+        av_filecache_checked(key);
 
     return 0;
 }
@@ -131,9 +253,12 @@ static struct archive *find_archive(const char *key)
     if(arch == NULL) {
         AV_NEW_OBJ(arch, arch_delete);
         AV_INITLOCK(arch->lock);
+        pthread_cond_init(&arch->cond, NULL);
+        arch->parseres = 0;
         arch->flags = 0;
         arch->ns = NULL;
         arch->numread = 0;
+        arch->lazydata = NULL;
         av_filecache_set(key, arch);
     }
     AV_UNLOCK(lock);
@@ -167,7 +292,7 @@ static int get_archive(ventry *ve, struct archive **archp)
         if(!(arch->flags & ARCHF_READY))
             res = new_archive(ve, arch);
         else
-            res = check_archive(ve, arch, &neednew);
+            res = check_archive(ve, key, arch, &neednew);
         if(res < 0 || neednew) {
             AV_UNLOCK(arch->lock);
             av_unref_obj(arch);
@@ -197,6 +322,20 @@ static int lookup_check_node(struct entry *ent, const char *name)
     return 0;
 }
 
+/* Create the entries of a directory, which the parse left to
+   ap->expand() */
+static int arch_expand(struct archive *arch, struct entry *ent)
+{
+    struct archnode *nod = (struct archnode *) av_namespace_get(ent);
+    struct archparams *ap = (struct archparams *) arch->avfs->data;
+
+    if(nod == NULL || !(nod->flags & ANOF_LAZY))
+        return 0;
+
+    nod->flags &= ~ANOF_LAZY;
+    return ap->expand(arch->lazydata, arch, ent);
+}
+
 static int arch_lookup(ventry *ve, const char *name, void **newp)
 {
     int res;
@@ -222,13 +361,29 @@ static int arch_lookup(ventry *ve, const char *name, void **newp)
         arch = ae->arch;
         AV_LOCK(arch->lock);
         res = lookup_check_node(ae->ent, name);
+        if(res == 0 && name != NULL)
+            res = arch_expand(arch, ae->ent);
         if(res < 0) {
             AV_UNLOCK(arch->lock);
             return res;
         }
     }
 
-    ent = av_namespace_lookup_all(arch->ns, ae->ent, name);
+    while(1) {
+        ent = av_namespace_lookup_all(arch->ns, ae->ent, name);
+        if(!(arch->flags & ARCHF_PARSING) ||
+           (ent != NULL && av_namespace_get(ent) != NULL))
+            break;
+
+        /* Not seen yet, but may still come */
+        av_unref_obj(ent);
+        pthread_cond_wait(&arch->cond, &arch->lock);
+    }
+    if(arch->parseres < 0 && (ent == NULL || av_namespace_get(ent) == NULL)) {
+        /* The parse stopped before getting to it */
+        av_unref_obj(ent);
+        ent = NULL;
+    }
     av_unref_obj(ae->ent);
     if(ent == NULL) {
         av_unref_obj(ae->arch);
@@ -317,6 +472,7 @@ static void arch_do_close(struct archfile *fil, int realopen)
     av_unref_obj(fil->nod);
     av_unref_obj(fil->ent);
     av_unref_obj(fil->curr);
+    av_readahead_free(fil->ra);
     av_free(fil);
 }
 
@@ -339,7 +495,14 @@ static int arch_do_open(ventry *ve, int flags, avmode_t mode, void **resp)
 
     if((flags & AVO_DIRECTORY) != 0 && !AV_ISDIR(nod->st.mode))
         return -ENOTDIR;
-    
+
+    /* The link count of a directory is only known after its expansion */
+    if(AV_ISDIR(nod->st.mode)) {
+        res = arch_expand(arch, ae->ent);
+        if(res < 0)
+            return res;
+    }
+
     realopen = arch_real_open(flags);
     if(realopen) {
         if(!(ap->flags & ARF_NOBASE)) {
@@ -369,6 +532,7 @@ static int arch_do_open(ventry *ve, int flags, avmode_t mode, void **resp)
 
     fil->curr = NULL;
     fil->currn = -1;
+    fil->ra = NULL;
 
     av_ref_obj(fil->arch);
     av_ref_obj(fil->nod);
@@ -423,7 +587,6 @@ static int arch_close(vfile *vf)
 avssize_t av_arch_read(vfile *vf, char *buf, avsize_t nbyte)
 {
     int res;
-    avoff_t realoff;
     struct archfile *fil = arch_vfile_file(vf);
     struct archnode *nod = fil->nod;
     avoff_t nact;
@@ -434,34 +597,98 @@ avssize_t av_arch_read(vfile *vf, char *buf, avsize_t nbyte)
     if(nbyte == 0 || vf->ptr >= nod->realsize)
         return 0;
 
-    realoff = vf->ptr + nod->offset;
     nact = AV_MIN((avoff_t)nbyte, (avoff_t) (nod->realsize - vf->ptr));
 
     // due to the MIN, nact is not larger than the range of avsize_t
-    res = av_pread(fil->basefile, buf, (avsize_t)nact, realoff);
+    res = av_readahead_pread(&fil->ra, fil->basefile, buf, (avsize_t)nact,
+                             nod->offset + vf->ptr,
+                             nod->offset + nod->realsize);
     if(res > 0)
         vf->ptr += res;
 
     return res;
 }
 
+/* Reads of one member are serialized by the lock of its node, which
+   also covers the state shared by its opens.  Different members can be
+   read in parallel */
 static avssize_t arch_read(vfile *vf, char *buf, avsize_t nbyte)
 {
     avssize_t res;
     struct archfile *fil = arch_vfile_file(vf);
-    struct archive *arch = fil->arch;
+    struct archnode *nod = fil->nod;
     struct archparams *ap = (struct archparams *) vf->mnt->avfs->data;
     
-    AV_LOCK(arch->lock);
-    if(AV_ISDIR(fil->nod->st.mode))
+    AV_LOCK(nod->lock);
+    if(AV_ISDIR(nod->st.mode))
 	res = -EISDIR;
     else
 	res =  ap->read(vf, buf, nbyte);
-    AV_UNLOCK(arch->lock);
+    AV_UNLOCK(nod->lock);
+
+    return res;
+}
+
+/* A member stored as is can be read straight from the base file */
+static int arch_getfd(vfile *vf, avoff_t *offsetp, avoff_t *sizep)
+{
+    int res;
+    avoff_t offset;
+    avoff_t size;
+    struct archfile *fil = arch_vfile_file(vf);
+    struct archnode *nod = fil->nod;
+    avoff_t nodoffset;
+    int flags;
+
+    if(AV_ISDIR(nod->st.mode))
+        return -EISDIR;
+
+    /* The module may set these at open */
+    AV_LOCK(nod->lock);
+    flags = nod->flags;
+    nodoffset = nod->offset;
+    AV_UNLOCK(nod->lock);
+
+    if(!(flags & ANOF_STORED) || fil->basefile == NULL)
+        return -ENOSYS;
+
+    res = av_getfd(fil->basefile, &offset, &size);
+    if(res < 0)
+        return res;
+
+    /* Truncated archive: leave it to the normal read */
+    if(nodoffset + nod->realsize > size)
+        return -ENOSYS;
+
+    *offsetp = offset + nodoffset;
+    *sizep = nod->realsize;
 
     return res;
 }
 
+/* Pass the hint on to the base file for a stored member, so that a
+   decompressor under the archive can get ready for the inner seek */
+static void arch_seekhint(vfile *vf, avoff_t offset)
+{
+    struct archfile *fil = arch_vfile_file(vf);
+    struct archnode *nod = fil->nod;
+    avoff_t nodoffset;
+    int flags;
+
+    AV_LOCK(nod->lock);
+    flags = nod->flags;
+    nodoffset = nod->offset;
+    AV_UNLOCK(nod->lock);
+
+    if(!(flags & ANOF_STORED) || fil->basefile == NULL)
+        return;
+
+    if(offset < 0 || offset >= nod->realsize)
+        return;
+
+    av_seekhint(fil->basefile, nodoffset + offset);
+}
+
 static struct archnode *arch_special_entry(int n, struct entry *ent,
                                            char **namep)
 {
@@ -524,6 +751,10 @@ static int arch_readdir(vfile *vf, struct avdirent *buf)
     char *name;
 
     AV_LOCK(arch->lock);
+    /* Any part of the archive can add entries to a directory */
+    while((arch->flags & ARCHF_PARSING) != 0)
+        pthread_cond_wait(&arch->cond, &arch->lock);
+
     nod = arch_nth_entry(vf->ptr, fil, &name);
     if(nod == NULL)
         res = 0;
@@ -540,6 +771,8 @@ static int arch_readdir(vfile *vf, struct avdirent *buf)
     return res;
 }
 
+/* While a parse is running in the background, the link count of a
+   directory only counts the subdirectories found so far */
 static int arch_getattr(vfile *vf, struct avstat *buf, int attrmask)
 {
      struct archfile *fil = arch_vfile_file(vf);
@@ -618,6 +851,8 @@ int av_archive_init(const char *name, struct ext_info *exts, int version,
     avfs->getattr   = arch_getattr;
     avfs->access    = arch_access;
     avfs->readlink  = arch_readlink;
+    avfs->getfd     = arch_getfd;
+    avfs->seekhint  = arch_seekhint;
     avfs->destroy   = arch_destroy;
 
     AV_NEW(ap);
@@ -628,6 +863,7 @@ int av_archive_init(const char *name, struct ext_info *exts, int version,
     ap->close = NULL;
     ap->read = av_arch_read;
     ap->release = NULL;
+    ap->expand = NULL;
 
     avfs->data = ap;
 
@@ -12,6 +12,7 @@ static void archnode_destroy(struct archnode *nod)
 {
     av_free(nod->linkname);
     av_unref_obj(nod->data);
+    AV_FREELOCK(nod->lock);
 }
 
 struct archnode *av_arch_new_node(struct archive *arch, struct entry *ent,
@@ -34,6 +35,7 @@ struct archnode *av_arch_new_node(struct archive *arch, struct entry *ent,
     nod->data = NULL;
     nod->flags = 0;
     nod->numopen = 0;
+    AV_INITLOCK(nod->lock);
 
     /* FIXME: This scheme will allocate the same device to a tar file
        inside a tarfile. While this is not fatal, 'find -xdev' would not do
@@ -170,6 +172,48 @@ int av_arch_isroot(struct archive *arch, struct entry *ent)
     return res;
 }
 
+/* A parse running in the background holds the archive lock only while
+   it changes the entries.  It calls these around reading the base, so
+   lookups can use the entries created so far in the meantime.  The
+   parse should give up if av_arch_parse_lock() returns an error */
+void av_arch_parse_unlock(struct archive *arch)
+{
+    if(arch->flags & ARCHF_PARSING) {
+        pthread_cond_broadcast(&arch->cond);
+        AV_UNLOCK(arch->lock);
+    }
+}
+
+int av_arch_parse_lock(struct archive *arch)
+{
+    if(arch->flags & ARCHF_PARSING) {
+        AV_LOCK(arch->lock);
+        /* The library is exiting */
+        if(av_arch_parse_stopped())
+            return -EINTR;
+    }
+
+    return 0;
+}
+
+/* Instead of creating all entries in parse(), leave them to
+   ap->expand(), which is called with 'data' when a directory is first
+   looked into.  Takes over the reference to 'data' */
+void av_arch_set_lazy(struct archive *arch, void *data)
+{
+    struct entry *root;
+    struct archnode *nod;
+
+    av_unref_obj(arch->lazydata);
+    arch->lazydata = data;
+
+    root = av_namespace_subdir(arch->ns, NULL);
+    nod = (struct archnode *) av_namespace_get(root);
+    if(nod != NULL)
+        nod->flags |= ANOF_LAZY;
+    av_unref_obj(root);
+}
+
 struct entry *av_arch_create(struct archive *arch, const char *path, int flags)
 {
     struct archnode *nod;
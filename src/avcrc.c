@@ -0,0 +1,225 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    CRC-32 as used by gzip and zip.  The crc32() of the bundled zlib
+    processes one byte at a time, which shows up next to inflate when
+    reading compressed files.  This uses eight tables (eight bytes per
+    step) and, on x86, folding with the carry-less multiply
+    instruction or on ARMv8 the CRC instructions.
+*/
+
+#include "config.h"
+#include "avcrc.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define USE_PCLMUL
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#define USE_ARMCRC
+#include <arm_acle.h>
+#endif
+
+#ifndef USE_ARMCRC
+/* Reversed polynomial */
+#define CRC32_POLY 0xedb88320
+
+static avuint crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+#ifdef USE_PCLMUL
+static int crc_have_pclmul;
+#endif
+
+static void crc_init()
+{
+    int i, j;
+    avuint c;
+
+    for(i = 0; i < 256; i++) {
+        c = i;
+        for(j = 0; j < 8; j++)
+            c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for(i = 0; i < 256; i++) {
+        c = crc_table[0][i];
+        for(j = 1; j < 8; j++) {
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_table[j][i] = c;
+        }
+    }
+
+#ifdef USE_PCLMUL
+    __builtin_cpu_init();
+    crc_have_pclmul = __builtin_cpu_supports("pclmul") &&
+        __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+/* 'crc' is in the inverted form here and in the helpers below */
+static avuint crc_tables(avuint crc, const avbyte *p, avsize_t len)
+{
+    avuint lo, hi;
+
+    for(; len >= 8; len -= 8, p += 8) {
+        lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((avuint) p[3] << 24));
+        hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((avuint) p[7] << 24);
+        crc = crc_table[7][lo & 0xff] ^
+            crc_table[6][(lo >> 8) & 0xff] ^
+            crc_table[5][(lo >> 16) & 0xff] ^
+            crc_table[4][lo >> 24] ^
+            crc_table[3][hi & 0xff] ^
+            crc_table[2][(hi >> 8) & 0xff] ^
+            crc_table[1][(hi >> 16) & 0xff] ^
+            crc_table[0][hi >> 24];
+    }
+    for(; len > 0; len--, p++)
+        crc = crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+#endif
+
+#ifdef USE_PCLMUL
+/* Folding constants for the gzip polynomial, see Intel's "Fast CRC
+   Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+   'len' must be a multiple of 16 and at least 64 */
+__attribute__((target("pclmul,sse4.1")))
+static avuint crc_pclmul(avuint crc, const avbyte *p, avsize_t len)
+{
+    static const avuquad k1k2[2] __attribute__((aligned(16))) =
+        { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const avuquad k3k4[2] __attribute__((aligned(16))) =
+        { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const avuquad k5k0[2] __attribute__((aligned(16))) =
+        { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const avuquad poly[2] __attribute__((aligned(16))) =
+        { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *) (p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *) (p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *) (p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *) (p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *) k1k2);
+    p += 64;
+    len -= 64;
+
+    /* Fold four 128 bit lanes in parallel */
+    while(len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *) (p + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *) (p + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *) (p + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *) (p + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        p += 64;
+        len -= 64;
+    }
+
+    /* Fold the lanes into one */
+    x0 = _mm_load_si128((const __m128i *) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while(len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *) p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        len -= 16;
+    }
+
+    /* 128 bits to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+#ifdef USE_ARMCRC
+static avuint crc_armv8(avuint crc, const avbyte *p, avsize_t len)
+{
+    avuquad val;
+
+    for(; len >= 8; len -= 8, p += 8) {
+        memcpy(&val, p, 8);
+        crc = __crc32d(crc, val);
+    }
+    for(; len > 0; len--, p++)
+        crc = __crc32b(crc, *p);
+
+    return crc;
+}
+#endif
+
+avuint av_crc32(avuint crc, const void *buf, avsize_t len)
+{
+    const avbyte *p = (const avbyte *) buf;
+
+    if(buf == NULL)
+        return 0;
+
+    crc = ~crc;
+
+#if defined(USE_ARMCRC)
+    crc = crc_armv8(crc, p, len);
+#else
+    pthread_once(&crc_once, crc_init);
+#ifdef USE_PCLMUL
+    if(crc_have_pclmul && len >= 64) {
+        avsize_t n = len & ~15;
+
+        crc = crc_pclmul(crc, p, n);
+        p += n;
+        len -= n;
+    }
+#endif
+    crc = crc_tables(crc, p, len);
+#endif
+
+    return ~crc;
+}
@@ -11,6 +11,7 @@
 #include "bzlib.h"
 #include "oper.h"
 #include "exit.h"
+#include "idle.h"
 
 #include <stdlib.h>
 #include <fcntl.h>
@@ -22,10 +23,14 @@
 struct bzstreamcache {
     int id;
     bz_stream *s;
+    avtime_t lastused;
 };
 
-/* FIXME: the streamcache should be cleaned up after a short timeout
-   because it uses a LOT of memory */
+/* A bz_stream together with the memory allocated by bzlib for it */
+struct bzstream {
+    bz_stream s;
+    avsize_t memsize;
+};
 
 static struct bzstreamcache bzscache;
 static int bzread_nextid;
@@ -84,13 +89,33 @@ static void bz_delete_stream(bz_stream *s)
     }
 }
 
+/* bzlib only frees memory in BZ2_bzDecompressEnd(), so counting the
+   allocations is enough */
+static void *bz_alloc(void *opaque, int items, int size)
+{
+    struct bzstream *bs = (struct bzstream *) opaque;
+
+    bs->memsize += items * size;
+    return malloc(items * size);
+}
+
+static void bz_free(void *opaque, void *ptr)
+{
+    free(ptr);
+}
+
 static int bz_new_stream(bz_stream **resp)
 {
     int res;
     bz_stream *s;
-
-    AV_NEW(s);
-    memset(s, 0, sizeof(*s));
+    struct bzstream *bs;
+
+    AV_NEW(bs);
+    memset(bs, 0, sizeof(*bs));
+    s = &bs->s;
+    s->bzalloc = bz_alloc;
+    s->bzfree = bz_free;
+    s->opaque = bs;
     res = BZ2_bzDecompressInit(s, 0, 0);
     if(res != BZ_OK) {
         *resp = NULL;
@@ -112,12 +137,30 @@ static void bzfile_scache_delete()
     AV_UNLOCK(bzread_lock);
 }
 
+static avoff_t bzfile_scache_idle(avtime_t expire)
+{
+    avoff_t mem = 0;
+
+    AV_LOCK(bzread_lock);
+    if(bzscache.id != 0 && bzscache.lastused < expire) {
+        bz_delete_stream(bzscache.s);
+        bzscache.id = 0;
+    }
+    if(bzscache.id != 0)
+        mem = sizeof(struct bzstream) +
+            ((struct bzstream *) bzscache.s)->memsize;
+    AV_UNLOCK(bzread_lock);
+
+    return mem;
+}
+
 static void bzfile_scache_save(int id, bz_stream *s)
 {
     static int regdestroy = 0;
     if(!regdestroy) {
         regdestroy = 1;
         av_add_exithandler(bzfile_scache_delete);
+        av_add_idlehandler("bz", bzfile_scache_idle);
     }
 
     if(id == 0 || s == NULL) {
@@ -130,6 +173,7 @@ static void bzfile_scache_save(int id, bz_stream *s)
 
     bzscache.id = id;
     bzscache.s = s;
+    bzscache.lastused = av_time();
 }
 
 static int bzfile_reset(struct bzfile *fil)
@@ -154,7 +198,12 @@ static int bzfile_seek_index(struct bzfile *fil, struct bzindex *zi)
     unsigned int val;
     
     /* FIXME: Is it a good idea to save the previous state or not? */
-    bzfile_scache_save(fil->id, fil->s);
+    if (fil->iseof || fil->iserror)
+        bz_delete_stream(fil->s);
+    else
+        bzfile_scache_save(fil->id, fil->s);
+
+    fil->iseof = 0;
     res = bz_new_stream(&fil->s);
     if(res < 0)
         return res;
@@ -367,7 +416,15 @@ static int bzfile_seek(struct bzfile *fil, struct bzcache *zc, avoff_t offset)
                 bz_stream *tmp = fil->s;
                 fil->s = bzscache.s;
                 fil->s->avail_in = 0;
-                bzscache.s = tmp;
+                if(fil->iseof) {
+                    bz_delete_stream(tmp);
+                    bzscache.id = 0;
+                }
+                else {
+                    bzscache.s = tmp;
+                    bzscache.lastused = av_time();
+                }
+                fil->iseof = 0;
                 return 0;
             }
         }
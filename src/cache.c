@@ -432,7 +432,7 @@ void av_cache2_setsize(const char *name, avoff_t diskusage)
 
     AV_LOCK(cachelock);
     cobj = cacheobj2_find(name);
-    if(cobj->obj != NULL && cobj->diskusage != diskusage) {
+    if(cobj != NULL && cobj->obj != NULL && cobj->diskusage != diskusage) {
         disk_usage -= cobj->diskusage;
         cobj->diskusage = diskusage;
         disk_usage += cobj->diskusage;
@@ -0,0 +1,212 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Checkpoint index of the decoders, taken from zread.c
+*/
+
+#include "config.h"
+#include "ckptfile.h"
+#include "zlib.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+/* It is not worth it to compress the state better */
+#define STATE_COMPRESS_LEVEL 1
+
+static int ckpt_compress_state(struct ckptfile *cf, const char *state,
+                               int statelen, char **resp)
+{
+    int res;
+    z_stream s;
+    int bufsize = sizeof(int) + statelen + statelen / 1000 + 1 + 12;
+    char *cstate = av_malloc(bufsize);
+
+    memset(&s, 0, sizeof(s));
+    s.next_in = (Bytef *) state;
+    s.avail_in = statelen;
+    s.next_out = (Bytef *) (cstate + sizeof(int));
+    s.avail_out = bufsize - sizeof(int);
+
+    ((int *) cstate)[0] = statelen;
+
+    res = deflateInit(&s, STATE_COMPRESS_LEVEL);
+    if(res == Z_OK) {
+        res = deflate(&s, Z_FINISH);
+        deflateEnd(&s);
+    }
+    if(res != Z_STREAM_END) {
+        av_log(AVLOG_ERROR, "%s: compress state failed", cf->name);
+        av_free(cstate);
+        return -EIO;
+    }
+
+    *resp = cstate;
+    return sizeof(int) + s.total_out;
+}
+
+static int ckpt_uncompress_state(struct ckptfile *cf, char *cstate,
+                                 int cstatelen, char **resp)
+{
+    int res;
+    z_stream s;
+    int statelen;
+    char *state;
+
+    if(cstatelen < (int) sizeof(int) || ((int *) cstate)[0] < 0) {
+        av_log(AVLOG_ERROR, "%s: Error in indexfile %s", cf->name,
+               cf->indexfile);
+        return -EIO;
+    }
+    statelen = ((int *) cstate)[0];
+    state = av_malloc(statelen);
+
+    memset(&s, 0, sizeof(s));
+    s.next_in = (Bytef *) (cstate + sizeof(int));
+    s.avail_in = cstatelen - sizeof(int);
+    s.next_out = (Bytef *) state;
+    s.avail_out = statelen;
+
+    res = inflateInit(&s);
+    if(res == Z_OK) {
+        res = inflate(&s, Z_FINISH);
+        inflateEnd(&s);
+    }
+    if(res != Z_STREAM_END) {
+        av_log(AVLOG_ERROR, "%s: uncompress state failed", cf->name);
+        av_free(state);
+        return -EIO;
+    }
+
+    *resp = state;
+    return statelen;
+}
+
+/* Save a checkpoint of 'statelen' bytes at output offset 'offset'.
+   Checkpoints saved on request may be before the last one */
+int av_ckptfile_save(struct ckptfile *cf, const char *state, int statelen,
+                     avoff_t offset)
+{
+    int fd;
+    int res;
+    int clen;
+    char *cstate;
+    struct ckpt **cp;
+    struct ckpt *ck;
+
+    clen = ckpt_compress_state(cf, state, statelen, &cstate);
+    if(clen < 0)
+        return clen;
+
+    fd = open(cf->indexfile, O_WRONLY | O_CREAT, 0600);
+    if(fd == -1) {
+        av_log(AVLOG_ERROR, "%s: Error opening indexfile %s: %s", cf->name,
+               cf->indexfile, strerror(errno));
+        av_free(cstate);
+        return -EIO;
+    }
+
+    lseek(fd, cf->filesize, SEEK_SET);
+
+    res = write(fd, cstate, clen);
+    close(fd);
+    av_free(cstate);
+    if(res != clen) {
+        av_log(AVLOG_ERROR, "%s: Error writing indexfile %s: %s", cf->name,
+               cf->indexfile, strerror(errno));
+        return -EIO;
+    }
+
+    for(cp = &cf->ckpts; *cp != NULL && (*cp)->offset < offset;
+        cp = &(*cp)->next);
+
+    AV_NEW(ck);
+    ck->offset = offset;
+    ck->indexoffset = cf->filesize;
+    ck->indexsize = clen;
+    ck->next = *cp;
+
+    *cp = ck;
+
+    if(ck->next == NULL)
+        cf->nextindex = offset + CKPT_DISTANCE;
+    cf->filesize += clen;
+
+    return 0;
+}
+
+/* Read back the state saved in 'ck' into a newly allocated buffer.
+   Returns the length of the state */
+int av_ckptfile_load(struct ckptfile *cf, struct ckpt *ck, char **statep)
+{
+    int fd;
+    int res;
+    char *cstate;
+
+    fd = open(cf->indexfile, O_RDONLY, 0);
+    if(fd == -1) {
+        av_log(AVLOG_ERROR, "%s: Error opening indexfile %s: %s", cf->name,
+               cf->indexfile, strerror(errno));
+        return -EIO;
+    }
+
+    lseek(fd, ck->indexoffset, SEEK_SET);
+
+    cstate = av_malloc(ck->indexsize);
+    res = read(fd, cstate, ck->indexsize);
+    close(fd);
+    if(res != ck->indexsize) {
+        av_free(cstate);
+        av_log(AVLOG_ERROR, "%s: Error in indexfile %s", cf->name,
+               cf->indexfile);
+        return -EIO;
+    }
+
+    res = ckpt_uncompress_state(cf, cstate, ck->indexsize, statep);
+    av_free(cstate);
+
+    return res;
+}
+
+/* The last checkpoint at or before 'offset', or NULL */
+struct ckpt *av_ckptfile_find(struct ckptfile *cf, avoff_t offset)
+{
+    struct ckpt *prevck;
+    struct ckpt *ck;
+
+    prevck = NULL;
+    for(ck = cf->ckpts; ck != NULL; ck = ck->next) {
+        if(ck->offset > offset)
+            break;
+        prevck = ck;
+    }
+
+    return prevck;
+}
+
+void av_ckptfile_init(struct ckptfile *cf, const char *name)
+{
+    cf->name = name;
+    cf->indexfile = NULL;
+    cf->filesize = 0;
+    cf->nextindex = CKPT_DISTANCE;
+    cf->ckpts = NULL;
+
+    av_get_tmpfile(&cf->indexfile);
+}
+
+void av_ckptfile_free(struct ckptfile *cf)
+{
+    struct ckpt *ck;
+    struct ckpt *nextck;
+
+    av_del_tmpfile(cf->indexfile);
+
+    for(ck = cf->ckpts; ck != NULL; ck = nextck) {
+        nextck = ck->next;
+        av_free(ck);
+    }
+}
@@ -0,0 +1,901 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Decoder for Deflate64 ("enhanced deflate", zip method 9), which
+    zlib does not handle.  It differs from deflate in the 64k window,
+    the 16 extra bits of length code 285 and the two additional
+    distance codes.  Based on lzwread.c, the Huffman decoding follows
+    zlib's contrib/puff.
+*/
+
+#include "config.h"
+#include "d64file.h"
+#include "ckptfile.h"
+#include "oper.h"
+#include "avcrc.h"
+
+#define INBUFSIZE 16384
+#define OUTBUFSIZE 32768
+
+/* This is the 'cost' of the restoration from the index cache */
+#define D64CACHE_EXTRA_DIST 100000
+
+#define D64_WSIZE 65536
+#define D64_WMASK (D64_WSIZE - 1)
+
+/* Output is produced in pieces of at most this size, so that the CRC
+   can be calculated from the window */
+#define D64_STEP (D64_WSIZE / 2)
+
+#define D64_MAXBITS 15
+#define D64_MAXLCODES 288
+#define D64_MAXDCODES 32
+#define D64_MAXCODES (D64_MAXLCODES + D64_MAXDCODES)
+#define D64_FIXLCODES 288
+#define D64_NCLCODES 19
+
+/* Codes up to this length are decoded with a single table lookup */
+#define D64_FASTBITS 10
+
+/* Decoder modes */
+#define D64_HEADER 0
+#define D64_STORED 1
+#define D64_HUFF   2
+#define D64_DONE   3
+
+static AV_LOCK_DECL(d64read_lock);
+
+static const short d64_lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 3
+};
+static const short d64_lext[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 16
+};
+static const avuint d64_dbase[32] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577, 32769, 49153
+};
+static const short d64_dext[32] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 14, 14
+};
+static const short d64_clorder[D64_NCLCODES] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+struct d64huff {
+    short count[D64_MAXBITS + 1];
+    short symbol[D64_MAXLCODES];
+    /* length << 9 | symbol, or 0 for longer codes */
+    unsigned short fast[1 << D64_FASTBITS];
+};
+
+/* The decoder state between two symbols.  In the index this is
+   followed by the window */
+struct d64state {
+    avoff_t outoff;          /* The number of output bytes */
+    avoff_t bitoff;          /* Bit offset of the next symbol */
+    int mode;
+    int last;                /* Current block is the last one */
+    int fixed;               /* Current block uses the fixed codes */
+    int nlen;
+    int ndist;
+    avuint stored_left;
+    avuint copy_len;
+    avuint copy_dist;
+    avbyte lengths[D64_MAXCODES];
+};
+
+struct d64cache {
+    struct ckptfile ckpt;
+    avoff_t size;
+    avmutex lock;
+};
+
+struct d64file {
+    struct d64state st;
+    int iseof;
+    int iserror;
+
+    int calccrc;
+    int crcvalid;            /* crcval covers the output from the start */
+    avuint crc;
+    avuint crcval;
+    avoff_t crcoff;
+
+    avoff_t nextcheck;
+
+    vfile *infile;
+    avoff_t inend;           /* Size of the input if already known */
+    avoff_t inpos;           /* Next byte to load into bitbuf */
+    avuquad bitbuf;
+    int bitcnt;
+    avoff_t inbufoff;
+    avsize_t inbuflen;
+    avbyte inbuf[INBUFSIZE];
+
+    struct d64huff lencode;
+    struct d64huff distcode;
+    avbyte window[D64_WSIZE];
+};
+
+/* Make sure that at least 'need' bits are in bitbuf.  Past the end of
+   the input zeros are loaded, d64file_check_input() catches the case
+   when these are actually used */
+static int d64file_fill_bits(struct d64file *fil, int need)
+{
+    avssize_t res;
+
+    while(fil->bitcnt < need) {
+        avuint c = 0;
+
+        if(fil->inend == -1 || fil->inpos < fil->inend) {
+            if(fil->inpos < fil->inbufoff ||
+               fil->inpos >= fil->inbufoff + fil->inbuflen) {
+                res = av_pread(fil->infile, (char *) fil->inbuf, INBUFSIZE,
+                               fil->inpos);
+                if(res < 0)
+                    return res;
+
+                fil->inbufoff = fil->inpos;
+                fil->inbuflen = res;
+            }
+            if(fil->inbuflen == 0)
+                fil->inend = fil->inpos;
+            else
+                c = fil->inbuf[fil->inpos - fil->inbufoff];
+        }
+
+        fil->bitbuf |= (avuquad) c << fil->bitcnt;
+        fil->bitcnt += 8;
+        fil->inpos++;
+    }
+
+    return 0;
+}
+
+static int d64file_getbits(struct d64file *fil, int n)
+{
+    int res;
+    int val;
+
+    if(fil->bitcnt < n) {
+        res = d64file_fill_bits(fil, n);
+        if(res < 0)
+            return res;
+    }
+
+    val = fil->bitbuf & ((1U << n) - 1);
+    fil->bitbuf >>= n;
+    fil->bitcnt -= n;
+
+    return val;
+}
+
+static avoff_t d64file_bitoff(struct d64file *fil)
+{
+    return fil->inpos * 8 - fil->bitcnt;
+}
+
+static int d64file_check_input(struct d64file *fil)
+{
+    if(fil->inend != -1 && d64file_bitoff(fil) > fil->inend * 8) {
+        av_log(AVLOG_ERROR, "D64FILE: Unexpected end of compressed data");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void d64file_set_bitoff(struct d64file *fil, avoff_t bitoff)
+{
+    fil->inpos = bitoff >> 3;
+    fil->bitbuf = 0;
+    fil->bitcnt = 0;
+}
+
+/* Returns the number of unused codes (negative if over-subscribed) */
+static int d64huff_build(struct d64huff *h, const avbyte *length, int n)
+{
+    int symbol;
+    int len;
+    int left;
+    int i;
+    avuint code;
+    avuint rev;
+    short offs[D64_MAXBITS + 1];
+    avuint next[D64_MAXBITS + 1];
+
+    memset(h->count, 0, sizeof(h->count));
+    memset(h->fast, 0, sizeof(h->fast));
+    for(symbol = 0; symbol < n; symbol++)
+        h->count[length[symbol]]++;
+    if(h->count[0] == n)
+        return 0;
+
+    left = 1;
+    for(len = 1; len <= D64_MAXBITS; len++) {
+        left <<= 1;
+        left -= h->count[len];
+        if(left < 0)
+            return left;
+    }
+
+    offs[1] = 0;
+    for(len = 1; len < D64_MAXBITS; len++)
+        offs[len + 1] = offs[len] + h->count[len];
+    for(symbol = 0; symbol < n; symbol++) {
+        if(length[symbol] != 0)
+            h->symbol[offs[length[symbol]]++] = symbol;
+    }
+
+    /* Codes are stored starting with the most significant bit, so the
+       table is indexed by the reversed code */
+    code = 0;
+    for(len = 1; len <= D64_MAXBITS; len++) {
+        code = (code + (len > 1 ? h->count[len - 1] : 0)) << 1;
+        next[len] = code;
+    }
+    for(symbol = 0; symbol < n; symbol++) {
+        len = length[symbol];
+        if(len == 0 || len > D64_FASTBITS) {
+            if(len != 0)
+                next[len]++;
+            continue;
+        }
+        code = next[len]++;
+        rev = 0;
+        for(i = 0; i < len; i++)
+            rev |= ((code >> i) & 1) << (len - 1 - i);
+        for(i = rev; i < (1 << D64_FASTBITS); i += 1 << len)
+            h->fast[i] = (len << 9) | symbol;
+    }
+
+    return left;
+}
+
+static int d64file_decode(struct d64file *fil, const struct d64huff *h)
+{
+    int res;
+    int len;
+    int code;
+    int first;
+    int count;
+    int index;
+    avuint entry;
+
+    if(fil->bitcnt < D64_MAXBITS) {
+        res = d64file_fill_bits(fil, D64_MAXBITS);
+        if(res < 0)
+            return res;
+    }
+
+    entry = h->fast[fil->bitbuf & ((1 << D64_FASTBITS) - 1)];
+    if(entry != 0) {
+        len = entry >> 9;
+        fil->bitbuf >>= len;
+        fil->bitcnt -= len;
+        return entry & 0x1ff;
+    }
+
+    code = first = index = 0;
+    for(len = 1; len <= D64_MAXBITS; len++) {
+        code |= (fil->bitbuf >> (len - 1)) & 1;
+        count = h->count[len];
+        if(code - count < first) {
+            fil->bitbuf >>= len;
+            fil->bitcnt -= len;
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+
+    av_log(AVLOG_ERROR, "D64FILE: Invalid code in compressed data");
+    return -EIO;
+}
+
+static void d64file_build_fixed(struct d64file *fil)
+{
+    int symbol;
+    avbyte lengths[D64_FIXLCODES + D64_MAXDCODES];
+
+    for(symbol = 0; symbol < 144; symbol++)
+        lengths[symbol] = 8;
+    for(; symbol < 256; symbol++)
+        lengths[symbol] = 9;
+    for(; symbol < 280; symbol++)
+        lengths[symbol] = 7;
+    for(; symbol < D64_FIXLCODES; symbol++)
+        lengths[symbol] = 8;
+    for(; symbol < D64_FIXLCODES + D64_MAXDCODES; symbol++)
+        lengths[symbol] = 5;
+
+    d64huff_build(&fil->lencode, lengths, D64_FIXLCODES);
+    d64huff_build(&fil->distcode, lengths + D64_FIXLCODES, D64_MAXDCODES);
+}
+
+/* Incomplete codes are only allowed if there is a single code */
+static int d64file_build_dynamic(struct d64file *fil)
+{
+    int res;
+    struct d64state *st = &fil->st;
+
+    res = d64huff_build(&fil->lencode, st->lengths, st->nlen);
+    if(res < 0 || (res > 0 && st->nlen - fil->lencode.count[0] != 1))
+        goto bad;
+
+    res = d64huff_build(&fil->distcode, st->lengths + st->nlen, st->ndist);
+    if(res < 0 || (res > 0 && st->ndist - fil->distcode.count[0] != 1))
+        goto bad;
+
+    return 0;
+
+  bad:
+    av_log(AVLOG_ERROR, "D64FILE: Invalid code lengths in compressed data");
+    return -EIO;
+}
+
+static int d64file_read_dynamic(struct d64file *fil)
+{
+    int res;
+    int i;
+    int ncode;
+    int index;
+    int symbol;
+    int len;
+    int rep;
+    avbyte cllengths[D64_NCLCODES];
+    struct d64state *st = &fil->st;
+
+    if((res = d64file_getbits(fil, 5)) < 0)
+        return res;
+    st->nlen = res + 257;
+    if((res = d64file_getbits(fil, 5)) < 0)
+        return res;
+    st->ndist = res + 1;
+    if((res = d64file_getbits(fil, 4)) < 0)
+        return res;
+    ncode = res + 4;
+    if(st->nlen > D64_MAXLCODES || st->ndist > D64_MAXDCODES)
+        goto bad;
+
+    memset(cllengths, 0, sizeof(cllengths));
+    for(i = 0; i < ncode; i++) {
+        if((res = d64file_getbits(fil, 3)) < 0)
+            return res;
+        cllengths[d64_clorder[i]] = res;
+    }
+    /* The code length code is used for the distance codes too */
+    if(d64huff_build(&fil->lencode, cllengths, D64_NCLCODES) != 0)
+        goto bad;
+
+    index = 0;
+    while(index < st->nlen + st->ndist) {
+        symbol = d64file_decode(fil, &fil->lencode);
+        if(symbol < 0)
+            return symbol;
+
+        if(symbol < 16) {
+            st->lengths[index++] = symbol;
+            continue;
+        }
+
+        len = 0;
+        if(symbol == 16) {
+            if(index == 0)
+                goto bad;
+            len = st->lengths[index - 1];
+            rep = d64file_getbits(fil, 2);
+            rep = rep < 0 ? rep : rep + 3;
+        }
+        else if(symbol == 17) {
+            rep = d64file_getbits(fil, 3);
+            rep = rep < 0 ? rep : rep + 3;
+        }
+        else {
+            rep = d64file_getbits(fil, 7);
+            rep = rep < 0 ? rep : rep + 11;
+        }
+        if(rep < 0)
+            return rep;
+        if(index + rep > st->nlen + st->ndist)
+            goto bad;
+        while(rep--)
+            st->lengths[index++] = len;
+    }
+
+    /* There must be an end of block code */
+    if(st->lengths[256] == 0)
+        goto bad;
+
+    return d64file_build_dynamic(fil);
+
+  bad:
+    av_log(AVLOG_ERROR, "D64FILE: Invalid block header in compressed data");
+    return -EIO;
+}
+
+static int d64file_block_header(struct d64file *fil)
+{
+    int res;
+    int type;
+    int len;
+    struct d64state *st = &fil->st;
+
+    if((res = d64file_getbits(fil, 1)) < 0)
+        return res;
+    st->last = res;
+    if((res = d64file_getbits(fil, 2)) < 0)
+        return res;
+    type = res;
+
+    switch(type) {
+    case 0:
+        /* Stored blocks start at a byte boundary */
+        fil->bitbuf >>= fil->bitcnt & 7;
+        fil->bitcnt -= fil->bitcnt & 7;
+        if((res = d64file_getbits(fil, 16)) < 0)
+            return res;
+        len = res;
+        if((res = d64file_getbits(fil, 16)) < 0)
+            return res;
+        if(len != (~res & 0xffff)) {
+            av_log(AVLOG_ERROR, "D64FILE: Invalid stored block length");
+            return -EIO;
+        }
+        st->stored_left = len;
+        st->mode = D64_STORED;
+        return 0;
+
+    case 1:
+        st->fixed = 1;
+        d64file_build_fixed(fil);
+        st->mode = D64_HUFF;
+        return 0;
+
+    case 2:
+        st->fixed = 0;
+        res = d64file_read_dynamic(fil);
+        if(res < 0)
+            return res;
+        st->mode = D64_HUFF;
+        return 0;
+
+    default:
+        av_log(AVLOG_ERROR, "D64FILE: Invalid block type");
+        return -EIO;
+    }
+}
+
+static void d64file_update_crc(struct d64file *fil)
+{
+    avsize_t n;
+    avsize_t pos;
+
+    while(fil->crcoff < fil->st.outoff) {
+        pos = fil->crcoff & D64_WMASK;
+        n = AV_MIN(fil->st.outoff - fil->crcoff, D64_WSIZE - pos);
+        fil->crcval = av_crc32(fil->crcval, fil->window + pos, n);
+        fil->crcoff += n;
+    }
+}
+
+static void d64file_put(struct d64file *fil, char *buf, int c)
+{
+    fil->window[fil->st.outoff & D64_WMASK] = c;
+    if(buf != NULL)
+        *buf = c;
+    fil->st.outoff++;
+}
+
+/* Produce up to nbyte bytes of a pending match */
+static avsize_t d64file_copy(struct d64file *fil, char *buf, avsize_t nbyte)
+{
+    avsize_t i;
+    avsize_t n = AV_MIN(nbyte, fil->st.copy_len);
+    avuint dist = fil->st.copy_dist;
+
+    for(i = 0; i < n; i++)
+        d64file_put(fil, buf == NULL ? NULL : buf + i,
+                    fil->window[(fil->st.outoff - dist) & D64_WMASK]);
+
+    fil->st.copy_len -= n;
+    return n;
+}
+
+/* Decode symbols of a Huffman block until a match is found, the block
+   ends or nbyte literals were produced */
+static avssize_t d64file_inflate(struct d64file *fil, char *buf,
+                                 avsize_t nbyte)
+{
+    int symbol;
+    int res;
+    avsize_t done = 0;
+    struct d64state *st = &fil->st;
+
+    while(done < nbyte) {
+        symbol = d64file_decode(fil, &fil->lencode);
+        if(symbol < 0)
+            return symbol;
+
+        if(symbol < 256) {
+            d64file_put(fil, buf == NULL ? NULL : buf + done, symbol);
+            done++;
+            continue;
+        }
+        if(symbol == 256) {
+            st->mode = st->last ? D64_DONE : D64_HEADER;
+            break;
+        }
+
+        symbol -= 257;
+        if(symbol >= 29)
+            goto bad;
+        if((res = d64file_getbits(fil, d64_lext[symbol])) < 0)
+            return res;
+        st->copy_len = d64_lbase[symbol] + res;
+
+        symbol = d64file_decode(fil, &fil->distcode);
+        if(symbol < 0)
+            return symbol;
+        if(symbol >= 32)
+            goto bad;
+        if((res = d64file_getbits(fil, d64_dext[symbol])) < 0)
+            return res;
+        st->copy_dist = d64_dbase[symbol] + res;
+        if(st->copy_dist > st->outoff || st->copy_dist > D64_WSIZE)
+            goto bad;
+        break;
+    }
+
+    return done;
+
+  bad:
+    av_log(AVLOG_ERROR, "D64FILE: Invalid match in compressed data");
+    return -EIO;
+}
+
+static int d64file_reset(struct d64file *fil)
+{
+    memset(&fil->st, 0, sizeof(fil->st));
+    fil->st.mode = D64_HEADER;
+    d64file_set_bitoff(fil, 0);
+
+    fil->iseof = 0;
+    fil->crcvalid = fil->calccrc;
+    fil->crcval = 0;
+    fil->crcoff = 0;
+    fil->nextcheck = 0;
+
+    return 0;
+}
+
+static int d64file_save_index(struct d64file *fil, struct d64cache *zc)
+{
+    int res;
+    int statelen = sizeof(struct d64state) + D64_WSIZE;
+    char *state;
+
+    fil->st.bitoff = d64file_bitoff(fil);
+
+    state = av_malloc(statelen);
+    memcpy(state, &fil->st, sizeof(struct d64state));
+    memcpy(state + sizeof(struct d64state), fil->window, D64_WSIZE);
+
+    res = av_ckptfile_save(&zc->ckpt, state, statelen, fil->st.outoff);
+    av_free(state);
+
+    return res;
+}
+
+static int d64file_seek_index(struct d64file *fil, struct d64cache *zc,
+                              struct ckpt *zi)
+{
+    int res;
+    char *state;
+
+    res = av_ckptfile_load(&zc->ckpt, zi, &state);
+    if(res < 0)
+        return res;
+    if(res != (int) sizeof(struct d64state) + D64_WSIZE) {
+        av_log(AVLOG_ERROR, "D64FILE: Invalid state in indexfile");
+        av_free(state);
+        return -EIO;
+    }
+
+    memcpy(&fil->st, state, sizeof(struct d64state));
+    memcpy(fil->window, state + sizeof(struct d64state), D64_WSIZE);
+    av_free(state);
+
+    d64file_set_bitoff(fil, fil->st.bitoff & ~(avoff_t) 7);
+    res = d64file_getbits(fil, fil->st.bitoff & 7);
+    if(res < 0)
+        return res;
+
+    if(fil->st.mode == D64_HUFF) {
+        if(fil->st.fixed)
+            d64file_build_fixed(fil);
+        else {
+            res = d64file_build_dynamic(fil);
+            if(res < 0)
+                return res;
+        }
+    }
+
+    fil->iseof = 0;
+    fil->crcvalid = 0;
+    fil->nextcheck = 0;
+
+    return 0;
+}
+
+static int d64file_check_index(struct d64file *fil, struct d64cache *zc)
+{
+    int res = 0;
+
+    AV_LOCK(d64read_lock);
+    if(fil->st.outoff >= zc->ckpt.nextindex)
+        res = d64file_save_index(fil, zc);
+    fil->nextcheck = zc->ckpt.nextindex;
+    AV_UNLOCK(d64read_lock);
+
+    return res;
+}
+
+static int d64file_finish(struct d64file *fil, struct d64cache *zc)
+{
+    if(fil->crcvalid) {
+        d64file_update_crc(fil);
+        if(fil->crcval != fil->crc) {
+            av_log(AVLOG_ERROR, "D64FILE: CRC error");
+            return -EIO;
+        }
+    }
+
+    fil->iseof = 1;
+    AV_LOCK(d64read_lock);
+    zc->size = fil->st.outoff;
+    AV_UNLOCK(d64read_lock);
+
+    return 0;
+}
+
+/* Copy (or with buf == NULL skip) up to nbyte bytes of output */
+static avssize_t d64file_output(struct d64file *fil, struct d64cache *zc,
+                                char *buf, avsize_t nbyte)
+{
+    avssize_t res;
+    avsize_t n;
+    avsize_t done = 0;
+    struct d64state *st = &fil->st;
+
+    while(done < nbyte && !fil->iseof) {
+        if(fil->crcvalid && st->outoff - fil->crcoff >= D64_STEP)
+            d64file_update_crc(fil);
+
+        n = AV_MIN(nbyte - done, D64_STEP);
+        if(st->copy_len != 0) {
+            done += d64file_copy(fil, buf == NULL ? NULL : buf + done, n);
+            continue;
+        }
+
+        if(st->outoff >= fil->nextcheck) {
+            res = d64file_check_index(fil, zc);
+            if(res < 0)
+                return res;
+        }
+
+        switch(st->mode) {
+        case D64_HEADER:
+            res = d64file_block_header(fil);
+            break;
+
+        case D64_STORED:
+            if(st->stored_left == 0) {
+                st->mode = st->last ? D64_DONE : D64_HEADER;
+                res = 0;
+                break;
+            }
+            res = d64file_getbits(fil, 8);
+            if(res >= 0) {
+                d64file_put(fil, buf == NULL ? NULL : buf + done, res);
+                st->stored_left--;
+                done++;
+            }
+            break;
+
+        case D64_HUFF:
+            res = d64file_inflate(fil, buf == NULL ? NULL : buf + done, n);
+            if(res > 0)
+                done += res;
+            break;
+
+        default:
+            res = d64file_finish(fil, zc);
+            break;
+        }
+        if(res < 0)
+            return res;
+
+        res = d64file_check_input(fil);
+        if(res < 0)
+            return res;
+    }
+
+    if(fil->crcvalid)
+        d64file_update_crc(fil);
+
+    return done;
+}
+
+static int d64file_skip_to(struct d64file *fil, struct d64cache *zc,
+                           avoff_t offset)
+{
+    avssize_t res;
+
+    while(fil->st.outoff < offset && !fil->iseof) {
+        res = d64file_output(fil, zc, NULL,
+                             AV_MIN(OUTBUFSIZE, offset - fil->st.outoff));
+        if(res < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+static int d64file_seek(struct d64file *fil, struct d64cache *zc,
+                        avoff_t offset)
+{
+    struct ckpt *zi;
+    avoff_t curroff = fil->st.outoff;
+    avoff_t zcdist;
+    avoff_t dist;
+
+    if(offset >= curroff)
+        dist = offset - curroff;
+    else
+        dist = -1;
+
+    zi = av_ckptfile_find(&zc->ckpt, offset);
+    if(zi != NULL)
+        zcdist = offset - zi->offset + D64CACHE_EXTRA_DIST;
+    else
+        zcdist = offset;
+
+    if(dist == -1 || zcdist < dist) {
+        if(zi == NULL)
+            return d64file_reset(fil);
+        else
+            return d64file_seek_index(fil, zc, zi);
+    }
+
+    return 0;
+}
+
+static int d64file_goto(struct d64file *fil, struct d64cache *zc,
+                        avoff_t offset)
+{
+    int res;
+
+    AV_LOCK(zc->lock);
+    AV_LOCK(d64read_lock);
+    res = d64file_seek(fil, zc, offset);
+    AV_UNLOCK(d64read_lock);
+    if(res == 0)
+        res = d64file_skip_to(fil, zc, offset);
+    AV_UNLOCK(zc->lock);
+
+    return res;
+}
+
+static avssize_t av_d64file_do_pread(struct d64file *fil, struct d64cache *zc,
+                                     char *buf, avsize_t nbyte,
+                                     avoff_t offset)
+{
+    avssize_t res;
+
+    if(offset != fil->st.outoff) {
+        res = d64file_goto(fil, zc, offset);
+        if(res < 0)
+            return res;
+    }
+
+    return d64file_output(fil, zc, buf, nbyte);
+}
+
+avssize_t av_d64file_pread(struct d64file *fil, struct d64cache *zc,
+                           char *buf, avsize_t nbyte, avoff_t offset)
+{
+    avssize_t res;
+
+    if(fil->iserror)
+        return -EIO;
+
+    res = av_d64file_do_pread(fil, zc, buf, nbyte, offset);
+    if(res < 0)
+        fil->iserror = 1;
+
+    return res;
+}
+
+int av_d64file_size(struct d64file *fil, struct d64cache *zc, avoff_t *sizep)
+{
+    int res;
+    avoff_t size;
+
+    AV_LOCK(d64read_lock);
+    size = zc->size;
+    AV_UNLOCK(d64read_lock);
+
+    if(size != -1 || fil == NULL) {
+        *sizep = size;
+        return 0;
+    }
+
+    if(fil->iserror)
+        return -EIO;
+
+    res = d64file_goto(fil, zc, AV_MAXOFF);
+    if(res < 0) {
+        fil->iserror = 1;
+        return res;
+    }
+
+    AV_LOCK(d64read_lock);
+    size = zc->size;
+    AV_UNLOCK(d64read_lock);
+
+    if(size == -1) {
+        av_log(AVLOG_ERROR, "D64FILE: Internal error: could not find size");
+        return -EIO;
+    }
+
+    *sizep = size;
+    return 0;
+}
+
+struct d64file *av_d64file_new(vfile *vf, avuint crc, int calccrc)
+{
+    struct d64file *fil;
+
+    AV_NEW_OBJ(fil, NULL);
+    fil->iserror = 0;
+    fil->infile = vf;
+    fil->inend = -1;
+    fil->inbufoff = 0;
+    fil->inbuflen = 0;
+    fil->crc = crc;
+    fil->calccrc = calccrc;
+
+    d64file_reset(fil);
+
+    return fil;
+}
+
+static void d64cache_destroy(struct d64cache *zc)
+{
+    AV_FREELOCK(zc->lock);
+    av_ckptfile_free(&zc->ckpt);
+}
+
+struct d64cache *av_d64cache_new()
+{
+    struct d64cache *zc;
+
+    AV_NEW_OBJ(zc, d64cache_destroy);
+    zc->size = -1;
+    AV_INITLOCK(zc->lock);
+
+    av_ckptfile_init(&zc->ckpt, "D64FILE");
+
+    return zc;
+}
@@ -193,6 +193,20 @@ static avoff_t default_lseek(vfile *vf, avoff_t offset, int whence)
     return res;
 }
 
+static int default_getfd(vfile *vf, avoff_t *offsetp, avoff_t *sizep)
+{
+    return -ENOSYS;
+}
+
+static int default_linkfile(vfile *vf, const char *path)
+{
+    return -ENOSYS;
+}
+
+static void default_seekhint(vfile *vf, avoff_t offset)
+{
+}
+
 void av_default_avfs(struct avfs *avfs)
 {
     avfs->destroy    = default_destroy;
@@ -221,5 +235,8 @@ void av_default_avfs(struct avfs *avfs)
     avfs->setattr    = default_setattr;
     avfs->truncate   = default_truncate;
     avfs->lseek      = default_lseek;
+    avfs->getfd      = default_getfd;
+    avfs->linkfile   = default_linkfile;
+    avfs->seekhint   = default_seekhint;
 }
 
@@ -258,6 +258,20 @@ int av_fd_truncate(int fd, avoff_t length)
     return res;
 }
 
+int av_fd_getfd(int fd, avoff_t *offsetp, avoff_t *sizep)
+{
+    int res;
+    vfile *vf;
+
+    res = get_file(fd, &vf);
+    if(res == 0) {
+        res = av_file_getfd(vf, offsetp, sizep);
+	put_file(vf);
+    }
+
+    return res;
+}
+
 void av_close_all_files()
 {
     int fd;
@@ -16,11 +16,15 @@ struct filecache {
     
     char *key;
     void *obj;
+    avtime_t checked;        /* When the base was last found unchanged */
 };
 
 static struct filecache fclist;
 static AV_LOCK_DECL(fclock);
 
+/* Seconds for which the signature of a cached base is trusted */
+static avoff_t fc_revalidate = 0;
+
 static void filecache_remove(struct filecache *fc)
 {
     struct filecache *prev = fc->prev;
@@ -93,6 +97,7 @@ void av_filecache_set(const char *key, void *obj)
         AV_NEW(fc);
         fc->key = av_strdup(key);
         fc->obj = obj;
+        fc->checked = av_time();
         av_ref_obj(obj);
     }
     else
@@ -123,6 +128,9 @@ void av_init_filecache()
     fclist.prev = &fclist;
     fclist.obj = NULL;
     fclist.key = NULL;
+
+    av_avfsstat_register_int("filecache/revalidate", &fc_revalidate, &fclock,
+                             0, AV_MAXOFF, NULL);
     
     av_add_exithandler(destroy_filecache);
 }
@@ -142,3 +150,90 @@ int av_filecache_getkey(ventry *ve, char **resp)
     *resp = key;
     return 0;
 }
+
+/* Handler options are letters after a '-' following the name of the
+   handler (e.g. "file.gz#ugz-s").  'i' says that the base never
+   changes, and is accepted by all handlers using the file cache */
+int av_filecache_hasopt(ventry *ve, int opt)
+{
+    const char *opts = ve->mnt->opts;
+
+    return opts[0] == '-' && strchr(opts + 1, opt) != NULL;
+}
+
+int av_filecache_checkopts(ventry *ve, const char *known)
+{
+    const char *s = ve->mnt->opts;
+
+    if(s[0] == '\0')
+        return 0;
+    if(s[0] != '-' || s[1] == '\0')
+        return -EINVAL;
+
+    for(s++; *s; s++) {
+        if(*s != 'i' && strchr(known, *s) == NULL)
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Whether the base of the object cached with 'checked' should be
+   looked at again to see if it has changed.  Called with fclock held */
+static int filecache_recheck(ventry *ve, avtime_t checked)
+{
+    if(av_filecache_hasopt(ve, 'i'))
+        return 0;
+
+    if(fc_revalidate == 0)
+        return 1;
+
+    return av_time() - checked >= fc_revalidate;
+}
+
+/* Whether the base of the object cached under 'key' should be looked
+   at again.  If it is unchanged, call av_filecache_checked() */
+int av_filecache_recheck(ventry *ve, const char *key)
+{
+    int res;
+    struct filecache *fc;
+
+    AV_LOCK(fclock);
+    fc = filecache_find(key);
+    res = fc == NULL || filecache_recheck(ve, fc->checked);
+    AV_UNLOCK(fclock);
+
+    return res;
+}
+
+/* Like av_filecache_get(), but only returns the object if its base
+   need not be looked at again */
+void *av_filecache_get_checked(ventry *ve, const char *key)
+{
+    struct filecache *fc;
+    void *obj = NULL;
+
+    AV_LOCK(fclock);
+    fc = filecache_find(key);
+    if(fc != NULL && !filecache_recheck(ve, fc->checked)) {
+        filecache_remove(fc);
+        filecache_insert(fc);
+        obj = fc->obj;
+        av_ref_obj(obj);
+    }
+    AV_UNLOCK(fclock);
+
+    return obj;
+}
+
+/* The base of the object cached under 'key' was found unchanged */
+void av_filecache_checked(const char *key)
+{
+    struct filecache *fc;
+
+    AV_LOCK(fclock);
+    fc = filecache_find(key);
+    if(fc != NULL)
+        fc->checked = av_time();
+    AV_UNLOCK(fclock);
+}
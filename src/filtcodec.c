@@ -0,0 +1,1487 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    In-process codecs for the filter modules, so that gzip, bzip2 and
+    xz filtering does not need to fork an external program for every
+    open.
+*/
+
+#include "config.h"
+#include "filtcodec.h"
+#include "serialfile.h"
+#include "zlib.h"
+#include "bzlib.h"
+#include "oper.h"
+#include "internal.h"
+#include "avcrc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBLZMA
+#include "lzma.h"
+#endif
+
+#define CODECBUFSIZE 65536
+
+struct filtcodecfile {
+    vfile *vf;
+    const struct filtcodec *codec;
+    const struct filtcodec *revcodec;
+};
+
+struct codecconn {
+    struct filtcodecfile *fc;
+    const struct filtcodec *codec;
+    void *state;
+    int ineof;
+    int done;
+    const char *inat;
+    avsize_t inlen;
+    char buf[CODECBUFSIZE];
+};
+
+/* ---------------- parallel compression ---------------- */
+
+#define COMPRESS_THREADS_MAX 64
+
+/* Tunables in #avfsstat.  With threads set to 0 the number of
+   processors is used. */
+static AV_LOCK_DECL(filtcodec_lock);
+static avoff_t gzip_threads = 1;
+static avoff_t bzip2_threads = 1;
+
+/* A piece of the input, compressed independently by a worker */
+struct compchunk {
+    const char *in;
+    avsize_t inlen;
+    int last;
+    char *out;
+    avsize_t outlen;
+    int res;
+};
+
+struct compworker {
+    pthread_t thread;
+    struct compbatch *cb;
+    unsigned int first;
+    unsigned int step;
+};
+
+/* Input is collected until each thread has a chunk to compress, the
+   results are then passed on in order */
+struct compbatch {
+    unsigned int threads;
+    avsize_t chunksize;
+    void (*compress) (struct compchunk *ch);
+    char *inbuf;
+    avsize_t inlen;
+    unsigned int nchunks;
+    struct compchunk *chunks;
+    char *pend;
+    avsize_t pendsize;
+    avsize_t pendat;
+    avsize_t pendlen;
+};
+
+static unsigned int codec_get_threads(avoff_t *threadsp)
+{
+    avoff_t threads;
+
+    AV_LOCK(filtcodec_lock);
+    threads = *threadsp;
+    AV_UNLOCK(filtcodec_lock);
+
+    if(threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1)
+        threads = 1;
+
+    return AV_MIN(threads, COMPRESS_THREADS_MAX);
+}
+
+static struct compbatch *compbatch_new(unsigned int threads,
+                                       avsize_t chunksize,
+                                       void (*compress) (struct compchunk *))
+{
+    struct compbatch *cb;
+
+    AV_NEW(cb);
+    cb->threads = threads;
+    cb->chunksize = chunksize;
+    cb->compress = compress;
+    cb->inbuf = av_malloc(threads * chunksize);
+    cb->inlen = 0;
+    cb->nchunks = 0;
+    cb->chunks = av_calloc(sizeof(struct compchunk) * threads);
+    cb->pend = NULL;
+    cb->pendsize = 0;
+    cb->pendat = 0;
+    cb->pendlen = 0;
+
+    return cb;
+}
+
+static void compbatch_clear(struct compbatch *cb)
+{
+    unsigned int i;
+
+    for(i = 0; i < cb->nchunks; i++) {
+        av_free(cb->chunks[i].out);
+        cb->chunks[i].out = NULL;
+    }
+    cb->nchunks = 0;
+    cb->inlen = 0;
+}
+
+static void compbatch_free(struct compbatch *cb)
+{
+    compbatch_clear(cb);
+    av_free(cb->chunks);
+    av_free(cb->inbuf);
+    av_free(cb->pend);
+    av_free(cb);
+}
+
+static void compbatch_append(struct compbatch *cb, const void *buf,
+                             avsize_t len)
+{
+    if(cb->pendat == cb->pendlen)
+        cb->pendat = cb->pendlen = 0;
+
+    if(cb->pendlen + len > cb->pendsize) {
+        cb->pendsize = AV_MAX(cb->pendlen + len, cb->pendsize * 2);
+        cb->pend = av_realloc(cb->pend, cb->pendsize);
+    }
+    memcpy(cb->pend + cb->pendlen, buf, len);
+    cb->pendlen += len;
+}
+
+/* Pass on pending output.  Returns 1 if nothing is left */
+static int compbatch_drain(struct compbatch *cb, char **outp,
+                           avsize_t *outlenp)
+{
+    avsize_t n = AV_MIN(cb->pendlen - cb->pendat, *outlenp);
+
+    memcpy(*outp, cb->pend + cb->pendat, n);
+    cb->pendat += n;
+    *outp += n;
+    *outlenp -= n;
+
+    return cb->pendat == cb->pendlen;
+}
+
+/* Take input.  Returns 1 if a batch is ready to be compressed */
+static int compbatch_fill(struct compbatch *cb, const char **inp,
+                          avsize_t *inlenp, int finish)
+{
+    avsize_t n = AV_MIN(cb->threads * cb->chunksize - cb->inlen, *inlenp);
+
+    memcpy(cb->inbuf + cb->inlen, *inp, n);
+    cb->inlen += n;
+    *inp += n;
+    *inlenp -= n;
+
+    return cb->inlen == cb->threads * cb->chunksize ||
+        (finish && *inlenp == 0);
+}
+
+static void *compbatch_worker_run(void *data)
+{
+    struct compworker *w = (struct compworker *) data;
+    unsigned int i;
+
+    for(i = w->first; i < w->cb->nchunks; i += w->step)
+        w->cb->compress(&w->cb->chunks[i]);
+
+    return NULL;
+}
+
+/* Compress the collected input, the last chunk ending the stream if
+   'last' is set */
+static int compbatch_run(struct compbatch *cb, int last)
+{
+    unsigned int i;
+    unsigned int threads;
+    unsigned int started;
+    avsize_t off;
+    struct compworker workers[COMPRESS_THREADS_MAX];
+
+    off = 0;
+    cb->nchunks = 0;
+    do {
+        struct compchunk *ch = &cb->chunks[cb->nchunks++];
+
+        ch->in = cb->inbuf + off;
+        ch->inlen = AV_MIN(cb->chunksize, cb->inlen - off);
+        ch->last = 0;
+        ch->out = NULL;
+        ch->outlen = 0;
+        ch->res = 0;
+        off += ch->inlen;
+    } while(off < cb->inlen);
+    cb->chunks[cb->nchunks - 1].last = last;
+
+    /* There is at least one chunk and one thread, the first worker is
+       run by the caller */
+    threads = AV_MIN(cb->threads, cb->nchunks);
+    workers[0].cb = cb;
+    workers[0].first = 0;
+    workers[0].step = threads;
+    for(i = 1; i < threads; i++) {
+        workers[i].cb = cb;
+        workers[i].first = i;
+        workers[i].step = threads;
+    }
+    for(started = 1; started < threads; started++) {
+        if(pthread_create(&workers[started].thread, NULL,
+                          compbatch_worker_run, &workers[started]) != 0)
+            break;
+    }
+    /* Whatever could not be handed to a thread is done here */
+    for(i = started; i < threads; i++)
+        compbatch_worker_run(&workers[i]);
+    compbatch_worker_run(&workers[0]);
+    for(i = 1; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    for(i = 0; i < cb->nchunks; i++) {
+        if(cb->chunks[i].res < 0)
+            return cb->chunks[i].res;
+    }
+
+    return 0;
+}
+
+/* ---------------- gzip ---------------- */
+
+#define GZHEADER_SIZE 10
+#define GZFOOTER_SIZE 8
+
+#define GZMAGIC1 0x1f
+#define GZMAGIC2 0x8b
+
+#define GZMETHOD_DEFLATE 8
+#define GZOS_UNIX 3
+
+#define GZFL_CONTINUATION 0x02
+#define GZFL_EXTRA_FIELD  0x04
+#define GZFL_ORIG_NAME    0x08
+#define GZFL_COMMENT      0x10
+#define GZFL_RESERVED     0xE0
+
+#define BI(ptr, i)  ((avbyte) (ptr)[i])
+#define DBYTE(ptr) (BI(ptr,0) | (BI(ptr,1)<<8))
+#define QBYTE(ptr) ((avuint) (BI(ptr,0) | (BI(ptr,1)<<8) | \
+                   (BI(ptr,2)<<16) | (BI(ptr,3)<<24)))
+
+/* Member phases */
+#define GZ_HEADER  0
+#define GZ_DATA    1
+#define GZ_TRAILER 2
+#define GZ_END     3
+
+/* Header steps */
+#define HS_FIXED   0
+#define HS_CONT    1
+#define HS_XLEN    2
+#define HS_EXTRA   3
+#define HS_NAME    4
+#define HS_COMMENT 5
+#define HS_DONE    6
+
+struct gunzipstate {
+    z_stream s;
+    int phase;
+    int hstep;
+    int members;
+    int flags;
+    unsigned int hdrlen;
+    unsigned int skip;
+    avbyte hdr[GZHEADER_SIZE];
+    avuint crc;
+    avuint size;
+};
+
+/* Size of the pieces compressed in parallel */
+#define GZIP_CHUNKSIZE (1024 * 1024)
+
+struct gzipstate {
+    z_stream s;
+    int phase;
+    unsigned int pendat;
+    unsigned int pendlen;
+    avbyte pend[GZHEADER_SIZE];
+    avuint crc;
+    avuint size;
+    struct compbatch *batch;
+};
+
+static void codec_put_qbyte(avbyte *buf, avuint val)
+{
+    buf[0] = val & 0xff;
+    buf[1] = (val >> 8) & 0xff;
+    buf[2] = (val >> 16) & 0xff;
+    buf[3] = (val >> 24) & 0xff;
+}
+
+static int gunzip_init(void **statep)
+{
+    int res;
+    struct gunzipstate *st;
+
+    AV_NEW(st);
+    memset(&st->s, 0, sizeof(st->s));
+    res = inflateInit2(&st->s, -MAX_WBITS);
+    if(res != Z_OK) {
+        av_log(AVLOG_ERROR, "GUNZIP: inflateInit: %s (%i)",
+               st->s.msg == NULL ? "" : st->s.msg, res);
+        av_free(st);
+        return -EIO;
+    }
+    st->phase = GZ_HEADER;
+    st->hstep = HS_FIXED;
+    st->members = 0;
+    st->hdrlen = 0;
+
+    *statep = st;
+    return 0;
+}
+
+static void gunzip_end(void *state)
+{
+    struct gunzipstate *st = (struct gunzipstate *) state;
+
+    inflateEnd(&st->s);
+    av_free(st);
+}
+
+static int gunzip_check_header(struct gunzipstate *st)
+{
+    if(st->hdr[0] != GZMAGIC1 || st->hdr[1] != GZMAGIC2) {
+        av_log(AVLOG_ERROR, "GUNZIP: File not in GZIP format");
+        return -EIO;
+    }
+    if(st->hdr[2] != GZMETHOD_DEFLATE) {
+        av_log(AVLOG_ERROR, "GUNZIP: File compression is not DEFLATE");
+        return -EIO;
+    }
+    if((st->hdr[3] & GZFL_RESERVED) != 0) {
+        av_log(AVLOG_ERROR, "GUNZIP: Unknown flags");
+        return -EIO;
+    }
+    st->flags = st->hdr[3];
+
+    return 0;
+}
+
+/* Parse the member header incrementally.  Returns 1 if the header is
+   complete, 0 if more input is needed */
+static int gunzip_header(struct gunzipstate *st, const char **inp,
+                         avsize_t *inlenp)
+{
+    int res;
+    avbyte c;
+
+    while(st->hstep != HS_DONE) {
+        if(st->hstep == HS_CONT && !(st->flags & GZFL_CONTINUATION)) {
+            st->hstep = HS_XLEN;
+            continue;
+        }
+        if(st->hstep == HS_XLEN && !(st->flags & GZFL_EXTRA_FIELD)) {
+            st->hstep = HS_NAME;
+            continue;
+        }
+        if(st->hstep == HS_EXTRA && st->skip == 0) {
+            st->hstep = HS_NAME;
+            continue;
+        }
+        if(st->hstep == HS_NAME && !(st->flags & GZFL_ORIG_NAME)) {
+            st->hstep = HS_COMMENT;
+            continue;
+        }
+        if(st->hstep == HS_COMMENT && !(st->flags & GZFL_COMMENT)) {
+            st->hstep = HS_DONE;
+            continue;
+        }
+
+        if(*inlenp == 0)
+            return 0;
+
+        c = (avbyte) **inp;
+        (*inp)++;
+        (*inlenp)--;
+
+        switch(st->hstep) {
+        case HS_FIXED:
+            st->hdr[st->hdrlen++] = c;
+            if(st->hdrlen == GZHEADER_SIZE) {
+                res = gunzip_check_header(st);
+                if(res < 0)
+                    return res;
+                st->hdrlen = 0;
+                st->hstep = HS_CONT;
+            }
+            break;
+
+        case HS_CONT:
+            /* Part number of multi-part file */
+            st->hdrlen++;
+            if(st->hdrlen == 2) {
+                st->hdrlen = 0;
+                st->hstep = HS_XLEN;
+            }
+            break;
+
+        case HS_XLEN:
+            st->hdr[st->hdrlen++] = c;
+            if(st->hdrlen == 2) {
+                st->skip = DBYTE(st->hdr);
+                st->hdrlen = 0;
+                st->hstep = HS_EXTRA;
+            }
+            break;
+
+        case HS_EXTRA:
+            st->skip--;
+            break;
+
+        case HS_NAME:
+            if(c == '\0')
+                st->hstep = HS_COMMENT;
+            break;
+
+        case HS_COMMENT:
+            if(c == '\0')
+                st->hstep = HS_DONE;
+            break;
+        }
+    }
+
+    return 1;
+}
+
+static int gunzip_trailer(struct gunzipstate *st, const char **inp,
+                          avsize_t *inlenp)
+{
+    while(st->hdrlen < GZFOOTER_SIZE) {
+        if(*inlenp == 0)
+            return 0;
+
+        st->hdr[st->hdrlen++] = (avbyte) **inp;
+        (*inp)++;
+        (*inlenp)--;
+    }
+
+    if(QBYTE(st->hdr) != st->crc) {
+        av_log(AVLOG_ERROR, "GUNZIP: CRC error");
+        return -EIO;
+    }
+    if(QBYTE(st->hdr + 4) != st->size) {
+        av_log(AVLOG_ERROR, "GUNZIP: Length error");
+        return -EIO;
+    }
+
+    return 1;
+}
+
+static int gunzip_inflate(struct gunzipstate *st, const char **inp,
+                          avsize_t *inlenp, char **outp, avsize_t *outlenp,
+                          int finish)
+{
+    int res;
+    avsize_t produced;
+
+    st->s.next_in = (Bytef *) *inp;
+    st->s.avail_in = *inlenp;
+    st->s.next_out = (Bytef *) *outp;
+    st->s.avail_out = *outlenp;
+
+    res = inflate(&st->s, Z_NO_FLUSH);
+
+    produced = (char *) st->s.next_out - *outp;
+    st->crc = av_crc32(st->crc, *outp, produced);
+    st->size += produced;
+
+    *inp = (const char *) st->s.next_in;
+    *inlenp = st->s.avail_in;
+    *outp = (char *) st->s.next_out;
+    *outlenp = st->s.avail_out;
+
+    if(res == Z_STREAM_END)
+        return 1;
+
+    if(res == Z_BUF_ERROR || (res == Z_OK && produced == 0 &&
+                              *inlenp == 0)) {
+        if(finish && *inlenp == 0 && produced == 0) {
+            av_log(AVLOG_ERROR, "GUNZIP: Premature end of file");
+            return -EIO;
+        }
+        return 0;
+    }
+    if(res != Z_OK) {
+        av_log(AVLOG_ERROR, "GUNZIP: inflate: %s (%i)",
+               st->s.msg == NULL ? "" : st->s.msg, res);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int gunzip_process(void *state, const char **inp, avsize_t *inlenp,
+                          char **outp, avsize_t *outlenp, int finish)
+{
+    int res;
+    struct gunzipstate *st = (struct gunzipstate *) state;
+
+    while(1) {
+        switch(st->phase) {
+        case GZ_HEADER:
+            if(st->members != 0 && st->hstep == HS_FIXED &&
+               st->hdrlen == 0) {
+                if(*inlenp == 0) {
+                    if(!finish)
+                        return 0;
+
+                    st->phase = GZ_END;
+                    break;
+                }
+                if((avbyte) **inp != GZMAGIC1) {
+                    av_log(AVLOG_WARNING,
+                           "GUNZIP: trailing garbage ignored");
+                    st->phase = GZ_END;
+                    break;
+                }
+            }
+            res = gunzip_header(st, inp, inlenp);
+            if(res < 0)
+                return res;
+            if(res == 0) {
+                if(!finish)
+                    return 0;
+
+                av_log(AVLOG_ERROR, "GUNZIP: Premature end of file");
+                return -EIO;
+            }
+
+            inflateReset(&st->s);
+            st->crc = crc32(0L, Z_NULL, 0);
+            st->size = 0;
+            st->members++;
+            st->phase = GZ_DATA;
+            break;
+
+        case GZ_DATA:
+            if(*outlenp == 0 || (*inlenp == 0 && !finish))
+                return 0;
+
+            res = gunzip_inflate(st, inp, inlenp, outp, outlenp, finish);
+            if(res < 0)
+                return res;
+            if(res == 1) {
+                st->hdrlen = 0;
+                st->phase = GZ_TRAILER;
+            }
+            else if(*outlenp == 0 || *inlenp == 0)
+                return 0;
+            break;
+
+        case GZ_TRAILER:
+            res = gunzip_trailer(st, inp, inlenp);
+            if(res < 0)
+                return res;
+            if(res == 0) {
+                if(!finish)
+                    return 0;
+
+                av_log(AVLOG_ERROR, "GUNZIP: Premature end of file");
+                return -EIO;
+            }
+
+            st->hdrlen = 0;
+            st->hstep = HS_FIXED;
+            st->phase = GZ_HEADER;
+            break;
+
+        case GZ_END:
+            *inp += *inlenp;
+            *inlenp = 0;
+            return finish ? 1 : 0;
+        }
+    }
+}
+
+static void gzip_put_header(avbyte *buf)
+{
+    buf[0] = GZMAGIC1;
+    buf[1] = GZMAGIC2;
+    buf[2] = GZMETHOD_DEFLATE;
+    buf[3] = 0;
+    codec_put_qbyte(buf + 4, 0);
+    buf[8] = 0;
+    buf[9] = GZOS_UNIX;
+}
+
+/* Each chunk is compressed on its own and ends at a byte boundary with
+   a sync flush (or with the final block), so the results can simply be
+   concatenated into a single deflate stream */
+static void gzip_compress_chunk(struct compchunk *ch)
+{
+    int res;
+    z_stream s;
+    avsize_t size = ch->inlen + ch->inlen / 1000 + 64;
+
+    memset(&s, 0, sizeof(s));
+    res = deflateInit2(&s, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                       Z_DEFAULT_STRATEGY);
+    if(res != Z_OK) {
+        ch->res = -EIO;
+        return;
+    }
+
+    ch->out = av_malloc(size);
+    s.next_in = (Bytef *) ch->in;
+    s.avail_in = ch->inlen;
+    s.next_out = (Bytef *) ch->out;
+    s.avail_out = size;
+    while(1) {
+        res = deflate(&s, ch->last ? Z_FINISH : Z_SYNC_FLUSH);
+        if(res == Z_STREAM_END || (res == Z_OK && !ch->last &&
+                                   s.avail_out != 0))
+            break;
+        if(res != Z_OK && res != Z_BUF_ERROR) {
+            ch->res = -EIO;
+            break;
+        }
+        size *= 2;
+        ch->out = av_realloc(ch->out, size);
+        s.next_out = (Bytef *) ch->out + s.total_out;
+        s.avail_out = size - s.total_out;
+    }
+    ch->outlen = s.total_out;
+    deflateEnd(&s);
+}
+
+static int gzip_init(void **statep)
+{
+    int res;
+    struct gzipstate *st;
+    unsigned int threads = codec_get_threads(&gzip_threads);
+
+    AV_NEW(st);
+    st->phase = GZ_DATA;
+    st->crc = crc32(0L, Z_NULL, 0);
+    st->size = 0;
+
+    if(threads > 1) {
+        st->batch = compbatch_new(threads, GZIP_CHUNKSIZE,
+                                  gzip_compress_chunk);
+        gzip_put_header(st->pend);
+        compbatch_append(st->batch, st->pend, GZHEADER_SIZE);
+        *statep = st;
+        return 0;
+    }
+
+    memset(&st->s, 0, sizeof(st->s));
+    res = deflateInit2(&st->s, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if(res != Z_OK) {
+        av_log(AVLOG_ERROR, "GZIP: deflateInit: %s (%i)",
+               st->s.msg == NULL ? "" : st->s.msg, res);
+        av_free(st);
+        return -EIO;
+    }
+
+    gzip_put_header(st->pend);
+    st->pendat = 0;
+    st->pendlen = GZHEADER_SIZE;
+
+    *statep = st;
+    return 0;
+}
+
+static void gzip_end(void *state)
+{
+    struct gzipstate *st = (struct gzipstate *) state;
+
+    if(st->batch != NULL)
+        compbatch_free(st->batch);
+    else
+        deflateEnd(&st->s);
+    av_free(st);
+}
+
+static int gzip_process_batch(struct gzipstate *st, const char **inp,
+                              avsize_t *inlenp, char **outp,
+                              avsize_t *outlenp, int finish)
+{
+    int res;
+    unsigned int i;
+    struct compbatch *cb = st->batch;
+
+    while(1) {
+        if(!compbatch_drain(cb, outp, outlenp))
+            return 0;
+
+        if(st->phase == GZ_END)
+            return 1;
+
+        if(!compbatch_fill(cb, inp, inlenp, finish))
+            return 0;
+
+        res = compbatch_run(cb, finish && *inlenp == 0);
+        if(res < 0) {
+            av_log(AVLOG_ERROR, "GZIP: parallel deflate failed");
+            return res;
+        }
+
+        for(i = 0; i < cb->nchunks; i++) {
+            struct compchunk *ch = &cb->chunks[i];
+
+            if(ch->inlen != 0)
+                st->crc = av_crc32(st->crc, ch->in, ch->inlen);
+            st->size += ch->inlen;
+            compbatch_append(cb, ch->out, ch->outlen);
+
+            if(ch->last) {
+                codec_put_qbyte(st->pend, st->crc);
+                codec_put_qbyte(st->pend + 4, st->size);
+                compbatch_append(cb, st->pend, GZFOOTER_SIZE);
+                st->phase = GZ_END;
+            }
+        }
+        compbatch_clear(cb);
+    }
+}
+
+static int gzip_process(void *state, const char **inp, avsize_t *inlenp,
+                        char **outp, avsize_t *outlenp, int finish)
+{
+    int res;
+    avsize_t consumed;
+    struct gzipstate *st = (struct gzipstate *) state;
+
+    if(st->batch != NULL)
+        return gzip_process_batch(st, inp, inlenp, outp, outlenp, finish);
+
+    while(1) {
+        if(st->pendat < st->pendlen) {
+            avsize_t n = AV_MIN(st->pendlen - st->pendat, *outlenp);
+
+            memcpy(*outp, st->pend + st->pendat, n);
+            st->pendat += n;
+            *outp += n;
+            *outlenp -= n;
+            if(st->pendat < st->pendlen)
+                return 0;
+        }
+
+        if(st->phase == GZ_END)
+            return 1;
+
+        if(*outlenp == 0 || (*inlenp == 0 && !finish))
+            return 0;
+
+        st->s.next_in = (Bytef *) *inp;
+        st->s.avail_in = *inlenp;
+        st->s.next_out = (Bytef *) *outp;
+        st->s.avail_out = *outlenp;
+
+        res = deflate(&st->s, finish ? Z_FINISH : Z_NO_FLUSH);
+
+        consumed = (const char *) st->s.next_in - *inp;
+        if(consumed != 0) {
+            /* av_crc32() would restart on the NULL buffer of the final call */
+            st->crc = av_crc32(st->crc, *inp, consumed);
+            st->size += consumed;
+        }
+
+        *inp = (const char *) st->s.next_in;
+        *inlenp = st->s.avail_in;
+        *outp = (char *) st->s.next_out;
+        *outlenp = st->s.avail_out;
+
+        if(res == Z_STREAM_END) {
+            codec_put_qbyte(st->pend, st->crc);
+            codec_put_qbyte(st->pend + 4, st->size);
+            st->pendat = 0;
+            st->pendlen = GZFOOTER_SIZE;
+            st->phase = GZ_END;
+        }
+        else if(res != Z_OK && res != Z_BUF_ERROR) {
+            av_log(AVLOG_ERROR, "GZIP: deflate: %s (%i)",
+                   st->s.msg == NULL ? "" : st->s.msg, res);
+            return -EIO;
+        }
+    }
+}
+
+/* ---------------- bzip2 ---------------- */
+
+struct bunzip2state {
+    bz_stream s;
+    int active;
+    int streams;
+};
+
+static int bunzip2_init(void **statep)
+{
+    struct bunzip2state *st;
+
+    AV_NEW(st);
+    memset(&st->s, 0, sizeof(st->s));
+    st->active = 0;
+    st->streams = 0;
+
+    *statep = st;
+    return 0;
+}
+
+static void bunzip2_end(void *state)
+{
+    struct bunzip2state *st = (struct bunzip2state *) state;
+
+    if(st->active)
+        BZ2_bzDecompressEnd(&st->s);
+    av_free(st);
+}
+
+static int bunzip2_process(void *state, const char **inp, avsize_t *inlenp,
+                           char **outp, avsize_t *outlenp, int finish)
+{
+    int res;
+    struct bunzip2state *st = (struct bunzip2state *) state;
+    const char *origin;
+    char *origout;
+
+    while(1) {
+        if(!st->active) {
+            if(st->streams == -1 || (*inlenp == 0 && st->streams != 0)) {
+                *inp += *inlenp;
+                *inlenp = 0;
+                return finish ? 1 : 0;
+            }
+            if(*inlenp == 0) {
+                if(!finish)
+                    return 0;
+
+                av_log(AVLOG_ERROR, "BUNZIP2: Premature end of file");
+                return -EIO;
+            }
+            if(st->streams != 0 && **inp != 'B') {
+                av_log(AVLOG_WARNING, "BUNZIP2: trailing garbage ignored");
+                st->streams = -1;
+                continue;
+            }
+
+            res = BZ2_bzDecompressInit(&st->s, 0, 0);
+            if(res != BZ_OK) {
+                av_log(AVLOG_ERROR, "BUNZIP2: decompress init error: %i",
+                       res);
+                return -EIO;
+            }
+            st->active = 1;
+        }
+
+        if(*outlenp == 0 || (*inlenp == 0 && !finish))
+            return 0;
+
+        origin = *inp;
+        origout = *outp;
+        st->s.next_in = (char *) *inp;
+        st->s.avail_in = *inlenp;
+        st->s.next_out = *outp;
+        st->s.avail_out = *outlenp;
+
+        res = BZ2_bzDecompress(&st->s);
+
+        *inp = st->s.next_in;
+        *inlenp = st->s.avail_in;
+        *outp = st->s.next_out;
+        *outlenp = st->s.avail_out;
+
+        if(res == BZ_STREAM_END) {
+            BZ2_bzDecompressEnd(&st->s);
+            st->active = 0;
+            st->streams++;
+            continue;
+        }
+        if(res != BZ_OK) {
+            av_log(AVLOG_ERROR, "BUNZIP2: decompress error: %i", res);
+            return -EIO;
+        }
+        if(*inp == origin && *outp == origout) {
+            if(finish) {
+                av_log(AVLOG_ERROR, "BUNZIP2: Premature end of file");
+                return -EIO;
+            }
+            return 0;
+        }
+    }
+}
+
+/* Size of the pieces compressed in parallel.  With the worst case
+   expansion of the initial run length encoding this still fits into
+   a single block at level 9 */
+#define BZIP2_CHUNKSIZE 700000
+
+#define BZ_BLOCKMAGIC_BITS 48
+#define BZ_HEADER_BITS 32
+#define BZ_EOSMAGIC_HI 0x177245
+#define BZ_EOSMAGIC_LO 0x385090
+
+struct bzip2state {
+    bz_stream s;
+    struct compbatch *batch;
+    avuint combined;
+    avuint bitbuf;
+    int bitcount;
+    int ended;
+};
+
+static void bzip2_compress_chunk(struct compchunk *ch)
+{
+    int res;
+    bz_stream s;
+    avsize_t size = ch->inlen + ch->inlen / 100 + 600;
+
+    memset(&s, 0, sizeof(s));
+    res = BZ2_bzCompressInit(&s, 9, 0, 0);
+    if(res != BZ_OK) {
+        ch->res = -EIO;
+        return;
+    }
+
+    ch->out = av_malloc(size);
+    s.next_in = (char *) ch->in;
+    s.avail_in = ch->inlen;
+    s.next_out = ch->out;
+    s.avail_out = size;
+    while(1) {
+        res = BZ2_bzCompress(&s, BZ_FINISH);
+        if(res == BZ_STREAM_END)
+            break;
+        if(res != BZ_FINISH_OK) {
+            ch->res = -EIO;
+            break;
+        }
+        size *= 2;
+        ch->out = av_realloc(ch->out, size);
+        s.next_out = ch->out + s.total_out_lo32;
+        s.avail_out = size - s.total_out_lo32;
+    }
+    ch->outlen = s.total_out_lo32;
+    BZ2_bzCompressEnd(&s);
+}
+
+static avuint bzip2_getbits(const avbyte *buf, avsize_t bit, int n)
+{
+    avuint val = 0;
+
+    for(; n > 0; n--, bit++)
+        val = (val << 1) | ((buf[bit >> 3] >> (7 - (bit & 7))) & 1);
+
+    return val;
+}
+
+/* Append bits to the output, at most 24 at a time */
+static void bzip2_putbits(struct bzip2state *st, avbyte **outp, avuint val,
+                          int n)
+{
+    st->bitbuf = (st->bitbuf << n) | (val & ((1 << n) - 1));
+    st->bitcount += n;
+    while(st->bitcount >= 8) {
+        st->bitcount -= 8;
+        *(*outp)++ = st->bitbuf >> st->bitcount;
+    }
+}
+
+/* Find the end of the block in a single block stream, by looking for
+   the end of stream marker in front of the combined CRC and the
+   padding */
+static int bzip2_find_end(const avbyte *buf, avsize_t len, avsize_t *endp)
+{
+    int pad;
+    avsize_t end;
+
+    for(pad = 0; pad < 8; pad++) {
+        if(len * 8 < BZ_HEADER_BITS + 80 + pad)
+            break;
+        end = len * 8 - pad - 80;
+        if(bzip2_getbits(buf, end, 24) == BZ_EOSMAGIC_HI &&
+           bzip2_getbits(buf, end + 24, 24) == BZ_EOSMAGIC_LO) {
+            *endp = end;
+            return 0;
+        }
+    }
+
+    return -EIO;
+}
+
+/* Move the block of a separately compressed chunk into the output
+   stream.  Blocks are not byte aligned, so this needs shifting */
+static int bzip2_append_block(struct bzip2state *st, struct compchunk *ch)
+{
+    int res;
+    avsize_t bit;
+    avsize_t end;
+    avuint blockcrc;
+    avbyte *tmpbuf;
+    avbyte *out;
+    const avbyte *buf = (const avbyte *) ch->out;
+
+    res = bzip2_find_end(buf, ch->outlen, &end);
+    if(res < 0)
+        return res;
+
+    /* Empty input has no block */
+    if(end == BZ_HEADER_BITS)
+        return 0;
+
+    blockcrc = bzip2_getbits(buf, BZ_HEADER_BITS + BZ_BLOCKMAGIC_BITS, 32);
+    st->combined = ((st->combined << 1) | (st->combined >> 31)) ^ blockcrc;
+
+    tmpbuf = av_malloc((end - BZ_HEADER_BITS) / 8 + 2);
+    out = tmpbuf;
+    bit = BZ_HEADER_BITS;
+    while(bit + 8 <= end) {
+        bzip2_putbits(st, &out, buf[bit >> 3], 8);
+        bit += 8;
+    }
+    if(bit < end)
+        bzip2_putbits(st, &out, bzip2_getbits(buf, bit, end - bit),
+                      end - bit);
+
+    compbatch_append(st->batch, tmpbuf, out - tmpbuf);
+    av_free(tmpbuf);
+
+    return 0;
+}
+
+static void bzip2_append_trailer(struct bzip2state *st)
+{
+    avbyte tmpbuf[16];
+    avbyte *out = tmpbuf;
+
+    bzip2_putbits(st, &out, BZ_EOSMAGIC_HI, 24);
+    bzip2_putbits(st, &out, BZ_EOSMAGIC_LO, 24);
+    bzip2_putbits(st, &out, st->combined >> 16, 16);
+    bzip2_putbits(st, &out, st->combined, 16);
+    if(st->bitcount != 0)
+        bzip2_putbits(st, &out, 0, 8 - st->bitcount);
+
+    compbatch_append(st->batch, tmpbuf, out - tmpbuf);
+}
+
+static int bzip2_init(void **statep)
+{
+    int res;
+    struct bzip2state *st;
+    unsigned int threads = codec_get_threads(&bzip2_threads);
+
+    AV_NEW(st);
+    if(threads > 1) {
+        st->batch = compbatch_new(threads, BZIP2_CHUNKSIZE,
+                                  bzip2_compress_chunk);
+        compbatch_append(st->batch, "BZh9", 4);
+        *statep = st;
+        return 0;
+    }
+
+    memset(&st->s, 0, sizeof(st->s));
+    res = BZ2_bzCompressInit(&st->s, 9, 0, 0);
+    if(res != BZ_OK) {
+        av_log(AVLOG_ERROR, "BZIP2: compress init error: %i", res);
+        av_free(st);
+        return -EIO;
+    }
+
+    *statep = st;
+    return 0;
+}
+
+static void bzip2_end(void *state)
+{
+    struct bzip2state *st = (struct bzip2state *) state;
+
+    if(st->batch != NULL)
+        compbatch_free(st->batch);
+    else
+        BZ2_bzCompressEnd(&st->s);
+    av_free(st);
+}
+
+static int bzip2_process_batch(struct bzip2state *st, const char **inp,
+                               avsize_t *inlenp, char **outp,
+                               avsize_t *outlenp, int finish)
+{
+    int res;
+    unsigned int i;
+    struct compbatch *cb = st->batch;
+
+    while(1) {
+        if(!compbatch_drain(cb, outp, outlenp))
+            return 0;
+
+        if(st->ended)
+            return 1;
+
+        if(!compbatch_fill(cb, inp, inlenp, finish))
+            return 0;
+
+        res = compbatch_run(cb, finish && *inlenp == 0);
+        for(i = 0; res == 0 && i < cb->nchunks; i++) {
+            struct compchunk *ch = &cb->chunks[i];
+
+            res = bzip2_append_block(st, ch);
+            if(res == 0 && ch->last) {
+                bzip2_append_trailer(st);
+                st->ended = 1;
+            }
+        }
+        compbatch_clear(cb);
+        if(res < 0) {
+            av_log(AVLOG_ERROR, "BZIP2: parallel compress failed");
+            return res;
+        }
+    }
+}
+
+static int bzip2_process(void *state, const char **inp, avsize_t *inlenp,
+                         char **outp, avsize_t *outlenp, int finish)
+{
+    int res;
+    struct bzip2state *st = (struct bzip2state *) state;
+    bz_stream *s = &st->s;
+
+    if(st->batch != NULL)
+        return bzip2_process_batch(st, inp, inlenp, outp, outlenp, finish);
+
+    while(1) {
+        if(*outlenp == 0 || (*inlenp == 0 && !finish))
+            return 0;
+
+        s->next_in = (char *) *inp;
+        s->avail_in = *inlenp;
+        s->next_out = *outp;
+        s->avail_out = *outlenp;
+
+        res = BZ2_bzCompress(s, finish ? BZ_FINISH : BZ_RUN);
+
+        *inp = s->next_in;
+        *inlenp = s->avail_in;
+        *outp = s->next_out;
+        *outlenp = s->avail_out;
+
+        if(res == BZ_STREAM_END)
+            return 1;
+        if(res != BZ_RUN_OK && res != BZ_FINISH_OK) {
+            av_log(AVLOG_ERROR, "BZIP2: compress error: %i", res);
+            return -EIO;
+        }
+    }
+}
+
+/* ---------------- xz ---------------- */
+
+#ifdef HAVE_LIBLZMA
+
+static int unxz_init(void **statep)
+{
+    lzma_ret res;
+    lzma_stream *s;
+
+    AV_NEW(s);
+    memset(s, 0, sizeof(*s));
+    res = lzma_auto_decoder(s, UINT64_MAX, LZMA_CONCATENATED);
+    if(res != LZMA_OK) {
+        av_log(AVLOG_ERROR, "UNXZ: decompress init error: %i", res);
+        av_free(s);
+        return -EIO;
+    }
+
+    *statep = s;
+    return 0;
+}
+
+static int xz_init(void **statep)
+{
+    lzma_ret res;
+    lzma_stream *s;
+
+    AV_NEW(s);
+    memset(s, 0, sizeof(*s));
+    res = lzma_easy_encoder(s, 6, LZMA_CHECK_CRC64);
+    if(res != LZMA_OK) {
+        av_log(AVLOG_ERROR, "XZ: compress init error: %i", res);
+        av_free(s);
+        return -EIO;
+    }
+
+    *statep = s;
+    return 0;
+}
+
+static void xz_end(void *state)
+{
+    lzma_stream *s = (lzma_stream *) state;
+
+    lzma_end(s);
+    av_free(s);
+}
+
+static int xz_process(void *state, const char **inp, avsize_t *inlenp,
+                      char **outp, avsize_t *outlenp, int finish)
+{
+    lzma_ret res;
+    lzma_stream *s = (lzma_stream *) state;
+
+    while(1) {
+        if(*outlenp == 0 || (*inlenp == 0 && !finish))
+            return 0;
+
+        s->next_in = (const uint8_t *) *inp;
+        s->avail_in = *inlenp;
+        s->next_out = (uint8_t *) *outp;
+        s->avail_out = *outlenp;
+
+        res = lzma_code(s, finish ? LZMA_FINISH : LZMA_RUN);
+
+        *inp = (const char *) s->next_in;
+        *inlenp = s->avail_in;
+        *outp = (char *) s->next_out;
+        *outlenp = s->avail_out;
+
+        if(res == LZMA_STREAM_END)
+            return 1;
+        if(res == LZMA_BUF_ERROR && finish) {
+            av_log(AVLOG_ERROR, "XZ: Premature end of file");
+            return -EIO;
+        }
+        if(res != LZMA_OK && res != LZMA_BUF_ERROR) {
+            av_log(AVLOG_ERROR, "XZ: lzma_code error: %i", res);
+            return -EIO;
+        }
+    }
+}
+
+#endif /* HAVE_LIBLZMA */
+
+static const struct filtcodec filtcodecs[] = {
+    { "gunzip",  gunzip_init,  gunzip_process,  gunzip_end },
+    { "gzip",    gzip_init,    gzip_process,    gzip_end },
+    { "bunzip2", bunzip2_init, bunzip2_process, bunzip2_end },
+    { "bzip2",   bzip2_init,   bzip2_process,   bzip2_end },
+#ifdef HAVE_LIBLZMA
+    { "unxz",    unxz_init,    xz_process,      xz_end },
+    { "xz",      xz_init,      xz_process,      xz_end },
+#endif
+    { NULL,      NULL,         NULL,            NULL }
+};
+
+const struct filtcodec *av_filtcodec_find(const char *name)
+{
+    const struct filtcodec *codec;
+
+    for(codec = filtcodecs; codec->name != NULL; codec++) {
+        if(strcmp(codec->name, name) == 0)
+            return codec;
+    }
+
+    return NULL;
+}
+
+/* ---------------- serial file ---------------- */
+
+static void codecconn_stop(struct codecconn *cc)
+{
+    if(cc->state != NULL)
+        cc->codec->end(cc->state);
+    av_lseek(cc->fc->vf, 0, AVSEEK_SET);
+}
+
+static int codecconn_start(struct filtcodecfile *fc,
+                           const struct filtcodec *codec,
+                           struct codecconn **resp)
+{
+    int res;
+    void *state;
+    struct codecconn *cc;
+
+    res = codec->init(&state);
+    if(res < 0)
+        return res;
+
+    AV_NEW_OBJ(cc, codecconn_stop);
+    cc->fc = fc;
+    cc->codec = codec;
+    cc->state = state;
+    cc->ineof = 0;
+    cc->done = 0;
+    cc->inat = cc->buf;
+    cc->inlen = 0;
+
+    *resp = cc;
+    return 0;
+}
+
+static int filtcodec_startget(void *data, void **resp)
+{
+    int res;
+    struct filtcodecfile *fc = (struct filtcodecfile *) data;
+    struct codecconn *cc;
+
+    res = codecconn_start(fc, fc->codec, &cc);
+    if(res < 0)
+        return res;
+
+    *resp = cc;
+    return 0;
+}
+
+static avssize_t filtcodec_read(void *data, char *buf, avsize_t nbyte)
+{
+    int res;
+    avssize_t rres;
+    struct codecconn *cc = (struct codecconn *) data;
+    char *out = buf;
+    avsize_t outlen = nbyte;
+
+    while(outlen == nbyte && !cc->done) {
+        if(cc->inlen == 0 && !cc->ineof) {
+            rres = av_read(cc->fc->vf, cc->buf, CODECBUFSIZE);
+            if(rres < 0)
+                return rres;
+            if(rres == 0)
+                cc->ineof = 1;
+
+            cc->inat = cc->buf;
+            cc->inlen = rres;
+        }
+
+        res = cc->codec->process(cc->state, &cc->inat, &cc->inlen,
+                                 &out, &outlen, cc->ineof);
+        if(res < 0)
+            return res;
+        if(res == 1)
+            cc->done = 1;
+    }
+
+    return nbyte - outlen;
+}
+
+static int filtcodec_output(struct codecconn *cc, const char **inp,
+                            avsize_t *inlenp, int finish)
+{
+    int res;
+    avssize_t wres;
+    char *out = cc->buf;
+    avsize_t outlen = CODECBUFSIZE;
+
+    res = cc->codec->process(cc->state, inp, inlenp, &out, &outlen, finish);
+    if(res < 0)
+        return res;
+
+    if(out != cc->buf) {
+        wres = av_write(cc->fc->vf, cc->buf, out - cc->buf);
+        if(wres < 0)
+            return wres;
+    }
+
+    return res;
+}
+
+static int filtcodec_startput(void *data, void **resp)
+{
+    int res;
+    struct filtcodecfile *fc = (struct filtcodecfile *) data;
+    struct codecconn *cc;
+
+    if(fc->revcodec == NULL)
+        return -EROFS;
+
+    res = av_ftruncate(fc->vf, 0);
+    if(res < 0)
+        return res;
+
+    res = codecconn_start(fc, fc->revcodec, &cc);
+    if(res < 0)
+        return res;
+
+    *resp = cc;
+    return 0;
+}
+
+static avssize_t filtcodec_write(void *data, const char *buf, avsize_t nbyte)
+{
+    int res;
+    struct codecconn *cc = (struct codecconn *) data;
+    const char *in = buf;
+    avsize_t inlen = nbyte;
+
+    while(inlen != 0) {
+        res = filtcodec_output(cc, &in, &inlen, 0);
+        if(res < 0)
+            return res;
+    }
+
+    return nbyte;
+}
+
+static int filtcodec_endput(void *data)
+{
+    int res;
+    struct codecconn *cc = (struct codecconn *) data;
+    const char *in = NULL;
+    avsize_t inlen = 0;
+
+    do {
+        res = filtcodec_output(cc, &in, &inlen, 1);
+        if(res < 0)
+            return res;
+    } while(res == 0);
+
+    return 0;
+}
+
+struct sfile *av_filtcodec_new(vfile *vf, const struct filtcodec *codec,
+                               const struct filtcodec *revcodec)
+{
+    struct filtcodecfile *fc;
+    struct sfile *sf;
+    static const struct sfilefuncs func = {
+        filtcodec_startget,
+        filtcodec_read,
+        filtcodec_startput,
+        filtcodec_write,
+        filtcodec_endput
+    };
+
+    AV_NEW_OBJ(fc, NULL);
+    fc->vf = vf;
+    fc->codec = codec;
+    fc->revcodec = revcodec;
+
+    sf = av_sfile_new(&func, fc, 0);
+
+    return sf;
+}
+
+void av_filtcodec_change(struct sfile *sf, vfile *newvf)
+{
+    struct filtcodecfile *fc = (struct filtcodecfile *) av_sfile_getdata(sf);
+
+    fc->vf = newvf;
+}
+
+void av_init_filtcodecstat()
+{
+    av_avfsstat_register_int("gzip/threads", &gzip_threads, &filtcodec_lock,
+                             0, COMPRESS_THREADS_MAX, NULL);
+    av_avfsstat_register_int("bzip2/threads", &bzip2_threads, &filtcodec_lock,
+                             0, COMPRESS_THREADS_MAX, NULL);
+}
@@ -0,0 +1,31 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "avfs.h"
+
+struct sfile;
+
+/* In-process replacement for a filter program.  'process' consumes
+   input from *inp and produces output into *outp, advancing both.
+   'finish' is set once all input has been passed in.  Returns
+   negative error, 0 if more input or output space is needed, and 1
+   when the stream has been completely produced */
+struct filtcodec {
+    const char *name;
+    int (*init) (void **statep);
+    int (*process) (void *state, const char **inp, avsize_t *inlenp,
+                    char **outp, avsize_t *outlenp, int finish);
+    void (*end) (void *state);
+};
+
+const struct filtcodec *av_filtcodec_find(const char *name);
+
+struct sfile *av_filtcodec_new(vfile *vf, const struct filtcodec *codec,
+                               const struct filtcodec *revcodec);
+void av_filtcodec_change(struct sfile *sf, vfile *newvf);
+
+void av_init_filtcodecstat();
@@ -9,10 +9,12 @@
 #include "filter.h"
 #include "version.h"
 #include "filtprog.h"
+#include "filtcodec.h"
 #include "filecache.h"
 #include "cache.h"
 #include "internal.h"
 #include "oper.h"
+#include "exit.h"
 
 /* FIXME: If there was an error in read, this shouldn't be kept in cache */
 
@@ -137,6 +139,23 @@ static void filt_mod_set(struct filtmod *mod, struct avstat *stbuf)
 }
 
 
+static struct sfile *filt_new_sfile(vfile *vf, struct filtdata *filtdat)
+{
+    if(filtdat->codec != NULL)
+        return av_filtcodec_new(vf, filtdat->codec, filtdat->revcodec);
+    else
+        return av_filtprog_new(vf, filtdat);
+}
+
+static void filt_change_sfile(struct sfile *sf, vfile *newvf,
+                              struct filtdata *filtdat)
+{
+    if(filtdat->codec != NULL)
+        av_filtcodec_change(sf, newvf);
+    else
+        av_filtprog_change(sf, newvf);
+}
+
 static void filt_newnode(struct filtfile *ff, ventry *ve, vfile *vf,
                          const char *key, struct avstat *buf)
 {
@@ -146,7 +165,7 @@ static void filt_newnode(struct filtfile *ff, ventry *ve, vfile *vf,
     AV_NEW_OBJ(nod, filtnode_free);
     AV_INITLOCK(nod->lock);
     nod->vf = vf;
-    nod->sf = av_filtprog_new(vf, filtdat);
+    nod->sf = filt_new_sfile(vf, filtdat);
     filt_id_set(&nod->id, buf);
     filt_mod_set(&nod->mod, buf);
     nod->ino = av_new_ino(ve->mnt->avfs);
@@ -162,12 +181,12 @@ static void filt_newnode(struct filtfile *ff, ventry *ve, vfile *vf,
 static int filt_validate_file(struct filtnode *nod, ventry *ve, vfile *vf,
                               struct avstat *buf, int iswrite)
 {
+    struct filtdata *filtdat = (struct filtdata *) ve->mnt->avfs->data;
+
     if(nod->writers == 0 && !filt_unmodif_file(&nod->mod, buf)) {
-        struct filtdata *filtdat = (struct filtdata *) ve->mnt->avfs->data;
-        
         av_unref_obj(nod->sf);
         av_close(nod->vf);
-        nod->sf = av_filtprog_new(vf, filtdat);
+        nod->sf = filt_new_sfile(vf, filtdat);
         nod->vf = vf;
         filt_mod_set(&nod->mod, buf);
     }
@@ -180,7 +199,7 @@ static int filt_validate_file(struct filtnode *nod, ventry *ve, vfile *vf,
         if(pos < 0)
             return pos;
         
-        av_filtprog_change(nod->sf, vf);
+        filt_change_sfile(nod->sf, vf, filtdat);
         av_close(nod->vf);
         nod->vf = vf;
     }
@@ -389,6 +408,19 @@ static int filt_truncate(vfile *vf, avoff_t length)
     return res;
 }
 
+static int filt_linkfile(vfile *vf, const char *path)
+{
+    int res;
+    struct filtfile *ff = (struct filtfile *) vf->data;
+    struct filtnode *nod = ff->nod;
+    
+    AV_LOCK(nod->lock);
+    res = av_sfile_linkfile(nod->sf, path);
+    AV_UNLOCK(nod->lock);
+
+    return res;
+}
+
 static void filt_afterflush(vfile *vf, struct filtnode *nod)
 {
     int res;
@@ -535,6 +567,8 @@ int av_init_filt(struct vmodule *module, int version, const char *name,
     AV_NEW(filtdat);
     filtdat->prog = filt_copy_prog(prog);
     filtdat->revprog = filt_copy_prog(revprog);
+    filtdat->codec = NULL;
+    filtdat->revcodec = NULL;
 
     avfs->data = filtdat;
 
@@ -550,6 +584,7 @@ int av_init_filt(struct vmodule *module, int version, const char *name,
     avfs->getattr  = filt_getattr;
     avfs->setattr  = filt_setattr;
     avfs->truncate = filt_truncate;
+    avfs->linkfile = filt_linkfile;
 
     av_add_avfs(avfs);
     
@@ -557,3 +592,40 @@ int av_init_filt(struct vmodule *module, int version, const char *name,
 
     return 0;
 }
+
+static int filt_statinit = 0;
+
+/* #avfsstat is created again when the library is initialized again */
+static void filt_statexit()
+{
+    filt_statinit = 0;
+}
+
+void av_filt_set_codecs(struct avfs *avfs, const char *codec,
+                        const char *revcodec)
+{
+    struct filtdata *filtdat = (struct filtdata *) avfs->data;
+    const struct filtcodec *c;
+    const struct filtcodec *rc = NULL;
+
+    /* The modules are initialized one at a time, so this needs no lock */
+    if(!filt_statinit) {
+        av_init_filtcodecstat();
+        av_add_exithandler(filt_statexit);
+        filt_statinit = 1;
+    }
+
+    /* Keep using the programs if the codecs are not compiled in */
+    c = av_filtcodec_find(codec);
+    if(c == NULL)
+        return;
+
+    if(revcodec != NULL) {
+        rc = av_filtcodec_find(revcodec);
+        if(rc == NULL)
+            return;
+    }
+
+    filtdat->codec = c;
+    filtdat->revcodec = rc;
+}
@@ -9,9 +9,13 @@
 #include "avfs.h"
 #include "serialfile.h"
 
+struct filtcodec;
+
 struct filtdata {
     char **prog;
     char **revprog;
+    const struct filtcodec *codec;
+    const struct filtcodec *revcodec;
 };
 
 struct sfile *av_filtprog_new(vfile *vf, struct filtdata *fitdat);
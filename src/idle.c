@@ -0,0 +1,196 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* The decompressors keep the state of the last used stream, so that
+   seeking back is cheap.  This can be several megabytes (e.g. for
+   bzip2), so a thread releases these states if they are not used for
+   a while. */
+
+#include "idle.h"
+#include "internal.h"
+#include "exit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_IDLE_TIMEOUT 60
+
+/* The longest time in seconds between two checks */
+#define IDLE_CHECK_INTERVAL 10
+
+struct idlehandler {
+    const char *name;
+    avoff_t (*func)(avtime_t expire);
+    struct idlehandler *next;
+};
+
+static AV_LOCK_DECL(idle_lock);
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t idle_thread;
+static int idle_running = 0;
+static int idle_stop = 0;
+
+/* Handlers are never removed, so the list can be walked without
+   holding idle_lock */
+static struct idlehandler *idle_handlers = NULL;
+
+/* Seconds of inactivity after which saved state is released, 0 keeps
+   it forever.  Protected by idle_lock. */
+static avoff_t idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+static void idle_release(avtime_t expire)
+{
+    struct idlehandler *hand;
+
+    AV_LOCK(idle_lock);
+    hand = idle_handlers;
+    AV_UNLOCK(idle_lock);
+
+    for(; hand != NULL; hand = hand->next)
+        hand->func(expire);
+}
+
+static void *idle_reaper(void *data)
+{
+    avoff_t timeout;
+    struct timespec ts;
+
+    AV_LOCK(idle_lock);
+    while(!idle_stop) {
+        timeout = idle_timeout;
+        if(timeout == 0 || timeout > IDLE_CHECK_INTERVAL)
+            timeout = IDLE_CHECK_INTERVAL;
+
+        ts.tv_sec = av_time() + timeout;
+        ts.tv_nsec = 0;
+        pthread_cond_timedwait(&idle_cond, &idle_lock, &ts);
+
+        timeout = idle_timeout;
+        if(!idle_stop && timeout != 0) {
+            AV_UNLOCK(idle_lock);
+            idle_release(av_time() - timeout);
+            AV_LOCK(idle_lock);
+        }
+    }
+    AV_UNLOCK(idle_lock);
+
+    return NULL;
+}
+
+/* Must be called with idle_lock held */
+static void idle_start()
+{
+    int res;
+
+    if(idle_running || idle_stop || idle_handlers == NULL)
+        return;
+
+    res = pthread_create(&idle_thread, NULL, idle_reaper, NULL);
+    if(res != 0) {
+        av_log(AVLOG_ERROR, "Failed to start idle thread: %s", strerror(res));
+        return;
+    }
+    idle_running = 1;
+}
+
+static void idle_exit()
+{
+    int running;
+
+    AV_LOCK(idle_lock);
+    idle_stop = 1;
+    running = idle_running;
+    idle_running = 0;
+    pthread_cond_signal(&idle_cond);
+    AV_UNLOCK(idle_lock);
+
+    if(running)
+        pthread_join(idle_thread, NULL);
+}
+
+void av_add_idlehandler(const char *name, avoff_t (*func)(avtime_t expire))
+{
+    struct idlehandler *hand;
+    struct idlehandler **hp;
+
+    AV_NEW(hand);
+    hand->name = name;
+    hand->func = func;
+    hand->next = NULL;
+
+    AV_LOCK(idle_lock);
+    for(hp = &idle_handlers; *hp != NULL; hp = &(*hp)->next);
+    *hp = hand;
+    idle_start();
+    AV_UNLOCK(idle_lock);
+}
+
+static void idle_timeout_changed()
+{
+    pthread_cond_signal(&idle_cond);
+}
+
+static int idle_get_memory(struct entry *ent, const char *param, char **retp)
+{
+    char buf[128];
+    char *ret;
+    struct idlehandler *hand;
+
+    AV_LOCK(idle_lock);
+    hand = idle_handlers;
+    AV_UNLOCK(idle_lock);
+
+    ret = av_strdup("");
+    for(; hand != NULL; hand = hand->next) {
+        sprintf(buf, "%s: %llu\n", hand->name, hand->func(0));
+        ret = av_stradd(ret, buf, NULL);
+    }
+
+    *retp = ret;
+    return 0;
+}
+
+static int idle_set_release(struct entry *ent, const char *param,
+                            const char *val)
+{
+    if(strlen(val) > 0)
+        idle_release(AV_MAXTIME);
+
+    return 0;
+}
+
+static int idle_get_release(struct entry *ent, const char *param, char **retp)
+{
+    *retp = av_strdup("");
+    return 0;
+}
+
+void av_init_idle()
+{
+    struct statefile statf;
+
+    av_avfsstat_register_int("streamcache/idle_timeout", &idle_timeout,
+                             &idle_lock, 0, AV_MAXOFF, idle_timeout_changed);
+
+    statf.data = NULL;
+    statf.get = idle_get_memory;
+    statf.set = NULL;
+    av_avfsstat_register("streamcache/memory", &statf);
+
+    statf.get = idle_get_release;
+    statf.set = idle_set_release;
+    av_avfsstat_register("streamcache/release", &statf);
+
+    /* Handlers registered before a previous shutdown are still there */
+    AV_LOCK(idle_lock);
+    idle_stop = 0;
+    idle_start();
+    AV_UNLOCK(idle_lock);
+
+    av_add_exithandler(idle_exit);
+}
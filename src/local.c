@@ -231,6 +231,27 @@ static int local_getattr(vfile *vf, struct avstat *buf, int attrmask)
     return 0;
 }
 
+static int local_getfd(vfile *vf, avoff_t *offsetp, avoff_t *sizep)
+{
+    struct stat stbuf;
+    struct localfile *fi = local_vfile_file(vf);
+
+    if(fi->fd == -1)
+        return -EISDIR;
+
+    if(fstat(fi->fd, &stbuf) == -1)
+        return -errno;
+
+    /* pread() is not possible on pipes, devices, etc. */
+    if(!S_ISREG(stbuf.st_mode))
+        return -ENOSYS;
+
+    *offsetp = 0;
+    *sizep = stbuf.st_size;
+
+    return fi->fd;
+}
+
 static int local_set_time(struct localfile *fi, const struct avstat *buf,
                           int attrmask)
 {
@@ -477,6 +498,7 @@ int av_init_module_local()
     avfs->link       = local_link;
     avfs->symlink    = local_symlink;
     avfs->truncate   = local_truncate;
+    avfs->getfd      = local_getfd;
 
     av_add_avfs(avfs);
     
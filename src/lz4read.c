@@ -0,0 +1,1123 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    based on zstdread.c
+*/
+
+/* The LZ4 frame format is parsed here and only the block decoder of
+   liblz4 is used.  This way block boundaries are known, which allows
+   random access checkpoints and decoding independent blocks on
+   several threads. */
+
+#include "config.h"
+#include "lz4file.h"
+#include "lz4.h"
+#include "oper.h"
+#include "internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Block starts are only remembered if they are at least this far
+   apart in the output */
+#define INDEXDISTANCE 1048576
+
+/* Sequential reads decode about this much per thread in one go, but
+   not more than BATCHMAX altogether */
+#define BATCHSIZE 1048576
+#define BATCHMAX (32 * 1048576)
+#define LZ4_THREADS_MAX 64
+
+#define LZ4_MAGIC            0x184D2204
+#define LZ4_LEGACY_MAGIC     0x184C2102
+#define LZ4_LEGACY_BLOCKMAX  (8 * 1048576)
+#define LZ4_SKIPPABLE_MAGIC  0x184D2A50
+#define LZ4_SKIPPABLE_MASK   0xFFFFFFF0
+#define LZ4_HEADER_MAX       19
+#define LZ4_HISTORY          65536
+#define LZ4_UNCOMPRESSED     0x80000000U
+
+/* The index scan reads the headers through a buffer of this size */
+#define SCANBUFSIZE 16384
+
+#define FLG_BLOCK_INDEP      0x20
+#define FLG_BLOCK_CHECKSUM   0x10
+#define FLG_CONTENT_SIZE     0x08
+#define FLG_CONTENT_CHECKSUM 0x04
+#define FLG_LEGACY           0x02 /* Reserved in frames, used internally */
+#define FLG_DICTID           0x01
+
+#define XXH_PRIME1 2654435761U
+#define XXH_PRIME2 2246822519U
+#define XXH_PRIME3 3266489917U
+#define XXH_PRIME4  668265263U
+#define XXH_PRIME5  374761393U
+
+static AV_LOCK_DECL(lz4read_lock);
+
+/* Tunable in #avfsstat/lz4, protected by lz4read_lock.  With threads
+   set to 0 the number of processors is used. */
+static avoff_t lz4_threads = 1;
+
+struct lz4index {
+    avoff_t inoff;           /* Start of the frame or block in the input */
+    avoff_t offset;          /* The number of output bytes */
+    int blockstart;          /* Inside a frame, flg and bd are valid */
+    avbyte flg;
+    avbyte bd;
+};
+
+struct lz4cache {
+    avoff_t size;
+    avmutex lock;
+    int indexread;
+    unsigned int numindex;
+    unsigned int allocindex;
+    struct lz4index *indexes;
+};
+
+struct lz4xxh {
+    avuquad total;
+    avuint v[4];
+    avbyte mem[16];
+    avsize_t memsize;
+};
+
+struct lz4block {
+    const char *src;
+    avsize_t srclen;
+    int raw;
+    int checksum;
+    avuint sum;
+    char *dst;
+    avsize_t dstlen;
+    int res;
+};
+
+struct lz4worker {
+    pthread_t thread;
+    struct lz4block *blocks;
+    unsigned int first;
+    unsigned int num;
+    unsigned int step;
+};
+
+struct lz4file {
+    int iseof;
+    int iserror;
+    int indexchecked;
+    avoff_t lastend;         /* End of the previous read */
+    int seqreads;            /* Number of sequential reads in a row */
+
+    /* The frame being decoded */
+    int inframe;
+    avbyte flg;
+    avbyte bd;
+    avsize_t blockmax;
+    avsize_t cblockmax;      /* Largest compressed block */
+    int checkcontent;        /* Decoding started at the frame start */
+    struct lz4xxh xxh;
+
+    avoff_t inoff;           /* Next frame or block header in the input */
+    char *buf;               /* Decoded data, with history if linked */
+    avsize_t bufsize;
+    avoff_t bufoff;          /* Output offset of buf[0] */
+    avsize_t buflen;
+    char *cbuf;              /* Compressed blocks */
+    avsize_t cbufsize;
+
+    vfile *infile;
+};
+
+static avuint lz4_le32(const avbyte *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((avuint) p[3] << 24);
+}
+
+static avuint xxh_rotl(avuint x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+static avuint xxh_round(avuint acc, avuint input)
+{
+    acc += input * XXH_PRIME2;
+    acc = xxh_rotl(acc, 13);
+    return acc * XXH_PRIME1;
+}
+
+static void xxh_init(struct lz4xxh *x)
+{
+    x->total = 0;
+    x->v[0] = XXH_PRIME1 + XXH_PRIME2;
+    x->v[1] = XXH_PRIME2;
+    x->v[2] = 0;
+    x->v[3] = -XXH_PRIME1;
+    x->memsize = 0;
+}
+
+static void xxh_stripe(struct lz4xxh *x, const avbyte *p)
+{
+    x->v[0] = xxh_round(x->v[0], lz4_le32(p));
+    x->v[1] = xxh_round(x->v[1], lz4_le32(p + 4));
+    x->v[2] = xxh_round(x->v[2], lz4_le32(p + 8));
+    x->v[3] = xxh_round(x->v[3], lz4_le32(p + 12));
+}
+
+static void xxh_update(struct lz4xxh *x, const void *data, avsize_t len)
+{
+    const avbyte *p = (const avbyte *) data;
+
+    x->total += len;
+    if(x->memsize + len < 16) {
+        memcpy(x->mem + x->memsize, p, len);
+        x->memsize += len;
+        return;
+    }
+    if(x->memsize != 0) {
+        avsize_t fill = 16 - x->memsize;
+
+        memcpy(x->mem + x->memsize, p, fill);
+        xxh_stripe(x, x->mem);
+        p += fill;
+        len -= fill;
+        x->memsize = 0;
+    }
+    for(; len >= 16; p += 16, len -= 16)
+        xxh_stripe(x, p);
+
+    memcpy(x->mem, p, len);
+    x->memsize = len;
+}
+
+static avuint xxh_digest(struct lz4xxh *x)
+{
+    avuint h;
+    avsize_t i;
+
+    if(x->total >= 16)
+        h = xxh_rotl(x->v[0], 1) + xxh_rotl(x->v[1], 7) +
+            xxh_rotl(x->v[2], 12) + xxh_rotl(x->v[3], 18);
+    else
+        h = x->v[2] + XXH_PRIME5;
+
+    h += (avuint) x->total;
+    for(i = 0; i + 4 <= x->memsize; i += 4) {
+        h += lz4_le32(x->mem + i) * XXH_PRIME3;
+        h = xxh_rotl(h, 17) * XXH_PRIME4;
+    }
+    for(; i < x->memsize; i++) {
+        h += x->mem[i] * XXH_PRIME5;
+        h = xxh_rotl(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 15;
+    h *= XXH_PRIME2;
+    h ^= h >> 13;
+    h *= XXH_PRIME3;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static avuint xxh32(const void *data, avsize_t len)
+{
+    struct lz4xxh x;
+
+    xxh_init(&x);
+    xxh_update(&x, data, len);
+    return xxh_digest(&x);
+}
+
+static int lz4_pread(vfile *vf, void *buf, avsize_t nbyte, avoff_t offset)
+{
+    avssize_t res;
+
+    res = av_pread(vf, (char *) buf, nbyte, offset);
+    if(res < 0)
+        return res;
+    if(res != nbyte) {
+        av_log(AVLOG_ERROR, "LZ4: unexpected end of file");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* Reads within the last SCANBUFSIZE bytes read from the file are
+   served from the buffer */
+struct lz4scanbuf {
+    avbyte *buf;
+    avoff_t start;
+    avsize_t len;
+};
+
+static int lz4_bufread(vfile *vf, struct lz4scanbuf *sb, void *buf,
+                       avsize_t nbyte, avoff_t offset, avoff_t filesize)
+{
+    int res;
+
+    if(offset < sb->start || offset + nbyte > sb->start + sb->len) {
+        if(offset + nbyte > filesize) {
+            av_log(AVLOG_ERROR, "LZ4: unexpected end of file");
+            return -EIO;
+        }
+
+        sb->start = offset;
+        sb->len = AV_MIN(SCANBUFSIZE, filesize - offset);
+        res = lz4_pread(vf, sb->buf, sb->len, offset);
+        if(res < 0) {
+            sb->len = 0;
+            return res;
+        }
+    }
+    memcpy(buf, sb->buf + (offset - sb->start), nbyte);
+
+    return 0;
+}
+
+/* Parse a frame header.  Returns the size of the header, or a
+   negative error. */
+static int lz4_parse_header(const avbyte *buf, avsize_t len,
+                            avbyte *flgp, avbyte *bdp, avoff_t *contentp)
+{
+    avbyte flg;
+    avbyte bd;
+    avsize_t hdrlen;
+    avoff_t content;
+    int i;
+
+    if(len < 7 || lz4_le32(buf) != LZ4_MAGIC) {
+        av_log(AVLOG_ERROR, "LZ4: unknown frame format (magic 0x%08x)",
+               len >= 4 ? lz4_le32(buf) : 0);
+        return -EIO;
+    }
+
+    flg = buf[4];
+    bd = buf[5];
+    if((flg >> 6) != 1 || (flg & 0x02) != 0 || (bd & 0x8F) != 0 ||
+       ((bd >> 4) & 7) < 4) {
+        av_log(AVLOG_ERROR, "LZ4: bad frame descriptor");
+        return -EIO;
+    }
+    if((flg & FLG_DICTID) != 0) {
+        av_log(AVLOG_ERROR, "LZ4: frames with a dictionary are not supported");
+        return -EIO;
+    }
+
+    hdrlen = 6;
+    content = -1;
+    if((flg & FLG_CONTENT_SIZE) != 0) {
+        if(len < 6 + 8 + 1)
+            return -EIO;
+        content = 0;
+        for(i = 7; i >= 0; i--)
+            content = (content << 8) | buf[6 + i];
+        hdrlen += 8;
+    }
+
+    if(buf[hdrlen] != ((xxh32(buf + 4, hdrlen - 4) >> 8) & 0xFF)) {
+        av_log(AVLOG_ERROR, "LZ4: frame header checksum error");
+        return -EIO;
+    }
+
+    *flgp = flg;
+    *bdp = bd;
+    *contentp = content;
+
+    return hdrlen + 1;
+}
+
+static avsize_t lz4_blockmax(avbyte bd)
+{
+    return 1 << (8 + 2 * ((bd >> 4) & 7));
+}
+
+/* Must be called with lz4read_lock held */
+static void lz4cache_add_index(struct lz4cache *zc, struct lz4index *zi,
+                               int checkdist)
+{
+    unsigned int lo = 0;
+    unsigned int hi = zc->numindex;
+    unsigned int i;
+
+    /* Frames and blocks are mostly found in order */
+    if(hi > 0 && zc->indexes[hi-1].offset < zi->offset)
+        lo = hi;
+
+    while(lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if(zc->indexes[mid].offset >= zi->offset)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    i = lo;
+    if(i < zc->numindex && zc->indexes[i].offset == zi->offset)
+        return;
+    if(checkdist && i > 0 &&
+       zi->offset - zc->indexes[i-1].offset < INDEXDISTANCE)
+        return;
+
+    if(zc->numindex == zc->allocindex) {
+        zc->allocindex = AV_MAX(16, zc->allocindex * 2);
+        zc->indexes = (struct lz4index *)
+            av_realloc(zc->indexes, sizeof(*zc->indexes) * zc->allocindex);
+    }
+    zc->numindex ++;
+    memmove(&zc->indexes[i+1], &zc->indexes[i],
+            sizeof(*zc->indexes) * (zc->numindex - i - 1));
+
+    zc->indexes[i] = *zi;
+}
+
+static struct lz4index *lz4cache_find_index(struct lz4cache *zc,
+                                            avoff_t offset)
+{
+    unsigned int lo = 0;
+    unsigned int hi = zc->numindex;
+
+    while(lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if(zc->indexes[mid].offset > offset)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if(lo == 0)
+        return NULL;
+
+    return &zc->indexes[lo-1];
+}
+
+static void lz4cache_add_frame(struct lz4cache *zc, avoff_t inoff,
+                               avoff_t offset)
+{
+    struct lz4index zi;
+
+    zi.inoff = inoff;
+    zi.offset = offset;
+    zi.blockstart = 0;
+    zi.flg = 0;
+    zi.bd = 0;
+
+    AV_LOCK(lz4read_lock);
+    lz4cache_add_index(zc, &zi, 1);
+    AV_UNLOCK(lz4read_lock);
+}
+
+/* Blocks depending on earlier ones can't be a starting point */
+static void lz4cache_add_block(struct lz4file *fil, struct lz4cache *zc,
+                               avoff_t inoff, avoff_t offset)
+{
+    struct lz4index zi;
+
+    if(!(fil->flg & FLG_BLOCK_INDEP))
+        return;
+
+    zi.inoff = inoff;
+    zi.offset = offset;
+    zi.blockstart = 1;
+    zi.flg = fil->flg;
+    zi.bd = fil->bd;
+
+    AV_LOCK(lz4read_lock);
+    lz4cache_add_index(zc, &zi, 1);
+    AV_UNLOCK(lz4read_lock);
+}
+
+/* Walk the frames by reading only the frame and block headers.  Every
+   frame start is recorded up to the first frame which doesn't store
+   its content size. */
+static void lz4index_scan_frames(vfile *vf, avoff_t filesize,
+                                 struct lz4cache *zc, struct lz4scanbuf *sb)
+{
+    int res;
+    avbyte buf[LZ4_HEADER_MAX];
+    avbyte bh[4];
+    avoff_t pos = 0;
+    avoff_t offset = 0;
+    avoff_t content;
+    avbyte flg;
+    avbyte bd;
+    avuint blocksize;
+
+    while(pos < filesize) {
+        avsize_t len = AV_MIN(LZ4_HEADER_MAX, filesize - pos);
+
+        if(len < 8 || lz4_bufread(vf, sb, buf, len, pos, filesize) < 0)
+            return;
+
+        if((lz4_le32(buf) & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+            pos += 8 + (avoff_t) lz4_le32(buf + 4);
+            continue;
+        }
+        /* Doesn't store the content size either */
+        if(lz4_le32(buf) == LZ4_LEGACY_MAGIC)
+            return;
+
+        res = lz4_parse_header(buf, len, &flg, &bd, &content);
+        if(res < 0 || content == -1)
+            return;
+
+        lz4cache_add_frame(zc, pos, offset);
+
+        pos += res;
+        while(1) {
+            if(lz4_bufread(vf, sb, bh, 4, pos, filesize) < 0)
+                return;
+
+            pos += 4;
+            blocksize = lz4_le32(bh);
+            if(blocksize == 0)
+                break;
+
+            pos += blocksize & ~LZ4_UNCOMPRESSED;
+            if((flg & FLG_BLOCK_CHECKSUM) != 0)
+                pos += 4;
+        }
+
+        if((flg & FLG_CONTENT_CHECKSUM) != 0)
+            pos += 4;
+        offset += content;
+    }
+
+    if(pos == filesize) {
+        AV_LOCK(lz4read_lock);
+        zc->size = offset;
+        AV_UNLOCK(lz4read_lock);
+    }
+}
+
+static void lz4index_scan(vfile *vf, avoff_t filesize, struct lz4cache *zc)
+{
+    struct lz4scanbuf sb;
+
+    sb.buf = av_malloc(SCANBUFSIZE);
+    sb.start = 0;
+    sb.len = 0;
+    lz4index_scan_frames(vf, filesize, zc, &sb);
+    av_free(sb.buf);
+}
+
+static void lz4cache_check_index(struct lz4file *fil, struct lz4cache *zc)
+{
+    int res;
+    struct avstat stbuf;
+
+    AV_LOCK(zc->lock);
+    if(!zc->indexread) {
+        res = av_fgetattr(fil->infile, &stbuf, AVA_SIZE);
+        if(res == 0)
+            lz4index_scan(fil->infile, stbuf.size, zc);
+
+        zc->indexread = 1;
+    }
+    AV_UNLOCK(zc->lock);
+
+    fil->indexchecked = 1;
+}
+
+static unsigned int lz4_get_threads()
+{
+    avoff_t threads;
+
+    AV_LOCK(lz4read_lock);
+    threads = lz4_threads;
+    AV_UNLOCK(lz4read_lock);
+
+    if(threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1)
+        threads = 1;
+
+    return AV_MIN(threads, LZ4_THREADS_MAX);
+}
+
+static void lz4file_reserve(struct lz4file *fil, avsize_t bufsize,
+                            avsize_t cbufsize)
+{
+    if(bufsize > fil->bufsize) {
+        fil->buf = av_realloc(fil->buf, bufsize);
+        fil->bufsize = bufsize;
+    }
+    if(cbufsize > fil->cbufsize) {
+        av_free(fil->cbuf);
+        fil->cbuf = av_malloc(cbufsize);
+        fil->cbufsize = cbufsize;
+    }
+}
+
+static void lz4file_set_frame(struct lz4file *fil, avbyte flg, avbyte bd)
+{
+    fil->inframe = 1;
+    fil->flg = flg;
+    fil->bd = bd;
+    if(flg & FLG_LEGACY) {
+        /* Legacy blocks are never stored uncompressed */
+        fil->blockmax = LZ4_LEGACY_BLOCKMAX;
+        fil->cblockmax = LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKMAX);
+    }
+    else {
+        fil->blockmax = lz4_blockmax(bd);
+        fil->cblockmax = fil->blockmax;
+    }
+
+    if(flg & FLG_BLOCK_INDEP)
+        lz4file_reserve(fil, fil->blockmax, fil->cblockmax + 4);
+    else
+        lz4file_reserve(fil, LZ4_HISTORY + fil->blockmax, fil->cblockmax + 4);
+}
+
+static void lz4file_reset(struct lz4file *fil, struct lz4index *zi)
+{
+    fil->iseof = 0;
+    fil->buflen = 0;
+    fil->inframe = 0;
+    fil->checkcontent = 0;
+    if(zi != NULL) {
+        fil->inoff = zi->inoff;
+        fil->bufoff = zi->offset;
+        if(zi->blockstart)
+            lz4file_set_frame(fil, zi->flg, zi->bd);
+    }
+    else {
+        fil->inoff = 0;
+        fil->bufoff = 0;
+    }
+}
+
+static int lz4file_start_frame(struct lz4file *fil, struct lz4cache *zc)
+{
+    int res;
+    avssize_t len;
+    avbyte buf[LZ4_HEADER_MAX];
+    avbyte flg;
+    avbyte bd;
+    avoff_t content;
+
+    fil->bufoff += fil->buflen;
+    fil->buflen = 0;
+
+    len = av_pread(fil->infile, (char *) buf, LZ4_HEADER_MAX, fil->inoff);
+    if(len < 0)
+        return len;
+    if(len == 0) {
+        fil->iseof = 1;
+        AV_LOCK(lz4read_lock);
+        zc->size = fil->bufoff;
+        AV_UNLOCK(lz4read_lock);
+        return 0;
+    }
+
+    if(len >= 8 &&
+       (lz4_le32(buf) & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+        fil->inoff += 8 + (avoff_t) lz4_le32(buf + 4);
+        return 0;
+    }
+
+    /* Written by 'lz4 -l': independent 8MB blocks up to the end of the
+       file or the next magic number, with no checksums */
+    if(len >= 4 && lz4_le32(buf) == LZ4_LEGACY_MAGIC) {
+        lz4cache_add_frame(zc, fil->inoff, fil->bufoff);
+
+        lz4file_set_frame(fil, FLG_LEGACY | FLG_BLOCK_INDEP, 0);
+        fil->checkcontent = 0;
+        fil->inoff += 4;
+        return 0;
+    }
+
+    res = lz4_parse_header(buf, len, &flg, &bd, &content);
+    if(res < 0)
+        return res;
+
+    lz4cache_add_frame(zc, fil->inoff, fil->bufoff);
+
+    lz4file_set_frame(fil, flg, bd);
+    fil->checkcontent = (flg & FLG_CONTENT_CHECKSUM) != 0;
+    xxh_init(&fil->xxh);
+    fil->inoff += res;
+
+    return 0;
+}
+
+static int lz4file_end_frame(struct lz4file *fil)
+{
+    int res;
+    avbyte sum[4];
+
+    /* A legacy frame has no end mark */
+    if((fil->flg & FLG_LEGACY) != 0) {
+        fil->inframe = 0;
+        return 0;
+    }
+
+    fil->inoff += 4;
+    if((fil->flg & FLG_CONTENT_CHECKSUM) != 0) {
+        res = lz4_pread(fil->infile, sum, 4, fil->inoff);
+        if(res < 0)
+            return res;
+
+        if(fil->checkcontent && lz4_le32(sum) != xxh_digest(&fil->xxh)) {
+            av_log(AVLOG_ERROR, "LZ4: content checksum error");
+            return -EIO;
+        }
+        fil->inoff += 4;
+    }
+    fil->inframe = 0;
+
+    return 0;
+}
+
+/* Read the block at inoff into cbuf.  Returns the size of the block
+   in the input, or 0 for the end mark. */
+static avssize_t lz4file_read_block(struct lz4file *fil, avoff_t inoff,
+                                    char *cbuf, struct lz4block *blk)
+{
+    int res;
+    avbyte bh[4];
+    avuint blocksize;
+    avsize_t extra;
+
+    if((fil->flg & FLG_LEGACY) != 0) {
+        res = av_pread(fil->infile, (char *) bh, 4, inoff);
+        if(res < 0)
+            return res;
+        if(res == 0)
+            return 0;
+        if(res != 4) {
+            av_log(AVLOG_ERROR, "LZ4: unexpected end of file");
+            return -EIO;
+        }
+
+        blocksize = lz4_le32(bh);
+        if(blocksize == LZ4_LEGACY_MAGIC || blocksize == LZ4_MAGIC ||
+           (blocksize & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC)
+            return 0;
+        blk->raw = 0;
+        blk->srclen = blocksize;
+    }
+    else {
+        res = lz4_pread(fil->infile, bh, 4, inoff);
+        if(res < 0)
+            return res;
+
+        blocksize = lz4_le32(bh);
+        if(blocksize == 0)
+            return 0;
+
+        blk->raw = (blocksize & LZ4_UNCOMPRESSED) != 0;
+        blk->srclen = blocksize & ~LZ4_UNCOMPRESSED;
+    }
+    if(blk->srclen > fil->cblockmax) {
+        av_log(AVLOG_ERROR, "LZ4: block too large");
+        return -EIO;
+    }
+
+    blk->checksum = (fil->flg & FLG_BLOCK_CHECKSUM) != 0;
+    extra = blk->checksum ? 4 : 0;
+    res = lz4_pread(fil->infile, cbuf, blk->srclen + extra, inoff + 4);
+    if(res < 0)
+        return res;
+
+    blk->src = cbuf;
+    if(blk->checksum)
+        blk->sum = lz4_le32((avbyte *) cbuf + blk->srclen);
+    blk->dstlen = fil->blockmax;
+
+    return 4 + blk->srclen + extra;
+}
+
+static void lz4_decode_block(struct lz4block *blk, const char *dict,
+                             int dictlen)
+{
+    if(blk->checksum && xxh32(blk->src, blk->srclen) != blk->sum) {
+        blk->res = -EILSEQ;
+        return;
+    }
+
+    if(blk->raw) {
+        memcpy(blk->dst, blk->src, blk->srclen);
+        blk->res = blk->srclen;
+    }
+    else if(dict != NULL)
+        blk->res = LZ4_decompress_safe_usingDict(blk->src, blk->dst,
+                                                 blk->srclen, blk->dstlen,
+                                                 dict, dictlen);
+    else
+        blk->res = LZ4_decompress_safe(blk->src, blk->dst,
+                                       blk->srclen, blk->dstlen);
+}
+
+static int lz4_block_result(struct lz4block *blk)
+{
+    if(blk->res == -EILSEQ) {
+        av_log(AVLOG_ERROR, "LZ4: block checksum error");
+        return -EIO;
+    }
+    if(blk->res < 0) {
+        av_log(AVLOG_ERROR, "LZ4: corrupted block");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int lz4file_decode_next(struct lz4file *fil, struct lz4cache *zc)
+{
+    int res;
+    avssize_t len;
+    struct lz4block blk;
+    const char *dict = NULL;
+    avsize_t keep = 0;
+
+    /* Linked blocks may refer to the last 64k of output */
+    if(!(fil->flg & FLG_BLOCK_INDEP))
+        keep = AV_MIN(fil->buflen, LZ4_HISTORY);
+    if(keep != 0) {
+        memmove(fil->buf, fil->buf + fil->buflen - keep, keep);
+        dict = fil->buf;
+    }
+    fil->bufoff += fil->buflen - keep;
+    fil->buflen = keep;
+
+    len = lz4file_read_block(fil, fil->inoff, fil->cbuf, &blk);
+    if(len < 0)
+        return len;
+    if(len == 0)
+        return lz4file_end_frame(fil);
+
+    lz4cache_add_block(fil, zc, fil->inoff, fil->bufoff + fil->buflen);
+
+    blk.dst = fil->buf + fil->buflen;
+    lz4_decode_block(&blk, dict, keep);
+    res = lz4_block_result(&blk);
+    if(res < 0)
+        return res;
+
+    if(fil->checkcontent)
+        xxh_update(&fil->xxh, blk.dst, blk.res);
+
+    fil->buflen += blk.res;
+    fil->inoff += len;
+
+    return 0;
+}
+
+static void *lz4_worker_run(void *data)
+{
+    struct lz4worker *w = (struct lz4worker *) data;
+    unsigned int i;
+
+    for(i = w->first; i < w->num; i += w->step)
+        lz4_decode_block(&w->blocks[i], NULL, 0);
+
+    return NULL;
+}
+
+/* Decode a batch of independent blocks, spreading them over several
+   threads */
+static int lz4file_decode_batch(struct lz4file *fil, struct lz4cache *zc,
+                                unsigned int threads)
+{
+    int res;
+    avssize_t len = 0;
+    unsigned int maxblocks;
+    unsigned int num;
+    unsigned int i;
+    unsigned int started;
+    avsize_t cstride = fil->cblockmax + 4;
+    avsize_t out;
+    avoff_t pos;
+    struct lz4block *blocks;
+    avoff_t *inoffs;
+    struct lz4worker workers[LZ4_THREADS_MAX];
+
+    maxblocks = threads * AV_MAX(1, BATCHSIZE / fil->blockmax);
+    maxblocks = AV_MIN(maxblocks, AV_MAX(1, BATCHMAX / fil->blockmax));
+    lz4file_reserve(fil, maxblocks * fil->blockmax, maxblocks * cstride);
+
+    fil->bufoff += fil->buflen;
+    fil->buflen = 0;
+
+    blocks = av_malloc(sizeof(*blocks) * maxblocks);
+    inoffs = av_malloc(sizeof(*inoffs) * maxblocks);
+    pos = fil->inoff;
+    for(num = 0; num < maxblocks; num++) {
+        len = lz4file_read_block(fil, pos, fil->cbuf + num * cstride,
+                                 &blocks[num]);
+        if(len <= 0)
+            break;
+
+        blocks[num].dst = fil->buf + num * fil->blockmax;
+        inoffs[num] = pos;
+        pos += len;
+    }
+    if(num == 0 || len < 0) {
+        av_free(blocks);
+        av_free(inoffs);
+        if(num == 0 && len == 0)
+            return lz4file_end_frame(fil);
+        return len < 0 ? len : -EIO;
+    }
+
+    threads = AV_MIN(threads, num);
+    for(i = 0; i < threads; i++) {
+        workers[i].blocks = blocks;
+        workers[i].first = i;
+        workers[i].num = num;
+        workers[i].step = threads;
+    }
+    for(started = 1; started < threads; started++) {
+        if(pthread_create(&workers[started].thread, NULL, lz4_worker_run,
+                          &workers[started]) != 0)
+            break;
+    }
+    /* Whatever could not be handed to a thread is done here */
+    for(i = started; i < threads; i++)
+        lz4_worker_run(&workers[i]);
+    lz4_worker_run(&workers[0]);
+    for(i = 1; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    /* Move the decoded blocks next to each other */
+    out = 0;
+    res = 0;
+    for(i = 0; i < num; i++) {
+        res = lz4_block_result(&blocks[i]);
+        if(res < 0)
+            break;
+
+        lz4cache_add_block(fil, zc, inoffs[i], fil->bufoff + out);
+        if(blocks[i].dst != fil->buf + out)
+            memmove(fil->buf + out, blocks[i].dst, blocks[i].res);
+        if(fil->checkcontent)
+            xxh_update(&fil->xxh, fil->buf + out, blocks[i].res);
+        out += blocks[i].res;
+    }
+    av_free(blocks);
+    av_free(inoffs);
+    if(res < 0)
+        return res;
+
+    fil->buflen = out;
+    fil->inoff = pos;
+
+    return 0;
+}
+
+static int lz4file_next(struct lz4file *fil, struct lz4cache *zc, int batch)
+{
+    unsigned int threads;
+
+    if(!fil->inframe)
+        return lz4file_start_frame(fil, zc);
+
+    if(batch && (fil->flg & FLG_BLOCK_INDEP)) {
+        threads = lz4_get_threads();
+        if(threads > 1)
+            return lz4file_decode_batch(fil, zc, threads);
+    }
+
+    return lz4file_decode_next(fil, zc);
+}
+
+static void lz4file_seek(struct lz4file *fil, struct lz4cache *zc,
+                         avoff_t offset)
+{
+    struct lz4index *zi;
+    struct lz4index tmp;
+    int found;
+    avoff_t end = fil->bufoff + fil->buflen;
+
+    AV_LOCK(lz4read_lock);
+    zi = lz4cache_find_index(zc, offset);
+    found = (zi != NULL);
+    if(found)
+        tmp = *zi;
+    AV_UNLOCK(lz4read_lock);
+
+    /* Decoding on is only worth it if no checkpoint is in between */
+    if(offset >= fil->bufoff && (!found || tmp.offset <= end))
+        return;
+
+    lz4file_reset(fil, found ? &tmp : NULL);
+}
+
+static avssize_t av_lz4file_do_pread(struct lz4file *fil,
+                                     struct lz4cache *zc, char *buf,
+                                     avsize_t nbyte, avoff_t offset)
+{
+    int res;
+    avsize_t done = 0;
+    avoff_t pos;
+    avsize_t n;
+    int batch;
+
+    if(offset == fil->lastend)
+        fil->seqreads ++;
+    else
+        fil->seqreads = 0;
+
+    while(done < nbyte) {
+        pos = offset + done;
+        if(pos >= fil->bufoff && pos < fil->bufoff + fil->buflen) {
+            n = AV_MIN(nbyte - done, fil->bufoff + fil->buflen - pos);
+            memcpy(buf + done, fil->buf + (pos - fil->bufoff), n);
+            done += n;
+            continue;
+        }
+
+        lz4file_seek(fil, zc, pos);
+        if(fil->iseof)
+            break;
+
+        /* Skipping forward or reading sequentially uses all threads */
+        batch = fil->seqreads != 0 || pos > fil->bufoff + fil->buflen;
+        res = lz4file_next(fil, zc, batch);
+        if(res < 0)
+            return res;
+    }
+    fil->lastend = offset + done;
+
+    return done;
+}
+
+avssize_t av_lz4file_pread(struct lz4file *fil, struct lz4cache *zc,
+                           char *buf, avsize_t nbyte, avoff_t offset)
+{
+    avssize_t res;
+
+    if(fil->iserror)
+        return -EIO;
+
+    if(!fil->indexchecked)
+        lz4cache_check_index(fil, zc);
+
+    res = av_lz4file_do_pread(fil, zc, buf, nbyte, offset);
+    if(res < 0)
+        fil->iserror = 1;
+
+    return res;
+}
+
+int av_lz4file_size(struct lz4file *fil, struct lz4cache *zc,
+                    avoff_t *sizep)
+{
+    int res;
+    avoff_t size;
+
+    AV_LOCK(lz4read_lock);
+    size = zc->size;
+    AV_UNLOCK(lz4read_lock);
+
+    if(size != -1 || fil == NULL) {
+        *sizep = size;
+        return 0;
+    }
+
+    if(fil->iserror)
+        return -EIO;
+
+    if(!fil->indexchecked) {
+        /* The frame headers may tell the size */
+        lz4cache_check_index(fil, zc);
+
+        AV_LOCK(lz4read_lock);
+        size = zc->size;
+        AV_UNLOCK(lz4read_lock);
+        if(size != -1) {
+            *sizep = size;
+            return 0;
+        }
+    }
+
+    lz4file_seek(fil, zc, AV_MAXOFF);
+    while(!fil->iseof) {
+        res = lz4file_next(fil, zc, 1);
+        if(res < 0) {
+            fil->iserror = 1;
+            return res;
+        }
+    }
+
+    AV_LOCK(lz4read_lock);
+    size = zc->size;
+    AV_UNLOCK(lz4read_lock);
+
+    if(size == -1) {
+        av_log(AVLOG_ERROR, "LZ4: Internal error: could not find size");
+        return -EIO;
+    }
+
+    *sizep = size;
+    return 0;
+}
+
+static void lz4file_destroy(struct lz4file *fil)
+{
+    av_free(fil->buf);
+    av_free(fil->cbuf);
+}
+
+struct lz4file *av_lz4file_new(vfile *vf)
+{
+    struct lz4file *fil;
+
+    AV_NEW_OBJ(fil, lz4file_destroy);
+    fil->iseof = 0;
+    fil->iserror = 0;
+    fil->indexchecked = 0;
+    fil->lastend = -1;
+    fil->seqreads = 0;
+    fil->inframe = 0;
+    fil->flg = 0;
+    fil->bd = 0;
+    fil->blockmax = 0;
+    fil->cblockmax = 0;
+    fil->checkcontent = 0;
+    fil->inoff = 0;
+    fil->buf = NULL;
+    fil->bufsize = 0;
+    fil->bufoff = 0;
+    fil->buflen = 0;
+    fil->cbuf = NULL;
+    fil->cbufsize = 0;
+    fil->infile = vf;
+
+    return fil;
+}
+
+static void lz4cache_destroy(struct lz4cache *zc)
+{
+    AV_FREELOCK(zc->lock);
+    av_free(zc->indexes);
+}
+
+struct lz4cache *av_lz4cache_new()
+{
+    struct lz4cache *zc;
+
+    AV_NEW_OBJ(zc, lz4cache_destroy);
+    zc->size = -1;
+    zc->indexread = 0;
+    zc->numindex = 0;
+    zc->allocindex = 0;
+    zc->indexes = NULL;
+    AV_INITLOCK(zc->lock);
+
+    return zc;
+}
+
+void av_init_lz4stat()
+{
+    av_avfsstat_register_int("lz4/threads", &lz4_threads, &lz4read_lock,
+                             0, LZ4_THREADS_MAX, NULL);
+}
@@ -0,0 +1,526 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Decoder for compress(1) .Z files, based on zread.c
+*/
+
+#include "config.h"
+#include "lzwfile.h"
+#include "ckptfile.h"
+#include "oper.h"
+
+#define INBUFSIZE 16384
+#define OUTBUFSIZE 32768
+
+/* This is the 'cost' of the restoration from the index cache */
+#define LZWCACHE_EXTRA_DIST 100000
+
+#define LZW_MAGIC1 0x1f
+#define LZW_MAGIC2 0x9d
+#define LZW_HEADER_SIZE 3
+
+#define LZW_BIT_MASK   0x1f
+#define LZW_BLOCK_MODE 0x80
+#define LZW_RESERVED   0x60
+
+#define LZW_INIT_BITS 9
+#define LZW_MAX_BITS 16
+#define LZW_MAXCODES (1 << LZW_MAX_BITS)
+
+#define LZW_CLEAR 256
+#define LZW_FIRST 257
+
+static AV_LOCK_DECL(lzwread_lock);
+
+/* The decoder state between two codes.  In the index this is followed
+   by the prefix and suffix tables from LZW_CLEAR up to free_ent */
+struct lzwstate {
+    avoff_t outoff;          /* The number of output bytes */
+    avoff_t bitoff;          /* Bit offset of the next code */
+    avoff_t groupstart;      /* Byte offset where the code size changed */
+    int maxbits;
+    int block_mode;
+    int n_bits;
+    int free_ent;
+    int oldcode;
+    int finchar;
+};
+
+struct lzwcache {
+    struct ckptfile ckpt;
+    avoff_t size;
+    avmutex lock;
+};
+
+struct lzwfile {
+    struct lzwstate st;
+    int iseof;
+    int iserror;
+
+    /* Output of the last code is stack[stackp..LZW_MAXCODES-1] */
+    unsigned int stackp;
+
+    vfile *infile;
+    avoff_t inbufoff;
+    avsize_t inbuflen;
+    avbyte inbuf[INBUFSIZE];
+
+    unsigned short prefix[LZW_MAXCODES];
+    avbyte suffix[LZW_MAXCODES];
+    avbyte stack[LZW_MAXCODES];
+};
+
+static int lzwfile_reset(struct lzwfile *fil)
+{
+    avssize_t res;
+    avbyte hdr[LZW_HEADER_SIZE];
+    struct lzwstate *st = &fil->st;
+
+    res = av_pread(fil->infile, (char *) hdr, LZW_HEADER_SIZE, 0);
+    if(res < 0)
+        return res;
+
+    if(res != LZW_HEADER_SIZE || hdr[0] != LZW_MAGIC1 ||
+       hdr[1] != LZW_MAGIC2) {
+        av_log(AVLOG_ERROR, "LZWFILE: File not in compress format");
+        return -EIO;
+    }
+    if((hdr[2] & LZW_RESERVED) != 0)
+        av_log(AVLOG_WARNING, "LZWFILE: Unknown flags: 0x%02x", hdr[2]);
+
+    st->maxbits = hdr[2] & LZW_BIT_MASK;
+    if(st->maxbits < LZW_INIT_BITS || st->maxbits > LZW_MAX_BITS) {
+        av_log(AVLOG_ERROR, "LZWFILE: Unsupported code size: %i",
+               st->maxbits);
+        return -EIO;
+    }
+    st->block_mode = (hdr[2] & LZW_BLOCK_MODE) != 0;
+    st->outoff = 0;
+    st->bitoff = LZW_HEADER_SIZE * 8;
+    st->groupstart = LZW_HEADER_SIZE;
+    st->n_bits = LZW_INIT_BITS;
+    st->free_ent = st->block_mode ? LZW_FIRST : LZW_CLEAR;
+    st->oldcode = -1;
+    st->finchar = 0;
+
+    fil->stackp = LZW_MAXCODES;
+    fil->iseof = 0;
+
+    return 0;
+}
+
+static int lzwfile_save_index(struct lzwfile *fil, struct lzwcache *zc)
+{
+    int res;
+    int nent = fil->st.free_ent - LZW_CLEAR;
+    int statelen = sizeof(struct lzwstate) + nent * 3;
+    char *state;
+
+    state = av_malloc(statelen);
+    memcpy(state, &fil->st, sizeof(struct lzwstate));
+    memcpy(state + sizeof(struct lzwstate), fil->prefix + LZW_CLEAR,
+           nent * 2);
+    memcpy(state + sizeof(struct lzwstate) + nent * 2,
+           fil->suffix + LZW_CLEAR, nent);
+
+    res = av_ckptfile_save(&zc->ckpt, state, statelen, fil->st.outoff);
+    av_free(state);
+
+    return res;
+}
+
+static int lzwfile_seek_index(struct lzwfile *fil, struct lzwcache *zc,
+                              struct ckpt *zi)
+{
+    int res;
+    int nent;
+    char *state;
+
+    res = av_ckptfile_load(&zc->ckpt, zi, &state);
+    if(res < 0)
+        return res;
+    if(res < (int) sizeof(struct lzwstate)) {
+        av_log(AVLOG_ERROR, "LZWFILE: Invalid state in indexfile");
+        av_free(state);
+        return -EIO;
+    }
+
+    memcpy(&fil->st, state, sizeof(struct lzwstate));
+    nent = fil->st.free_ent - LZW_CLEAR;
+    memcpy(fil->prefix + LZW_CLEAR, state + sizeof(struct lzwstate),
+           nent * 2);
+    memcpy(fil->suffix + LZW_CLEAR, state + sizeof(struct lzwstate) + nent * 2,
+           nent);
+    av_free(state);
+
+    fil->stackp = LZW_MAXCODES;
+    fil->iseof = 0;
+
+    return 0;
+}
+
+/* Codes are written in groups of n_bits bytes (8 codes).  When the code
+   size changes, the rest of the current group is skipped */
+static void lzwfile_skip_group(struct lzwstate *st)
+{
+    avoff_t groupbits = st->n_bits * 8;
+    avoff_t rel = st->bitoff - st->groupstart * 8;
+
+    rel = (rel + groupbits - 1) / groupbits * groupbits;
+    st->bitoff = st->groupstart * 8 + rel;
+    st->groupstart = st->bitoff >> 3;
+}
+
+/* Returns 1 and the code in *codep, or 0 at the end of the input */
+static int lzwfile_getcode(struct lzwfile *fil, int *codep)
+{
+    avssize_t res;
+    struct lzwstate *st = &fil->st;
+    avoff_t byteoff = st->bitoff >> 3;
+    avoff_t inbits;
+    const avbyte *p;
+    avuint bits;
+
+    if(byteoff < fil->inbufoff ||
+       byteoff + 3 > fil->inbufoff + fil->inbuflen) {
+        res = av_pread(fil->infile, (char *) fil->inbuf, INBUFSIZE, byteoff);
+        if(res < 0)
+            return res;
+
+        fil->inbufoff = byteoff;
+        fil->inbuflen = res;
+    }
+
+    inbits = (fil->inbufoff + fil->inbuflen) * 8 - st->bitoff;
+    if(inbits < st->n_bits)
+        return 0;
+
+    p = fil->inbuf + (byteoff - fil->inbufoff);
+    bits = p[0];
+    if(inbits > 8)
+        bits |= p[1] << 8;
+    if(inbits > 16)
+        bits |= p[2] << 16;
+
+    *codep = (bits >> (st->bitoff & 7)) & ((1 << st->n_bits) - 1);
+    st->bitoff += st->n_bits;
+
+    return 1;
+}
+
+/* Decode the next code into the stack.  Returns 0 at end of file */
+static int lzwfile_decode(struct lzwfile *fil)
+{
+    int res;
+    int code;
+    int incode;
+    int maxcode;
+    unsigned int sp;
+    struct lzwstate *st = &fil->st;
+
+    while(1) {
+        if(st->n_bits == st->maxbits)
+            maxcode = 1 << st->maxbits;
+        else
+            maxcode = (1 << st->n_bits) - 1;
+
+        if(st->free_ent > maxcode) {
+            lzwfile_skip_group(st);
+            st->n_bits++;
+            continue;
+        }
+
+        res = lzwfile_getcode(fil, &code);
+        if(res <= 0)
+            return res;
+
+        if(st->oldcode == -1) {
+            if(code >= 256) {
+                av_log(AVLOG_ERROR, "LZWFILE: Corrupt input");
+                return -EIO;
+            }
+            st->oldcode = st->finchar = code;
+            fil->stackp = LZW_MAXCODES - 1;
+            fil->stack[fil->stackp] = code;
+            return 1;
+        }
+
+        if(code == LZW_CLEAR && st->block_mode) {
+            lzwfile_skip_group(st);
+            st->n_bits = LZW_INIT_BITS;
+            st->free_ent = LZW_FIRST - 1;
+            continue;
+        }
+
+        incode = code;
+        sp = LZW_MAXCODES;
+
+        if(code >= st->free_ent) {
+            if(code > st->free_ent) {
+                av_log(AVLOG_ERROR, "LZWFILE: Corrupt input");
+                return -EIO;
+            }
+            fil->stack[--sp] = st->finchar;
+            code = st->oldcode;
+        }
+        while(code >= 256) {
+            fil->stack[--sp] = fil->suffix[code];
+            code = fil->prefix[code];
+        }
+        st->finchar = code;
+        fil->stack[--sp] = code;
+
+        if(st->free_ent < (1 << st->maxbits)) {
+            fil->prefix[st->free_ent] = st->oldcode;
+            fil->suffix[st->free_ent] = st->finchar;
+            st->free_ent++;
+        }
+        st->oldcode = incode;
+        fil->stackp = sp;
+
+        return 1;
+    }
+}
+
+static int lzwfile_fill_stack(struct lzwfile *fil, struct lzwcache *zc)
+{
+    int res;
+
+    AV_LOCK(lzwread_lock);
+    if(fil->st.outoff >= zc->ckpt.nextindex)
+        res = lzwfile_save_index(fil, zc);
+    else
+        res = 0;
+    AV_UNLOCK(lzwread_lock);
+    if(res < 0)
+        return res;
+
+    res = lzwfile_decode(fil);
+    if(res < 0)
+        return res;
+
+    if(res == 0) {
+        fil->iseof = 1;
+        AV_LOCK(lzwread_lock);
+        zc->size = fil->st.outoff;
+        AV_UNLOCK(lzwread_lock);
+    }
+
+    return 0;
+}
+
+/* Copy (or with buf == NULL skip) up to nbyte bytes of output */
+static avssize_t lzwfile_output(struct lzwfile *fil, struct lzwcache *zc,
+                                char *buf, avsize_t nbyte)
+{
+    int res;
+    avsize_t n;
+    avsize_t done = 0;
+
+    while(done < nbyte && !fil->iseof) {
+        if(fil->stackp == LZW_MAXCODES) {
+            res = lzwfile_fill_stack(fil, zc);
+            if(res < 0)
+                return res;
+            continue;
+        }
+
+        n = AV_MIN(nbyte - done, LZW_MAXCODES - fil->stackp);
+        if(buf != NULL)
+            memcpy(buf + done, fil->stack + fil->stackp, n);
+        fil->stackp += n;
+        fil->st.outoff += n;
+        done += n;
+    }
+
+    return done;
+}
+
+static int lzwfile_skip_to(struct lzwfile *fil, struct lzwcache *zc,
+                           avoff_t offset)
+{
+    avssize_t res;
+
+    while(fil->st.outoff < offset && !fil->iseof) {
+        res = lzwfile_output(fil, zc, NULL,
+                             AV_MIN(OUTBUFSIZE, offset - fil->st.outoff));
+        if(res < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+static int lzwfile_seek(struct lzwfile *fil, struct lzwcache *zc,
+                        avoff_t offset)
+{
+    struct ckpt *zi;
+    avoff_t curroff = fil->st.outoff;
+    avoff_t zcdist;
+    avoff_t dist;
+
+    if(offset >= curroff)
+        dist = offset - curroff;
+    else
+        dist = -1;
+
+    zi = av_ckptfile_find(&zc->ckpt, offset);
+    if(zi != NULL)
+        zcdist = offset - zi->offset + LZWCACHE_EXTRA_DIST;
+    else
+        zcdist = offset;
+
+    if(dist == -1 || zcdist < dist) {
+        if(zi == NULL)
+            return lzwfile_reset(fil);
+        else
+            return lzwfile_seek_index(fil, zc, zi);
+    }
+
+    return 0;
+}
+
+static int lzwfile_goto(struct lzwfile *fil, struct lzwcache *zc,
+                        avoff_t offset)
+{
+    int res;
+
+    AV_LOCK(zc->lock);
+    AV_LOCK(lzwread_lock);
+    res = lzwfile_seek(fil, zc, offset);
+    AV_UNLOCK(lzwread_lock);
+    if(res == 0)
+        res = lzwfile_skip_to(fil, zc, offset);
+    AV_UNLOCK(zc->lock);
+
+    return res;
+}
+
+static avssize_t av_lzwfile_do_pread(struct lzwfile *fil, struct lzwcache *zc,
+                                     char *buf, avsize_t nbyte,
+                                     avoff_t offset)
+{
+    avssize_t res;
+
+    if(offset != fil->st.outoff) {
+        res = lzwfile_goto(fil, zc, offset);
+        if(res < 0)
+            return res;
+    }
+
+    return lzwfile_output(fil, zc, buf, nbyte);
+}
+
+avssize_t av_lzwfile_pread(struct lzwfile *fil, struct lzwcache *zc,
+                           char *buf, avsize_t nbyte, avoff_t offset)
+{
+    avssize_t res;
+
+    if(fil->iserror)
+        return -EIO;
+
+    res = av_lzwfile_do_pread(fil, zc, buf, nbyte, offset);
+    if(res < 0)
+        fil->iserror = 1;
+
+    return res;
+}
+
+int av_lzwfile_size(struct lzwfile *fil, struct lzwcache *zc, avoff_t *sizep)
+{
+    int res;
+    avoff_t size;
+
+    AV_LOCK(lzwread_lock);
+    size = zc->size;
+    AV_UNLOCK(lzwread_lock);
+
+    if(size != -1 || fil == NULL) {
+        *sizep = size;
+        return 0;
+    }
+
+    if(fil->iserror)
+        return -EIO;
+
+    res = lzwfile_goto(fil, zc, AV_MAXOFF);
+    if(res < 0) {
+        fil->iserror = 1;
+        return res;
+    }
+
+    AV_LOCK(lzwread_lock);
+    size = zc->size;
+    AV_UNLOCK(lzwread_lock);
+
+    if(size == -1) {
+        av_log(AVLOG_ERROR, "LZWFILE: Internal error: could not find size");
+        return -EIO;
+    }
+
+    *sizep = size;
+    return 0;
+}
+
+/* Returns 1 if the builtin decoder knows the header of the file, 0 if
+   it would reject it */
+int av_lzwfile_check(vfile *vf)
+{
+    avssize_t res;
+    avbyte hdr[LZW_HEADER_SIZE];
+    int maxbits;
+
+    res = av_pread(vf, (char *) hdr, LZW_HEADER_SIZE, 0);
+    if(res < 0)
+        return res;
+
+    if(res != LZW_HEADER_SIZE || hdr[0] != LZW_MAGIC1 ||
+       hdr[1] != LZW_MAGIC2)
+        return 0;
+
+    maxbits = hdr[2] & LZW_BIT_MASK;
+    if(maxbits < LZW_INIT_BITS || maxbits > LZW_MAX_BITS)
+        return 0;
+
+    return 1;
+}
+
+struct lzwfile *av_lzwfile_new(vfile *vf)
+{
+    int res;
+    struct lzwfile *fil;
+
+    AV_NEW_OBJ(fil, NULL);
+    fil->iserror = 0;
+    fil->infile = vf;
+    fil->inbufoff = 0;
+    fil->inbuflen = 0;
+
+    res = lzwfile_reset(fil);
+    if(res < 0)
+        fil->iserror = 1;
+
+    return fil;
+}
+
+static void lzwcache_destroy(struct lzwcache *zc)
+{
+    AV_FREELOCK(zc->lock);
+    av_ckptfile_free(&zc->ckpt);
+}
+
+struct lzwcache *av_lzwcache_new()
+{
+    struct lzwcache *zc;
+
+    AV_NEW_OBJ(zc, lzwcache_destroy);
+    zc->size = -1;
+    AV_INITLOCK(zc->lock);
+
+    av_ckptfile_init(&zc->ckpt, "LZWFILE");
+
+    return zc;
+}
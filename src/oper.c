@@ -11,6 +11,102 @@
 #include "operutil.h"
 #include "internal.h"
 #include <stdlib.h>
+#include <time.h>
+
+/* The time spent reading is counted for each layer both with and
+   without the time spent in the layers under it, as long as these are
+   read in the same thread */
+struct readtimer {
+    int on;
+    struct timespec start;
+    avoff_t *childp;
+    avoff_t savedchild;
+};
+
+static pthread_key_t readstat_key;
+static pthread_once_t readstat_once = PTHREAD_ONCE_INIT;
+
+/* Tunable in #avfsstat: the counting costs two clock readings and a
+   lock on each read, so it is off by default */
+static AV_LOCK_DECL(readstat_lock);
+static avoff_t readstat_enable = 0;
+
+static int readstat_enabled()
+{
+    int on;
+
+    AV_LOCK(readstat_lock);
+    on = readstat_enable != 0;
+    AV_UNLOCK(readstat_lock);
+
+    return on;
+}
+
+static void readstat_init()
+{
+    /* The values are freed by the thread exiting, not by AVFS */
+    pthread_key_create(&readstat_key, free);
+}
+
+static void readstat_start(struct readtimer *rt)
+{
+    avoff_t *childp;
+
+    rt->on = readstat_enabled();
+    if(!rt->on)
+        return;
+
+    pthread_once(&readstat_once, readstat_init);
+    childp = (avoff_t *) pthread_getspecific(readstat_key);
+    if(childp == NULL) {
+        childp = (avoff_t *) calloc(1, sizeof(*childp));
+        if(childp != NULL)
+            pthread_setspecific(readstat_key, childp);
+    }
+
+    rt->childp = childp;
+    if(childp != NULL) {
+        rt->savedchild = *childp;
+        *childp = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &rt->start);
+}
+
+static void readstat_end(struct avfs *avfs, struct readtimer *rt,
+                         avssize_t res, int seek)
+{
+    struct timespec now;
+    avoff_t nsec;
+    avoff_t child = 0;
+
+    if(!rt->on)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    nsec = (avoff_t) (now.tv_sec - rt->start.tv_sec) * 1000000000 +
+        (now.tv_nsec - rt->start.tv_nsec);
+
+    if(rt->childp != NULL) {
+        child = *rt->childp;
+        *rt->childp = rt->savedchild + nsec;
+    }
+
+    AV_LOCK(avfs->statlock);
+    avfs->rstat.reads ++;
+    if(res > 0)
+        avfs->rstat.bytes += res;
+    if(seek)
+        avfs->rstat.seeks ++;
+    avfs->rstat.nsec += nsec;
+    avfs->rstat.selfnsec += nsec - child;
+    AV_UNLOCK(avfs->statlock);
+}
+
+void av_init_readstat()
+{
+    av_avfsstat_register_int("layers_enable", &readstat_enable,
+                             &readstat_lock, 0, 1, NULL);
+}
 
 static int check_file_access(vfile *vf, int access)
 {
@@ -80,10 +176,13 @@ avssize_t av_file_read(vfile *vf, char *buf, avsize_t nbyte)
     res = check_file_access(vf, AVO_RDONLY);
     if(res == 0) {
         struct avfs *avfs = vf->mnt->avfs;
+        struct readtimer rt;
 
+        readstat_start(&rt);
         AVFS_LOCK(avfs);
         res = avfs->read(vf, buf, nbyte);
         AVFS_UNLOCK(avfs);
+        readstat_end(avfs, &rt, res, 0);
     }
 
     return res;
@@ -98,7 +197,10 @@ avssize_t av_file_pread(vfile *vf, char *buf, avsize_t nbyte, avoff_t offset)
     if(res == 0) {
         avoff_t sres;
         struct avfs *avfs = vf->mnt->avfs;
+        struct readtimer rt;
+        int seek = (offset != vf->ptr);
 
+        readstat_start(&rt);
         AVFS_LOCK(avfs);
         sres = avfs->lseek(vf, offset, AVSEEK_SET);
         if(sres < 0)
@@ -106,6 +208,7 @@ avssize_t av_file_pread(vfile *vf, char *buf, avsize_t nbyte, avoff_t offset)
         else
             res = avfs->read(vf, buf, nbyte);
         AVFS_UNLOCK(avfs);
+        readstat_end(avfs, &rt, res, seek);
     }
 
     return res;
@@ -204,6 +307,62 @@ avoff_t av_file_lseek(vfile *vf, avoff_t offset, int whence)
     return res;
 }
 
+/* Tell the file that reads will later start at 'offset', so that it
+   can prepare for seeking there (e.g. a decompressor can save its
+   state when it gets to that point) */
+void av_file_seekhint(vfile *vf, avoff_t offset)
+{
+    struct avfs *avfs = vf->mnt->avfs;
+
+    if(readstat_enabled()) {
+        AV_LOCK(avfs->statlock);
+        avfs->rstat.hints ++;
+        AV_UNLOCK(avfs->statlock);
+    }
+
+    AVFS_LOCK(avfs);
+    avfs->seekhint(vf, offset);
+    AVFS_UNLOCK(avfs);
+}
+
+/* Get a real file descriptor holding the contents of the file, which
+   are the 'size' bytes at 'offset'.  The descriptor belongs to the
+   vfile: it is only valid while the vfile is open and must only be
+   used with pread() or similar, which don't change the file position */
+int av_file_getfd(vfile *vf, avoff_t *offsetp, avoff_t *sizep)
+{
+    int res;
+
+    res = check_file_access(vf, AVO_RDONLY);
+    if(res == 0) {
+        struct avfs *avfs = vf->mnt->avfs;
+
+        AVFS_LOCK(avfs);
+        res = avfs->getfd(vf, offsetp, sizep);
+        AVFS_UNLOCK(avfs);
+    }
+
+    return res;
+}
+
+/* Make 'path' a hard link to a local file already holding the whole
+   contents of the file, so that it needn't be copied */
+int av_file_linkfile(vfile *vf, const char *path)
+{
+    int res;
+
+    res = check_file_access(vf, AVO_RDONLY);
+    if(res == 0) {
+        struct avfs *avfs = vf->mnt->avfs;
+
+        AVFS_LOCK(avfs);
+        res = avfs->linkfile(vf, path);
+        AVFS_UNLOCK(avfs);
+    }
+
+    return res;
+}
+
 static void file_destroy(vfile *vf)
 {
     if(vf->mnt != NULL)
@@ -301,6 +460,35 @@ avoff_t av_lseek(vfile *vf, avoff_t offset, int whence)
     return res;
 }
 
+void av_seekhint(vfile *vf, avoff_t offset)
+{
+    AV_LOCK(vf->lock);
+    av_file_seekhint(vf, offset);
+    AV_UNLOCK(vf->lock);
+}
+
+int av_getfd(vfile *vf, avoff_t *offsetp, avoff_t *sizep)
+{
+    int res;
+
+    AV_LOCK(vf->lock);
+    res = av_file_getfd(vf, offsetp, sizep);
+    AV_UNLOCK(vf->lock);
+
+    return res;
+}
+
+int av_linkfile(vfile *vf, const char *path)
+{
+    int res;
+
+    AV_LOCK(vf->lock);
+    res = av_file_linkfile(vf, path);
+    AV_UNLOCK(vf->lock);
+
+    return res;
+}
+
 int av_ftruncate(vfile *vf, avoff_t length)
 {
     int res;
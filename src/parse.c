@@ -100,6 +100,57 @@ static int modstat_get(struct entry *ent, const char *param, char **retp)
     return 0;
 }
 
+static int layerstat_get(struct entry *ent, const char *param, char **retp)
+{
+    char *ret;
+    char buf[256];
+    struct avfs_list *li;
+
+    sprintf(buf, "%-12s %10s %14s %10s %10s %12s %12s\n", "name", "reads",
+            "bytes", "seeks", "hints", "msec", "self msec");
+    ret = av_strdup(buf);
+
+    AV_LOCK(avfs_lock);
+    for(li = avfs_list.next; li != &avfs_list; li = li->next) {
+        struct avfs *avfs = li->avfs;
+        struct avreadstat rs;
+
+        AV_LOCK(avfs->statlock);
+        rs = avfs->rstat;
+        AV_UNLOCK(avfs->statlock);
+
+        if(rs.reads == 0 && rs.hints == 0)
+            continue;
+
+        sprintf(buf, "%-12s %10lli %14lli %10lli %10lli %12lli %12lli\n",
+                avfs->name, rs.reads, rs.bytes, rs.seeks, rs.hints,
+                rs.nsec / 1000000, rs.selfnsec / 1000000);
+        ret = av_stradd(ret, buf, NULL);
+    }
+    AV_UNLOCK(avfs_lock);
+
+    *retp = ret;
+
+    return 0;
+}
+
+static int layerstat_set(struct entry *ent, const char *param, const char *val)
+{
+    struct avfs_list *li;
+
+    AV_LOCK(avfs_lock);
+    for(li = avfs_list.next; li != &avfs_list; li = li->next) {
+        struct avfs *avfs = li->avfs;
+
+        AV_LOCK(avfs->statlock);
+        memset(&avfs->rstat, 0, sizeof(avfs->rstat));
+        AV_UNLOCK(avfs->statlock);
+    }
+    AV_UNLOCK(avfs_lock);
+
+    return 0;
+}
+
 static int versionstat_get(struct entry *ent, const char *param, char **retp)
 {
     char buf[128];
@@ -180,12 +231,20 @@ static void init_stats()
     statf.get = symlinkrewrite_get;
     statf.set = symlinkrewrite_set;
     av_avfsstat_register("symlink_rewrite", &statf);
+
+    statf.get = layerstat_get;
+    statf.set = layerstat_set;
+    av_avfsstat_register("layers", &statf);
+    av_init_readstat();
 }
 
 static void destroy()
 {
     av_log(AVLOG_DEBUG, "DESTROY");
 
+    /* Not under initlock, a parse may still be looking up paths */
+    av_archive_stop_parses();
+
     AV_LOCK(initlock);
     if(inited) {
         av_close_all_files();
@@ -231,7 +290,10 @@ static int init()
             av_init_logstat();
             init_stats();
             av_init_cache();
+            av_init_idle();
             av_init_filecache();
+            av_init_readahead();
+            av_init_zread();
             atexit(destroy);
             inited = 1;
             av_log(AVLOG_DEBUG, "INIT successful");
@@ -529,7 +591,7 @@ static int lookup_avfs(struct parse_state *ps, char *name)
     }
 
     c = *opts;
-    *s = '\0';
+    *opts = '\0';
     avfs = find_avfs_name(name);
     *opts = c;
 
@@ -0,0 +1,245 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    based on xzread.c
+*/
+
+/* Members of rar archives are unpacked with libarchive, reading the
+   archive through the base vfile.  libarchive lives in this file
+   only, because its 'struct archive' clashes with ours.  For the same
+   reason its archive.h is included by full path. */
+
+#include "config.h"
+#include "rarfile.h"
+#include "oper.h"
+
+#include LIBARCHIVE_H
+#include <archive_entry.h>
+
+#define INBUFSIZE 65536
+#define OUTBUFSIZE 65536
+
+struct rarstream {
+    struct archive *a;
+    int iserror;
+    int index;               /* Number of file headers before the member */
+    avoff_t size;            /* Unpacked size of the member */
+
+    avoff_t outoff;          /* Output offset of outbuf */
+    avsize_t outlen;
+    char outbuf[OUTBUFSIZE];
+
+    vfile *infile;
+    avoff_t insize;
+    avoff_t inoff;
+    char inbuf[INBUFSIZE];
+};
+
+static la_ssize_t rarstream_read_cb(struct archive *a, void *data,
+                                    const void **bufp)
+{
+    avssize_t res;
+    struct rarstream *fil = (struct rarstream *) data;
+
+    res = av_pread(fil->infile, fil->inbuf, INBUFSIZE, fil->inoff);
+    if(res < 0) {
+        archive_set_error(a, -res, "read error");
+        return -1;
+    }
+    fil->inoff += res;
+    *bufp = fil->inbuf;
+
+    return res;
+}
+
+static la_int64_t rarstream_skip_cb(struct archive *a, void *data,
+                                    la_int64_t request)
+{
+    struct rarstream *fil = (struct rarstream *) data;
+
+    if(request > fil->insize - fil->inoff)
+        request = fil->insize - fil->inoff;
+    if(request < 0)
+        return 0;
+
+    fil->inoff += request;
+
+    return request;
+}
+
+static la_int64_t rarstream_seek_cb(struct archive *a, void *data,
+                                    la_int64_t offset, int whence)
+{
+    struct rarstream *fil = (struct rarstream *) data;
+
+    switch(whence) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += fil->inoff;
+        break;
+    case SEEK_END:
+        offset += fil->insize;
+        break;
+    default:
+        return ARCHIVE_FATAL;
+    }
+    if(offset < 0)
+        return ARCHIVE_FATAL;
+
+    fil->inoff = offset;
+
+    return offset;
+}
+
+static int rarstream_error(struct rarstream *fil)
+{
+    const char *msg = archive_error_string(fil->a);
+
+    av_log(AVLOG_ERROR, "RAR: %s", msg != NULL ? msg : "unpack error");
+    fil->iserror = 1;
+
+    return -EIO;
+}
+
+static void rarstream_end(struct rarstream *fil)
+{
+    if(fil->a != NULL) {
+        archive_read_free(fil->a);
+        fil->a = NULL;
+    }
+}
+
+/* Skip the archive up to the member's data.  With a solid archive the
+   preceding members are unpacked as well. */
+static int rarstream_start(struct rarstream *fil)
+{
+    int res;
+    int i;
+    struct archive_entry *ent;
+
+    rarstream_end(fil);
+    fil->a = archive_read_new();
+    if(fil->a == NULL)
+        return -ENOMEM;
+
+    archive_read_support_format_rar(fil->a);
+    archive_read_support_format_rar5(fil->a);
+    archive_read_set_callback_data(fil->a, fil);
+    archive_read_set_read_callback(fil->a, rarstream_read_cb);
+    archive_read_set_skip_callback(fil->a, rarstream_skip_cb);
+    archive_read_set_seek_callback(fil->a, rarstream_seek_cb);
+
+    fil->inoff = 0;
+    fil->outoff = 0;
+    fil->outlen = 0;
+    fil->iserror = 0;
+    if(archive_read_open1(fil->a) != ARCHIVE_OK)
+        return rarstream_error(fil);
+
+    for(i = 0; i <= fil->index; i++) {
+        res = archive_read_next_header(fil->a, &ent);
+        if(res == ARCHIVE_EOF) {
+            fil->iserror = 1;
+            return -ENOENT;
+        }
+        if(res < ARCHIVE_WARN)
+            return rarstream_error(fil);
+    }
+
+    /* The members are counted differently: let the caller fall back */
+    if(archive_entry_size(ent) != fil->size ||
+       archive_entry_is_encrypted(ent)) {
+        fil->iserror = 1;
+        return -ENOSYS;
+    }
+
+    return 0;
+}
+
+static avssize_t rarstream_fill(struct rarstream *fil)
+{
+    la_ssize_t res;
+
+    fil->outoff += fil->outlen;
+    fil->outlen = 0;
+
+    res = archive_read_data(fil->a, fil->outbuf, OUTBUFSIZE);
+    if(res < 0)
+        return rarstream_error(fil);
+
+    fil->outlen = res;
+    return res;
+}
+
+avssize_t av_rarstream_pread(struct rarstream *fil, char *buf, avsize_t nbyte,
+                             avoff_t offset)
+{
+    avssize_t res;
+    avsize_t n;
+
+    if(offset < fil->outoff || fil->iserror) {
+        /* The data before the buffer is gone: start over */
+        res = rarstream_start(fil);
+        if(res < 0)
+            return res;
+    }
+
+    while(offset >= fil->outoff + (avoff_t) fil->outlen) {
+        if(fil->outoff + (avoff_t) fil->outlen >= fil->size)
+            return 0;
+
+        res = rarstream_fill(fil);
+        if(res < 0)
+            return res;
+        if(res == 0)
+            return 0;
+    }
+
+    n = fil->outoff + fil->outlen - offset;
+    if(n > nbyte)
+        n = nbyte;
+    memcpy(buf, fil->outbuf + (offset - fil->outoff), n);
+
+    return n;
+}
+
+static void rarstream_destroy(struct rarstream *fil)
+{
+    rarstream_end(fil);
+}
+
+int av_rarstream_new(vfile *vf, int index, avoff_t size,
+                     struct rarstream **resp)
+{
+    int res;
+    struct avstat stbuf;
+    struct rarstream *fil;
+
+    res = av_fgetattr(vf, &stbuf, AVA_SIZE);
+    if(res < 0)
+        return res;
+
+    AV_NEW_OBJ(fil, rarstream_destroy);
+    fil->a = NULL;
+    fil->infile = vf;
+    fil->insize = stbuf.size;
+    fil->index = index;
+    fil->size = size;
+
+    /* Unpack the first part right away, so that a member which
+       libarchive can't handle is found out at open */
+    res = rarstream_start(fil);
+    if(res == 0 && size != 0)
+        res = rarstream_fill(fil);
+    if(res < 0) {
+        av_unref_obj(fil);
+        return res;
+    }
+
+    *resp = fil;
+    return 0;
+}
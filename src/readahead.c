@@ -0,0 +1,167 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Read-ahead for the members of archives, taken from archive.c
+*/
+
+#include "readahead.h"
+#include "internal.h"
+#include "oper.h"
+
+#define RA_MINWINDOW (64 * 1024)
+#define RA_DEFWINDOW (1024 * 1024)
+#define RA_DEFTOTAL  (16 * 1024 * 1024)
+
+struct readahead {
+    char *buf;
+    avsize_t bufsize;
+    avoff_t start;           /* Offset of buf in the file */
+    avsize_t len;            /* Bytes valid in buf */
+    avoff_t next;            /* Where a sequential read would go on */
+    avsize_t window;         /* Size of the next fill, 0 if not sequential */
+};
+
+static AV_LOCK_DECL(ralock);
+static avoff_t ra_maxwindow = RA_DEFWINDOW;
+/* The buffers of all the open files together may not be larger */
+static avoff_t ra_maxtotal = RA_DEFTOTAL;
+static avoff_t ra_total = 0;
+
+static void readahead_release(struct readahead *ra)
+{
+    AV_LOCK(ralock);
+    ra_total -= ra->bufsize;
+    AV_UNLOCK(ralock);
+
+    av_free(ra->buf);
+    ra->buf = NULL;
+    ra->bufsize = 0;
+    ra->len = 0;
+}
+
+/* Make the buffer 'num' bytes, or as much of it as the limit on all
+   buffers allows.  Returns the size that can be used */
+static avsize_t readahead_reserve(struct readahead *ra, avsize_t num)
+{
+    avoff_t avail;
+
+    if(num <= ra->bufsize)
+        return num;
+
+    AV_LOCK(ralock);
+    avail = ra_maxtotal - ra_total;
+    if(avail < 0)
+        avail = 0;
+    if((avoff_t) (num - ra->bufsize) > avail)
+        num = ra->bufsize + avail;
+    ra_total += num - ra->bufsize;
+    AV_UNLOCK(ralock);
+
+    if(num > ra->bufsize) {
+        ra->buf = av_realloc(ra->buf, num);
+        ra->bufsize = num;
+    }
+
+    return num;
+}
+
+/* Reads following each other are served from a buffer filled ahead of
+   them, which doubles in size up to the read-ahead window each time it
+   runs out.  Any other read goes straight to the file, starts over
+   with the smallest window and gives back the buffer */
+avssize_t av_readahead_pread(struct readahead **rap, vfile *vf, char *buf,
+                             avsize_t nbyte, avoff_t offset, avoff_t end)
+{
+    avssize_t res;
+    avsize_t num;
+    avsize_t total;
+    avsize_t maxwindow;
+    struct readahead *ra = *rap;
+
+    AV_LOCK(ralock);
+    maxwindow = ra_maxwindow;
+    AV_UNLOCK(ralock);
+
+    if(ra == NULL) {
+        if(maxwindow == 0)
+            return av_pread(vf, buf, nbyte, offset);
+
+        AV_NEW(ra);
+        ra->buf = NULL;
+        ra->bufsize = 0;
+        ra->start = 0;
+        ra->len = 0;
+        ra->next = 0;
+        ra->window = 0;
+        *rap = ra;
+    }
+
+    total = 0;
+    if(offset >= ra->start && offset < ra->start + ra->len) {
+        num = AV_MIN(nbyte, ra->start + ra->len - offset);
+        memcpy(buf, ra->buf + (offset - ra->start), num);
+        total = num;
+        offset += num;
+        ra->next = offset;
+        if(num == nbyte)
+            return total;
+        buf += num;
+        nbyte -= num;
+    }
+
+    if(offset != ra->next || maxwindow == 0) {
+        ra->window = 0;
+        if(ra->buf != NULL)
+            readahead_release(ra);
+    }
+    else if(ra->window == 0)
+        ra->window = AV_MIN(RA_MINWINDOW, maxwindow);
+    else
+        ra->window = AV_MIN(ra->window * 2, maxwindow);
+
+    num = 0;
+    if(nbyte < ra->window && offset < end)
+        num = readahead_reserve(ra, AV_MIN((avoff_t) ra->window,
+                                           end - offset));
+
+    if(num <= nbyte) {
+        res = av_pread(vf, buf, nbyte, offset);
+        if(res > 0)
+            ra->next = offset + res;
+    }
+    else {
+        ra->len = 0;
+        res = av_pread(vf, ra->buf, num, offset);
+        if(res > 0) {
+            ra->start = offset;
+            ra->len = res;
+            res = AV_MIN(nbyte, (avsize_t) res);
+            memcpy(buf, ra->buf, res);
+            ra->next = offset + res;
+        }
+    }
+
+    if(res < 0)
+        return total != 0 ? (avssize_t) total : res;
+
+    return total + res;
+}
+
+void av_readahead_free(struct readahead *ra)
+{
+    if(ra != NULL) {
+        readahead_release(ra);
+        av_free(ra);
+    }
+}
+
+void av_init_readahead()
+{
+    av_avfsstat_register_int("archive/readahead", &ra_maxwindow, &ralock,
+                             0, 1 << 30, NULL);
+    av_avfsstat_register_int("archive/readahead_total", &ra_maxtotal,
+                             &ralock, 0, AV_MAXOFF, NULL);
+}
@@ -6,37 +6,117 @@
     See the file COPYING.
 */
 
+#include "config.h"
 #include "realfile.h"
 #include "oper.h"
 #include "cache.h"
+#include "tmpfile.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 
 #define COPY_BUFSIZE 16384
+#define COPY_RANGESIZE (1024 * 1024)
 
-static int copy_file(ventry *ve, const char *destpath)
+static int write_all(int destfd, const char *destpath, const char *buf,
+                     avsize_t num)
+{
+    avssize_t res;
+
+    res = write(destfd, buf, num);
+    if(res == -1 && (errno == ENOSPC || errno == EDQUOT)) {
+        av_cache_diskfull();
+        res = write(destfd, buf, num);
+    }
+    if(res == -1) {
+        res = -errno;
+        av_log(AVLOG_ERROR, "Error writing file %s: %s", destpath,
+               strerror(errno));
+        return res;
+    }
+    if(res != num) {
+        av_log(AVLOG_ERROR, "Error writing file %s: short write", destpath);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* The contents are a region of a real file (e.g. a member stored in a
+   local archive), so copy it without going through the layers, and
+   possibly without copying the data at all */
+static int copy_fd_region(int srcfd, avoff_t offset, avoff_t size,
+                          int destfd, const char *destpath)
+{
+    int res;
+    avssize_t num;
+    char buf[COPY_BUFSIZE];
+    avoff_t end = offset + size;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while(offset < end) {
+        off64_t off = offset;
+
+        num = copy_file_range(srcfd, &off, destfd, NULL,
+                              AV_MIN(end - offset, COPY_RANGESIZE), 0);
+        if(num == -1 && (errno == ENOSPC || errno == EDQUOT)) {
+            av_cache_diskfull();
+            num = copy_file_range(srcfd, &off, destfd, NULL,
+                                  AV_MIN(end - offset, COPY_RANGESIZE), 0);
+        }
+        if(num <= 0)
+            break;
+
+        offset += num;
+        av_cache_checkspace();
+    }
+#endif
+
+    while(offset < end) {
+        num = pread(srcfd, buf, AV_MIN(end - offset, COPY_BUFSIZE), offset);
+        if(num == -1)
+            return -errno;
+        if(num == 0)
+            return -EIO;
+
+        res = write_all(destfd, destpath, buf, num);
+        if(res < 0)
+            return res;
+
+        offset += num;
+        if((offset % (64 * COPY_BUFSIZE)) < num)
+            av_cache_checkspace();
+    }
+
+    return 0;
+}
+
+static int copy_file(vfile *vf, const char *destpath)
 {
     int res;
     avssize_t num;
     char buf[COPY_BUFSIZE];
     int ctr;
-    vfile *vf;
     int destfd;
+    int srcfd;
+    avoff_t offset;
+    avoff_t size;
 
-    res = av_open(ve, AVO_RDONLY, 0, &vf);
-    if(res < 0)
-        return res;
-    
     destfd = open(destpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
     if(destfd == -1) {
         res = -errno;
-        av_close(vf);
         av_log(AVLOG_ERROR, "Error opening file %s: %s", destpath,
                strerror(errno));
         return res;
     }
 
+    srcfd = av_getfd(vf, &offset, &size);
+    if(srcfd >= 0) {
+        res = copy_fd_region(srcfd, offset, size, destfd, destpath);
+        close(destfd);
+        return res;
+    }
+
     ctr = 0;
     while(1) {
         res = av_read(vf, buf, COPY_BUFSIZE);
@@ -44,17 +124,9 @@ static int copy_file(ventry *ve, const char *destpath)
             break;
 
         num = res;
-        res = write(destfd, buf, num);
-        if(res == -1 && (errno == ENOSPC || errno == EDQUOT)) {
-            av_cache_diskfull();
-            res = write(destfd, buf, num);
-        }
-        if(res == -1) {
-            res = -errno;
-            av_log(AVLOG_ERROR, "Error writing file %s: %s", destpath,
-                   strerror(errno));
+        res = write_all(destfd, destpath, buf, num);
+        if(res < 0)
             break;
-        }
 
         /* Check free space after each Meg */
         if((ctr++ % 64) == 0)
@@ -62,6 +134,27 @@ static int copy_file(ventry *ve, const char *destpath)
     }
 
     close(destfd);
+
+    return res;
+}
+
+/* Sets '*linkedp' if 'destpath' became a hard link */
+static int get_file(ventry *ve, const char *destpath, int *linkedp)
+{
+    int res;
+    vfile *vf;
+
+    res = av_open(ve, AVO_RDONLY, 0, &vf);
+    if(res < 0)
+        return res;
+
+    /* If the file is already held in a local file (e.g. it was
+       downloaded or uncompressed before), just link to that */
+    res = av_linkfile(vf, destpath);
+    *linkedp = (res == 0);
+    if(res < 0)
+        res = copy_file(vf, destpath);
+
     if(res == 0)
         res = av_close(vf);
     else
@@ -78,16 +171,47 @@ static void realfile_delete(struct realfile *rf)
         av_del_tmpfile(rf->name);
 }
 
+/* The copies are kept in the cache under the path of the file, and are
+   only used again if the file still looks the same */
+static char *realfile_key(ventry *ve, struct avstat *stbuf)
+{
+    int res;
+    char *path;
+    int attrmask = AVA_INO | AVA_DEV | AVA_SIZE | AVA_MTIME;
+
+    res = av_getattr(ve, stbuf, attrmask, 0);
+    if(res < 0)
+        return NULL;
+
+    res = av_generate_path(ve, &path);
+    if(res < 0)
+        return NULL;
+
+    return av_stradd(NULL, "realfile:", path, NULL);
+}
+
+static int realfile_same(struct realfile *rf, struct avstat *stbuf)
+{
+    if(rf->st.ino == stbuf->ino && rf->st.dev == stbuf->dev &&
+       rf->st.size == stbuf->size &&
+       rf->st.mtime.sec == stbuf->mtime.sec &&
+       rf->st.mtime.nsec == stbuf->mtime.nsec)
+        return 1;
+
+    return 0;
+}
+
 int av_get_realfile(ventry *ve, struct realfile **resp)
 {
     int res;
     struct realfile *rf;
-
-    AV_NEW_OBJ(rf, realfile_delete);
-    rf->is_tmp = 0;
-    rf->name = NULL;
+    struct avstat stbuf;
+    char *key;
+    avoff_t size;
+    int linked;
 
     if(ve->mnt->base == NULL) {
+        AV_NEW_OBJ(rf, realfile_delete);
         rf->name = av_strdup((char *) ve->data);
         rf->is_tmp = 0;
 
@@ -95,20 +219,50 @@ int av_get_realfile(ventry *ve, struct realfile **resp)
         return 0;
     }
 
+    key = realfile_key(ve, &stbuf);
+    if(key != NULL) {
+        rf = (struct realfile *) av_cache2_get(key);
+        if(rf != NULL) {
+            if(realfile_same(rf, &stbuf)) {
+                av_free(key);
+                *resp = rf;
+                return 0;
+            }
+            av_unref_obj(rf);
+        }
+    }
+
+    AV_NEW_OBJ(rf, realfile_delete);
+    rf->is_tmp = 0;
+    rf->name = NULL;
+    rf->st = stbuf;
+
     res = av_get_tmpfile(&rf->name);
     if(res < 0) {
+        av_free(key);
         av_unref_obj(rf);
         return res;
     }
 
     rf->is_tmp = 1;
 
-    res = copy_file(ve, rf->name);
+    res = get_file(ve, rf->name, &linked);
     if(res < 0) {
+        av_free(key);
         av_unref_obj(rf);
         return res;
     }
 
+    if(key != NULL) {
+        av_cache2_set(rf, key);
+        /* A link takes no space of its own: the local file it shares
+           is already counted by its owner */
+        size = linked ? 0 : av_tmpfile_blksize(rf->name);
+        if(size > 0)
+            av_cache2_setsize(key, size);
+        av_free(key);
+    }
+
     *resp = rf;
     return 0;
 }
@@ -868,6 +868,32 @@ static avssize_t rem_read(vfile *vf, char *buf, avsize_t nbyte)
     return res;
 }
 
+static int rem_linkfile(vfile *vf, const char *path)
+{
+    int res;
+    struct remfs *fs = rem_vfile_filesys(vf);
+    struct entry *ent = rem_vfile_entry(vf);
+    struct remnode *nod;
+    struct remfile *fil = NULL;
+
+    nod = rem_get_node(fs, ent);
+    AV_LOCK(nod->filelock);
+    res = rem_get_file(fs, nod, &fil);
+    if(res == 0) {
+        res = rem_wait_data(fs, nod, fil, AV_MAXOFF);
+        if(res < 0) {
+            av_unref_obj(nod->file);
+            nod->file = NULL;
+        }
+        else if(link(fil->localname, path) == -1)
+            res = -errno;
+        av_unref_obj(fil);
+    }
+    AV_UNLOCK(nod->filelock);
+    av_unref_obj(nod);
+
+    return res;
+}
 
 static int rem_getattr(vfile *vf, struct avstat *buf, int attrmask)
 {
@@ -1015,6 +1041,7 @@ int av_remote_init(struct vmodule *module, struct remote *rem,
 
     avfs->close     = rem_close;
     avfs->read      = rem_read;
+    avfs->linkfile  = rem_linkfile;
     avfs->readdir   = rem_readdir;
     avfs->getattr   = rem_getattr;
 
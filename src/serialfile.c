@@ -27,6 +27,7 @@ struct sfile {
     avoff_t numbytes;
     int fd;
     int dirty;
+    int linked;
     enum { SF_BEGIN, SF_READ, SF_FINI } state;
 };
 
@@ -38,6 +39,7 @@ static void sfile_init(struct sfile *fil)
     fil->fd = -1;
     fil->state = SF_BEGIN;
     fil->dirty = 0;
+    fil->linked = 0;
 }
 
 static void sfile_end(struct sfile *fil)
@@ -356,6 +358,42 @@ int av_sfile_startget(struct sfile *fil)
     return sfile_read_until(fil, 0, 0);
 }
 
+/* The local file has another name made by av_sfile_linkfile(), so it
+   is copied before being changed */
+static int sfile_unshare(struct sfile *fil)
+{
+    int res;
+    char *oldfile = fil->localfile;
+    int oldfd = fil->fd;
+    const int tmpbufsize = 8192;
+    char tmpbuf[tmpbufsize];
+    avoff_t offset;
+
+    res = sfile_open_localfile(fil);
+    for(offset = 0; res == 0 && offset < fil->numbytes;) {
+        avsize_t nact = AV_MIN(tmpbufsize, fil->numbytes - offset);
+
+        res = pread(oldfd, tmpbuf, nact, offset);
+        if(res <= 0) {
+            res = -EIO;
+            break;
+        }
+        nact = res;
+        res = sfile_cached_pwrite(fil, tmpbuf, nact, offset);
+        if(res >= 0) {
+            offset += res;
+            res = 0;
+        }
+    }
+    close(oldfd);
+    av_del_tmpfile(oldfile);
+    fil->linked = 0;
+    if(res < 0)
+        sfile_reset(fil);
+
+    return res;
+}
+
 int av_sfile_truncate(struct sfile *fil, avoff_t length)
 {
     int res;
@@ -379,6 +417,11 @@ int av_sfile_truncate(struct sfile *fil, avoff_t length)
         return res;
 
     if(fil->numbytes > length) {
+        if(fil->linked) {
+            res = sfile_unshare(fil);
+            if(res < 0)
+                return res;
+        }
         ftruncate(fil->fd, length);
         fil->numbytes = length;
         fil->dirty = 1;
@@ -399,6 +442,12 @@ avssize_t av_sfile_pwrite(struct sfile *fil, const char *buf, avsize_t nbyte,
     res = sfile_read_until(fil, AV_MAXOFF, 1);
     if(res < 0)
         return res;
+
+    if(fil->linked) {
+        res = sfile_unshare(fil);
+        if(res < 0)
+            return res;
+    }
     
     res = sfile_cached_pwrite(fil, buf, nbyte, offset);
     if(res < 0) {
@@ -483,3 +532,26 @@ avoff_t av_sfile_diskusage(struct sfile *fil)
     
     return buf.st_blocks * 512;
 }
+
+/* Give the whole file another name, so it can be used without copying
+   it.  This is only possible if it is all in the local file */
+int av_sfile_linkfile(struct sfile *fil, const char *path)
+{
+    int res;
+
+    if((fil->flags & SFILE_NOCACHE) != 0 || fil->dirty)
+        return -ENOSYS;
+
+    res = sfile_read_until(fil, AV_MAXOFF, 0);
+    if(res < 0)
+        return res;
+
+    if(fil->localfile == NULL)
+        return -ENOSYS;
+
+    if(link(fil->localfile, path) == -1)
+        return -errno;
+
+    fil->linked = 1;
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    A part of a file seen as a file of its own.  Used to hand the data
+    of an archive member to the decompressors, which read a whole file.
+    Their reads of the base are done ahead, like those of stored members.
+*/
+
+#include "subfile.h"
+#include "internal.h"
+#include "oper.h"
+#include "operutil.h"
+#include "version.h"
+#include "exit.h"
+#include "readahead.h"
+
+struct subfile {
+    vfile *base;
+    avoff_t offset;
+    avoff_t size;
+    avsize_t hdrlen;
+    char *hdr;
+    struct readahead *ra;
+};
+
+static AV_LOCK_DECL(subfile_lock);
+static struct avfs *subfile_avfs;
+
+static avssize_t subfile_read(vfile *vf, char *buf, avsize_t nbyte)
+{
+    avssize_t res;
+    avsize_t n;
+    avsize_t done = 0;
+    struct subfile *sf = (struct subfile *) vf->data;
+
+    if(vf->ptr < sf->hdrlen) {
+        n = AV_MIN(nbyte, sf->hdrlen - vf->ptr);
+        memcpy(buf, sf->hdr + vf->ptr, n);
+        vf->ptr += n;
+        done = n;
+    }
+
+    if(done < nbyte && vf->ptr < sf->hdrlen + sf->size) {
+        n = AV_MIN(nbyte - done, sf->hdrlen + sf->size - vf->ptr);
+        res = av_readahead_pread(&sf->ra, sf->base, buf + done, n,
+                                 sf->offset + vf->ptr - sf->hdrlen,
+                                 sf->offset + sf->size);
+        if(res < 0)
+            return res;
+
+        vf->ptr += res;
+        done += res;
+    }
+
+    return done;
+}
+
+static int subfile_getattr(vfile *vf, struct avstat *buf, int attrmask)
+{
+    int res;
+    struct subfile *sf = (struct subfile *) vf->data;
+
+    res = av_fgetattr(sf->base, buf, attrmask);
+    if(res < 0)
+        return res;
+
+    buf->size = sf->hdrlen + sf->size;
+    buf->blocks = AV_BLOCKS(buf->size);
+
+    return 0;
+}
+
+static int subfile_close(vfile *vf)
+{
+    struct subfile *sf = (struct subfile *) vf->data;
+
+    av_unref_obj(sf->base);
+    av_readahead_free(sf->ra);
+    av_free(sf->hdr);
+    av_free(sf);
+
+    return 0;
+}
+
+static void subfile_destroy_avfs()
+{
+    AV_LOCK(subfile_lock);
+    av_unref_obj(subfile_avfs);
+    subfile_avfs = NULL;
+    AV_UNLOCK(subfile_lock);
+}
+
+static int subfile_get_avfs(struct avfs **resp)
+{
+    int res = 0;
+    int created = 0;
+    struct avfs *avfs;
+
+    AV_LOCK(subfile_lock);
+    if(subfile_avfs == NULL) {
+        res = av_new_avfs("subfile", NULL, AV_VER, AVF_NOLOCK, NULL, &avfs);
+        if(res == 0) {
+            avfs->read    = subfile_read;
+            avfs->getattr = subfile_getattr;
+            avfs->close   = subfile_close;
+            subfile_avfs = avfs;
+            created = 1;
+        }
+    }
+    if(res == 0) {
+        *resp = subfile_avfs;
+        av_ref_obj(subfile_avfs);
+    }
+    AV_UNLOCK(subfile_lock);
+
+    /* Not under subfile_lock: the handler is called with the exit
+       lock held */
+    if(created)
+        av_add_exithandler(subfile_destroy_avfs);
+
+    return res;
+}
+
+static void subfile_destroy(vfile *vf)
+{
+    if(vf->mnt != NULL)
+        av_file_close(vf);
+
+    AV_FREELOCK(vf->lock);
+}
+
+int av_subfile_new(vfile *base, avoff_t offset, avoff_t size,
+                   const char *hdr, avsize_t hdrlen, vfile **resp)
+{
+    int res;
+    vfile *vf;
+    struct avfs *avfs = NULL;
+    struct avmount *mnt;
+    struct subfile *sf;
+
+    res = subfile_get_avfs(&avfs);
+    if(res < 0)
+        return res;
+
+    AV_NEW(sf);
+    sf->base = base;
+    av_ref_obj(base);
+    sf->offset = offset;
+    sf->size = size;
+    sf->hdrlen = hdrlen;
+    sf->hdr = NULL;
+    sf->ra = NULL;
+    if(hdrlen != 0) {
+        sf->hdr = av_malloc(hdrlen);
+        memcpy(sf->hdr, hdr, hdrlen);
+    }
+
+    AV_NEW(mnt);
+    mnt->base = NULL;
+    mnt->avfs = avfs;
+    mnt->opts = NULL;
+    mnt->flags = 0;
+
+    AV_NEW_OBJ(vf, subfile_destroy);
+    AV_INITLOCK(vf->lock);
+    vf->data = sf;
+    vf->mnt = mnt;
+    vf->flags = AVO_RDONLY;
+    vf->ptr = 0;
+
+    *resp = vf;
+    return 0;
+}
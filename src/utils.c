@@ -11,6 +11,8 @@
 #include "oper.h"
 #include <stdarg.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #define NEED_VER    90
 
@@ -95,6 +97,7 @@ static void free_avfs(struct avfs *avfs)
 
     av_unref_obj(avfs->module);
     AV_FREELOCK(avfs->lock);
+    AV_FREELOCK(avfs->statlock);
 }
 
 static int new_minor()
@@ -136,6 +139,8 @@ int av_new_avfs(const char *name, struct ext_info *exts, int version,
 
     AV_NEW_OBJ(avfs, free_avfs);
     AV_INITLOCK(avfs->lock);
+    AV_INITLOCK(avfs->statlock);
+    memset(&avfs->rstat, 0, sizeof(avfs->rstat));
 
     avfs->name = av_strdup(name);
 
@@ -175,6 +180,78 @@ void av_avfsstat_register(const char *path, struct statefile *func)
     av_namespace_set(ent, stf);
 }
 
+struct avfsstat_int {
+    avoff_t *valp;
+    avmutex *lock;
+    avoff_t min;
+    avoff_t max;
+    void (*changed)(void);
+};
+
+static int avfsstat_int_get(struct entry *ent, const char *param,
+                            char **retp)
+{
+    char buf[64];
+    struct statefile *sf = (struct statefile *) av_namespace_get(ent);
+    struct avfsstat_int *si = (struct avfsstat_int *) sf->data;
+
+    AV_LOCK(*si->lock);
+    sprintf(buf, "%lli\n", *si->valp);
+    AV_UNLOCK(*si->lock);
+
+    *retp = av_strdup(buf);
+    return 0;
+}
+
+static int avfsstat_int_set(struct entry *ent, const char *param,
+                            const char *val)
+{
+    struct statefile *sf = (struct statefile *) av_namespace_get(ent);
+    struct avfsstat_int *si = (struct avfsstat_int *) sf->data;
+    avoff_t num;
+    char *end;
+
+    num = strtoll(val, &end, 0);
+    if(end == val)
+        return -EINVAL;
+    if(*end == '\n')
+        end ++;
+    if(*end != '\0')
+        return -EINVAL;
+    if(num < si->min || num > si->max)
+        return -EINVAL;
+
+    AV_LOCK(*si->lock);
+    *si->valp = num;
+    if(si->changed != NULL)
+        si->changed();
+    AV_UNLOCK(*si->lock);
+
+    return 0;
+}
+
+/* A number in #avfsstat, which is read and written with 'lock' held.
+   Values outside min..max are refused.  'changed' (if not NULL) is
+   called with the lock held after a new value is set */
+void av_avfsstat_register_int(const char *path, avoff_t *valp, avmutex *lock,
+                              avoff_t min, avoff_t max, void (*changed)(void))
+{
+    struct statefile statf;
+    struct avfsstat_int *si;
+
+    AV_NEW(si);
+    si->valp = valp;
+    si->lock = lock;
+    si->min = min;
+    si->max = max;
+    si->changed = changed;
+
+    statf.data = si;
+    statf.get = avfsstat_int_get;
+    statf.set = avfsstat_int_set;
+    av_avfsstat_register(path, &statf);
+}
+
 char *av_strdup(const char *s)
 {
     char *ns;
@@ -98,6 +98,31 @@ ssize_t virt_read(int fd, void *buf, size_t nbyte)
     return res;
 }
 
+/* Return a real file descriptor from which the contents of 'fd' can
+   be read with pread(), at '*offsetp' and '*sizep' bytes long.  This
+   is only possible for local files and for archive members stored
+   without compression, otherwise -1 is returned with errno set.  The
+   returned descriptor must not be closed and is valid until 'fd' is
+   closed */
+int virt_getfd(int fd, off_t *offsetp, off_t *sizep)
+{
+    int res;
+    avoff_t offset;
+    avoff_t size;
+    int errno_save = errno;
+
+    res = av_fd_getfd(fd, &offset, &size);
+    if(res < 0) {
+        errno = -res;
+        return -1;
+    }
+    *offsetp = offset;
+    *sizep = size;
+
+    errno = errno_save;
+    return res;
+}
+
 off_t virt_lseek(int fd, off_t offset, int whence)
 {
     off_t res;
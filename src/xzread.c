@@ -13,7 +13,10 @@
 #include "lzma.h"
 #include "oper.h"
 #include "exit.h"
+#include "idle.h"
+#include "internal.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 
@@ -22,21 +25,47 @@
 #define OUTBUFSIZE 32768
 #define INITIAL_MEMLIMIT (100<<20)
 
+/* The threaded decoder is stable since liblzma 5.4.0 */
+#if LZMA_VERSION >= 50040002
+#define XZ_USE_THREADS
+#endif
+
+/* Same as liblzma's internal limit.  The xz/threads tunable is there
+   without the threaded decoder too, it just has no effect then */
+#define XZ_THREADS_MAX 16384
+
+/* Upper limit for the size of a single stream index we are willing
+   to load into memory */
+#define MAX_INDEXSIZE (64<<20)
+
+#define XZINDEX_UNKNOWN 0
+#define XZINDEX_OK      1
+#define XZINDEX_NONE    2
+
 struct xzstreamcache {
     int id;
     lzma_stream *s;
+    uint64_t memusage;
+    avtime_t lastused;
 };
 
-/* FIXME: the streamcache should be cleaned up after a short timeout
-   because it uses a LOT of memory */
-
 static struct xzstreamcache xzscache;
 static int xzread_nextid;
 static AV_LOCK_DECL(xzread_lock);
 
+/* Tunables in #avfsstat/xz, protected by xzstat_lock as they are also
+   needed with xzread_lock held.  With threads set to 0 the number of
+   processors is used. */
+static AV_LOCK_DECL(xzstat_lock);
+static avoff_t xz_threads = 1;
+static avoff_t xz_memlimit = INITIAL_MEMLIMIT;
+
 struct xzcache {
     int id;
     avoff_t size;
+    avmutex lock;
+    int indexstate;
+    lzma_index *index;       /* Block index of all streams in the file */
 };
 
 struct xzfile {
@@ -44,6 +73,16 @@ struct xzfile {
     int iseof;
     int iserror;
     int id; /* The id of the last used xzcache */
+
+    int indexchecked;
+    int useindex;            /* Decode single blocks located by the index */
+    int blockdone;           /* The current block has been fully decoded */
+    int threaded;            /* Decoding a whole stream with threads */
+    avoff_t inbase;          /* Input offset of the current block's data */
+    avoff_t outbase;         /* Output offset of the current block */
+    avoff_t blockend;        /* Output offset of the current block's end */
+    lzma_block block;        /* Referenced by the block decoder */
+    uint64_t blockmem;       /* Memory usage of the block decoder */
     
     vfile *infile;
     char inbuf[INBUFSIZE];
@@ -54,14 +93,14 @@ void xz_internal_error(int errorcode)
     av_log(AVLOG_ERROR, "XZ: internal error %i", errorcode);
 }
 
-static avoff_t xz_total_in(lzma_stream *s)
+static avoff_t xz_total_in(struct xzfile *fil)
 {
-    return (avoff_t) s->total_in;
+    return fil->inbase + (avoff_t) fil->s->total_in;
 }
 
-static avoff_t xz_total_out(lzma_stream *s)
+static avoff_t xz_total_out(struct xzfile *fil)
 {
-    return (avoff_t) s->total_out;
+    return fil->outbase + (avoff_t) fil->s->total_out;
 }
 
 static void xz_delete_stream(lzma_stream *s)
@@ -78,12 +117,16 @@ static int xz_new_stream(lzma_stream **resp)
     int res;
     lzma_stream *s;
     lzma_stream tmp = LZMA_STREAM_INIT;
+    uint64_t memlimit;
 
     AV_NEW(s);
     *s = tmp;
 
-    /* TODO: choose good memory limit */
-    res = lzma_auto_decoder(s, INITIAL_MEMLIMIT, 0);
+    AV_LOCK(xzstat_lock);
+    memlimit = xz_memlimit;
+    AV_UNLOCK(xzstat_lock);
+
+    res = lzma_auto_decoder(s, memlimit, 0);
     if(res != LZMA_OK) {
         *resp = NULL;
         av_log(AVLOG_ERROR, "XZ: decompress init error: %i", res);
@@ -104,12 +147,44 @@ static void xzfile_scache_delete()
     AV_UNLOCK(xzread_lock);
 }
 
-static void xzfile_scache_save(int id, lzma_stream *s)
+static avoff_t xzfile_scache_idle(avtime_t expire)
+{
+    avoff_t mem = 0;
+
+    AV_LOCK(xzread_lock);
+    if(xzscache.id != 0 && xzscache.lastused < expire) {
+        xz_delete_stream(xzscache.s);
+        xzscache.id = 0;
+    }
+    if(xzscache.id != 0)
+        mem = sizeof(lzma_stream) + xzscache.memusage;
+    AV_UNLOCK(xzread_lock);
+
+    return mem;
+}
+
+/* The block decoder can't tell its memory usage */
+static uint64_t xzfile_memusage(struct xzfile *fil)
+{
+    uint64_t mem;
+
+    if(fil->s == NULL)
+        return 0;
+
+    mem = lzma_memusage(fil->s);
+    if(mem == 0 && fil->useindex && !fil->threaded)
+        mem = fil->blockmem;
+
+    return mem;
+}
+
+static void xzfile_scache_save(int id, lzma_stream *s, uint64_t memusage)
 {
     static int regdestroy = 0;
     if(!regdestroy) {
         regdestroy = 1;
         av_add_exithandler(xzfile_scache_delete);
+        av_add_idlehandler("xz", xzfile_scache_idle);
     }
 
     if(id == 0 || s == NULL) {
@@ -122,6 +197,8 @@ static void xzfile_scache_save(int id, lzma_stream *s)
 
     xzscache.id = id;
     xzscache.s = s;
+    xzscache.memusage = memusage;
+    xzscache.lastused = av_time();
 }
 
 static int xzfile_reset(struct xzfile *fil)
@@ -130,17 +207,338 @@ static int xzfile_reset(struct xzfile *fil)
     if (fil->iseof || fil->iserror)
         xz_delete_stream(fil->s);
     else
-        xzfile_scache_save(fil->id, fil->s);
+        xzfile_scache_save(fil->id, fil->s, xzfile_memusage(fil));
 
     fil->iseof = 0;
     fil->iserror = 0;
+    fil->inbase = 0;
+    fil->outbase = 0;
     return xz_new_stream(&fil->s);
 }
 
+static int xzindex_pread(vfile *vf, uint8_t *buf, avsize_t nbyte,
+                         avoff_t offset)
+{
+    avssize_t res;
+
+    res = av_pread_all(vf, (char *) buf, nbyte, offset);
+    if(res < 0)
+        return res;
+
+    return 0;
+}
+
+/* Decode one stream from its end, the footer of which is at 'pos' -
+   LZMA_STREAM_HEADER_SIZE.  Returns the start offset of the stream */
+static avoff_t xzindex_decode_stream(vfile *vf, avoff_t pos,
+                                     lzma_index **resp)
+{
+    int res;
+    lzma_ret ret;
+    lzma_stream_flags footer;
+    lzma_stream_flags header;
+    uint8_t buf[LZMA_STREAM_HEADER_SIZE];
+    uint8_t *ibuf;
+    avoff_t indexsize;
+    avoff_t start;
+    uint64_t memlimit = UINT64_MAX;
+    size_t inpos = 0;
+    lzma_index *idx = NULL;
+
+    if(pos < 2 * LZMA_STREAM_HEADER_SIZE)
+        return -EIO;
+
+    res = xzindex_pread(vf, buf, LZMA_STREAM_HEADER_SIZE,
+                        pos - LZMA_STREAM_HEADER_SIZE);
+    if(res < 0)
+        return res;
+
+    if(lzma_stream_footer_decode(&footer, buf) != LZMA_OK)
+        return -EIO;
+
+    indexsize = footer.backward_size;
+    if(indexsize > MAX_INDEXSIZE ||
+       pos < indexsize + 2 * LZMA_STREAM_HEADER_SIZE)
+        return -EIO;
+
+    ibuf = av_malloc(indexsize);
+    res = xzindex_pread(vf, ibuf, indexsize,
+                        pos - LZMA_STREAM_HEADER_SIZE - indexsize);
+    if(res == 0) {
+        ret = lzma_index_buffer_decode(&idx, &memlimit, NULL, ibuf, &inpos,
+                                       indexsize);
+        if(ret != LZMA_OK)
+            res = -EIO;
+    }
+    av_free(ibuf);
+    if(res < 0)
+        return res;
+
+    start = pos - (avoff_t) lzma_index_stream_size(idx);
+    if(start < 0)
+        res = -EIO;
+    else
+        res = xzindex_pread(vf, buf, LZMA_STREAM_HEADER_SIZE, start);
+    if(res == 0) {
+        if(lzma_stream_header_decode(&header, buf) != LZMA_OK ||
+           lzma_stream_flags_compare(&header, &footer) != LZMA_OK ||
+           lzma_index_stream_flags(idx, &footer) != LZMA_OK)
+            res = -EIO;
+    }
+    if(res < 0) {
+        lzma_index_end(idx, NULL);
+        return res;
+    }
+
+    *resp = idx;
+    return start;
+}
+
+/* Read the indexes of all (possibly concatenated) streams from the
+   end of the file, the same way 'xz --list' does */
+static int xzindex_read(vfile *vf, lzma_index **resp)
+{
+    int res;
+    struct avstat stbuf;
+    avoff_t pos;
+    avoff_t padding;
+    uint8_t buf[4];
+    lzma_index *idx;
+    lzma_index *combined = NULL;
+
+    res = av_fgetattr(vf, &stbuf, AVA_SIZE);
+    if(res < 0)
+        return res;
+
+    pos = stbuf.size;
+    if(pos <= 0 || (pos % 4) != 0)
+        return -EIO;
+
+    padding = 0;
+    while(pos > 0) {
+        res = xzindex_pread(vf, buf, 4, pos - 4);
+        if(res < 0)
+            break;
+
+        if(buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] == 0) {
+            pos -= 4;
+            padding += 4;
+            continue;
+        }
+
+        pos = xzindex_decode_stream(vf, pos, &idx);
+        if(pos < 0) {
+            res = pos;
+            break;
+        }
+
+        if(lzma_index_stream_padding(idx, padding) != LZMA_OK) {
+            lzma_index_end(idx, NULL);
+            res = -EIO;
+            break;
+        }
+        padding = 0;
+
+        if(combined != NULL &&
+           lzma_index_cat(idx, combined, NULL) != LZMA_OK) {
+            lzma_index_end(idx, NULL);
+            res = -EIO;
+            break;
+        }
+        combined = idx;
+    }
+    if(res == 0 && combined == NULL)
+        res = -EIO;
+
+    if(res < 0) {
+        lzma_index_end(combined, NULL);
+        return res;
+    }
+
+    *resp = combined;
+    return 0;
+}
+
+static void xzcache_check_index(struct xzfile *fil, struct xzcache *zc)
+{
+    int res;
+    lzma_index *idx;
+
+    AV_LOCK(zc->lock);
+    if(zc->indexstate == XZINDEX_UNKNOWN) {
+        res = xzindex_read(fil->infile, &idx);
+        if(res == 0) {
+            zc->index = idx;
+            zc->indexstate = XZINDEX_OK;
+            AV_LOCK(xzread_lock);
+            zc->size = lzma_index_uncompressed_size(idx);
+            AV_UNLOCK(xzread_lock);
+            av_log(AVLOG_DEBUG, "XZ: index with %llu blocks",
+                   (unsigned long long) lzma_index_block_count(idx));
+        }
+        else {
+            /* Not an xz file (e.g. .lzma) or broken index: stream it */
+            zc->indexstate = XZINDEX_NONE;
+        }
+    }
+    fil->indexchecked = 1;
+    fil->useindex = (zc->indexstate == XZINDEX_OK);
+    fil->blockdone = fil->useindex;
+    AV_UNLOCK(zc->lock);
+}
+
+static void xzfile_free_filters(lzma_filter *filters)
+{
+    int i;
+
+    for(i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) {
+        free(filters[i].options);
+        filters[i].options = NULL;
+    }
+}
+
+#ifdef XZ_USE_THREADS
+static uint32_t xz_get_threads()
+{
+    avoff_t threads;
+
+    AV_LOCK(xzstat_lock);
+    threads = xz_threads;
+    AV_UNLOCK(xzstat_lock);
+
+    if(threads == 0)
+        threads = lzma_cputhreads();
+
+    return AV_MIN(threads, XZ_THREADS_MAX);
+}
+
+/* Reading from the start of a multi-block stream is most likely
+   sequential, so let liblzma decode the whole stream on several
+   threads.  Returns 1 if the threaded decoder was started, 0 if
+   single block decoding should be used. */
+static int xzfile_start_threaded(struct xzfile *fil, lzma_index_iter *iter)
+{
+    lzma_ret ret;
+    lzma_mt mt;
+    uint64_t memlimit;
+
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = xz_get_threads();
+    if(mt.threads <= 1)
+        return 0;
+
+    AV_LOCK(xzstat_lock);
+    memlimit = xz_memlimit;
+    AV_UNLOCK(xzstat_lock);
+
+    mt.memlimit_threading = memlimit;
+    mt.memlimit_stop = memlimit;
+
+    ret = lzma_stream_decoder_mt(fil->s, &mt);
+    if(ret != LZMA_OK) {
+        av_log(AVLOG_WARNING, "XZ: threaded decoder init error: %i", ret);
+        return 0;
+    }
+
+    fil->s->next_in = NULL;
+    fil->s->avail_in = 0;
+    fil->inbase = iter->stream.compressed_offset;
+    fil->outbase = iter->stream.uncompressed_offset;
+    fil->blockend = fil->outbase + iter->stream.uncompressed_size;
+    fil->blockdone = 0;
+    fil->threaded = 1;
+    fil->iseof = 0;
+
+    return 1;
+}
+#endif
+
+/* Start decoding the block containing 'offset'.  Only the block
+   header is read, all previous blocks are skipped. */
+static int xzfile_goto_block(struct xzfile *fil, struct xzcache *zc,
+                             avoff_t offset)
+{
+    int res;
+    lzma_ret ret;
+    lzma_index_iter iter;
+    lzma_block *block = &fil->block;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    uint8_t hdr[LZMA_BLOCK_HEADER_SIZE_MAX];
+    avoff_t hdroff;
+    avoff_t hdrsize;
+    avoff_t size;
+
+    lzma_index_iter_init(&iter, zc->index);
+    if(lzma_index_iter_locate(&iter, offset)) {
+        /* Past the end: there's nothing left to decode.  The stream
+           is kept as it is, only the offsets are moved to the end */
+        size = lzma_index_uncompressed_size(zc->index);
+        fil->inbase = lzma_index_file_size(zc->index) - fil->s->total_in;
+        fil->outbase = size - fil->s->total_out;
+        fil->blockend = size;
+        fil->blockdone = 1;
+        fil->iseof = 1;
+        return 0;
+    }
+
+#ifdef XZ_USE_THREADS
+    if(iter.block.number_in_stream == 1 && iter.stream.block_count > 1) {
+        if(xzfile_start_threaded(fil, &iter))
+            return 0;
+    }
+#endif
+
+    hdroff = iter.block.compressed_file_offset;
+    hdrsize = AV_MIN(LZMA_BLOCK_HEADER_SIZE_MAX,
+                     iter.block.total_size);
+    res = xzindex_pread(fil->infile, hdr, hdrsize, hdroff);
+    if(res < 0)
+        return res;
+
+    memset(block, 0, sizeof(*block));
+    block->version = 0;
+    block->check = iter.stream.flags->check;
+    block->filters = filters;
+    block->header_size = lzma_block_header_size_decode(hdr[0]);
+    if(block->header_size > hdrsize) {
+        av_log(AVLOG_ERROR, "XZ: bad block header");
+        return -EIO;
+    }
+
+    ret = lzma_block_header_decode(block, NULL, hdr);
+    if(ret == LZMA_OK)
+        ret = lzma_block_compressed_size(block, iter.block.unpadded_size);
+    if(ret != LZMA_OK) {
+        av_log(AVLOG_ERROR, "XZ: bad block header: %i", ret);
+        return -EIO;
+    }
+    block->uncompressed_size = iter.block.uncompressed_size;
+
+    fil->blockmem = lzma_raw_decoder_memusage(filters);
+    ret = lzma_block_decoder(fil->s, block);
+    xzfile_free_filters(filters);
+    block->filters = NULL;
+    if(ret != LZMA_OK) {
+        av_log(AVLOG_ERROR, "XZ: block decoder init error: %i", ret);
+        return -EIO;
+    }
+
+    fil->s->next_in = NULL;
+    fil->s->avail_in = 0;
+    fil->inbase = hdroff + block->header_size;
+    fil->outbase = iter.block.uncompressed_file_offset;
+    fil->blockend = fil->outbase + iter.block.uncompressed_size;
+    fil->blockdone = 0;
+    fil->threaded = 0;
+    fil->iseof = 0;
+
+    return 0;
+}
+
 static int xzfile_fill_inbuf(struct xzfile *fil)
 {
     avssize_t res;
-    avoff_t inoff = xz_total_in(fil->s);
+    avoff_t inoff = xz_total_in(fil);
 
     res = av_pread(fil->infile, fil->inbuf, INBUFSIZE, inoff);
     if(res < 0)
@@ -157,6 +555,11 @@ static int xzfile_decompress(struct xzfile *fil, struct xzcache *zc)
     int res;
     unsigned char *start;
 
+    if(fil->useindex && fil->blockdone) {
+        /* Continue with the next block */
+        return xzfile_goto_block(fil, zc, xz_total_out(fil));
+    }
+
     if(fil->s->avail_in == 0) {
         res = xzfile_fill_inbuf(fil);
         if(res < 0)
@@ -171,14 +574,26 @@ static int xzfile_decompress(struct xzfile *fil, struct xzcache *zc)
     start = (unsigned char*)( fil->s->next_out );
 
     res = lzma_code(fil->s, LZMA_RUN);
+    if(res == LZMA_STREAM_END && fil->useindex) {
+        if(xz_total_out(fil) != fil->blockend) {
+            av_log(AVLOG_ERROR, "XZ: %s size mismatch",
+                   fil->threaded ? "stream" : "block");
+            return -EIO;
+        }
+        fil->blockdone = 1;
+        return 0;
+    }
     if(res == LZMA_STREAM_END) {
         fil->iseof = 1;
         AV_LOCK(xzread_lock);
-        zc->size = xz_total_out(fil->s);
+        zc->size = xz_total_out(fil);
         AV_UNLOCK(xzread_lock);
         return 0;
     }
-    /*TODO handle LZMA_MEMLIMIT_ERROR */
+    if(res == LZMA_MEMLIMIT_ERROR) {
+        av_log(AVLOG_ERROR, "XZ: memory limit exceeded, raise #avfsstat/xz/memlimit");
+        return -EIO;
+    }
     if(res != LZMA_OK) {
         av_log(AVLOG_ERROR, "XZ: decompress error: %i", res);
         return -EIO;
@@ -212,7 +627,7 @@ static int xzfile_skip_to(struct xzfile *fil, struct xzcache *zc,
     uint8_t outbuf[OUTBUFSIZE];
     
     while(!fil->iseof) {
-        avoff_t curroff = xz_total_out(fil->s);
+        avoff_t curroff = xz_total_out(fil);
 
         if(curroff == offset)
             break;
@@ -237,15 +652,25 @@ static avssize_t av_xzfile_do_pread(struct xzfile *fil, struct xzcache *zc,
 
     fil->id = zc->id;
 
-    curroff = xz_total_out(fil->s);
+    curroff = xz_total_out(fil);
     if(offset != curroff) {
-        AV_LOCK(xzread_lock);
-        if ( curroff > offset ) {
-            res = xzfile_reset( fil );
-        } else {
-            res = 0;
+        if(fil->useindex) {
+            /* Within the current block it is cheaper to decode on.
+               The threaded decoder is only kept for sequential reads */
+            if(offset < curroff || offset >= fil->blockend || fil->threaded)
+                res = xzfile_goto_block(fil, zc, offset);
+            else
+                res = 0;
+        }
+        else {
+            AV_LOCK(xzread_lock);
+            if ( curroff > offset ) {
+                res = xzfile_reset( fil );
+            } else {
+                res = 0;
+            }
+            AV_UNLOCK(xzread_lock);
         }
-        AV_UNLOCK(xzread_lock);
         if(res < 0)
             return res;
 
@@ -267,6 +692,9 @@ avssize_t av_xzfile_pread(struct xzfile *fil, struct xzcache *zc, char *buf,
     if(fil->iserror)
         return -EIO;
 
+    if(!fil->indexchecked)
+        xzcache_check_index(fil, zc);
+
     res = av_xzfile_do_pread(fil, zc, buf, nbyte, offset);
     if(res < 0)
         fil->iserror = 1;
@@ -288,6 +716,19 @@ int av_xzfile_size(struct xzfile *fil, struct xzcache *zc, avoff_t *sizep)
         return 0;
     }
 
+    if(!fil->indexchecked) {
+        /* The index tells the size without decompressing anything */
+        xzcache_check_index(fil, zc);
+
+        AV_LOCK(xzread_lock);
+        size = zc->size;
+        AV_UNLOCK(xzread_lock);
+        if(size != -1) {
+            *sizep = size;
+            return 0;
+        }
+    }
+
     fil->id = zc->id;
 
     AV_LOCK(xzread_lock);
@@ -315,8 +756,14 @@ int av_xzfile_size(struct xzfile *fil, struct xzcache *zc, avoff_t *sizep)
 
 static void xzfile_destroy(struct xzfile *fil)
 {
+    /* Don't keep the worker threads of a threaded decoder around */
+    if(fil->threaded) {
+        xz_delete_stream(fil->s);
+        return;
+    }
+
     AV_LOCK(xzread_lock);
-    xzfile_scache_save(fil->id, fil->s);
+    xzfile_scache_save(fil->id, fil->s, xzfile_memusage(fil));
     AV_UNLOCK(xzread_lock);
 }
 
@@ -330,6 +777,14 @@ struct xzfile *av_xzfile_new(vfile *vf)
     fil->iserror = 0;
     fil->infile = vf;
     fil->id = 0;
+    fil->indexchecked = 0;
+    fil->useindex = 0;
+    fil->blockdone = 0;
+    fil->threaded = 0;
+    fil->inbase = 0;
+    fil->outbase = 0;
+    fil->blockend = 0;
+    fil->blockmem = 0;
 
     res = xz_new_stream(&fil->s);
     if(res < 0)
@@ -340,6 +795,8 @@ struct xzfile *av_xzfile_new(vfile *vf)
 
 static void xzcache_destroy(struct xzcache *zc)
 {
+    AV_FREELOCK(zc->lock);
+    lzma_index_end(zc->index, NULL);
 }
 
 struct xzcache *av_xzcache_new()
@@ -348,6 +805,9 @@ struct xzcache *av_xzcache_new()
 
     AV_NEW_OBJ(zc, xzcache_destroy);
     zc->size = -1;
+    zc->indexstate = XZINDEX_UNKNOWN;
+    zc->index = NULL;
+    AV_INITLOCK(zc->lock);
 
     AV_LOCK(xzread_lock);
     if(xzread_nextid == 0)
@@ -358,3 +818,11 @@ struct xzcache *av_xzcache_new()
     
     return zc;
 }
+
+void av_init_xzstat()
+{
+    av_avfsstat_register_int("xz/threads", &xz_threads, &xzstat_lock,
+                             0, XZ_THREADS_MAX, NULL);
+    av_avfsstat_register_int("xz/memlimit", &xz_memlimit, &xzstat_lock,
+                             1, AV_MAXOFF, NULL);
+}
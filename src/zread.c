@@ -8,13 +8,19 @@
 
 #include "config.h"
 #include "zfile.h"
+#include "ckptfile.h"
 #include "zlib.h"
 #include "oper.h"
+#include "idle.h"
+#include "avcrc.h"
+#include "internal.h"
 
+#include <stdio.h>
 #include <stdlib.h>
-#include <fcntl.h>
 
-#define INDEXDISTANCE 1048576
+/* Minimum distance of an index saved on request from the previous
+   one, which limits the size of the indexfile */
+#define HINTDISTANCE (CKPT_DISTANCE / 4)
 
 #define INBUFSIZE 16384
 #define OUTBUFSIZE 32768
@@ -22,34 +28,31 @@
 /* This is the 'cost' of the restoration from the index cache */
 #define ZCACHE_EXTRA_DIST 45000
 
-/* It is not worth it to compress the state better */
-#define STATE_COMPRESS_LEVEL 1
+/* Roughly the memory used by an inflate state and its window */
+#define ZSTATE_MEMSIZE (sizeof(z_stream) + 8192 + (1 << MAX_WBITS))
 
 struct streamcache {
     int id;
     z_stream s;
     int calccrc;
     int iseof;
+    avtime_t lastused;
 };
 
 static struct streamcache scache;
 static int zread_nextid;
 static AV_LOCK_DECL(zread_lock);
 
-struct zindex {
-    avoff_t offset;          /* The number of output bytes */
-    avoff_t indexoffset;     /* Offset in the indexfile */
-    avsize_t indexsize;      /* Size of state record */
-    struct zindex *next;
-};
+/* Tunable in #avfsstat: with 0 the CRC stored in the archive is not
+   checked, e.g. for trusted sources */
+static avoff_t zread_verify_crc = 1;
 
 struct zcache {
-    char *indexfile;
-    avoff_t filesize;
-    avoff_t nextindex;
+    struct ckptfile ckpt;
     avoff_t size;
     int id;
-    struct zindex *indexes;
+    avoff_t *hints;          /* Requested index offsets, ascending */
+    unsigned int numhints;
     avmutex lock;
     int crc_ok;
 };
@@ -67,96 +70,45 @@ struct zfile {
     char inbuf[INBUFSIZE];
 };
 
-#ifndef USE_SYSTEM_ZLIB
-static int zfile_compress_state(char *state, int statelen, char **resp)
+static void zfile_scache_delete()
 {
     int res;
-    z_stream s;
-    int bufsize = sizeof(int) + statelen + statelen / 1000 + 1 + 12;
-    char *cstate = av_malloc(bufsize);
-    
-    s.next_in = (Bytef*)state;
-    s.avail_in = statelen;
-    s.next_out = (Bytef*)( cstate + sizeof(int) );
-    s.avail_out = bufsize - sizeof(int);
-    s.zalloc = NULL;
-    s.zfree = NULL;
 
-    ((int *) cstate)[0] = statelen;
-
-    res = deflateInit(&s, STATE_COMPRESS_LEVEL);
-    if(res != Z_OK) {
-        av_log(AVLOG_ERROR, "ZFILE: compress state failed");
-        av_free(cstate);
-        return -EIO;
-    }
-
-    res = deflate(&s, Z_FINISH);
-    if(res != Z_STREAM_END) {
-        av_log(AVLOG_ERROR, "ZFILE: compress state failed");
-        av_free(cstate);
-        return -EIO;
-    }
-    
-    res = deflateEnd(&s);
-    if(res != Z_OK) {
-        av_log(AVLOG_ERROR, "ZFILE: compress state failed");
-        av_free(cstate);
-        return -EIO;
+    if(scache.id != 0) {
+        res = inflateEnd(&scache.s);
+        if(res != Z_OK) {
+            av_log(AVLOG_ERROR, "ZFILE: inflateEnd: %s (%i)",
+                   scache.s.msg == NULL ? "" : scache.s.msg, res);
+        }
+        scache.id = 0;
     }
-    
-    *resp = cstate;
-    return sizeof(int) + s.total_out;
 }
 
-static int zfile_uncompress_state(char *cstate, int cstatelen, char **resp)
+static void zfile_scache_cleanup(void)
 {
-    int res;
-    z_stream s;
-    int statelen = ((int *) cstate)[0];
-    char *state = av_malloc(statelen);
-    
-    s.next_in = (Bytef*)( cstate + sizeof(int) );
-    s.avail_in = cstatelen - sizeof(int);
-    s.next_out = (Bytef*)state;
-    s.avail_out = statelen;
-    s.zalloc = NULL;
-    s.zfree = NULL;
-
-    res = inflateInit(&s);
-    if(res != Z_OK) {
-        av_log(AVLOG_ERROR, "ZFILE: compress state failed");
-        av_free(state);
-        return -EIO;
-    }
-
-    res = inflate(&s, Z_FINISH);
-    if(res != Z_STREAM_END) {
-        av_log(AVLOG_ERROR, "ZFILE: compress state failed");
-        av_free(state);
-        return -EIO;
-    }
-    
-    res = inflateEnd(&s);
-    if(res != Z_OK) {
-        av_log(AVLOG_ERROR, "ZFILE: compress state failed");
-        av_free(state);
-        return -EIO;
-    }
-    
-    *resp = state;
-    return 0;
+    AV_LOCK(zread_lock);
+    zfile_scache_delete();
+    AV_UNLOCK(zread_lock);
 }
-#endif
 
-static void zfile_scache_cleanup(void)
+static avoff_t zfile_scache_idle(avtime_t expire)
 {
-    inflateEnd(&scache.s);
+    avoff_t mem = 0;
+
+    AV_LOCK(zread_lock);
+    if(scache.id != 0 && scache.lastused < expire)
+        zfile_scache_delete();
+    if(scache.id != 0)
+        mem = ZSTATE_MEMSIZE;
+    AV_UNLOCK(zread_lock);
+
+    return mem;
 }
 
 static void zfile_scache_save(int id, z_stream *s, int calccrc, int iseof)
 {
     int res;
+    static int registered = 0;
 
     if(id == 0 || iseof) {
         res = inflateEnd(s);
@@ -167,20 +119,18 @@ static void zfile_scache_save(int id, z_stream *s, int calccrc, int iseof)
         return;
     }
 
-    if(scache.id != 0) {
-        res = inflateEnd(&scache.s);
-        if(res != Z_OK) {
-            av_log(AVLOG_ERROR, "ZFILE: inflateEnd: %s (%i)",
-                   scache.s.msg == NULL ? "" : scache.s.msg, res);
-        }
-    }
-    if(scache.id == 0)
+    if(!registered) {
+        registered = 1;
         atexit(zfile_scache_cleanup);
+        av_add_idlehandler("z", zfile_scache_idle);
+    }
+    zfile_scache_delete();
 
     scache.id = id;
     scache.s = *s;
     scache.calccrc = calccrc;
     scache.iseof = iseof;
+    scache.lastused = av_time();
 }
 
 static int zfile_reset(struct zfile *fil)
@@ -204,53 +154,10 @@ static int zfile_reset(struct zfile *fil)
 }
 
 #ifndef USE_SYSTEM_ZLIB
-static int zfile_save_state(struct zcache *zc, char *state, int statesize,
-                            avoff_t offset)
-{
-    int fd;
-    int res;
-    struct zindex **zp;
-    struct zindex *zi;
-
-    for(zp = &zc->indexes; *zp != NULL; zp = &(*zp)->next);
-
-    fd = open(zc->indexfile, O_WRONLY | O_CREAT, 0600);
-    if(fd == -1) {
-        av_log(AVLOG_ERROR, "ZFILE: Error opening indexfile %s: %s",
-               zc->indexfile, strerror(errno));
-        return -EIO;
-    }
-    
-    lseek(fd, zc->filesize, SEEK_SET);
-    
-    res = write(fd, state, statesize);
-    close(fd);
-    if(res == -1) {
-        av_log(AVLOG_ERROR, "ZFILE: Error writing indexfile %s: %s",
-               zc->indexfile, strerror(errno));
-        return -EIO;
-    }
-
-    AV_NEW(zi);
-    zi->offset = offset;
-    zi->indexoffset = zc->filesize;
-    zi->indexsize = statesize;
-    zi->next = NULL;
-    
-    *zp = zi;
-
-    zc->nextindex += INDEXDISTANCE;
-    zc->filesize += statesize;
-    
-    return 0;
-}
-
-
 static int zfile_save_index(struct zfile *fil, struct zcache *zc)
 {
     int res;
     char *state;
-    char *cstate;
 
     res = inflateSave(&fil->s, &state);
     if(res < 0) {
@@ -258,49 +165,23 @@ static int zfile_save_index(struct zfile *fil, struct zcache *zc)
         return -EIO;
     }
     
-    res = zfile_compress_state(state, res, &cstate);
+    res = av_ckptfile_save(&zc->ckpt, state, res, fil->s.total_out);
     free(state);
-    if(res < 0)
-        return res;
-
-    res = zfile_save_state(zc, cstate, res, fil->s.total_out);
-    av_free(cstate);
 
     return res;
 }
 
 static int zfile_seek_index(struct zfile *fil, struct zcache *zc, 
-                            struct zindex *zi)
+                            struct ckpt *zi)
 {
-    int fd;
     int res;
-    char *cstate;
     char *state;
 
     /* FIXME: Is it a good idea to save the previous state or not? */
     zfile_scache_save(fil->id, &fil->s, fil->calccrc, fil->iseof);
     memset(&fil->s, 0, sizeof(z_stream));
 
-    fd = open(zc->indexfile, O_RDONLY, 0);
-    if(fd == -1) {
-        av_log(AVLOG_ERROR, "ZFILE: Error opening indexfile %s: %s",
-               zc->indexfile, strerror(errno));
-        return -EIO;
-    }
-    
-    lseek(fd, zi->indexoffset, SEEK_SET);
-
-    cstate = av_malloc(zi->indexsize);
-    res = read(fd, cstate, zi->indexsize);
-    close(fd);
-    if(res != zi->indexsize) {
-        av_free(cstate);
-        av_log(AVLOG_ERROR, "ZFILE: Error in indexfile %s", zc->indexfile);
-        return -EIO;
-    }
-
-    res = zfile_uncompress_state(cstate, zi->indexsize, &state);
-    av_free(cstate);
+    res = av_ckptfile_load(&zc->ckpt, zi, &state);
     if(res < 0)
         return res;
 
@@ -316,19 +197,31 @@ static int zfile_seek_index(struct zfile *fil, struct zcache *zc,
     return 0;
 }
 
-static struct zindex *zcache_find_index(struct zcache *zc, avoff_t offset)
+/* Is there no index close before 'offset'? */
+static int zcache_index_wanted(struct zcache *zc, avoff_t offset)
 {
-    struct zindex *prevzi;
-    struct zindex *zi;
-    
-    prevzi = NULL;
-    for(zi = zc->indexes; zi != NULL; zi = zi->next) {
-        if(zi->offset > offset)
-            break;
-        prevzi = zi;
+    struct ckpt *zi = av_ckptfile_find(&zc->ckpt, offset);
+
+    return offset >= (zi == NULL ? 0 : zi->offset) + HINTDISTANCE;
+}
+
+/* Drop the hints up to 'offset', and tell if an index should be saved
+   there because of them */
+static int zcache_hint_due(struct zcache *zc, avoff_t offset)
+{
+    unsigned int i;
+    int due = 0;
+
+    for(i = 0; i < zc->numhints && zc->hints[i] <= offset; i++) {
+        if(offset - zc->hints[i] < OUTBUFSIZE)
+            due = 1;
+    }
+    if(i != 0) {
+        zc->numhints -= i;
+        memmove(zc->hints, zc->hints + i, zc->numhints * sizeof(avoff_t));
     }
 
-    return prevzi;
+    return due && zcache_index_wanted(zc, offset);
 }
 #endif
 
@@ -352,6 +245,17 @@ static int zfile_inflate(struct zfile *fil, struct zcache *zc)
     int res;
     unsigned char *start;
 
+#ifndef USE_SYSTEM_ZLIB
+    AV_LOCK(zread_lock);
+    if(zc->numhints != 0 && zcache_hint_due(zc, fil->s.total_out))
+        res = zfile_save_index(fil, zc);
+    else
+        res = 0;
+    AV_UNLOCK(zread_lock);
+    if(res < 0)
+        return res;
+#endif
+
     if(fil->s.avail_in == 0) {
         res = zfile_fill_inbuf(fil);
         if(res < 0)
@@ -360,15 +264,9 @@ static int zfile_inflate(struct zfile *fil, struct zcache *zc)
 
     start = fil->s.next_out;
     res = inflate(&fil->s, Z_NO_FLUSH);
-    if(fil->calccrc) {
-        AV_LOCK(zread_lock);
-        if(zc->crc_ok)
-            fil->calccrc = 0;
-        AV_UNLOCK(zread_lock);
+    if(fil->calccrc)
+        fil->s.adler = av_crc32(fil->s.adler, start, fil->s.next_out - start);
 
-        if(fil->calccrc)
-            fil->s.adler = crc32(fil->s.adler, start, fil->s.next_out - start);
-    }
     if(res == Z_STREAM_END) {
         fil->iseof = 1;
         if(fil->calccrc && fil->s.adler != fil->crc) {
@@ -389,10 +287,13 @@ static int zfile_inflate(struct zfile *fil, struct zcache *zc)
     }
     
     AV_LOCK(zread_lock);
+    /* Another reader has already checked the whole stream */
+    if(zc->crc_ok)
+        fil->calccrc = 0;
 #ifdef USE_SYSTEM_ZLIB
     res = 0;
 #else
-    if(fil->s.total_out >= zc->nextindex)
+    if(fil->s.total_out >= zc->ckpt.nextindex)
         res = zfile_save_index(fil, zc);
     else
         res = 0;
@@ -442,7 +343,7 @@ static int zfile_skip_to(struct zfile *fil, struct zcache *zc, avoff_t offset)
 #ifndef USE_SYSTEM_ZLIB
 static int zfile_seek(struct zfile *fil, struct zcache *zc, avoff_t offset)
 {
-    struct zindex *zi;
+    struct ckpt *zi;
     avoff_t curroff = fil->s.total_out;
     avoff_t zcdist;
     avoff_t scdist;
@@ -453,7 +354,7 @@ static int zfile_seek(struct zfile *fil, struct zcache *zc, avoff_t offset)
     else
         dist = -1;
 
-    zi = zcache_find_index(zc, offset);
+    zi = av_ckptfile_find(&zc->ckpt, offset);
     if(zi != NULL)
         zcdist = offset - zi->offset + ZCACHE_EXTRA_DIST;
     else
@@ -472,6 +373,7 @@ static int zfile_seek(struct zfile *fil, struct zcache *zc, avoff_t offset)
             scache.s = tmp;
             scache.calccrc = tmpcc;
             scache.iseof = tmpiseof;
+            scache.lastused = av_time();
             return 0;
         }
     }
@@ -594,7 +496,10 @@ struct zfile *av_zfile_new(vfile *vf, avoff_t dataoff, avuint crc, int calccrc)
     fil->dataoff = dataoff;
     fil->id = 0;
     fil->crc = crc;
-    fil->calccrc = calccrc;
+
+    AV_LOCK(zread_lock);
+    fil->calccrc = zread_verify_crc ? calccrc : 0;
+    AV_UNLOCK(zread_lock);
 
     memset(&fil->s, 0, sizeof(z_stream));
     res = inflateInit2(&fil->s, -MAX_WBITS);
@@ -610,16 +515,9 @@ struct zfile *av_zfile_new(vfile *vf, avoff_t dataoff, avuint crc, int calccrc)
 
 static void zcache_destroy(struct zcache *zc)
 {
-    struct zindex *zi;
-    struct zindex *nextzi;
-
     AV_FREELOCK(zc->lock);
-    av_del_tmpfile(zc->indexfile);
-    
-    for(zi = zc->indexes; zi != NULL; zi = nextzi) {
-        nextzi = zi->next;
-        av_free(zi);
-    }
+    av_ckptfile_free(&zc->ckpt);
+    av_free(zc->hints);
 }
 
 struct zcache *av_zcache_new()
@@ -627,10 +525,8 @@ struct zcache *av_zcache_new()
     struct zcache *zc;
 
     AV_NEW_OBJ(zc, zcache_destroy);
-    zc->indexfile = NULL;
-    zc->nextindex = INDEXDISTANCE;
-    zc->indexes = NULL;
-    zc->filesize = 0;
+    zc->hints = NULL;
+    zc->numhints = 0;
     zc->size = -1;
     zc->crc_ok = 0;
     AV_INITLOCK(zc->lock);
@@ -642,12 +538,43 @@ struct zcache *av_zcache_new()
     zc->id = zread_nextid ++;
     AV_UNLOCK(zread_lock);
     
-    av_get_tmpfile(&zc->indexfile);
+    av_ckptfile_init(&zc->ckpt, "ZFILE");
     
     return zc;
 }
 
 avoff_t av_zcache_size(struct zcache *zc)
 {
-    return zc->filesize;
+    return zc->ckpt.filesize;
+}
+
+/* Reads will later start at 'offset' (e.g. it is the start of a member
+   in a tar archive), so save an index there when decompression gets
+   to it, unless there is one close before */
+void av_zcache_hint(struct zcache *zc, avoff_t offset)
+{
+#ifndef USE_SYSTEM_ZLIB
+    unsigned int i;
+
+    AV_LOCK(zread_lock);
+    if(zcache_index_wanted(zc, offset) &&
+       (zc->size == -1 || offset < zc->size)) {
+        for(i = zc->numhints; i > 0 && zc->hints[i-1] > offset; i--);
+        if(i == 0 || zc->hints[i-1] != offset) {
+            zc->hints = (avoff_t *)
+                av_realloc(zc->hints, (zc->numhints + 1) * sizeof(avoff_t));
+            memmove(zc->hints + i + 1, zc->hints + i,
+                    (zc->numhints - i) * sizeof(avoff_t));
+            zc->hints[i] = offset;
+            zc->numhints ++;
+        }
+    }
+    AV_UNLOCK(zread_lock);
+#endif
+}
+
+void av_init_zread()
+{
+    av_avfsstat_register_int("deflate/verify_crc", &zread_verify_crc,
+                             &zread_lock, 0, 1, NULL);
 }
@@ -0,0 +1,738 @@
+/*
+    AVFS: A Virtual File System Library
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    based on xzread.c
+*/
+
+#include "config.h"
+#include "zstdfile.h"
+#include "zstd.h"
+#include "oper.h"
+
+#include <stdlib.h>
+#include <fcntl.h>
+
+#define OUTBUFSIZE 32768
+
+/* Frame starts found while decoding are only remembered if they are
+   at least this far apart in the output */
+#define INDEXDISTANCE 1048576
+
+/* Upper limit for the size of a seek table we are willing to load */
+#define MAX_SEEKTABLESIZE (64<<20)
+
+#define ZSTD_SKIPPABLE_MAGIC     0x184D2A50
+#define ZSTD_SKIPPABLE_MASK      0xFFFFFFF0
+#define ZSTD_FRAMEHEADER_MAX     18
+#define ZSTD_BLOCKHEADER_SIZE    3
+
+/* The index scan reads the headers through a buffer of this size */
+#define SCANBUFSIZE 16384
+
+/* The seekable format (see contrib/seekable_format in the zstd
+   sources) stores a table of frame sizes in a skippable frame at the
+   end of the file */
+#define SEEKABLE_SKIPPABLE_MAGIC 0x184D2A5E
+#define SEEKABLE_MAGIC           0x8F92EAB1
+#define SEEKABLE_FOOTER_SIZE     9
+
+static AV_LOCK_DECL(zstdread_lock);
+
+struct zstdindex {
+    avoff_t inoff;           /* Start of the frame in the input */
+    avoff_t offset;          /* The number of output bytes */
+};
+
+struct zstdcache {
+    avoff_t size;
+    avmutex lock;
+    int indexread;
+    unsigned int numindex;
+    unsigned int allocindex;
+    struct zstdindex *indexes;
+};
+
+struct zstdfile {
+    ZSTD_DCtx *dctx;
+    int iseof;
+    int iserror;
+    int framedone;           /* Decoding stopped at a frame boundary */
+    int indexchecked;
+    avoff_t total_in;
+    avoff_t total_out;
+
+    vfile *infile;
+    ZSTD_inBuffer in;
+    char *inbuf;
+    avsize_t inbufsize;
+};
+
+static avuint zstd_le32(const avbyte *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((avuint) p[3] << 24);
+}
+
+static int zstdindex_pread(vfile *vf, avbyte *buf, avsize_t nbyte,
+                           avoff_t offset)
+{
+    avssize_t res;
+
+    res = av_pread(vf, (char *) buf, nbyte, offset);
+    if(res < 0)
+        return res;
+    if(res != nbyte)
+        return -EIO;
+
+    return 0;
+}
+
+/* Reads within the last SCANBUFSIZE bytes read from the file are
+   served from the buffer */
+struct zstdscanbuf {
+    avbyte *buf;
+    avoff_t start;
+    avsize_t len;
+};
+
+static int zstdindex_bufread(vfile *vf, struct zstdscanbuf *sb, avbyte *buf,
+                             avsize_t nbyte, avoff_t offset,
+                             avoff_t filesize)
+{
+    int res;
+
+    if(offset < sb->start || offset + nbyte > sb->start + sb->len) {
+        if(offset + nbyte > filesize)
+            return -EIO;
+
+        sb->start = offset;
+        sb->len = AV_MIN(SCANBUFSIZE, filesize - offset);
+        res = zstdindex_pread(vf, sb->buf, sb->len, offset);
+        if(res < 0) {
+            sb->len = 0;
+            return res;
+        }
+    }
+    memcpy(buf, sb->buf + (offset - sb->start), nbyte);
+
+    return 0;
+}
+
+/* Must be called with zstdread_lock held */
+static void zstdcache_append_index(struct zstdcache *zc, avoff_t inoff,
+                                   avoff_t offset)
+{
+    unsigned int i = zc->numindex;
+
+    if(i > 0 && zc->indexes[i-1].offset >= offset)
+        return;
+
+    zc->numindex ++;
+    zc->indexes[i].inoff = inoff;
+    zc->indexes[i].offset = offset;
+}
+
+/* Must be called with zstdread_lock held */
+static void zstdcache_add_index(struct zstdcache *zc, avoff_t inoff,
+                                avoff_t offset, int checkdist)
+{
+    unsigned int lo = 0;
+    unsigned int hi = zc->numindex;
+    unsigned int i;
+
+    /* Frames are mostly found in order */
+    if(hi > 0 && zc->indexes[hi-1].offset < offset)
+        lo = hi;
+
+    while(lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if(zc->indexes[mid].offset >= offset)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    i = lo;
+    if(i < zc->numindex && zc->indexes[i].offset == offset)
+        return;
+    if(checkdist && i > 0 &&
+       offset - zc->indexes[i-1].offset < INDEXDISTANCE)
+        return;
+
+    if(zc->numindex == zc->allocindex) {
+        zc->allocindex = AV_MAX(16, zc->allocindex * 2);
+        zc->indexes = (struct zstdindex *)
+            av_realloc(zc->indexes, sizeof(*zc->indexes) * zc->allocindex);
+    }
+    zc->numindex ++;
+    memmove(&zc->indexes[i+1], &zc->indexes[i],
+            sizeof(*zc->indexes) * (zc->numindex - i - 1));
+
+    zc->indexes[i].inoff = inoff;
+    zc->indexes[i].offset = offset;
+}
+
+static struct zstdindex *zstdcache_find_index(struct zstdcache *zc,
+                                              avoff_t offset)
+{
+    unsigned int lo = 0;
+    unsigned int hi = zc->numindex;
+
+    while(lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if(zc->indexes[mid].offset > offset)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if(lo == 0)
+        return NULL;
+
+    return &zc->indexes[lo-1];
+}
+
+/* Load the seek table of a file in the seekable format.  Returns 0
+   if there's no usable seek table. */
+static int zstdindex_read_seektable(vfile *vf, avoff_t filesize,
+                                    struct zstdcache *zc)
+{
+    int res;
+    avbyte footer[SEEKABLE_FOOTER_SIZE];
+    avbyte hdr[8];
+    avbyte *table;
+    avuint numframes;
+    avuint entrysize;
+    avoff_t tablesize;
+    avoff_t tablestart;
+    avoff_t inoff;
+    avoff_t offset;
+    avuint i;
+    struct zstdindex *old;
+    unsigned int numold;
+    unsigned int j;
+
+    if(filesize < 8 + SEEKABLE_FOOTER_SIZE)
+        return 0;
+
+    res = zstdindex_pread(vf, footer, SEEKABLE_FOOTER_SIZE,
+                          filesize - SEEKABLE_FOOTER_SIZE);
+    if(res < 0 || zstd_le32(footer + 5) != SEEKABLE_MAGIC)
+        return 0;
+
+    /* Bits 2-6 of the descriptor are reserved */
+    if((footer[4] & 0x7C) != 0)
+        return 0;
+
+    numframes = zstd_le32(footer);
+    entrysize = (footer[4] & 0x80) ? 12 : 8;
+    tablesize = (avoff_t) numframes * entrysize;
+    tablestart = filesize - SEEKABLE_FOOTER_SIZE - tablesize;
+    if(tablesize > MAX_SEEKTABLESIZE || tablestart < 8)
+        return 0;
+
+    res = zstdindex_pread(vf, hdr, 8, tablestart - 8);
+    if(res < 0 || zstd_le32(hdr) != SEEKABLE_SKIPPABLE_MAGIC ||
+       zstd_le32(hdr + 4) != tablesize + SEEKABLE_FOOTER_SIZE)
+        return 0;
+
+    table = av_malloc(tablesize + 1);
+    res = zstdindex_pread(vf, table, tablesize, tablestart);
+    if(res < 0) {
+        av_free(table);
+        return 0;
+    }
+
+    inoff = 0;
+    offset = 0;
+    for(i = 0; i < numframes; i++) {
+        inoff += zstd_le32(table + i * entrysize);
+        offset += zstd_le32(table + i * entrysize + 4);
+    }
+    if(inoff != tablestart - 8) {
+        av_log(AVLOG_WARNING, "ZSTD: seek table doesn't match file size");
+        av_free(table);
+        return 0;
+    }
+
+    /* Merge the frames into the indexes already found while decoding
+       in one pass, keeping the old entry where both have an offset */
+    AV_LOCK(zstdread_lock);
+    old = zc->indexes;
+    numold = zc->numindex;
+    zc->allocindex = numold + numframes;
+    zc->indexes = (struct zstdindex *)
+        av_malloc(sizeof(*zc->indexes) * zc->allocindex);
+    zc->numindex = 0;
+    j = 0;
+    inoff = 0;
+    offset = 0;
+    for(i = 0; i < numframes; i++) {
+        for(; j < numold && old[j].offset <= offset; j++)
+            zstdcache_append_index(zc, old[j].inoff, old[j].offset);
+        zstdcache_append_index(zc, inoff, offset);
+        inoff += zstd_le32(table + i * entrysize);
+        offset += zstd_le32(table + i * entrysize + 4);
+    }
+    for(; j < numold; j++)
+        zstdcache_append_index(zc, old[j].inoff, old[j].offset);
+    zc->size = offset;
+    AV_UNLOCK(zstdread_lock);
+    av_free(old);
+    av_free(table);
+
+    av_log(AVLOG_DEBUG, "ZSTD: seek table with %u frames", numframes);
+
+    return 1;
+}
+
+/* Find the size of the frame header and the content size from the
+   header.  Returns 0 if the content size is not stored. */
+static int zstd_parse_frameheader(const avbyte *buf, avsize_t len,
+                                  avsize_t *hdrsizep, avoff_t *contentp,
+                                  int *checksump)
+{
+    static const int didsizes[4] = { 0, 1, 2, 4 };
+    static const int fcssizes[4] = { 0, 2, 4, 8 };
+    avbyte fhd;
+    int singleseg;
+    int fcsflag;
+    int fcssize;
+    avsize_t pos;
+    avuquad fcs;
+    int i;
+
+    if(len < 5 || zstd_le32(buf) != ZSTD_MAGICNUMBER)
+        return -EIO;
+
+    fhd = buf[4];
+    fcsflag = fhd >> 6;
+    singleseg = (fhd >> 5) & 1;
+    if((fhd & 0x08) != 0)
+        return -EIO;
+
+    fcssize = fcssizes[fcsflag];
+    if(fcsflag == 0 && singleseg)
+        fcssize = 1;
+
+    pos = 5 + (singleseg ? 0 : 1) + didsizes[fhd & 3];
+    if(pos + fcssize > len)
+        return -EIO;
+
+    fcs = 0;
+    for(i = fcssize - 1; i >= 0; i--)
+        fcs = (fcs << 8) | buf[pos + i];
+    if(fcssize == 2)
+        fcs += 256;
+
+    *hdrsizep = pos + fcssize;
+    *contentp = (avoff_t) fcs;
+    *checksump = (fhd >> 2) & 1;
+
+    return fcssize != 0;
+}
+
+/* Walk the frames of a plain file by reading only the frame and
+   block headers.  Every frame start is recorded up to the first frame
+   which doesn't store its content size. */
+static void zstdindex_scan_frames(vfile *vf, avoff_t filesize,
+                                  struct zstdcache *zc,
+                                  struct zstdscanbuf *sb)
+{
+    int res;
+    avbyte buf[ZSTD_FRAMEHEADER_MAX];
+    avbyte bh[ZSTD_BLOCKHEADER_SIZE];
+    avoff_t pos = 0;
+    avoff_t offset = 0;
+    avoff_t content;
+    avsize_t hdrsize;
+    int checksum;
+    int last;
+    avuint blockhdr;
+
+    while(pos < filesize) {
+        avsize_t len = AV_MIN(ZSTD_FRAMEHEADER_MAX, filesize - pos);
+
+        res = zstdindex_bufread(vf, sb, buf, len, pos, filesize);
+        if(res < 0 || len < 8)
+            return;
+
+        if((zstd_le32(buf) & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC) {
+            pos += 8 + (avoff_t) zstd_le32(buf + 4);
+            continue;
+        }
+
+        res = zstd_parse_frameheader(buf, len, &hdrsize, &content, &checksum);
+        if(res <= 0)
+            return;
+
+        AV_LOCK(zstdread_lock);
+        zstdcache_add_index(zc, pos, offset, 1);
+        AV_UNLOCK(zstdread_lock);
+
+        pos += hdrsize;
+        do {
+            res = zstdindex_bufread(vf, sb, bh, ZSTD_BLOCKHEADER_SIZE, pos,
+                                    filesize);
+            if(res < 0)
+                return;
+
+            blockhdr = bh[0] | (bh[1] << 8) | (bh[2] << 16);
+            last = blockhdr & 1;
+            pos += ZSTD_BLOCKHEADER_SIZE;
+            switch((blockhdr >> 1) & 3) {
+            case 1: /* RLE block */
+                pos += 1;
+                break;
+            case 3: /* reserved */
+                return;
+            default:
+                pos += blockhdr >> 3;
+            }
+        } while(!last);
+
+        if(checksum)
+            pos += 4;
+        offset += content;
+    }
+
+    if(pos == filesize) {
+        AV_LOCK(zstdread_lock);
+        zc->size = offset;
+        AV_UNLOCK(zstdread_lock);
+    }
+}
+
+static void zstdindex_scan(vfile *vf, avoff_t filesize, struct zstdcache *zc)
+{
+    struct zstdscanbuf sb;
+
+    sb.buf = av_malloc(SCANBUFSIZE);
+    sb.start = 0;
+    sb.len = 0;
+    zstdindex_scan_frames(vf, filesize, zc, &sb);
+    av_free(sb.buf);
+}
+
+static void zstdcache_check_index(struct zstdfile *fil, struct zstdcache *zc)
+{
+    int res;
+    struct avstat stbuf;
+
+    AV_LOCK(zc->lock);
+    if(!zc->indexread) {
+        res = av_fgetattr(fil->infile, &stbuf, AVA_SIZE);
+        if(res == 0 && !zstdindex_read_seektable(fil->infile, stbuf.size, zc))
+            zstdindex_scan(fil->infile, stbuf.size, zc);
+
+        zc->indexread = 1;
+    }
+    AV_UNLOCK(zc->lock);
+
+    fil->indexchecked = 1;
+}
+
+static int zstdfile_reset(struct zstdfile *fil, struct zstdindex *zi)
+{
+    size_t ret;
+
+    ret = ZSTD_DCtx_reset(fil->dctx, ZSTD_reset_session_only);
+    if(ZSTD_isError(ret)) {
+        av_log(AVLOG_ERROR, "ZSTD: reset error: %s", ZSTD_getErrorName(ret));
+        return -EIO;
+    }
+
+    fil->in.src = fil->inbuf;
+    fil->in.size = 0;
+    fil->in.pos = 0;
+    fil->iseof = 0;
+    fil->framedone = 1;
+    if(zi != NULL) {
+        fil->total_in = zi->inoff;
+        fil->total_out = zi->offset;
+    }
+    else {
+        fil->total_in = 0;
+        fil->total_out = 0;
+    }
+
+    return 0;
+}
+
+static int zstdfile_fill_inbuf(struct zstdfile *fil)
+{
+    avssize_t res;
+
+    res = av_pread(fil->infile, fil->inbuf, fil->inbufsize, fil->total_in);
+    if(res < 0)
+        return res;
+
+    fil->in.src = fil->inbuf;
+    fil->in.size = res;
+    fil->in.pos = 0;
+
+    return 0;
+}
+
+static int zstdfile_decompress(struct zstdfile *fil, struct zstdcache *zc,
+                               ZSTD_outBuffer *out)
+{
+    int res;
+    size_t ret;
+    size_t inpos;
+    size_t outpos;
+
+    if(fil->in.pos == fil->in.size) {
+        res = zstdfile_fill_inbuf(fil);
+        if(res < 0)
+            return res;
+        if(fil->in.size == 0) {
+            if(!fil->framedone) {
+                av_log(AVLOG_ERROR, "ZSTD: unexpected end of file");
+                return -EIO;
+            }
+            fil->iseof = 1;
+            AV_LOCK(zstdread_lock);
+            zc->size = fil->total_out;
+            AV_UNLOCK(zstdread_lock);
+            return 0;
+        }
+    }
+
+    inpos = fil->in.pos;
+    outpos = out->pos;
+    ret = ZSTD_decompressStream(fil->dctx, out, &fil->in);
+    fil->total_in += fil->in.pos - inpos;
+    fil->total_out += out->pos - outpos;
+    if(ZSTD_isError(ret)) {
+        av_log(AVLOG_ERROR, "ZSTD: decompress error: %s",
+               ZSTD_getErrorName(ret));
+        return -EIO;
+    }
+
+    fil->framedone = (ret == 0);
+    if(fil->framedone) {
+        AV_LOCK(zstdread_lock);
+        zstdcache_add_index(zc, fil->total_in, fil->total_out, 1);
+        AV_UNLOCK(zstdread_lock);
+    }
+
+    return 0;
+}
+
+static int zstdfile_read(struct zstdfile *fil, struct zstdcache *zc,
+                         char *buf, avsize_t nbyte)
+{
+    int res;
+    ZSTD_outBuffer out;
+
+    out.dst = buf;
+    out.size = nbyte;
+    out.pos = 0;
+    while(out.pos != out.size && !fil->iseof) {
+        res = zstdfile_decompress(fil, zc, &out);
+        if(res < 0)
+            return res;
+    }
+
+    return out.pos;
+}
+
+static int zstdfile_skip_to(struct zstdfile *fil, struct zstdcache *zc,
+                            avoff_t offset)
+{
+    int res;
+    char outbuf[OUTBUFSIZE];
+    ZSTD_outBuffer out;
+
+    while(fil->total_out < offset && !fil->iseof) {
+        /* FIXME: Maybe cache some data as well */
+        out.dst = outbuf;
+        out.size = AV_MIN(OUTBUFSIZE, offset - fil->total_out);
+        out.pos = 0;
+
+        res = zstdfile_decompress(fil, zc, &out);
+        if(res < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+static int zstdfile_seek(struct zstdfile *fil, struct zstdcache *zc,
+                         avoff_t offset)
+{
+    struct zstdindex *zi;
+    struct zstdindex tmp;
+    int found;
+
+    AV_LOCK(zstdread_lock);
+    zi = zstdcache_find_index(zc, offset);
+    found = (zi != NULL);
+    if(found)
+        tmp = *zi;
+    AV_UNLOCK(zstdread_lock);
+
+    /* Decoding on is only worth it if no frame starts in between */
+    if(offset >= fil->total_out && (!found || tmp.offset <= fil->total_out))
+        return 0;
+
+    return zstdfile_reset(fil, found ? &tmp : NULL);
+}
+
+static avssize_t av_zstdfile_do_pread(struct zstdfile *fil,
+                                      struct zstdcache *zc, char *buf,
+                                      avsize_t nbyte, avoff_t offset)
+{
+    avssize_t res;
+
+    if(offset != fil->total_out) {
+        res = zstdfile_seek(fil, zc, offset);
+        if(res < 0)
+            return res;
+
+        res = zstdfile_skip_to(fil, zc, offset);
+        if(res < 0)
+            return res;
+    }
+
+    res = zstdfile_read(fil, zc, buf, nbyte);
+
+    return res;
+}
+
+avssize_t av_zstdfile_pread(struct zstdfile *fil, struct zstdcache *zc,
+                            char *buf, avsize_t nbyte, avoff_t offset)
+{
+    avssize_t res;
+
+    if(fil->iserror)
+        return -EIO;
+
+    if(!fil->indexchecked)
+        zstdcache_check_index(fil, zc);
+
+    res = av_zstdfile_do_pread(fil, zc, buf, nbyte, offset);
+    if(res < 0)
+        fil->iserror = 1;
+
+    return res;
+}
+
+int av_zstdfile_size(struct zstdfile *fil, struct zstdcache *zc,
+                     avoff_t *sizep)
+{
+    int res;
+    avoff_t size;
+
+    AV_LOCK(zstdread_lock);
+    size = zc->size;
+    AV_UNLOCK(zstdread_lock);
+
+    if(size != -1 || fil == NULL) {
+        *sizep = size;
+        return 0;
+    }
+
+    if(fil->iserror)
+        return -EIO;
+
+    if(!fil->indexchecked) {
+        /* The seek table or the frame headers may tell the size */
+        zstdcache_check_index(fil, zc);
+
+        AV_LOCK(zstdread_lock);
+        size = zc->size;
+        AV_UNLOCK(zstdread_lock);
+        if(size != -1) {
+            *sizep = size;
+            return 0;
+        }
+    }
+
+    res = zstdfile_seek(fil, zc, AV_MAXOFF);
+    if(res == 0)
+        res = zstdfile_skip_to(fil, zc, AV_MAXOFF);
+    if(res < 0) {
+        fil->iserror = 1;
+        return res;
+    }
+
+    AV_LOCK(zstdread_lock);
+    size = zc->size;
+    AV_UNLOCK(zstdread_lock);
+
+    if(size == -1) {
+        av_log(AVLOG_ERROR, "ZSTD: Internal error: could not find size");
+        return -EIO;
+    }
+
+    *sizep = size;
+    return 0;
+}
+
+static void zstdfile_destroy(struct zstdfile *fil)
+{
+    ZSTD_freeDCtx(fil->dctx);
+    av_free(fil->inbuf);
+}
+
+struct zstdfile *av_zstdfile_new(vfile *vf)
+{
+    struct zstdfile *fil;
+
+    AV_NEW_OBJ(fil, zstdfile_destroy);
+    fil->iseof = 0;
+    fil->iserror = 0;
+    fil->framedone = 1;
+    fil->indexchecked = 0;
+    fil->total_in = 0;
+    fil->total_out = 0;
+    fil->infile = vf;
+    fil->inbufsize = ZSTD_DStreamInSize();
+    fil->inbuf = av_malloc(fil->inbufsize);
+    fil->in.src = fil->inbuf;
+    fil->in.size = 0;
+    fil->in.pos = 0;
+
+    fil->dctx = ZSTD_createDCtx();
+    if(fil->dctx == NULL) {
+        av_log(AVLOG_ERROR, "ZSTD: decompress init error");
+        fil->iserror = 1;
+    }
+    else {
+        /* Accept frames made with --long (or a high level), which
+           need a larger window than the default limit of 128MB.  The
+           memory is only used if the frame asks for it */
+        ZSTD_bounds bounds = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+
+        if(!ZSTD_isError(bounds.error))
+            ZSTD_DCtx_setParameter(fil->dctx, ZSTD_d_windowLogMax,
+                                   bounds.upperBound);
+    }
+
+    return fil;
+}
+
+static void zstdcache_destroy(struct zstdcache *zc)
+{
+    AV_FREELOCK(zc->lock);
+    av_free(zc->indexes);
+}
+
+struct zstdcache *av_zstdcache_new()
+{
+    struct zstdcache *zc;
+
+    AV_NEW_OBJ(zc, zstdcache_destroy);
+    zc->size = -1;
+    zc->indexread = 0;
+    zc->numindex = 0;
+    zc->allocindex = 0;
+    zc->indexes = NULL;
+    AV_INITLOCK(zc->lock);
+
+    return zc;
+}
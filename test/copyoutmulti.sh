@@ -0,0 +1,91 @@
+#! /bin/sh
+#
+# Checks the copyoutmulti command of the uextrar extfs handler: several
+# members are extracted with one run of unrar, and they are the same
+# as the ones extracted by copyout.  Members which are not in the
+# archive must be left to copyout.
+#
+# It is run by make check, or in the build tree after make (sh
+# test/copyoutmulti.sh).  It needs rar and unrar, and exits with 77 if
+# they are not there.
+
+handler=`cd "${top_builddir-.}" && pwd`/extfs/uextrar
+
+if ! test -f "$handler"; then
+    echo "$handler not found, run make first" >&2
+    exit 1
+fi
+
+for prog in rar unrar; do
+    if ! command -v $prog > /dev/null; then
+        echo "$prog not found, skipping"
+        exit 77
+    fi
+done
+
+dir=`mktemp -d "${TMPDIR:-/tmp}/avfstest-multi.XXXXXX"` || exit 1
+trap 'rm -rf "$dir"' 0 1 2 3 15
+
+# unrar is looked up in PATH, so put one in front which counts its runs
+mkdir "$dir/bin" "$dir/in" "$dir/in/sub" "$dir/out"
+cat > "$dir/bin/unrar" <<EOF
+#! /bin/sh
+echo "\$1" >> "$dir/runs"
+exec `command -v unrar` "\$@"
+EOF
+chmod +x "$dir/bin/unrar"
+PATH="$dir/bin:$PATH"
+export PATH
+
+i=0
+for name in one two sub/three "sub/with space" "w*"; do
+    i=`expr $i + 1`
+    dd if=/dev/urandom of="$dir/in/$name" bs=1024 count=$i 2> /dev/null
+done
+
+# A solid archive, so that a run of unrar unpacks all of it
+(cd "$dir/in" && rar a -s -r -inul ../t.rar .) || exit 1
+
+fail=0
+
+sh "$handler" copyoutmulti "$dir/t.rar" \
+    one "$dir/out/1" \
+    "sub/with space" "$dir/out/2" \
+    sub/three "$dir/out/3" \
+    missing "$dir/out/4" \
+    "w*" "$dir/out/5"
+
+if test "`grep -c '^x$' "$dir/runs"`" != 1; then
+    echo "copyoutmulti: unrar x not run exactly once"
+    fail=1
+fi
+
+set -- one 1 "sub/with space" 2 sub/three 3
+while test $# -ge 2; do
+    sh "$handler" copyout "$dir/t.rar" "$1" "$dir/out/$2.single"
+    if ! cmp -s "$dir/in/$1" "$dir/out/$2"; then
+        echo "copyoutmulti: $1 differs"
+        fail=1
+    fi
+    if ! cmp -s "$dir/out/$2" "$dir/out/$2.single"; then
+        echo "copyoutmulti: $1 differs from copyout"
+        fail=1
+    fi
+    shift 2
+done
+
+if test -f "$dir/out/4"; then
+    echo "copyoutmulti: missing member was created"
+    fail=1
+fi
+
+# unrar takes it as a wildcard, so it is left to copyout
+if test -f "$dir/out/5"; then
+    echo "copyoutmulti: member with a wildcard was extracted"
+    fail=1
+fi
+
+if test $fail = 0; then
+    echo "copyoutmulti: OK"
+fi
+exit $fail